@@ -0,0 +1,556 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "btrfs/btrfs.h"
+#include "archive.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// <sys/stat.h> maps these to struct timespec members, which would clash with
+// the BTRFS_InodeItem fields of the same name.
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define ARCHIVE_ROOT_DIR 256
+#define ARCHIVE_BLOCK_SIZE 512
+#define ARCHIVE_RECORD_SIZE (20 * ARCHIVE_BLOCK_SIZE)
+#define ARCHIVE_PATH_MAX 4096
+
+// File data is read straight into the output buffer and written out once
+// it is full.
+#define ARCHIVE_BUFFER_SIZE (1024 * 1024)
+
+// A read shorter than this flushes the buffer first rather than splitting.
+#define ARCHIVE_MIN_READ (64 * 1024)
+
+#define ARCHIVE_PAX_SIZE (4 * ARCHIVE_PATH_MAX)
+
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} ArchiveHeader;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} ArchiveRegion;
+
+typedef struct {
+  uint64_t inode;
+  char *name;
+} ArchiveLink;
+
+typedef struct {
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint64_t size;
+  uint64_t rdev;
+  uint64_t mtime;
+} ArchiveInode;
+
+typedef struct {
+  int fd;
+  uint8_t *buf;
+  size_t used;
+  uint64_t written;
+  bool error;
+  long failed;
+
+  BTRFS_Path path;
+  BTRFS_ExtentDataInline *extent;
+
+  // The names already written for hard linked inodes, open addressed.
+  ArchiveLink *links;
+  size_t link_count;
+  size_t link_capacity;
+
+  ArchiveRegion *regions;
+  size_t region_count;
+  size_t region_capacity;
+
+  char name[ARCHIVE_PATH_MAX];
+  char pax[ARCHIVE_PAX_SIZE];
+  size_t pax_len;
+} Archive;
+
+static void Archive_Flush(Archive *archive) {
+  for (size_t done = 0; !archive->error && done < archive->used;) {
+    ssize_t n = write(archive->fd, archive->buf + done, archive->used - done);
+    if (n <= 0)
+      archive->error = true;
+    else
+      done += n;
+  }
+  archive->written += archive->used;
+  archive->used = 0;
+}
+
+// Room for len bytes at the end of the buffer, flushing it if needed.
+static uint8_t *Archive_Reserve(Archive *archive, size_t len) {
+  if (archive->used + len > ARCHIVE_BUFFER_SIZE) Archive_Flush(archive);
+  return archive->buf + archive->used;
+}
+
+static void Archive_Put(Archive *archive, const void *data, size_t len) {
+  memcpy(Archive_Reserve(archive, len), data, len);
+  archive->used += len;
+}
+
+// Pad with zeros to a multiple of the size.
+static void Archive_Pad(Archive *archive, size_t size) {
+  size_t pad = -(archive->written + archive->used) % size;
+  memset(Archive_Reserve(archive, pad), 0, pad);
+  archive->used += pad;
+}
+
+static bool Archive_Octal(char *field, size_t width, uint64_t value) {
+  if (value >> (3 * (width - 1)) != 0) return false;
+  snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+  return true;
+}
+
+static void Archive_PaxRecord(Archive *archive, const char *key,
+                              const char *value) {
+  // The length counts its own digits.
+  size_t len = strlen(key) + strlen(value) + 3;
+  size_t digits = snprintf(NULL, 0, "%zu", len);
+  if ((size_t)snprintf(NULL, 0, "%zu", len + digits) > digits) digits++;
+  len += digits;
+
+  if (archive->pax_len + len >= ARCHIVE_PAX_SIZE) return;
+  snprintf(archive->pax + archive->pax_len, len + 1, "%zu %s=%s\n", len, key,
+           value);
+  archive->pax_len += len;
+}
+
+static void Archive_PaxNumber(Archive *archive, const char *key,
+                              uint64_t value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%llu", (unsigned long long)value);
+  Archive_PaxRecord(archive, key, text);
+}
+
+static void Archive_PutHeader(Archive *archive, ArchiveHeader *header) {
+  memcpy(header->magic, "ustar", 6);
+  memcpy(header->version, "00", 2);
+  memset(header->checksum, ' ', sizeof(header->checksum));
+
+  unsigned sum = 0;
+  for (size_t i = 0; i < sizeof(ArchiveHeader); i++)
+    sum += ((uint8_t *)header)[i];
+  snprintf(header->checksum, 7, "%06o", sum);
+  header->checksum[7] = ' ';
+
+  Archive_Put(archive, header, sizeof(ArchiveHeader));
+}
+
+// Write the header of an entry, preceded by a pax header with any records
+// already queued and those for the values the ustar fields cannot hold.
+static void Archive_Header(Archive *archive, const char *name, char typeflag,
+                           uint64_t size, const ArchiveInode *inode,
+                           const char *linkname) {
+  ArchiveHeader header;
+  memset(&header, 0, sizeof(ArchiveHeader));
+
+  if (strlen(name) > sizeof(header.name))
+    Archive_PaxRecord(archive, "path", name);
+  if (linkname != NULL && strlen(linkname) > sizeof(header.linkname))
+    Archive_PaxRecord(archive, "linkpath", linkname);
+  if (!Archive_Octal(header.size, sizeof(header.size), size))
+    Archive_PaxNumber(archive, "size", size);
+  if (!Archive_Octal(header.uid, sizeof(header.uid), inode->uid))
+    Archive_PaxNumber(archive, "uid", inode->uid);
+  if (!Archive_Octal(header.gid, sizeof(header.gid), inode->gid))
+    Archive_PaxNumber(archive, "gid", inode->gid);
+  if (!Archive_Octal(header.mtime, sizeof(header.mtime), inode->mtime))
+    Archive_PaxNumber(archive, "mtime", inode->mtime);
+
+  if (archive->pax_len > 0) {
+    ArchiveHeader pax;
+    memset(&pax, 0, sizeof(ArchiveHeader));
+    strcpy(pax.name, "PaxHeader");
+    Archive_Octal(pax.mode, sizeof(pax.mode), 0644);
+    Archive_Octal(pax.uid, sizeof(pax.uid), 0);
+    Archive_Octal(pax.gid, sizeof(pax.gid), 0);
+    Archive_Octal(pax.size, sizeof(pax.size), archive->pax_len);
+    Archive_Octal(pax.mtime, sizeof(pax.mtime), 0);
+    pax.typeflag = 'x';
+    Archive_PutHeader(archive, &pax);
+    Archive_Put(archive, archive->pax, archive->pax_len);
+    Archive_Pad(archive, ARCHIVE_BLOCK_SIZE);
+    archive->pax_len = 0;
+  }
+
+  strncpy(header.name, name, sizeof(header.name));
+  if (linkname != NULL)
+    strncpy(header.linkname, linkname, sizeof(header.linkname));
+  Archive_Octal(header.mode, sizeof(header.mode), inode->mode & 07777);
+  header.typeflag = typeflag;
+  if (typeflag == '3' || typeflag == '4') {
+    Archive_Octal(header.devmajor, sizeof(header.devmajor), inode->rdev >> 20);
+    Archive_Octal(header.devminor, sizeof(header.devminor),
+                  inode->rdev & 0xfffff);
+  }
+  Archive_PutHeader(archive, &header);
+}
+
+static size_t Archive_LinkSlot(ArchiveLink *links, size_t capacity,
+                               uint64_t inode) {
+  size_t i = (inode * 0x9e3779b97f4a7c15ull >> 32) & (capacity - 1);
+  while (links[i].name != NULL && links[i].inode != inode)
+    i = (i + 1) & (capacity - 1);
+  return i;
+}
+
+// The name an inode was first written under, or NULL after remembering the
+// current name for it.
+static const char *Archive_Link(Archive *archive, uint64_t inode) {
+  if (archive->link_count * 2 >= archive->link_capacity) {
+    size_t capacity = archive->link_capacity ? archive->link_capacity * 2 : 256;
+    ArchiveLink *links = calloc(capacity, sizeof(ArchiveLink));
+    if (links == NULL) return NULL;
+    for (size_t i = 0; i < archive->link_capacity; i++)
+      if (archive->links[i].name != NULL)
+        links[Archive_LinkSlot(links, capacity, archive->links[i].inode)] =
+            archive->links[i];
+    free(archive->links);
+    archive->links = links;
+    archive->link_capacity = capacity;
+  }
+
+  ArchiveLink *link = &archive->links[Archive_LinkSlot(
+      archive->links, archive->link_capacity, inode)];
+  if (link->name != NULL) return link->name;
+
+  link->name = strdup(archive->name);
+  if (link->name != NULL) {
+    link->inode = inode;
+    archive->link_count++;
+  }
+  return NULL;
+}
+
+static int Archive_AddRegion(Archive *archive, uint64_t offset,
+                             uint64_t length) {
+  if (archive->region_count > 0) {
+    ArchiveRegion *last = &archive->regions[archive->region_count - 1];
+    if (last->offset + last->length == offset) {
+      last->length += length;
+      return 0;
+    }
+  }
+
+  if (archive->region_count == archive->region_capacity) {
+    size_t capacity =
+        archive->region_capacity ? archive->region_capacity * 2 : 64;
+    ArchiveRegion *grown =
+        realloc(archive->regions, capacity * sizeof(ArchiveRegion));
+    if (grown == NULL) return -1;
+    archive->regions = grown;
+    archive->region_capacity = capacity;
+  }
+  archive->regions[archive->region_count++] =
+      (ArchiveRegion){offset, length};
+  return 0;
+}
+
+// Find the parts of a file holding data, everything else reads as zeros.
+static int Archive_MapFile(Archive *archive, uint64_t inode, uint64_t size) {
+  archive->region_count = 0;
+
+  for (uint64_t offset = 0; offset < size;) {
+    uint64_t extent_off = 0;
+    int found = BTRFS_FindFileExtent(&archive->path, inode, offset,
+                                     archive->extent, &extent_off, NULL);
+    if (found < 0) return -1;
+    if (found == 0) break;
+    if (extent_off > offset) offset = extent_off;
+    if (offset >= size) break;
+
+    BTRFS_ExtentDataFull *extent_full = (BTRFS_ExtentDataFull *)archive->extent;
+    uint64_t length = archive->extent->decoded_size;
+    if (archive->extent->type != ExtentDataType_Inline)
+      length = extent_full->logical_byte_count;
+    length -= offset - extent_off;
+    if (length > size - offset) length = size - offset;
+
+    bool hole = archive->extent->type == ExtentDataType_Prealloc ||
+                (archive->extent->type != ExtentDataType_Inline &&
+                 extent_full->extent_logical_addr == 0);
+    if (!hole && Archive_AddRegion(archive, offset, length) != 0) return -1;
+    offset += length;
+  }
+  return 0;
+}
+
+// Copy the data regions of a file into the archive, reading each straight
+// into the output buffer.
+static void Archive_CopyData(Archive *archive, uint64_t inode) {
+  bool failed = false;
+
+  for (size_t i = 0; i < archive->region_count; i++) {
+    uint64_t offset = archive->regions[i].offset;
+    uint64_t remaining = archive->regions[i].length;
+
+    while (remaining > 0) {
+      if (ARCHIVE_BUFFER_SIZE - archive->used < ARCHIVE_MIN_READ &&
+          ARCHIVE_BUFFER_SIZE - archive->used < remaining)
+        Archive_Flush(archive);
+
+      uint64_t n = ARCHIVE_BUFFER_SIZE - archive->used;
+      if (n > remaining) n = remaining;
+      uint8_t *dst = archive->buf + archive->used;
+
+      // The header already promised the data, what cannot be read is
+      // written as zeros.
+      uint64_t got =
+          BTRFS_ReadFilePath(&archive->path, inode, offset, n, dst);
+      if (got != n) {
+        if (got > n) got = 0;
+        memset(dst + got, 0, n - got);
+        failed = true;
+      }
+
+      archive->used += n;
+      offset += n;
+      remaining -= n;
+    }
+  }
+
+  Archive_Pad(archive, ARCHIVE_BLOCK_SIZE);
+  if (failed) {
+    fprintf(stderr, "%s: unreadable data\n", archive->name);
+    archive->failed++;
+  }
+}
+
+// Write a regular file, in the pax sparse format if it has holes. The data
+// is then preceded by the map of its regions.
+static int Archive_File(Archive *archive, uint64_t inode,
+                        const ArchiveInode *meta) {
+  if (Archive_MapFile(archive, inode, meta->size) != 0) return -1;
+
+  uint64_t data_size = 0;
+  for (size_t i = 0; i < archive->region_count; i++)
+    data_size += archive->regions[i].length;
+
+  if (data_size == meta->size) {
+    Archive_Header(archive, archive->name, '0', meta->size, meta, NULL);
+    Archive_CopyData(archive, inode);
+    return 0;
+  }
+
+  // The map ends with an empty region at the end of the file.
+  if (Archive_AddRegion(archive, meta->size, 0) != 0) return -1;
+
+  char line[48];
+  uint64_t map_size = snprintf(line, sizeof(line), "%zu\n",
+                               archive->region_count);
+  for (size_t i = 0; i < archive->region_count; i++)
+    map_size += snprintf(line, sizeof(line), "%llu\n%llu\n",
+                         (unsigned long long)archive->regions[i].offset,
+                         (unsigned long long)archive->regions[i].length);
+  map_size += -map_size % ARCHIVE_BLOCK_SIZE;
+
+  Archive_PaxRecord(archive, "GNU.sparse.major", "1");
+  Archive_PaxRecord(archive, "GNU.sparse.minor", "0");
+  Archive_PaxRecord(archive, "GNU.sparse.name", archive->name);
+  Archive_PaxNumber(archive, "GNU.sparse.realsize", meta->size);
+
+  // Readers without sparse support extract the raw data under this name,
+  // kept short enough to need no pax record of its own.
+  char raw_name[sizeof(((ArchiveHeader *)0)->name)];
+  const char *base = strrchr(archive->name, '/');
+  snprintf(raw_name, sizeof(raw_name), "GNUSparseFile.0/%.*s",
+           (int)sizeof(raw_name) - 17, base != NULL ? base + 1 : archive->name);
+  Archive_Header(archive, raw_name, '0', map_size + data_size, meta, NULL);
+
+  int len = snprintf(line, sizeof(line), "%zu\n", archive->region_count);
+  Archive_Put(archive, line, len);
+  for (size_t i = 0; i < archive->region_count; i++) {
+    len = snprintf(line, sizeof(line), "%llu\n%llu\n",
+                   (unsigned long long)archive->regions[i].offset,
+                   (unsigned long long)archive->regions[i].length);
+    Archive_Put(archive, line, len);
+  }
+  Archive_Pad(archive, ARCHIVE_BLOCK_SIZE);
+
+  Archive_CopyData(archive, inode);
+  return 0;
+}
+
+static int Archive_Directory(Archive *archive, uint64_t dir, size_t name_len,
+                             int depth);
+
+// Write the entry named by the current name, recursing into directories.
+static int Archive_Entry(Archive *archive, uint64_t inode, size_t name_len,
+                         int depth) {
+  BTRFS_Key key = {inode, KeyType_InodeItem, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, &archive->path);
+  if (err < 0) return -1;
+  if (err > 0 || BTRFS_CompareKeys(BTRFS_PathKey(&archive->path), &key) != 0)
+    return 0;
+
+  BTRFS_InodeItem *item = BTRFS_PathItem(&archive->path, NULL);
+  ArchiveInode meta = {item->st_mode, item->st_uid,  item->st_gid,
+                       item->st_nlink, item->st_size, item->st_rdev,
+                       item->st_mtime.seconds};
+
+  switch (meta.mode & S_IFMT) {
+    case S_IFDIR:
+      // The whole volume is written without an entry for its root.
+      if (name_len > 0) {
+        if (name_len + 1 >= ARCHIVE_PATH_MAX) return 0;
+        strcpy(archive->name + name_len, "/");
+        Archive_Header(archive, archive->name, '5', 0, &meta, NULL);
+        archive->name[name_len] = '\0';
+      }
+      return Archive_Directory(archive, inode, name_len, depth);
+    case S_IFREG: {
+      const char *first =
+          meta.nlink > 1 ? Archive_Link(archive, inode) : NULL;
+      if (first != NULL) {
+        Archive_Header(archive, archive->name, '1', 0, &meta, first);
+        return 0;
+      }
+      return Archive_File(archive, inode, &meta);
+    }
+    case S_IFLNK: {
+      char target[ARCHIVE_PATH_MAX];
+      if (meta.size >= ARCHIVE_PATH_MAX ||
+          BTRFS_ReadFilePath(&archive->path, inode, 0, meta.size, target) !=
+              meta.size) {
+        fprintf(stderr, "%s: unreadable link\n", archive->name);
+        archive->failed++;
+        return 0;
+      }
+      target[meta.size] = '\0';
+      Archive_Header(archive, archive->name, '2', 0, &meta, target);
+    } break;
+    case S_IFCHR:
+      Archive_Header(archive, archive->name, '3', 0, &meta, NULL);
+      break;
+    case S_IFBLK:
+      Archive_Header(archive, archive->name, '4', 0, &meta, NULL);
+      break;
+    case S_IFIFO:
+      Archive_Header(archive, archive->name, '6', 0, &meta, NULL);
+      break;
+  }
+  return 0;
+}
+
+// Write the entries of a directory in DIR_INDEX order. Each directory being
+// written keeps a cursor of its own, so memory grows with the depth of the
+// tree but not its size.
+static int Archive_Directory(Archive *archive, uint64_t dir, size_t name_len,
+                             int depth) {
+  if (depth > ARCHIVE_PATH_MAX / 2) return 0;
+
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+
+  BTRFS_Key key = {dir, KeyType_DirIndex, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, &path);
+
+  for (; err == 0 && !archive->error; err = BTRFS_NextItem(&path)) {
+    BTRFS_Key *found = BTRFS_PathKey(&path);
+    if (found->object_id != dir || found->type != KeyType_DirIndex) break;
+
+    uint32_t size = 0;
+    BTRFS_DirectoryIndex *item = BTRFS_PathItem(&path, &size);
+    const char *name = item->name_data;
+    size_t len = item->name_len;
+
+    // Subvolumes live in trees of their own and are left out.
+    size_t child_len = name_len + (name_len > 0) + len;
+    if (size < sizeof(BTRFS_DirectoryIndex) + len ||
+        item->key.type != KeyType_InodeItem || len == 0 ||
+        memchr(name, '/', len) != NULL || child_len + 1 >= ARCHIVE_PATH_MAX)
+      continue;
+
+    char *pos = archive->name + name_len;
+    if (name_len > 0) *pos++ = '/';
+    memcpy(pos, name, len);
+    pos[len] = '\0';
+
+    err = Archive_Entry(archive, item->key.object_id, child_len, depth + 1);
+    archive->name[name_len] = '\0';
+    if (err != 0) break;
+  }
+
+  BTRFS_PathRelease(&path);
+  return err < 0 ? -1 : 0;
+}
+
+long Archive_WriteTar(const char *path, int fd) {
+  Archive *archive = calloc(1, sizeof(Archive));
+  if (archive == NULL) return -1;
+  archive->fd = fd;
+  archive->buf = malloc(ARCHIVE_BUFFER_SIZE);
+  archive->extent = BTRFS_Alloc(BTRFS_GetNodeSize());
+
+  long retVal = -1;
+  uint64_t root = ARCHIVE_ROOT_DIR;
+  if (archive->buf == NULL || archive->extent == NULL) goto done;
+
+  // Entries are named from the subtree's own name down.
+  if (strcmp(path, "/") != 0 && path[0] != '\0') {
+    if (BTRFS_ParseFullFSTree((char *)path, &root) != 0) goto done;
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    if (strlen(base) + 1 >= ARCHIVE_PATH_MAX) goto done;
+    strcpy(archive->name, base);
+  }
+
+  if (Archive_Entry(archive, root, strlen(archive->name), 0) != 0) goto done;
+
+  // Two zero blocks end the archive, which is padded to a whole record.
+  size_t end = 2 * ARCHIVE_BLOCK_SIZE;
+  memset(Archive_Reserve(archive, end), 0, end);
+  archive->used += end;
+  Archive_Pad(archive, ARCHIVE_RECORD_SIZE);
+  Archive_Flush(archive);
+
+  if (!archive->error) retVal = archive->failed;
+
+done:
+  for (size_t i = 0; i < archive->link_capacity; i++)
+    free(archive->links[i].name);
+  free(archive->links);
+  free(archive->regions);
+  BTRFS_PathRelease(&archive->path);
+  BTRFS_Free(archive->extent, BTRFS_GetNodeSize());
+  free(archive->buf);
+  free(archive);
+  return retVal;
+}
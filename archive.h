@@ -0,0 +1,27 @@
+// Copyright (c) 2017 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef BTRFS_ARCHIVE_H_
+#define BTRFS_ARCHIVE_H_
+
+///
+/// @brief      Write a subtree of the parsed volume's FS tree as a POSIX tar
+///             stream.
+///
+/// Entries are written depth first straight from the tree, so memory use
+/// does not grow with the size of the subtree; only the names of hard
+/// linked files are remembered. Long names and large values go into pax
+/// extended headers, and files with holes are written in the pax sparse
+/// format, version 1.0, so the holes take no space in the archive.
+///
+/// @param      path  The subtree in the volume, "/" for all of it
+/// @param[in]  fd    The file descriptor to write to
+///
+/// @return     -1 on a read or write failure, otherwise the number of files
+///             whose data could not be read, written as zeros.
+///
+long Archive_WriteTar(const char *path, int fd);
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The arena is cut into slabs, and each slab is dedicated to one power of
+// two size class the first time that class runs dry. Freed objects go back
+// on their class' free list and slabs are never returned, so the arena's
+// size is a hard bound on memory use and no allocation touches malloc.
+
+#define ARENA_SLAB_SIZE (256 * 1024)
+#define ARENA_MIN_SHIFT 6
+#define ARENA_MAX_SHIFT 18
+#define ARENA_CLASS_COUNT (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+typedef struct BTRFS_FreeObject {
+  struct BTRFS_FreeObject *next;
+} BTRFS_FreeObject;
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *arena_slabs = NULL;
+static size_t arena_slab_count = 0;
+static size_t arena_slabs_used = 0;
+static BTRFS_FreeObject *arena_free[ARENA_CLASS_COUNT];
+
+static int BTRFS_ArenaClass(size_t size) {
+  int shift = ARENA_MIN_SHIFT;
+  while (shift <= ARENA_MAX_SHIFT && ((size_t)1 << shift) < size) shift++;
+  return shift - ARENA_MIN_SHIFT;
+}
+
+int BTRFS_SetArena(void *base, size_t size) {
+  pthread_mutex_lock(&arena_lock);
+
+  arena_slabs = NULL;
+  arena_slab_count = 0;
+  arena_slabs_used = 0;
+  memset(arena_free, 0, sizeof(arena_free));
+
+  if (base != NULL) {
+    // Slabs start on a cache line so every object is at least that aligned.
+    uintptr_t start = ((uintptr_t)base + 63) & ~(uintptr_t)63;
+    size_t usable = size - (start - (uintptr_t)base);
+
+    if (size < start - (uintptr_t)base || usable < ARENA_SLAB_SIZE) {
+      pthread_mutex_unlock(&arena_lock);
+      return -1;
+    }
+    arena_slabs = (uint8_t *)start;
+    arena_slab_count = usable / ARENA_SLAB_SIZE;
+  }
+
+  pthread_mutex_unlock(&arena_lock);
+  return 0;
+}
+
+void *BTRFS_Alloc(size_t size) {
+  BTRFS_STAT(allocations, 1);
+  BTRFS_STAT(allocation_bytes, size);
+
+  if (arena_slabs == NULL) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) BTRFS_STAT(allocation_failures, 1);
+    return ptr;
+  }
+
+  int cls = BTRFS_ArenaClass(size);
+  if (cls >= ARENA_CLASS_COUNT) {
+    BTRFS_STAT(allocation_failures, 1);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&arena_lock);
+
+  if (arena_free[cls] == NULL && arena_slabs_used < arena_slab_count) {
+    // Carve a fresh slab into objects of this class.
+    size_t obj_size = (size_t)1 << (cls + ARENA_MIN_SHIFT);
+    uint8_t *slab = arena_slabs + arena_slabs_used++ * ARENA_SLAB_SIZE;
+
+    for (size_t off = ARENA_SLAB_SIZE; off >= obj_size; off -= obj_size) {
+      BTRFS_FreeObject *obj = (BTRFS_FreeObject *)(slab + off - obj_size);
+      obj->next = arena_free[cls];
+      arena_free[cls] = obj;
+    }
+  }
+
+  BTRFS_FreeObject *obj = arena_free[cls];
+  if (obj != NULL) arena_free[cls] = obj->next;
+
+  pthread_mutex_unlock(&arena_lock);
+
+  if (obj == NULL) BTRFS_STAT(allocation_failures, 1);
+  return obj;
+}
+
+void BTRFS_Free(void *ptr, size_t size) {
+  if (ptr == NULL) return;
+
+  // Anything from before the arena was set came from malloc.
+  uint8_t *p = ptr;
+  if (arena_slabs == NULL || p < arena_slabs ||
+      p >= arena_slabs + arena_slab_count * ARENA_SLAB_SIZE) {
+    free(ptr);
+    return;
+  }
+
+  int cls = BTRFS_ArenaClass(size);
+  BTRFS_FreeObject *obj = ptr;
+
+  pthread_mutex_lock(&arena_lock);
+  obj->next = arena_free[cls];
+  arena_free[cls] = obj;
+  pthread_mutex_unlock(&arena_lock);
+}
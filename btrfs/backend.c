@@ -0,0 +1,248 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "btrfs.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reads come from several threads during parallel walks, so every backend
+// reads with pread and no file position is shared.
+
+#define BACKEND_MAX_DEVICES 64
+#define BACKEND_SUPERBLOCK_OFFSET 0x10000
+#define BACKEND_SUPERBLOCK_SIZE 0x1000
+
+// Regular files take O_DIRECT reads aligned to the page size. Block devices
+// report their logical block size.
+#define BACKEND_FILE_ALIGNMENT 4096
+
+// Reads bigger than a bounce buffer go through it in pieces. The pool holds
+// a buffer for each thread a walk usually runs with.
+#define BACKEND_BOUNCE_SIZE (1024 * 1024)
+#define BACKEND_BOUNCE_COUNT 16
+
+typedef struct {
+  int fd;
+  uint64_t device_id;
+  uint8_t device_uuid[UUID_LEN];
+  uint64_t size;
+  uint64_t alignment;
+} Backend_Device;
+
+static Backend_Device backend_devices[BACKEND_MAX_DEVICES];
+static int backend_count = 0;
+
+static pthread_mutex_t backend_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backend_pool_free = PTHREAD_COND_INITIALIZER;
+static uint8_t *backend_pool[BACKEND_BOUNCE_COUNT];
+static int backend_pool_count = 0;
+
+// Device 0 is the first device, the superblock is read from it before the
+// device ids are known.
+static Backend_Device *Backend_Find(uint64_t devID) {
+  if (backend_count == 0) return NULL;
+  if (devID == 0) return &backend_devices[0];
+  for (int i = 0; i < backend_count; i++)
+    if (backend_devices[i].device_id == devID) return &backend_devices[i];
+  return NULL;
+}
+
+static uint64_t Backend_PreadAll(int fd, void *buf, uint64_t off,
+                                 uint64_t len) {
+  uint64_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, off + done);
+    if (n <= 0) break;
+    done += n;
+  }
+  return done;
+}
+
+static uint64_t Backend_ReadPread(void *buf, uint64_t devID, uint64_t off,
+                                  uint64_t len) {
+  Backend_Device *device = Backend_Find(devID);
+  if (device == NULL) return 0;
+  return Backend_PreadAll(device->fd, buf, off, len);
+}
+
+static void Backend_PrefetchPread(uint64_t devID, uint64_t off, uint64_t len) {
+  Backend_Device *device = Backend_Find(devID);
+  if (device != NULL) posix_fadvise(device->fd, off, len, POSIX_FADV_WILLNEED);
+}
+
+static uint8_t *Backend_GetBounce(void) {
+  pthread_mutex_lock(&backend_pool_lock);
+  while (backend_pool_count == 0)
+    pthread_cond_wait(&backend_pool_free, &backend_pool_lock);
+  uint8_t *bounce = backend_pool[--backend_pool_count];
+  pthread_mutex_unlock(&backend_pool_lock);
+  return bounce;
+}
+
+static void Backend_PutBounce(uint8_t *bounce) {
+  pthread_mutex_lock(&backend_pool_lock);
+  backend_pool[backend_pool_count++] = bounce;
+  pthread_cond_signal(&backend_pool_free);
+  pthread_mutex_unlock(&backend_pool_lock);
+}
+
+// Aligned reads into aligned buffers go straight to the device, anything
+// else is read whole blocks at a time into a bounce buffer and copied out.
+static uint64_t Backend_ReadDirect(void *buf, uint64_t devID, uint64_t off,
+                                   uint64_t len) {
+  Backend_Device *device = Backend_Find(devID);
+  if (device == NULL) return 0;
+
+  uint64_t align = device->alignment;
+  if ((off | len | (uintptr_t)buf) % align == 0)
+    return Backend_PreadAll(device->fd, buf, off, len);
+
+  uint8_t *bounce = Backend_GetBounce();
+  uint64_t done = 0;
+  while (done < len) {
+    uint64_t pos = off + done;
+    uint64_t skip = pos % align;
+    uint64_t want = skip + len - done;
+    if (want > BACKEND_BOUNCE_SIZE) want = BACKEND_BOUNCE_SIZE;
+    want = (want + align - 1) / align * align;
+
+    uint64_t got = Backend_PreadAll(device->fd, bounce, pos - skip, want);
+    if (got <= skip) break;
+
+    uint64_t n = got - skip;
+    if (n > len - done) n = len - done;
+    memcpy((uint8_t *)buf + done, bounce + skip, n);
+    done += n;
+
+    // Short of what was asked for, the end of the device.
+    if (got < want) break;
+  }
+  Backend_PutBounce(bounce);
+  return done;
+}
+
+static uint64_t Backend_Write(void *buf, uint64_t devID, uint64_t off,
+                              uint64_t len) {
+  return -1;
+}
+
+static int Backend_OpenDevice(const char *path, BTRFS_BackendType type,
+                              Backend_Device *device) {
+  device->fd = open(path, O_RDONLY | (type == Backend_Direct ? O_DIRECT : 0));
+  if (device->fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(device->fd, &st) != 0) return -1;
+
+  device->size = st.st_size;
+  device->alignment = BACKEND_FILE_ALIGNMENT;
+  if (S_ISBLK(st.st_mode)) {
+    int sector_size = 0;
+    if (ioctl(device->fd, BLKGETSIZE64, &device->size) != 0) return -1;
+    if (ioctl(device->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+      device->alignment = sector_size;
+  }
+  return 0;
+}
+
+static int Backend_CreatePool(uint64_t alignment) {
+  for (backend_pool_count = 0; backend_pool_count < BACKEND_BOUNCE_COUNT;
+       backend_pool_count++) {
+    uint8_t *bounce = aligned_alloc(alignment, BACKEND_BOUNCE_SIZE);
+    if (bounce == NULL) return -1;
+    backend_pool[backend_pool_count] = bounce;
+  }
+  return 0;
+}
+
+void BTRFS_CloseDevices(void) {
+  for (int i = 0; i < backend_count; i++)
+    if (backend_devices[i].fd >= 0) close(backend_devices[i].fd);
+  backend_count = 0;
+
+  while (backend_pool_count > 0) free(backend_pool[--backend_pool_count]);
+
+  // What was cached about the filesystem must not outlive it.
+  BTRFS_ReleasePathCache();
+  BTRFS_ReleaseChecksumCache();
+}
+
+int BTRFS_OpenDevices(const char **paths, int count, BTRFS_BackendType type) {
+  BTRFS_CloseDevices();
+  if (count < 1 || count > BACKEND_MAX_DEVICES) return -1;
+
+  uint8_t *sblock_buf =
+      aligned_alloc(BACKEND_FILE_ALIGNMENT, BACKEND_SUPERBLOCK_SIZE);
+  if (sblock_buf == NULL) return -1;
+  BTRFS_Superblock *sblock = (BTRFS_Superblock *)sblock_buf;
+
+  uint8_t fsid[UUID_LEN];
+  uint64_t alignment = BACKEND_FILE_ALIGNMENT;
+  int retVal = 0;
+
+  char btrfs_magic[] = BTRFS_MagicString;
+
+  for (int i = 0; retVal == 0 && i < count; i++) {
+    Backend_Device *device = &backend_devices[backend_count++];
+    if (Backend_OpenDevice(paths[i], type, device) != 0 ||
+        Backend_PreadAll(device->fd, sblock_buf, BACKEND_SUPERBLOCK_OFFSET,
+                         BACKEND_SUPERBLOCK_SIZE) != BACKEND_SUPERBLOCK_SIZE) {
+      retVal = -1;
+      break;
+    }
+    if (memcmp(sblock->magic, btrfs_magic, BTRFS_MagicStringLen) != 0) {
+      retVal = -1;
+      break;
+    }
+
+    if (i == 0) memcpy(fsid, sblock->uuid, UUID_LEN);
+    if (memcmp(fsid, sblock->uuid, UUID_LEN) != 0) retVal = -2;
+
+    device->device_id = sblock->dev_item.device_id;
+    memcpy(device->device_uuid, sblock->dev_item.device_uuid, UUID_LEN);
+    if (device->alignment > alignment) alignment = device->alignment;
+
+    // The same device given twice, or two copies of one device.
+    for (int j = 0; j < i; j++)
+      if (memcmp(backend_devices[j].device_uuid, device->device_uuid,
+                 UUID_LEN) == 0)
+        retVal = -2;
+  }
+  free(sblock_buf);
+
+  if (retVal == 0 && type == Backend_Direct)
+    retVal = Backend_CreatePool(alignment);
+  if (retVal != 0) {
+    BTRFS_CloseDevices();
+    return retVal;
+  }
+
+  if (type == Backend_Direct) {
+    BTRFS_SetDiskReadHandler(Backend_ReadDirect);
+    // Nothing is cached to read ahead into.
+    BTRFS_SetDiskPrefetchHandler(NULL);
+  } else {
+    BTRFS_SetDiskReadHandler(Backend_ReadPread);
+    BTRFS_SetDiskPrefetchHandler(Backend_PrefetchPread);
+  }
+  BTRFS_SetDiskWriteHandler(Backend_Write);
+  return 0;
+}
+
+uint64_t BTRFS_GetDeviceSize(uint64_t devID) {
+  Backend_Device *device = Backend_Find(devID);
+  return device == NULL ? 0 : device->size;
+}
@@ -0,0 +1,496 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "extent.h"
+#include "btrfs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// References are first decoded as they are stored, then resolved to a
+// root and inode. Shared references name the tree block holding the
+// reference instead of a root, and resolving them reads that block.
+typedef enum {
+  BackRef_Data,
+  BackRef_Tree,
+  BackRef_SharedData,
+  BackRef_SharedTree,
+} BackRefKind;
+
+typedef struct {
+  uint64_t bytenr;
+  uint64_t root;  // The parent block for the shared kinds
+  uint64_t inode;
+  uint64_t offset;
+  uint8_t kind;
+} BackRefRaw;
+
+typedef struct {
+  BackRefRaw *refs;
+  size_t count;
+  size_t capacity;
+  BTRFS_Range *extents;
+  size_t extent_count;
+  size_t extent_capacity;
+} BackRefList;
+
+static void *BackRef_Append(void *array_ptr, size_t *count, size_t *capacity,
+                            size_t size) {
+  uint8_t **array = array_ptr;
+
+  if (*count == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    uint8_t *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL) return NULL;
+    *array = grown;
+    *capacity = new_capacity;
+  }
+  return *array + (*count)++ * size;
+}
+
+static int BackRef_Add(BackRefList *list, uint64_t bytenr, uint8_t kind,
+                       uint64_t root, uint64_t inode, uint64_t offset) {
+  BackRefRaw *raw =
+      BackRef_Append(&list->refs, &list->count, &list->capacity, sizeof(*raw));
+  if (raw == NULL) return -1;
+  *raw = (BackRefRaw){bytenr, root, inode, offset, kind};
+  return 0;
+}
+
+// The length of the extent an extent or metadata item describes.
+static uint64_t BackRef_ExtentLength(BTRFS_Key *key) {
+  return key->type == KeyType_MetadataItem ? BTRFS_GetNodeSize() : key->offset;
+}
+
+// Decode the references of one extent tree item, either the inline ones of
+// an extent item or a keyed one.
+static int BackRef_DecodeItem(BTRFS_Key *key, uint8_t *data, uint32_t size,
+                              BackRefList *list) {
+  uint64_t bytenr = key->object_id;
+
+  switch (key->type) {
+    case KeyType_ExtentItem:
+    case KeyType_MetadataItem:
+      break;
+    case KeyType_ExtentDataRef: {
+      if (size < sizeof(BTRFS_ExtentDataRef)) return 0;
+      BTRFS_ExtentDataRef *ref = (BTRFS_ExtentDataRef *)data;
+      return BackRef_Add(list, bytenr, BackRef_Data, ref->root, ref->object_id,
+                         ref->offset);
+    }
+    case KeyType_TreeBlockRef:
+      return BackRef_Add(list, bytenr, BackRef_Tree, key->offset, 0, 0);
+    case KeyType_SharedDataRef:
+      return BackRef_Add(list, bytenr, BackRef_SharedData, key->offset, 0, 0);
+    case KeyType_SharedBlockRef:
+      return BackRef_Add(list, bytenr, BackRef_SharedTree, key->offset, 0, 0);
+    default:
+      return 0;
+  }
+
+  if (size < sizeof(BTRFS_ExtentItem)) return 0;
+  BTRFS_ExtentItem *extent_item = (BTRFS_ExtentItem *)data;
+  uint32_t off = sizeof(BTRFS_ExtentItem);
+  if (key->type == KeyType_ExtentItem &&
+      (extent_item->flags & ExtentFlag_TreeBlock))
+    off += sizeof(BTRFS_TreeBlockInfo);
+
+  BTRFS_Range *extent = BackRef_Append(&list->extents, &list->extent_count,
+                                       &list->extent_capacity,
+                                       sizeof(BTRFS_Range));
+  if (extent == NULL) return -1;
+  *extent = (BTRFS_Range){bytenr, BackRef_ExtentLength(key)};
+
+  while (off + sizeof(BTRFS_ExtentInlineRef) <= size) {
+    BTRFS_ExtentInlineRef *ref = (BTRFS_ExtentInlineRef *)(data + off);
+    int err = 0;
+
+    switch (ref->type) {
+      case KeyType_TreeBlockRef:
+        err = BackRef_Add(list, bytenr, BackRef_Tree, ref->offset, 0, 0);
+        off += sizeof(BTRFS_ExtentInlineRef);
+        break;
+      case KeyType_SharedBlockRef:
+        err = BackRef_Add(list, bytenr, BackRef_SharedTree, ref->offset, 0, 0);
+        off += sizeof(BTRFS_ExtentInlineRef);
+        break;
+      case KeyType_SharedDataRef:
+        // Followed by the reference count.
+        err = BackRef_Add(list, bytenr, BackRef_SharedData, ref->offset, 0, 0);
+        off += sizeof(BTRFS_ExtentInlineRef) + sizeof(uint32_t);
+        break;
+      case KeyType_ExtentDataRef: {
+        if (off + 1 + sizeof(BTRFS_ExtentDataRef) > size) return 0;
+        BTRFS_ExtentDataRef *data_ref =
+            (BTRFS_ExtentDataRef *)(data + off + 1);
+        err = BackRef_Add(list, bytenr, BackRef_Data, data_ref->root,
+                          data_ref->object_id, data_ref->offset);
+        off += 1 + sizeof(BTRFS_ExtentDataRef);
+      } break;
+      default:
+        // Nothing after an unknown reference can be found.
+        return 0;
+    }
+    if (err != 0) return err;
+  }
+  return 0;
+}
+
+// Receives an owner with the bytes of the extent it references, as offsets
+// into the extent. The offset of a file's owner is where the extent's start
+// would be in the file.
+typedef int (*BackRefSink)(const BTRFS_BackRef *ref, uint64_t start,
+                           uint64_t end, void *context);
+
+// What resolving one reference leaves for the next: the last shared block
+// read, as neighbouring shared references usually name the same one, and a
+// path into the tree of the last direct one.
+typedef struct {
+  BTRFS_Header *node;
+  BTRFS_Path path;
+  uint64_t tree_id;
+  uint64_t tree_root;
+} BackRefResolver;
+
+static int BackRef_ResolverInit(BackRefResolver *resolver) {
+  memset(resolver, 0, sizeof(BackRefResolver));
+  resolver->node = BTRFS_Alloc(BTRFS_GetNodeSize());
+  if (resolver->node == NULL) return -1;
+  resolver->node->logical_address = 0;
+  return 0;
+}
+
+static void BackRef_ResolverRelease(BackRefResolver *resolver) {
+  BTRFS_Free(resolver->node, BTRFS_GetNodeSize());
+  BTRFS_PathRelease(&resolver->path);
+}
+
+// Report a file extent item if it points into the extent. Only the bytes it
+// references are owned by the file, the rest of the extent may belong to
+// others or to no one.
+static int BackRef_ReportExtent(BTRFS_BackRef *ref, BTRFS_Key *key,
+                                BTRFS_ExtentDataFull *extent, uint64_t bytenr,
+                                BackRefSink sink, void *context) {
+  if (extent->inlineData.type == ExtentDataType_Inline ||
+      extent->extent_logical_addr != bytenr)
+    return 0;
+
+  ref->inode = key->object_id;
+  ref->offset = key->offset - extent->extent_offset;
+  return sink(ref, extent->extent_offset,
+              extent->extent_offset + extent->logical_byte_count, context);
+}
+
+// A data reference counts the file extent items of one inode that place the
+// extent's start at the same offset in the file. Those items start at or
+// after that offset and before the extent's end would be.
+static int BackRef_ResolveData(const BackRefRaw *raw, uint64_t length,
+                               BackRefResolver *resolver, BackRefSink sink,
+                               void *context) {
+  if (resolver->tree_id != raw->root) {
+    resolver->tree_id = 0;
+    int err = BTRFS_GetTreeRoot(raw->root, &resolver->tree_root, NULL);
+    if (err == -2) return 0;
+    if (err != 0) return -1;
+    resolver->tree_id = raw->root;
+  }
+
+  BTRFS_BackRef ref = {raw->root, raw->inode, 0};
+  BTRFS_Key key = {raw->inode, KeyType_ExtentData, raw->offset};
+  int err = BTRFS_SearchPath(resolver->tree_root, &key, &resolver->path);
+
+  while (err == 0) {
+    BTRFS_Key *item_key = BTRFS_PathKey(&resolver->path);
+    if (item_key->object_id != raw->inode ||
+        item_key->type != KeyType_ExtentData ||
+        item_key->offset - raw->offset >= length)
+      break;
+
+    uint32_t size = 0;
+    BTRFS_ExtentDataFull *extent = BTRFS_PathItem(&resolver->path, &size);
+    if (size >= sizeof(BTRFS_ExtentDataFull) &&
+        item_key->offset - extent->extent_offset == raw->offset) {
+      int retVal = BackRef_ReportExtent(&ref, item_key, extent, raw->bytenr,
+                                        sink, context);
+      if (retVal != 0) return retVal;
+    }
+    err = BTRFS_NextItem(&resolver->path);
+  }
+  return err < 0 ? -1 : 0;
+}
+
+// Resolve one decoded reference of an extent of the given length.
+static int BackRef_Resolve(const BackRefRaw *raw, uint64_t length,
+                           BackRefResolver *resolver, BackRefSink sink,
+                           void *context) {
+  BTRFS_BackRef ref = {raw->root, raw->inode, 0};
+  BTRFS_Header *node = resolver->node;
+
+  switch (raw->kind) {
+    case BackRef_Data:
+      return BackRef_ResolveData(raw, length, resolver, sink, context);
+    case BackRef_Tree:
+      return sink(&ref, 0, length, context);
+  }
+
+  if (node->logical_address != raw->root || node->logical_address == 0) {
+    if (BTRFS_GetNode(node, raw->root) != 0) {
+      node->logical_address = 0;
+      return -1;
+    }
+  }
+
+  ref.root = node->parent_tree_id;
+  if (raw->kind == BackRef_SharedTree) return sink(&ref, 0, length, context);
+  if (node->level != 0) return 0;
+
+  // The leaf's file extent items pointing into the extent.
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(node + 1);
+  for (uint32_t i = 0; i < node->item_count; i++, chunk_entry++) {
+    if (chunk_entry->key.type != KeyType_ExtentData ||
+        chunk_entry->data_size < sizeof(BTRFS_ExtentDataFull))
+      continue;
+
+    BTRFS_ExtentDataFull *extent =
+        (BTRFS_ExtentDataFull *)((uint8_t *)node + sizeof(BTRFS_Header) +
+                                 chunk_entry->data_offset);
+    int retVal = BackRef_ReportExtent(&ref, &chunk_entry->key, extent,
+                                      raw->bytenr, sink, context);
+    if (retVal != 0) return retVal;
+  }
+  return 0;
+}
+
+// Passes the owners of one address on to a BTRFS_BackRefCallback.
+typedef struct {
+  uint64_t delta;
+  BTRFS_BackRefCallback callback;
+  void *context;
+} BackRefFilter;
+
+static int BackRef_FilterOwner(const BTRFS_BackRef *ref, uint64_t start,
+                               uint64_t end, void *context) {
+  BackRefFilter *filter = context;
+  if (filter->delta < start || filter->delta >= end) return 0;
+
+  BTRFS_BackRef owner = *ref;
+  if (owner.inode != 0) owner.offset += filter->delta;
+  return filter->callback(&owner, filter->context);
+}
+
+int BTRFS_ResolveLogical(uint64_t logical, BTRFS_BackRefCallback callback,
+                         void *context) {
+  BackRefList list;
+  memset(&list, 0, sizeof(BackRefList));
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+
+  // Step back from past every item of the address to the extent or
+  // metadata item starting at or before it, over its keyed references.
+  BTRFS_Key key = {logical, 0xff, UINT64_MAX};
+  int err = BTRFS_SearchPath(BTRFS_GetExtentTreeLocation(), &key, &path);
+  if (err >= 0) err = BTRFS_PrevItem(&path);
+  while (err == 0 && BTRFS_PathKey(&path)->type != KeyType_ExtentItem &&
+         BTRFS_PathKey(&path)->type != KeyType_MetadataItem)
+    err = BTRFS_PrevItem(&path);
+
+  uint64_t bytenr = 0, length = 0;
+  if (err == 0) {
+    BTRFS_Key *extent_key = BTRFS_PathKey(&path);
+    bytenr = extent_key->object_id;
+    length = BackRef_ExtentLength(extent_key);
+    if (logical - bytenr >= length) err = 1;
+  }
+
+  // The extent item comes first, then its keyed references.
+  while (err == 0 && BTRFS_PathKey(&path)->object_id == bytenr) {
+    uint32_t size = 0;
+    uint8_t *data = BTRFS_PathItem(&path, &size);
+    if (BackRef_DecodeItem(BTRFS_PathKey(&path), data, size, &list) != 0)
+      err = -1;
+    else
+      err = BTRFS_NextItem(&path);
+  }
+  BTRFS_PathRelease(&path);
+
+  int retVal = err < 0 ? -1 : 0;
+  BackRefResolver resolver;
+  memset(&resolver, 0, sizeof(BackRefResolver));
+  if (retVal == 0 && list.count > 0)
+    retVal = BackRef_ResolverInit(&resolver);
+
+  BackRefFilter filter = {logical - bytenr, callback, context};
+  for (size_t i = 0; retVal == 0 && i < list.count; i++)
+    retVal = BackRef_Resolve(&list.refs[i], length, &resolver,
+                             BackRef_FilterOwner, &filter);
+
+  BackRef_ResolverRelease(&resolver);
+  free(list.refs);
+  free(list.extents);
+  return retVal;
+}
+
+static int BackRef_VisitLeaf(BTRFS_Header *leaf, int worker, void *context) {
+  BackRefList *list = (BackRefList *)context + worker;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    if (BackRef_DecodeItem(&chunk_entry->key,
+                           (uint8_t *)leaf + sizeof(BTRFS_Header) +
+                               chunk_entry->data_offset,
+                           chunk_entry->data_size, list) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int BackRef_CompareRaw(const void *a, const void *b) {
+  const BackRefRaw *x = a, *y = b;
+  if (x->bytenr != y->bytenr) return x->bytenr < y->bytenr ? -1 : 1;
+  if (x->root != y->root) return x->root < y->root ? -1 : 1;
+  return 0;
+}
+
+static int BackRef_CompareExtents(const void *a, const void *b) {
+  const BTRFS_Range *x = a, *y = b;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return 0;
+}
+
+typedef struct {
+  BTRFS_BackRefIndex *index;
+  size_t capacity;
+  uint64_t bytenr;
+  uint64_t length;
+} BackRefBuild;
+
+static int BackRef_AddEntry(const BTRFS_BackRef *ref, uint64_t start,
+                            uint64_t end, void *context) {
+  BackRefBuild *build = context;
+  BTRFS_BackRefIndex *index = build->index;
+
+  BTRFS_BackRefEntry *entry =
+      BackRef_Append(&index->entries, &index->count, &build->capacity,
+                     sizeof(BTRFS_BackRefEntry));
+  if (entry == NULL) return -1;
+  entry->bytenr = build->bytenr;
+  entry->length = build->length;
+  entry->start = start;
+  entry->end = end;
+  entry->ref = *ref;
+  return 0;
+}
+
+int BTRFS_BuildBackRefIndex(int threads, BTRFS_BackRefIndex *index) {
+  memset(index, 0, sizeof(BTRFS_BackRefIndex));
+  if (threads < 1) threads = 1;
+
+  BackRefList *lists = calloc(threads, sizeof(BackRefList));
+  if (lists == NULL) return -1;
+
+  int retVal = BTRFS_ParallelWalk(BTRFS_GetExtentTreeLocation(), threads,
+                                  BackRef_VisitLeaf, lists);
+
+  // Join the workers' lists, keyed references may have landed in another
+  // worker than their extent item.
+  BackRefList all;
+  memset(&all, 0, sizeof(BackRefList));
+  for (int i = 0; i < threads; i++) {
+    all.count += lists[i].count;
+    all.extent_count += lists[i].extent_count;
+  }
+  if (retVal == 0) {
+    all.refs = malloc(all.count * sizeof(BackRefRaw) + 1);
+    all.extents = malloc(all.extent_count * sizeof(BTRFS_Range) + 1);
+    if (all.refs == NULL || all.extents == NULL) retVal = -1;
+  }
+
+  size_t refs = 0, extents = 0;
+  for (int i = 0; i < threads; i++) {
+    if (retVal == 0) {
+      memcpy(all.refs + refs, lists[i].refs, lists[i].count * sizeof(BackRefRaw));
+      memcpy(all.extents + extents, lists[i].extents,
+             lists[i].extent_count * sizeof(BTRFS_Range));
+      refs += lists[i].count;
+      extents += lists[i].extent_count;
+    }
+    free(lists[i].refs);
+    free(lists[i].extents);
+  }
+  free(lists);
+
+  BackRefResolver resolver;
+  memset(&resolver, 0, sizeof(BackRefResolver));
+  if (retVal == 0) {
+    qsort(all.refs, all.count, sizeof(BackRefRaw), BackRef_CompareRaw);
+    qsort(all.extents, all.extent_count, sizeof(BTRFS_Range),
+          BackRef_CompareExtents);
+    retVal = BackRef_ResolverInit(&resolver);
+  }
+
+  // Both lists are in address order, so the extents' lengths are picked up
+  // in one pass.
+  BackRefBuild build = {index, 0, 0, 0};
+  size_t e = 0;
+  for (size_t i = 0; retVal == 0 && i < all.count; i++) {
+    BackRefRaw *raw = &all.refs[i];
+    while (e < all.extent_count && all.extents[e].start < raw->bytenr) e++;
+    if (e == all.extent_count || all.extents[e].start != raw->bytenr) continue;
+
+    build.bytenr = raw->bytenr;
+    build.length = all.extents[e].length;
+    retVal = BackRef_Resolve(raw, build.length, &resolver, BackRef_AddEntry,
+                             &build);
+  }
+
+  BackRef_ResolverRelease(&resolver);
+  free(all.refs);
+  free(all.extents);
+
+  if (retVal != 0) {
+    BTRFS_FreeBackRefIndex(index);
+    return -1;
+  }
+  return 0;
+}
+
+void BTRFS_FreeBackRefIndex(BTRFS_BackRefIndex *index) {
+  free(index->entries);
+  memset(index, 0, sizeof(BTRFS_BackRefIndex));
+}
+
+int BTRFS_BackRefIndexLookup(const BTRFS_BackRefIndex *index, uint64_t logical,
+                             BTRFS_BackRefCallback callback, void *context) {
+  // Find the last extent starting at or before the address, then the first
+  // of its entries.
+  size_t lo = 0, hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->entries[mid].bytenr <= logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0) return 0;
+
+  uint64_t bytenr = index->entries[lo - 1].bytenr;
+  if (logical - bytenr >= index->entries[lo - 1].length) return 0;
+  while (lo > 1 && index->entries[lo - 2].bytenr == bytenr) lo--;
+
+  for (size_t i = lo - 1; i < index->count && index->entries[i].bytenr == bytenr;
+       i++) {
+    const BTRFS_BackRefEntry *entry = &index->entries[i];
+    uint64_t delta = logical - bytenr;
+    if (delta < entry->start || delta >= entry->end) continue;
+
+    BTRFS_BackRef ref = entry->ref;
+    if (ref.inode != 0) ref.offset += delta;
+    int retVal = callback(&ref, context);
+    if (retVal != 0) return retVal;
+  }
+  return 0;
+}
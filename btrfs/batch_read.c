@@ -0,0 +1,383 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reading the extents of many files one file at a time seeks back and forth
+// across the device. Instead every extent wanted is planned first as a
+// segment, the segments are sorted by where they are on disk, and reads
+// sweep across the device once.
+
+// Reads are merged across gaps up to this size, reading the gap costs less
+// than seeking over it.
+#define BATCH_MERGE_GAP (128 * 1024)
+
+// Largest single read, segments are split to fit.
+#define BATCH_READ_SIZE (4 * 1024 * 1024)
+
+// Holes are handed out from a zeroed buffer of this size.
+#define BATCH_ZERO_SIZE (64 * 1024)
+
+#define BATCH_MAX_THREADS 64
+
+// One sector aligned read of part of an extent. Only len bytes from skip on
+// go to the file, the rest rounds the read out to whole sectors.
+typedef struct {
+  uint64_t device_id;
+  uint64_t physical_addr;
+  uint64_t logical;
+  uint64_t length;
+  uint64_t skip;
+  uint64_t len;
+  uint64_t file_offset;
+  size_t request;
+  bool verify;
+} BatchSegment;
+
+typedef struct {
+  const BTRFS_ReadRequest *requests;
+  BatchSegment *segments;
+  size_t count;
+  size_t capacity;
+  uint8_t *zeros;
+} BatchPlan;
+
+static int Batch_AddSegment(BatchPlan *plan, const BatchSegment *segment) {
+  if (plan->count == plan->capacity) {
+    size_t capacity = plan->capacity ? plan->capacity * 2 : 1024;
+    BatchSegment *grown =
+        realloc(plan->segments, capacity * sizeof(BatchSegment));
+    if (grown == NULL) return -1;
+    plan->segments = grown;
+    plan->capacity = capacity;
+  }
+  plan->segments[plan->count++] = *segment;
+  return 0;
+}
+
+static int Batch_Deliver(const BTRFS_ReadRequest *request, uint64_t offset,
+                         const void *data, uint64_t len) {
+  return request->callback(request->inode, offset, data, len,
+                           request->context);
+}
+
+static int Batch_DeliverZeros(BatchPlan *plan, const BTRFS_ReadRequest *request,
+                              uint64_t offset, uint64_t len) {
+  while (len > 0) {
+    uint64_t n = len < BATCH_ZERO_SIZE ? len : BATCH_ZERO_SIZE;
+    int err = Batch_Deliver(request, offset, plan->zeros, n);
+    if (err != 0) return err;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Plan the reads of part of an extent on disk, in pieces no larger than a
+// single read.
+static int Batch_PlanExtent(BatchPlan *plan, size_t request, uint64_t logical,
+                            uint64_t len, uint64_t file_offset, bool verify) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+
+  while (len > 0) {
+    BatchSegment segment;
+    segment.skip = logical % sector_size;
+    segment.logical = logical - segment.skip;
+    segment.len = BATCH_READ_SIZE - segment.skip;
+    if (segment.len > len) segment.len = len;
+    segment.length = (segment.skip + segment.len + sector_size - 1) /
+                     sector_size * sector_size;
+    segment.file_offset = file_offset;
+    segment.request = request;
+    segment.verify = verify;
+
+    BTRFS_PhysicalAddress p_addr = {0, 0};
+    if (BTRFS_TranslateLogicalAddress(segment.logical, &p_addr) != 0)
+      return -1;
+    segment.device_id = p_addr.device_id;
+    segment.physical_addr = p_addr.physical_addr;
+    if (Batch_AddSegment(plan, &segment) != 0) return -1;
+
+    logical += segment.len;
+    file_offset += segment.len;
+    len -= segment.len;
+  }
+  return 0;
+}
+
+// Gather the extents of one request. Inline data, holes and ranges that
+// cannot be read are delivered right away, the rest is planned.
+static int Batch_PlanRequest(BatchPlan *plan, size_t index, BTRFS_Path *path,
+                             BTRFS_ExtentDataInline *extent) {
+  const BTRFS_ReadRequest *request = &plan->requests[index];
+
+  BTRFS_Key key = {request->inode, KeyType_InodeItem, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+  if (err < 0) return -1;
+  if (err > 0 || BTRFS_CompareKeys(BTRFS_PathKey(path), &key) != 0) return 0;
+
+  BTRFS_InodeItem *inode_item = BTRFS_PathItem(path, NULL);
+  uint64_t file_size = inode_item->st_size;
+  bool verify = BTRFS_GetReadVerification() &&
+                !(inode_item->flags & BTRFS_InodeFlag_NoDataSum);
+
+  uint64_t offset = request->offset;
+  uint64_t end = request->offset + request->len;
+  if (end > file_size || end < offset) end = file_size;
+
+  while (offset < end) {
+    uint64_t size_rem = end - offset;
+    uint64_t extent_off = 0;
+    uint32_t extent_size = 0;
+
+    int found = BTRFS_FindFileExtent(path, request->inode, offset, extent,
+                                     &extent_off, &extent_size);
+    if (found < 0) return -1;
+
+    if (found == 0 || extent_off > offset) {
+      uint64_t hole = found == 0 ? size_rem : extent_off - offset;
+      if (hole > size_rem) hole = size_rem;
+      if ((err = Batch_DeliverZeros(plan, request, offset, hole)) != 0)
+        return err;
+      offset += hole;
+      continue;
+    }
+
+    uint64_t off_in_ext = offset - extent_off;
+    uint64_t extent_len = extent->decoded_size;
+    if (extent->type != ExtentDataType_Inline)
+      extent_len = ((BTRFS_ExtentDataFull *)extent)->logical_byte_count;
+    uint64_t rd_size = extent_len - off_in_ext;
+    if (rd_size > size_rem) rd_size = size_rem;
+
+    if (extent->compression_type != 0) {
+      err = Batch_Deliver(request, offset, NULL, rd_size);
+    } else if (extent->type == ExtentDataType_Inline) {
+      // Inline data shorter than the extent claims reads as zeros.
+      uint64_t avail = extent_size - sizeof(BTRFS_ExtentDataInline);
+      uint64_t copy = off_in_ext < avail ? avail - off_in_ext : 0;
+      if (copy > rd_size) copy = rd_size;
+      err = Batch_Deliver(request, offset,
+                          (uint8_t *)(extent + 1) + off_in_ext, copy);
+      if (err == 0)
+        err = Batch_DeliverZeros(plan, request, offset + copy, rd_size - copy);
+    } else {
+      BTRFS_ExtentDataFull *extent_full = (BTRFS_ExtentDataFull *)extent;
+
+      if (extent->type == ExtentDataType_Prealloc ||
+          extent_full->extent_logical_addr == 0)
+        err = Batch_DeliverZeros(plan, request, offset, rd_size);
+      else
+        err = Batch_PlanExtent(plan, index,
+                               extent_full->extent_logical_addr +
+                                   extent_full->extent_offset + off_in_ext,
+                               rd_size, offset, verify);
+    }
+    if (err != 0) return err;
+
+    offset += rd_size;
+  }
+  return 0;
+}
+
+static int Batch_CompareSegments(const void *a, const void *b) {
+  const BatchSegment *x = a, *y = b;
+  if (x->device_id != y->device_id) return x->device_id < y->device_id ? -1 : 1;
+  if (x->physical_addr != y->physical_addr)
+    return x->physical_addr < y->physical_addr ? -1 : 1;
+  return 0;
+}
+
+// Read the segments from first up to, not including, last with one read, and
+// deliver them.
+static int Batch_ReadSpan(BatchPlan *plan, size_t first, size_t last,
+                          uint8_t *buf) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  BatchSegment *segments = plan->segments;
+  uint64_t start = segments[first].physical_addr;
+  uint64_t end = start;
+  for (size_t i = first; i < last; i++)
+    if (segments[i].physical_addr + segments[i].length > end)
+      end = segments[i].physical_addr + segments[i].length;
+
+  if (BTRFS_ReadRaw(buf, segments[first].device_id, start, end - start) !=
+      end - start)
+    return -1;
+
+  for (size_t i = first; i < last; i++) {
+    BatchSegment *segment = &segments[i];
+    uint8_t *data = buf + (segment->physical_addr - start);
+
+    int err = 0;
+    if (segment->verify)
+      err = BTRFS_VerifyData(segment->logical, data,
+                             segment->length / sector_size);
+    if (err == -1) return -1;
+
+    err = Batch_Deliver(&plan->requests[segment->request],
+                        segment->file_offset,
+                        err == 0 ? data + segment->skip : NULL, segment->len);
+    if (err != 0) return err;
+  }
+  return 0;
+}
+
+// Readers take the merged reads in disk order, so with several of them the
+// device sees a short queue of nearby requests rather than random ones.
+typedef struct {
+  BatchPlan *plan;
+  size_t *spans;
+  size_t span_count;
+  atomic_size_t next;
+  atomic_int result;
+} BatchReaders;
+
+typedef struct {
+  BatchReaders *readers;
+  int index;
+} BatchReader;
+
+static void Batch_Fail(BatchReaders *readers, int err) {
+  int expected = 0;
+  atomic_compare_exchange_strong(&readers->result, &expected, err);
+}
+
+static void *Batch_ReadThread(void *arg) {
+  BatchReader *reader = arg;
+  BatchReaders *readers = reader->readers;
+  uint8_t *buf = malloc(BATCH_READ_SIZE + BATCH_MERGE_GAP);
+  if (buf == NULL) Batch_Fail(readers, -1);
+
+  while (buf != NULL && atomic_load(&readers->result) == 0) {
+    size_t span = atomic_fetch_add(&readers->next, 1);
+    if (span >= readers->span_count) break;
+
+    int err = Batch_ReadSpan(readers->plan, readers->spans[span],
+                             readers->spans[span + 1], buf);
+    if (err != 0) Batch_Fail(readers, err);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Split the sorted segments into reads. Segments join a read while they
+// start within the merge gap of its end and the read stays within the
+// buffer. Overlapping segments, from extents shared between files, always
+// join, so shared data is read once.
+static size_t Batch_SplitSpans(BatchPlan *plan, size_t *spans) {
+  size_t span_count = 0;
+  size_t first = 0;
+
+  while (first < plan->count) {
+    BatchSegment *head = &plan->segments[first];
+    uint64_t end = head->physical_addr + head->length;
+    size_t last = first + 1;
+
+    for (; last < plan->count; last++) {
+      BatchSegment *segment = &plan->segments[last];
+      uint64_t segment_end = segment->physical_addr + segment->length;
+      if (segment->device_id != head->device_id ||
+          segment->physical_addr > end + BATCH_MERGE_GAP ||
+          segment_end - head->physical_addr > BATCH_READ_SIZE + BATCH_MERGE_GAP)
+        break;
+      if (segment_end > end) end = segment_end;
+    }
+
+    spans[span_count++] = first;
+    first = last;
+  }
+  spans[span_count] = plan->count;
+  return span_count;
+}
+
+static int Batch_Read(BatchPlan *plan, int threads) {
+  if (threads < 1) threads = 1;
+  if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+
+  BatchReaders readers;
+  readers.plan = plan;
+  readers.spans = malloc((plan->count + 1) * sizeof(size_t));
+  if (readers.spans == NULL) return -1;
+  readers.span_count = Batch_SplitSpans(plan, readers.spans);
+  atomic_init(&readers.next, 0);
+  atomic_init(&readers.result, 0);
+
+  pthread_t handles[BATCH_MAX_THREADS];
+  BatchReader workers[BATCH_MAX_THREADS];
+  int started = 0;
+
+  for (int i = 1; i < threads && (size_t)i < readers.span_count; i++) {
+    workers[i] = (BatchReader){&readers, i};
+    if (pthread_create(&handles[i], NULL, Batch_ReadThread, &workers[i]) != 0)
+      break;
+    started = i;
+  }
+
+  // The calling thread is reader 0.
+  workers[0] = (BatchReader){&readers, 0};
+  Batch_ReadThread(&workers[0]);
+
+  for (int i = 1; i <= started; i++) pthread_join(handles[i], NULL);
+
+  free(readers.spans);
+  return atomic_load(&readers.result);
+}
+
+static int Batch_CompareRequests(const void *a, const void *b) {
+  const BTRFS_ReadRequest *x = *(const BTRFS_ReadRequest **)a;
+  const BTRFS_ReadRequest *y = *(const BTRFS_ReadRequest **)b;
+  if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+int BTRFS_ReadFiles(const BTRFS_ReadRequest *requests, size_t count,
+                    int threads) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BatchPlan plan;
+  memset(&plan, 0, sizeof(BatchPlan));
+  plan.requests = requests;
+
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+
+  // Planning in inode order keeps the tree searches moving forward.
+  const BTRFS_ReadRequest **order =
+      malloc(count * sizeof(BTRFS_ReadRequest *) + 1);
+  BTRFS_ExtentDataInline *extent = BTRFS_Alloc(node_size);
+  plan.zeros = BTRFS_Alloc(BATCH_ZERO_SIZE);
+
+  int retVal = -1;
+  if (order != NULL && extent != NULL && plan.zeros != NULL) {
+    memset(plan.zeros, 0, BATCH_ZERO_SIZE);
+    for (size_t i = 0; i < count; i++) order[i] = &requests[i];
+    qsort(order, count, sizeof(BTRFS_ReadRequest *), Batch_CompareRequests);
+
+    retVal = 0;
+    for (size_t i = 0; retVal == 0 && i < count; i++)
+      retVal = Batch_PlanRequest(&plan, order[i] - requests, &path, extent);
+  }
+  BTRFS_PathRelease(&path);
+
+  if (retVal == 0) {
+    qsort(plan.segments, plan.count, sizeof(BatchSegment),
+          Batch_CompareSegments);
+    retVal = Batch_Read(&plan, threads);
+  }
+
+  BTRFS_Free(plan.zeros, BATCH_ZERO_SIZE);
+  BTRFS_Free(extent, node_size);
+  free(order);
+  free(plan.segments);
+  return retVal;
+}
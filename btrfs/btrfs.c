@@ -8,6 +8,7 @@
 #include "btrfs.h"
 #include "crc32c.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,12 +20,27 @@ static uint64_t (*write_handler)(void *buf, uint64_t devID, uint64_t off,
                                  uint64_t len);
 static uint64_t (*read_handler)(void *buf, uint64_t devID, uint64_t off,
                                 uint64_t len);
+static void (*prefetch_handler)(uint64_t devID, uint64_t off, uint64_t len);
 
 #define L4_LEVEL_SIZE (512 * 1024 * 1024 * 1024ull)
 #define L3_LEVEL_SIZE (1 * 1024 * 1024 * 1024ull)
 #define L2_LEVEL_SIZE (2 * 1024 * 1024ull)
 #define L1_LEVEL_SIZE (4 * 1024ull)
 
+// Mapped entries hold the page aligned physical address, tagged with the
+// device id in the bits below it and a 1 in bit 0 to tell them from tables.
+#define MAPPING_DEVICE_SHIFT 1
+#define MAPPING_MAX_DEVICE 0x7ff
+#define MAPPING_ADDRESS_MASK (~0xfffull)
+
+// Nodes of a batch closer than this are read together, reading the gap
+// costs less than seeking over it. Runs are split at the largest read, and
+// batches are sorted this many nodes at a time, so both buffers fit in an
+// arena allocation.
+#define NODE_BATCH_MERGE_GAP (64 * 1024)
+#define NODE_BATCH_READ_SIZE (256 * 1024)
+#define NODE_BATCH_GROUP 8192
+
 #define INODE_NODE_TRANSLATION_CACHE_SIZE (64 * 1024)
 uint64_t inode_node_translation_table[INODE_NODE_TRANSLATION_CACHE_SIZE];
 uint64_t inode_node_translation_table_key[INODE_NODE_TRANSLATION_CACHE_SIZE];
@@ -36,6 +52,8 @@ void BTRFS_InitializeStructures(int cache_size) {
          INODE_NODE_TRANSLATION_CACHE_SIZE * sizeof(uint64_t));
   memset(inode_node_translation_table_key, 0,
          INODE_NODE_TRANSLATION_CACHE_SIZE * sizeof(uint64_t));
+  BTRFS_ReleasePathCache();
+  BTRFS_ReleaseChecksumCache();
 }
 
 void BTRFS_AddInodeToCache(uint64_t inode, uint64_t addr) {
@@ -54,6 +72,11 @@ void BTRFS_GetInodeFromCache(uint64_t *inode, uint64_t *addr) {
       inode_node_translation_table[*inode % INODE_NODE_TRANSLATION_CACHE_SIZE];
 }
 
+int BTRFS_ChunkIsStriped(const BTRFS_ChunkItem *chunk) {
+  return (chunk->type & (BlockGroupFlag_RAID0 | BlockGroupFlag_RAID10 |
+                         BlockGroupFlag_RAID5 | BlockGroupFlag_RAID6)) != 0;
+}
+
 void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
                              uint64_t len) {
   if (vAddr % 4096) return;
@@ -62,6 +85,8 @@ void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
 
   if (len % 4096) return;
 
+  if (deviceID > MAPPING_MAX_DEVICE) return;
+
   if (len != L4_LEVEL_SIZE && len != L3_LEVEL_SIZE && len != L2_LEVEL_SIZE &&
       len != L1_LEVEL_SIZE) {
     while (len > 0) {
@@ -94,12 +119,13 @@ void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
 
     return;
   }
-  printf("Vaddr: %llx \tPaddr: %llx \tLen: %llx \n", vAddr, pAddr, len);
-
+  // Tables are zeroed before they are published, lookups from other threads
+  // may be walking them without holding the chunk load lock.
   uint32_t l4_i = (vAddr >> 39) & 0x1FF;
   uint32_t l3_i = (vAddr >> 30) & 0x1FF;
   uint32_t l2_i = (vAddr >> 21) & 0x1FF;
   uint32_t l1_i = (vAddr >> 12) & 0x1FF;
+  uint64_t entry = pAddr | deviceID << MAPPING_DEVICE_SHIFT | 1;
 
   if ((uint64_t)chunk_tree_root[l4_i] & 1) {
     chunk_tree_root[l4_i] = 0;
@@ -107,10 +133,12 @@ void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
 
   if (chunk_tree_root[l4_i] == 0) {
     if (len != L4_LEVEL_SIZE) {
-      chunk_tree_root[l4_i] = malloc(sizeof(uint64_t) * 512);
-      memset(chunk_tree_root[l4_i], 0, 512 * sizeof(uint64_t));
+      uint64_t ***table = BTRFS_Alloc(512 * sizeof(uint64_t));
+      if (table == NULL) return;
+      memset(table, 0, 512 * sizeof(uint64_t));
+      chunk_tree_root[l4_i] = table;
     } else {
-      chunk_tree_root[l4_i] = (uint64_t ***)(pAddr | 1);
+      chunk_tree_root[l4_i] = (uint64_t ***)entry;
       return;
     }
   }
@@ -121,10 +149,12 @@ void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
 
   if (chunk_tree_root[l4_i][l3_i] == 0) {
     if (len != L3_LEVEL_SIZE) {
-      chunk_tree_root[l4_i][l3_i] = malloc(sizeof(uint64_t) * 512);
-      memset(chunk_tree_root[l4_i][l3_i], 0, 512 * sizeof(uint64_t));
+      uint64_t **table = BTRFS_Alloc(512 * sizeof(uint64_t));
+      if (table == NULL) return;
+      memset(table, 0, 512 * sizeof(uint64_t));
+      chunk_tree_root[l4_i][l3_i] = table;
     } else {
-      chunk_tree_root[l4_i][l3_i] = (uint64_t **)(pAddr | 1);
+      chunk_tree_root[l4_i][l3_i] = (uint64_t **)entry;
       return;
     }
   }
@@ -135,15 +165,17 @@ void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
 
   if (chunk_tree_root[l4_i][l3_i][l2_i] == 0) {
     if (len != L2_LEVEL_SIZE) {
-      chunk_tree_root[l4_i][l3_i][l2_i] = malloc(sizeof(uint64_t) * 512);
-      memset(chunk_tree_root[l4_i][l3_i][l2_i], 0, 512 * sizeof(uint64_t));
+      uint64_t *table = BTRFS_Alloc(512 * sizeof(uint64_t));
+      if (table == NULL) return;
+      memset(table, 0, 512 * sizeof(uint64_t));
+      chunk_tree_root[l4_i][l3_i][l2_i] = table;
     } else {
-      chunk_tree_root[l4_i][l3_i][l2_i] = (uint64_t *)(pAddr | 1);
+      chunk_tree_root[l4_i][l3_i][l2_i] = (uint64_t *)entry;
       return;
     }
   }
 
-  chunk_tree_root[l4_i][l3_i][l2_i][l1_i] = pAddr | 1;
+  chunk_tree_root[l4_i][l3_i][l2_i][l1_i] = entry;
 }
 
 void BTRFS_SetDiskReadHandler(uint64_t (*handler)(void *buf, uint64_t devID,
@@ -157,6 +189,37 @@ void BTRFS_SetDiskWriteHandler(uint64_t (*handler)(void *buf, uint64_t devID,
   write_handler = handler;
 }
 
+void BTRFS_SetDiskPrefetchHandler(void (*handler)(uint64_t devID, uint64_t off,
+                                                  uint64_t len)) {
+  prefetch_handler = handler;
+}
+
+void BTRFS_Prefetch(uint64_t logicalAddr, uint64_t len) {
+  if (prefetch_handler == NULL) return;
+
+  BTRFS_PhysicalAddress p_addr = {0, 0};
+  if (BTRFS_TranslateLogicalAddress(logicalAddr, &p_addr) != 0) return;
+
+  prefetch_handler(p_addr.device_id, p_addr.physical_addr, len);
+}
+
+// All reads go through here to be counted and recorded.
+static uint64_t BTRFS_ReadDevice(void *buf, uint64_t devId, uint64_t addr,
+                                 uint64_t len) {
+  uint64_t start = BTRFS_StatsClock();
+  uint64_t ret = read_handler(buf, devId, addr, len);
+  uint64_t elapsed = BTRFS_StatsClock() - start;
+
+  BTRFS_RecordIO(devId, addr, len, ret, start, elapsed);
+  BTRFS_STAT(read_calls, 1);
+  BTRFS_STAT(read_bytes, len);
+  BTRFS_STAT(read_ns, elapsed);
+  BTRFS_STAT_AT(device_bytes,
+                devId < BTRFS_STATS_DEVICES ? devId : BTRFS_STATS_DEVICES - 1,
+                len);
+  return ret;
+}
+
 uint64_t BTRFS_Read(void *buf, uint64_t logicalAddr, uint64_t len) {
   BTRFS_PhysicalAddress p_addr;
   int err = 0;
@@ -164,11 +227,11 @@ uint64_t BTRFS_Read(void *buf, uint64_t logicalAddr, uint64_t len) {
     return err;
   }
 
-  return read_handler(buf, p_addr.device_id, p_addr.physical_addr, len);
+  return BTRFS_ReadDevice(buf, p_addr.device_id, p_addr.physical_addr, len);
 }
 
 uint64_t BTRFS_ReadRaw(void *buf, uint64_t devId, uint64_t addr, uint64_t len) {
-  return read_handler(buf, devId, addr, len);
+  return BTRFS_ReadDevice(buf, devId, addr, len);
 }
 
 uint64_t BTRFS_Write(void *buf, uint64_t logicalAddr, uint64_t len) {
@@ -181,17 +244,177 @@ uint64_t BTRFS_Write(void *buf, uint64_t logicalAddr, uint64_t len) {
   return write_handler(buf, p_addr.device_id, p_addr.physical_addr, len);
 }
 
-int BTRFS_GetNode(void *buf, uint64_t logicalAddr) {
-  BTRFS_Header *chunk_tree = buf;
+static BTRFS_StatsTree BTRFS_StatsTreeOf(uint64_t owner) {
+  switch (owner) {
+    case ReservedObjectID_RootTree:
+      return StatsTree_Root;
+    case ReservedObjectID_ChunkTree:
+      return StatsTree_Chunk;
+    case ReservedObjectID_ExtentTree:
+      return StatsTree_Extent;
+    case ReservedObjectID_FSTree:
+      return StatsTree_FS;
+    case ReservedObjectID_ChecksumTree:
+      return StatsTree_Checksum;
+  }
+  // Subvolumes, short of the reserved ids at the top of the range.
+  if (owner >= ReservedObjectID_FirstChunkTree && owner < (uint64_t)-255)
+    return StatsTree_FS;
+  return StatsTree_Other;
+}
+
+// Check the checksum of a node that was read, and count it.
+static int BTRFS_CheckNode(BTRFS_Header *node) {
+  uint64_t start = BTRFS_StatsClock();
+  uint32_t crc = crc32c(-1, node->uuid, BTRFS_GetNodeSize() - 0x20);
+  uint32_t expected_csum = *(uint32_t *)(node->csum);
+
+  BTRFS_STAT(checksum_bytes, BTRFS_GetNodeSize() - 0x20);
+  BTRFS_STAT(checksum_ns, BTRFS_StatsClock() - start);
+  BTRFS_STAT_AT(node_reads, BTRFS_StatsTreeOf(node->parent_tree_id), 1);
+
+  if (crc != expected_csum) return -2;
+
+  return 0;
+}
+
+static int BTRFS_ReadNode(void *buf, uint64_t logicalAddr) {
   int err = 0;
-  if((err = BTRFS_Read(chunk_tree, logicalAddr, BTRFS_GetNodeSize())) < 0)
+  if((err = BTRFS_Read(buf, logicalAddr, BTRFS_GetNodeSize())) < 0)
     return err;
 
-  uint32_t crc = crc32c(-1, chunk_tree->uuid, BTRFS_GetNodeSize() - 0x20);
-  uint32_t expected_csum = *(uint32_t *)(chunk_tree->csum);
+  return BTRFS_CheckNode(buf);
+}
 
-  if (crc != expected_csum) return -2;
+int BTRFS_GetNode(void *buf, uint64_t logicalAddr) {
+  BTRFS_TraceEvent event = {.op = TraceOp_GetNode,
+                            .logical = logicalAddr,
+                            .bytes = BTRFS_GetNodeSize()};
+  uint64_t start = BTRFS_TraceBegin(&event);
+
+  int err = BTRFS_ReadNode(buf, logicalAddr);
+  if (start != 0) {
+    BTRFS_Header *node = buf;
+    if (err == 0) {
+      event.tree = node->parent_tree_id;
+      event.level = node->level;
+    } else {
+      event.bytes = 0;
+    }
+    event.result = err;
+    BTRFS_TraceEnd(&event, start);
+  }
+  return err;
+}
+
+typedef struct {
+  uint64_t device_id;
+  uint64_t physical_addr;
+  size_t index;
+} BTRFS_NodeBatchEntry;
+
+static int BTRFS_CompareBatchEntries(const void *a, const void *b) {
+  const BTRFS_NodeBatchEntry *x = a, *y = b;
+  if (x->device_id != y->device_id) return x->device_id < y->device_id ? -1 : 1;
+  if (x->physical_addr != y->physical_addr)
+    return x->physical_addr < y->physical_addr ? -1 : 1;
+  return 0;
+}
 
+// Sort the nodes by where they are on disk and read runs of nearby ones
+// with one read each, then copy every node out to its place in buf.
+static int BTRFS_ReadNodeGroup(uint8_t *buf, const uint64_t *logicalAddrs,
+                               size_t count, BTRFS_NodeBatchEntry *entries,
+                               uint8_t *span) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  int err = 0;
+
+  for (size_t i = 0; err == 0 && i < count; i++) {
+    BTRFS_PhysicalAddress p_addr = {0, 0};
+    err = BTRFS_TranslateLogicalAddress(logicalAddrs[i], &p_addr);
+    entries[i] = (BTRFS_NodeBatchEntry){p_addr.device_id,
+                                        p_addr.physical_addr, i};
+  }
+  if (err == 0)
+    qsort(entries, count, sizeof(BTRFS_NodeBatchEntry),
+          BTRFS_CompareBatchEntries);
+
+  for (size_t first = 0; err == 0 && first < count;) {
+    uint64_t start = entries[first].physical_addr;
+    uint64_t end = start + node_size;
+    size_t last = first + 1;
+    while (last < count &&
+           entries[last].device_id == entries[first].device_id &&
+           entries[last].physical_addr <= end + NODE_BATCH_MERGE_GAP &&
+           entries[last].physical_addr + node_size - start <=
+               NODE_BATCH_READ_SIZE) {
+      if (entries[last].physical_addr + node_size > end)
+        end = entries[last].physical_addr + node_size;
+      last++;
+    }
+
+    if (BTRFS_ReadRaw(span, entries[first].device_id, start, end - start) !=
+        end - start) {
+      err = -1;
+      break;
+    }
+    for (size_t i = first; err == 0 && i < last; i++) {
+      uint8_t *node = buf + entries[i].index * node_size;
+      memcpy(node, span + (entries[i].physical_addr - start), node_size);
+      err = BTRFS_CheckNode((BTRFS_Header *)node);
+    }
+    first = last;
+  }
+
+  return err;
+}
+
+static int BTRFS_ReadNodes(uint8_t *buf, const uint64_t *logicalAddrs,
+                           size_t count) {
+  size_t group = count < NODE_BATCH_GROUP ? count : NODE_BATCH_GROUP;
+  BTRFS_NodeBatchEntry *entries =
+      BTRFS_Alloc(group * sizeof(BTRFS_NodeBatchEntry));
+  uint8_t *span = BTRFS_Alloc(NODE_BATCH_READ_SIZE);
+  int err = entries == NULL || span == NULL ? -1 : 0;
+
+  for (size_t first = 0; err == 0 && first < count; first += group) {
+    size_t n = count - first < group ? count - first : group;
+    err = BTRFS_ReadNodeGroup(buf + first * BTRFS_GetNodeSize(),
+                              logicalAddrs + first, n, entries, span);
+  }
+
+  BTRFS_Free(span, NODE_BATCH_READ_SIZE);
+  BTRFS_Free(entries, group * sizeof(BTRFS_NodeBatchEntry));
+  return err;
+}
+
+int BTRFS_GetNodes(void *buf, const uint64_t *logicalAddrs, size_t count) {
+  if (count == 0) return 0;
+
+  BTRFS_TraceEvent event = {.op = TraceOp_GetNodes,
+                            .logical = logicalAddrs[0],
+                            .bytes = count * BTRFS_GetNodeSize()};
+  uint64_t start = BTRFS_TraceBegin(&event);
+
+  int err = BTRFS_ReadNodes(buf, logicalAddrs, count);
+  if (start != 0) {
+    BTRFS_Header *node = buf;
+    if (err == 0) {
+      event.tree = node->parent_tree_id;
+      event.level = node->level;
+    } else {
+      event.bytes = 0;
+    }
+    event.result = err;
+    BTRFS_TraceEnd(&event, start);
+  }
+  return err;
+}
+
+int BTRFS_CompareKeys(const BTRFS_Key *a, const BTRFS_Key *b) {
+  if (a->object_id != b->object_id) return a->object_id < b->object_id ? -1 : 1;
+  if (a->type != b->type) return a->type < b->type ? -1 : 1;
+  if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
   return 0;
 }
 
@@ -215,9 +438,14 @@ void *BTRFS_GetNodePointer(BTRFS_Header *parent, BTRFS_KeyType type,
   return NULL;
 }
 
-int BTRFS_TranslateLogicalAddress(uint64_t logicalAddress,
-                                  BTRFS_PhysicalAddress *physicalAddress) {
-  // Walk the chunk tree to translate the provided address
+static void BTRFS_MappingDecode(uint64_t entry, uint64_t offset,
+                                BTRFS_PhysicalAddress *physicalAddress) {
+  physicalAddress->device_id = (entry & 0xfff) >> MAPPING_DEVICE_SHIFT;
+  physicalAddress->physical_addr = (entry & MAPPING_ADDRESS_MASK) + offset;
+}
+
+int BTRFS_LookupMapping(uint64_t logicalAddress,
+                        BTRFS_PhysicalAddress *physicalAddress) {
 
   uint32_t l4_i = (logicalAddress >> 39) & 0x1FF;
   uint32_t l3_i = (logicalAddress >> 30) & 0x1FF;
@@ -227,50 +455,71 @@ int BTRFS_TranslateLogicalAddress(uint64_t logicalAddress,
   if ((uint64_t)chunk_tree_root[l4_i] == 0) return -1;
 
   if ((uint64_t)chunk_tree_root[l4_i] & 1) {
-    physicalAddress->physical_addr = (uint64_t)chunk_tree_root[l4_i] & ~1;
-    physicalAddress->physical_addr += (logicalAddress % L4_LEVEL_SIZE);
+    BTRFS_MappingDecode((uint64_t)chunk_tree_root[l4_i],
+                        logicalAddress % L4_LEVEL_SIZE, physicalAddress);
     return 0;
   }
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i] == 0) return -2;
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i] & 1) {
-    physicalAddress->physical_addr = (uint64_t)chunk_tree_root[l4_i][l3_i] & ~1;
-    physicalAddress->physical_addr += (logicalAddress % L3_LEVEL_SIZE);
+    BTRFS_MappingDecode((uint64_t)chunk_tree_root[l4_i][l3_i],
+                        logicalAddress % L3_LEVEL_SIZE, physicalAddress);
     return 0;
   }
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i][l2_i] == 0) return -3;
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i][l2_i] & 1) {
-    physicalAddress->physical_addr =
-        (uint64_t)chunk_tree_root[l4_i][l3_i][l2_i] & ~1;
-    physicalAddress->physical_addr += (logicalAddress % L2_LEVEL_SIZE);
+    BTRFS_MappingDecode((uint64_t)chunk_tree_root[l4_i][l3_i][l2_i],
+                        logicalAddress % L2_LEVEL_SIZE, physicalAddress);
     return 0;
   }
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i][l2_i][l1_i] == 0) return -4;
 
   if ((uint64_t)chunk_tree_root[l4_i][l3_i][l2_i][l1_i] & 1) {
-    physicalAddress->physical_addr =
-        (uint64_t)chunk_tree_root[l4_i][l3_i][l2_i][l1_i] & ~1;
-    physicalAddress->physical_addr += (logicalAddress % L1_LEVEL_SIZE);
+    BTRFS_MappingDecode(chunk_tree_root[l4_i][l3_i][l2_i][l1_i],
+                        logicalAddress % L1_LEVEL_SIZE, physicalAddress);
     return 0;
   }
 
   return -5;
 }
 
-int BTRFS_StartParser(void) {
-  BTRFS_Superblock *sblock = malloc(0x1000);
+int BTRFS_TranslateLogicalAddress(uint64_t logicalAddress,
+                                  BTRFS_PhysicalAddress *physicalAddress) {
+  int err = BTRFS_LookupMapping(logicalAddress, physicalAddress);
+  if (err == 0) return 0;
+  BTRFS_STAT(translation_misses, 1);
+
+  // Only the system chunks are mapped up front, the rest are found in the
+  // chunk tree the first time they are used.
+  if (BTRFS_LoadChunk(logicalAddress) != 0) return err;
+  return BTRFS_LookupMapping(logicalAddress, physicalAddress);
+}
+
+int BTRFS_StartParser(void) { return BTRFS_StartParserWithSidecar(NULL); }
+
+int BTRFS_StartParserWithSidecar(const char *sidecar_path) {
+  BTRFS_Superblock *sblock = BTRFS_Alloc(0x1000);
   if (sblock == NULL) return -1;
 
   // TODO: Find the highest generation superblock.
 
-  if (BTRFS_ParseSuperblock(sblock) != 0) return -2;
+  int err = BTRFS_ParseSuperblock(sblock);
+  BTRFS_Free(sblock, 0x1000);
+  if (err != 0) return -2;
+
+  // A missing or stale sidecar only means the trees are parsed instead.
+  bool have_sidecar =
+      sidecar_path != NULL && BTRFS_OpenSidecar(sidecar_path) == 0;
 
-  int err = 0;
   if((err = BTRFS_ParseChunkTree()) != 0) return err;
   if(BTRFS_ParseRootTree() != 0) return -4;
+
+  if (sidecar_path != NULL && !have_sidecar &&
+      BTRFS_WriteSidecar(sidecar_path) == 0)
+    BTRFS_OpenSidecar(sidecar_path);
   return 0;
-}
\ No newline at end of file
+}
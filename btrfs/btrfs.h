@@ -11,14 +11,446 @@
 
 #include "btrfs_types.h"
 
+///
+/// @brief      A position in a tree, from its root down to an item in a
+///             leaf. Zero initialize before first use.
+///
+typedef struct {
+  BTRFS_Header *nodes[BTRFS_MAX_LEVEL];
+  int slots[BTRFS_MAX_LEVEL];
+  uint64_t root;
+  int root_level;
+} BTRFS_Path;
+
+typedef enum {
+  DiffChange_Added = 0,
+  DiffChange_Removed = 1,
+  DiffChange_Modified = 2,
+} BTRFS_DiffChange;
+
+///
+/// @brief      Receives one changed item from BTRFS_DiffTrees.
+///
+/// @param[in]  change    The kind of change
+/// @param      key       The key of the item
+/// @param      old_item  The item in the old tree, NULL if added
+/// @param[in]  old_size  The size of the old item
+/// @param      new_item  The item in the new tree, NULL if removed
+/// @param[in]  new_size  The size of the new item
+/// @param      context   The context passed to BTRFS_DiffTrees
+///
+/// @return     0 to continue, any other value stops the diff.
+///
+typedef int (*BTRFS_DiffCallback)(BTRFS_DiffChange change, BTRFS_Key *key,
+                                  void *old_item, uint32_t old_size,
+                                  void *new_item, uint32_t new_size,
+                                  void *context);
+
+///
+/// @brief      Receives one leaf from BTRFS_ParallelWalk or BTRFS_LevelWalk.
+///
+/// In a parallel walk leaves go to whichever worker reaches them first, so
+/// calls from
+/// different workers run concurrently and in no particular order. Calls with
+/// the same worker index never overlap, so per-worker state needs no locking;
+/// merge it after the walk returns, sorting by each leaf's first key where
+/// key order matters.
+///
+/// @param      leaf     The leaf, only valid for the duration of the call
+/// @param[in]  worker   The index of the calling worker
+/// @param      context  The context passed to the walk
+///
+/// @return     0 to continue, any other value stops the walk.
+///
+typedef int (*BTRFS_LeafVisitor)(BTRFS_Header *leaf, int worker,
+                                 void *context);
+
+///
+/// @brief      Receives one inode related item from BTRFS_EnumerateInodes.
+///
+/// @param      key      The item's key, its type tells how to read the item
+/// @param      item     The BTRFS_InodeItem, or the packed
+///                      BTRFS_InodeReference / BTRFS_InodeExtReference records
+/// @param[in]  size     The size of the item in bytes
+/// @param      context  The context passed to BTRFS_EnumerateInodes
+///
+/// @return     0 to continue, any other value stops the enumeration.
+///
+typedef int (*BTRFS_InodeVisitor)(BTRFS_Key *key, void *item, uint32_t size,
+                                  void *context);
+
+///
+/// @brief      Receives one path of an inode from BTRFS_InodeToPaths.
+///
+/// @param[in]  inode    The inode
+/// @param[in]  path     The path from the root directory, only valid for the
+///                      duration of the call
+/// @param      context  The context passed along with the callback
+///
+/// @return     0 to continue, any other value stops the resolution.
+///
+typedef int (*BTRFS_PathCallback)(uint64_t inode, const char *path,
+                                  void *context);
+
+///
+/// @brief      Receives one piece of a file from BTRFS_ReadFiles.
+///
+/// @param[in]  inode    The file's inode
+/// @param[in]  offset   The offset of the piece in the file
+/// @param[in]  data     The data, only valid for the duration of the call.
+///                      NULL if it could not be read, because it failed
+///                      verification or is compressed.
+/// @param[in]  len      The length of the piece
+/// @param      context  The request's context
+///
+/// @return     0 to continue, any other value stops the reads.
+///
+typedef int (*BTRFS_ReadCallback)(uint64_t inode, uint64_t offset,
+                                  const void *data, uint64_t len,
+                                  void *context);
+
 ///
 /// @brief      Initialize the BTRFS driver
 ///
 void BTRFS_InitializeStructures(int cache_size);
 
+///
+/// @brief      Serve all of the driver's memory from a fixed arena instead
+///             of malloc. Must be called before the driver is started.
+///
+/// Node buffers, node batches, traversal stacks and translation tables come
+/// from power of two size class pools carved out of the arena on demand, so
+/// its size bounds the memory of lookups, file reads, fingerprints and level
+/// walks; when it is exhausted operations fail as they would on a failed
+/// malloc.
+///
+/// Passes over a whole tree or batch take their working buffers from malloc
+/// once per pass instead: the block lists and read buffers of
+/// BTRFS_ScrubMetadata and BTRFS_ScrubResume, and the plans and read buffers
+/// of BTRFS_ReadFiles.
+/// Building a sidecar, allocated range maps, back reference indexes, the
+/// batch sized arrays of BTRFS_ResolvePaths and BTRFS_InodesToPaths, saving
+/// a scrub checkpoint and each thread's statistics also use malloc.
+///
+/// @param      base  The arena, NULL to go back to malloc
+/// @param[in]  size  The size of the arena in bytes, at least 256KiB
+///
+/// @return     -1 if the arena is too small, 0 on success.
+///
+int BTRFS_SetArena(void *base, size_t size);
+
+///
+/// @brief      Allocate from the arena, or from malloc if none is set.
+///
+/// @param[in]  size  The size in bytes, at most 256KiB with an arena
+///
+/// @return     The allocation, NULL on failure.
+///
+void *BTRFS_Alloc(size_t size);
+
+///
+/// @brief      Release an allocation made by BTRFS_Alloc.
+///
+/// @param      ptr   The allocation, may be NULL
+/// @param[in]  size  The size it was allocated with
+///
+void BTRFS_Free(void *ptr, size_t size);
+
+///
+/// @brief      The trees node reads are counted under, by the owner in the
+///             node's header.
+///
+typedef enum {
+  StatsTree_Root = 0,
+  StatsTree_Chunk = 1,
+  StatsTree_Extent = 2,
+  StatsTree_FS = 3,
+  StatsTree_Checksum = 4,
+  StatsTree_Other = 5,
+  BTRFS_STATS_TREES = 6,
+} BTRFS_StatsTree;
+
+// Devices past the last share its counter.
+#define BTRFS_STATS_DEVICES 8
+
+///
+/// @brief      Counters of the work done by the driver, see BTRFS_GetStats.
+///             Every member is a uint64_t.
+///
+typedef struct {
+  uint64_t node_reads[BTRFS_STATS_TREES];
+  /// Searches that found the node already held by their path, or read it.
+  uint64_t path_hits;
+  uint64_t path_misses;
+  /// Data sectors whose checksum was cached, or had to be searched for.
+  uint64_t csum_hits;
+  uint64_t csum_misses;
+  /// Calls of the disk read handler, with the bytes and time they took.
+  uint64_t read_calls;
+  uint64_t read_bytes;
+  uint64_t read_ns;
+  uint64_t device_bytes[BTRFS_STATS_DEVICES];
+  /// Node and data bytes checksummed, with the time it took.
+  uint64_t checksum_bytes;
+  uint64_t checksum_ns;
+  /// Logical addresses whose chunk was not mapped yet.
+  uint64_t translation_misses;
+  uint64_t allocations;
+  uint64_t allocation_bytes;
+  uint64_t allocation_failures;
+} BTRFS_Stats;
+
+///
+/// @brief      Add to one of this thread's counters. Each thread counts into
+///             its own block, so this never contends.
+///
+/// @param[in]  counter  The counter's index, as a uint64_t, in BTRFS_Stats
+/// @param[in]  n        The amount to add
+///
+void BTRFS_StatsAdd(size_t counter, uint64_t n);
+
+#define BTRFS_STAT(field, n) \
+  BTRFS_StatsAdd(offsetof(BTRFS_Stats, field) / sizeof(uint64_t), (n))
+
+#define BTRFS_STAT_AT(field, index, n)                                   \
+  BTRFS_StatsAdd(offsetof(BTRFS_Stats, field) / sizeof(uint64_t) + (index), \
+                 (n))
+
+///
+/// @brief      A monotonic clock for timing counters.
+///
+/// @return     The time in nanoseconds.
+///
+uint64_t BTRFS_StatsClock(void);
+
+///
+/// @brief      Sum the counters of every thread, including exited ones.
+///
+/// @param[out] stats  The totals
+///
+void BTRFS_GetStats(BTRFS_Stats *stats);
+
+///
+/// @brief      Zero the counters of every thread. Updates racing with the
+///             reset may survive it.
+///
+void BTRFS_ResetStats(void);
+
+///
+/// @brief      The calls traced and timed, see BTRFS_SetTraceCallback.
+///
+typedef enum {
+  TraceOp_ParseFullFSTree = 0,
+  TraceOp_ReadFile = 1,
+  TraceOp_GetNode = 2,
+  TraceOp_GetNodes = 3,
+  BTRFS_TRACE_OPS = 4,
+} BTRFS_TraceOp;
+
+///
+/// @brief      A call starting or finishing. Members not known at the time
+///             of the event are 0.
+///
+typedef struct {
+  BTRFS_TraceOp op;
+  /// Non-zero for the event ending a call.
+  int end;
+  /// How many traced calls this thread is inside, so node reads can be tied
+  /// to the lookup or file read they are part of.
+  int depth;
+  /// The tree that owns the node, and its level, known once it is read.
+  uint64_t tree;
+  int level;
+  uint64_t inode;
+  uint64_t logical;
+  /// The bytes asked for, on the end event the bytes returned.
+  uint64_t bytes;
+  /// The call's return value and duration, on the end event.
+  int64_t result;
+  uint64_t duration_ns;
+} BTRFS_TraceEvent;
+
+typedef void (*BTRFS_TraceCallback)(const BTRFS_TraceEvent *event,
+                                    void *context);
+
+///
+/// @brief      Receive an event as every traced call begins and ends, on the
+///             calling thread. The callback must be thread safe.
+///
+/// @param[in]  callback  The callback, NULL to stop tracing
+/// @param      context   Passed through to the callback
+///
+void BTRFS_SetTraceCallback(BTRFS_TraceCallback callback, void *context);
+
+#define BTRFS_LATENCY_SUB_BITS 3
+#define BTRFS_LATENCY_BUCKETS ((64 - BTRFS_LATENCY_SUB_BITS + 1) << \
+                               BTRFS_LATENCY_SUB_BITS)
+
+///
+/// @brief      Latencies of one call in nanoseconds. Each power of two range
+///             is split into 1 << BTRFS_LATENCY_SUB_BITS linear buckets, so
+///             a bucket's width is within 12.5% of its values.
+///
+typedef struct {
+  uint64_t count;
+  uint64_t buckets[BTRFS_LATENCY_BUCKETS];
+} BTRFS_LatencyHistogram;
+
+///
+/// @brief      Turn recording of the latency histograms on or off. Off by
+///             default, when traced calls cost a flag check.
+///
+/// @param[in]  enabled  Non-zero to record
+///
+void BTRFS_SetLatencyHistograms(int enabled);
+
+///
+/// @brief      Copy the latency histogram of a call.
+///
+/// @param[in]  op         The call
+/// @param[out] histogram  The histogram
+///
+void BTRFS_GetLatencyHistogram(BTRFS_TraceOp op,
+                               BTRFS_LatencyHistogram *histogram);
+
+///
+/// @brief      Empty every latency histogram.
+///
+void BTRFS_ResetLatencyHistograms(void);
+
+///
+/// @brief      Find a percentile of a latency histogram.
+///
+/// @param      histogram   The histogram
+/// @param[in]  percentile  The percentile, 0 to 100
+///
+/// @return     The upper bound of the bucket holding it in nanoseconds, 0
+///             if the histogram is empty.
+///
+uint64_t BTRFS_LatencyPercentile(const BTRFS_LatencyHistogram *histogram,
+                                 double percentile);
+
+///
+/// @brief      Start a traced call.
+///
+/// @param      event  The call, filled in with what is known so far
+///
+/// @return     The start time to pass to BTRFS_TraceEnd, 0 when neither
+///             tracing nor histograms are on.
+///
+uint64_t BTRFS_TraceBegin(BTRFS_TraceEvent *event);
+
+///
+/// @brief      Finish a traced call, recording its latency and sending its
+///             end event.
+///
+/// @param      event  The call, with what was learned while making it
+/// @param[in]  start  What BTRFS_TraceBegin returned
+///
+void BTRFS_TraceEnd(BTRFS_TraceEvent *event, uint64_t start);
+
+///
+/// @brief      Track which traced calls each thread is in even with tracing
+///             and histograms off, see BTRFS_TraceContext.
+///
+/// @param[in]  enabled  Non-zero to track
+///
+void BTRFS_SetTraceContext(int enabled);
+
+///
+/// @brief      Find the traced call this thread is in.
+///
+/// @param[out] node  Set non-zero if inside BTRFS_GetNode or BTRFS_GetNodes
+///
+/// @return     The outermost call, -1 if none or tracking is off.
+///
+int BTRFS_TraceContext(int *node);
+
+#define BTRFS_IO_RECORD_MAGIC 0x4f495442  // "BTIO"
+#define BTRFS_IO_RECORD_VERSION 1
+
+// The read was for a tree node.
+#define BTRFS_IORecordFlag_Node 0x1
+// The read handler returned less than asked, as when probing for superblock
+// copies past the end of a device.
+#define BTRFS_IORecordFlag_Short 0x2
+
+///
+/// @brief      Starts an I/O trace file, followed by BTRFS_IORecords.
+///
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+} __attribute__((packed)) BTRFS_IORecordHeader;
+
+///
+/// @brief      One call of the disk read handler, see BTRFS_StartIORecord.
+///
+typedef struct {
+  /// When the read was issued, from the start of the recording.
+  uint64_t time_ns;
+  uint64_t offset;
+  uint32_t len;
+  /// How long the read handler took, saturating.
+  uint32_t duration_ns;
+  uint16_t device;
+  /// The outermost traced call the read was made for, 0xff if none.
+  uint8_t api;
+  uint8_t flags;
+  /// Numbers the recorded threads from 0.
+  uint32_t thread;
+} __attribute__((packed)) BTRFS_IORecord;
+
+///
+/// @brief      Log every call of the disk read handler to a binary trace,
+///             for tools/ioreplay. Records are buffered and written in
+///             batches.
+///
+/// @param      path  The trace file to create
+///
+/// @return     -1 if the file could not be created or a recording is
+///             already running, 0 on success.
+///
+int BTRFS_StartIORecord(const char *path);
+
+///
+/// @brief      Write out the remaining records and close the trace.
+///
+/// @return     -1 if any record could not be written, 0 on success.
+///
+int BTRFS_StopIORecord(void);
+
+///
+/// @brief      Add a read to the running recording, if any.
+///
+/// @param[in]  device       The device read
+/// @param[in]  offset       The physical offset read
+/// @param[in]  len          The bytes asked for
+/// @param[in]  done         What the read handler returned
+/// @param[in]  start        BTRFS_StatsClock when the read was issued
+/// @param[in]  duration_ns  How long it took
+///
+void BTRFS_RecordIO(uint64_t device, uint64_t offset, uint64_t len,
+                    uint64_t done, uint64_t start, uint64_t duration_ns);
+
 void BTRFS_AddMappingToCache(uint64_t vAddr, uint64_t deviceID, uint64_t pAddr,
                              uint64_t len);
 
+///
+/// @brief      Check whether a chunk spreads its data over its stripes, as
+///             RAID0, RAID10, RAID5 and RAID6 do.
+///
+/// Only chunks whose first stripe holds all of the data, single, DUP and
+/// the RAID1 profiles, are mapped. Striped chunks are refused rather than
+/// read from the wrong device ranges.
+///
+/// @param      chunk  The chunk item
+///
+/// @return     Non-zero if the chunk is striped.
+///
+int BTRFS_ChunkIsStriped(const BTRFS_ChunkItem *chunk);
+
 ///
 /// @brief      Set the disk read handler.
 ///
@@ -35,6 +467,63 @@ void BTRFS_SetDiskReadHandler(uint64_t (*handler)(void *buf, uint64_t devID,
 void BTRFS_SetDiskWriteHandler(uint64_t (*handler)(void *buf, uint64_t devID,
                                                    uint64_t off, uint64_t len));
 
+///
+/// @brief      Set the disk prefetch handler, used to start reads of blocks
+///             which will be needed shortly.
+///
+/// @param[in]  handler  The handler
+///
+void BTRFS_SetDiskPrefetchHandler(void (*handler)(uint64_t devID, uint64_t off,
+                                                  uint64_t len));
+
+typedef enum {
+  Backend_Pread = 0,
+  Backend_Direct = 1,
+} BTRFS_BackendType;
+
+///
+/// @brief      Open the devices of a filesystem and install read handlers
+///             for them. Each file or block device is identified by the
+///             device item in its superblock, and all must belong to the
+///             same filesystem. Device 0 is the first path given.
+///
+///             Backend_Pread reads through the page cache. Backend_Direct
+///             opens the devices with O_DIRECT and reads through a pool of
+///             aligned bounce buffers, for scrubs and clones which would
+///             only evict the cache.
+///
+/// @param[in]  paths  The device paths
+/// @param[in]  count  The number of paths
+/// @param[in]  type   The backend
+///
+/// @return     0 on success, -1 if a device could not be opened or holds
+///             no filesystem, -2 if the devices are not of one filesystem.
+///
+int BTRFS_OpenDevices(const char **paths, int count, BTRFS_BackendType type);
+
+///
+/// @brief      Close the devices opened by BTRFS_OpenDevices, and drop the
+///             directory paths and checksums cached from their filesystem.
+///
+void BTRFS_CloseDevices(void);
+
+///
+/// @brief      Get the size of an opened device.
+///
+/// @param[in]  devID  The device id, 0 for the first device
+///
+/// @return     The size in bytes, 0 if the device is not open.
+///
+uint64_t BTRFS_GetDeviceSize(uint64_t devID);
+
+///
+/// @brief      Hint that a logical range will be read soon.
+///
+/// @param[in]  logicalAddr  The logical address
+/// @param[in]  len          The length
+///
+void BTRFS_Prefetch(uint64_t logicalAddr, uint64_t len);
+
 ///
 /// @brief      Read from the disk logical address.
 ///
@@ -69,6 +558,30 @@ uint64_t BTRFS_Write(void *buf, uint64_t logicalAddr, uint64_t len);
 ///
 int BTRFS_GetNode(void *buf, uint64_t logicalAddr);
 
+///
+/// @brief      Get several nodes at once. They are read in the order they
+///             are on disk, nearby ones with a single read, instead of one
+///             at a time.
+///
+/// @param      buf           The buffer, count node sizes long. Node i is
+///                           placed at node size times i.
+/// @param[in]  logicalAddrs  The logical addresses
+/// @param[in]  count         The number of nodes
+///
+/// @return     Error code on failure, 0 on success.
+///
+int BTRFS_GetNodes(void *buf, const uint64_t *logicalAddrs, size_t count);
+
+///
+/// @brief      Compare two keys in tree order.
+///
+/// @param      a     The first key
+/// @param      b     The second key
+///
+/// @return     Negative if a sorts first, positive if b does, 0 if equal.
+///
+int BTRFS_CompareKeys(const BTRFS_Key *a, const BTRFS_Key *b);
+
 ///
 /// @brief      Get a node pointer.
 ///
@@ -89,6 +602,93 @@ void *BTRFS_GetNodePointer(BTRFS_Header *parent, BTRFS_KeyType type,
 ///
 int BTRFS_StartParser(void);
 
+///
+/// @brief      Start the BTRFS driver using a metadata sidecar.
+///
+/// If the sidecar at the path was written for this volume at its current
+/// generation it is mapped and used for the chunk map, the root items, path
+/// lookups and file extents. Otherwise the volume is parsed normally and a
+/// new sidecar is written to the path for the next start.
+///
+/// @param[in]  sidecar_path  The sidecar file, NULL to go without one
+///
+/// @return     Error code on error, 0 on success.
+///
+int BTRFS_StartParserWithSidecar(const char *sidecar_path);
+
+///
+/// @brief      Map a sidecar, replacing any already open one.
+///
+/// @param[in]  path  The sidecar file
+///
+/// @return     -1 if missing or malformed, -2 if written for another volume
+///             or generation, 0 on success.
+///
+int BTRFS_OpenSidecar(const char *path);
+
+///
+/// @brief      Write a sidecar for the parsed volume.
+///
+/// @param[in]  path  The sidecar file
+///
+/// @return     -1 on error, 0 on success.
+///
+int BTRFS_WriteSidecar(const char *path);
+
+///
+/// @brief      Unmap the open sidecar, if any.
+///
+void BTRFS_CloseSidecar(void);
+
+///
+/// @brief      Add the sidecar's chunk map to the translation cache.
+///
+/// @return     -1 without a sidecar, 0 on success.
+///
+int BTRFS_SidecarLoadChunks(void);
+
+///
+/// @brief      Find the root of a tree in the sidecar.
+///
+/// @param[in]  tree_id     The tree's object id
+/// @param      root_addr   The logical address of the tree's root node
+/// @param      generation  The generation of the tree's root, may be NULL
+///
+/// @return     -1 without a sidecar, -2 if not found, 0 on success.
+///
+int BTRFS_SidecarGetRoot(uint64_t tree_id, uint64_t *root_addr,
+                         uint64_t *generation);
+
+///
+/// @brief      Find a directory entry of the FS tree in the sidecar.
+///
+/// @param[in]  dir       The directory's inode
+/// @param[in]  name      The name, not terminated
+/// @param[in]  name_len  The length of the name
+/// @param      child     The inode the entry points to
+///
+/// @return     -1 without a sidecar, 0 if not found, 1 if found.
+///
+int BTRFS_SidecarLookup(uint64_t dir, const char *name, size_t name_len,
+                        uint64_t *child);
+
+///
+/// @brief      Find the first file extent item of an inode that ends after
+///             an offset in the sidecar. It starts after the offset when the
+///             offset is in a hole.
+///
+/// @param[in]  inode     The file's inode
+/// @param[in]  offset    The offset in the file
+/// @param      node       Receives the raw extent item
+/// @param      node_off   Receives the file offset the extent starts at
+/// @param      node_size  Receives the size of the raw item, may be NULL
+///
+/// @return     -1 without a sidecar, 0 if not found, 1 if found.
+///
+int BTRFS_SidecarGetExtent(uint64_t inode, uint64_t offset,
+                           BTRFS_ExtentDataInline *node, uint64_t *node_off,
+                           uint32_t *node_size);
+
 ///
 /// @brief      Retrive the superblock from the buffer after verifying it.
 ///
@@ -109,6 +709,18 @@ int BTRFS_ParseSuperblock(BTRFS_Superblock *block);
 int BTRFS_TranslateLogicalAddress(uint64_t logicalAddress,
                                   BTRFS_PhysicalAddress *physicalAddress);
 
+///
+/// @brief      Translate a logical address using only the chunks already in
+///             the translation cache.
+///
+/// @param[in]  logicalAddress   The logical address
+/// @param      physicalAddress  The physical address
+///
+/// @return     Negative on a cache miss, 0 on success.
+///
+int BTRFS_LookupMapping(uint64_t logicalAddress,
+                        BTRFS_PhysicalAddress *physicalAddress);
+
 ///
 /// @brief      Get the sector size.
 ///
@@ -152,6 +764,20 @@ uint64_t BTRFS_GetChunkTreeRootAddress(void);
 ///
 void BTRFS_GetLabel(char *buffer);
 
+///
+/// @brief      Get the file system UUID.
+///
+/// @param      uuid  The buffer of UUID_LEN bytes in which to put the UUID.
+///
+void BTRFS_GetFSID(uint8_t *uuid);
+
+///
+/// @brief      Get the generation of the superblock in use.
+///
+/// @return     The superblock generation.
+///
+uint64_t BTRFS_GetGeneration(void);
+
 ///
 /// @brief      Get the checksum tree location.
 ///
@@ -187,6 +813,129 @@ uint64_t BTRFS_GetExtentTreeLocation(void);
 ///
 uint64_t BTRFS_Scrub(void);
 
+///
+/// @brief      What BTRFS_ScrubMetadata found. A block with several faults
+///             is counted under each.
+///
+typedef struct {
+  uint64_t blocks;
+  uint64_t bytes;
+  /// Blocks that could not be translated or read.
+  uint64_t read_errors;
+  uint64_t csum_errors;
+  /// Blocks whose header names another address, filesystem, level or
+  /// generation than the extent tree holds for them.
+  uint64_t address_errors;
+  uint64_t fsid_errors;
+  uint64_t level_errors;
+  uint64_t generation_errors;
+} BTRFS_MetadataScrub;
+
+///
+/// @brief      Verify every tree block of the filesystem, without reading
+///             any data.
+///
+/// The tree blocks are listed from the metadata and tree block extent items
+/// of the extent tree, sorted by where they are on disk and read in long
+/// runs by a pool of threads, each checking the blocks it read. The disk
+/// read handler must be safe to call from several threads at once.
+///
+/// @param[in]  threads  The number of threads, including the calling thread
+/// @param[out] result   Receives the counts
+///
+/// @return     -1 if the extent tree could not be read, 0 otherwise.
+///
+int BTRFS_ScrubMetadata(int threads, BTRFS_MetadataScrub *result);
+
+///
+/// @brief      The progress of an incremental scrub, see BTRFS_ScrubResume.
+///
+typedef struct {
+  /// Checksum tree blocks older than this generation are skipped.
+  uint64_t since;
+  /// The filesystem generation when the pass started. Once it completes
+  /// the next pass can start from the generation after it.
+  uint64_t generation;
+  /// Checksum items below this logical address have been verified.
+  uint64_t position;
+  uint64_t sectors;
+  /// Mismatched or unreadable sectors.
+  uint64_t errors;
+  int complete;
+} BTRFS_ScrubCheckpoint;
+
+///
+/// @brief      Called after each checksum leaf an incremental scrub verifies.
+///
+/// @param[in]  checkpoint  The progress so far, save it to resume from
+/// @param      context     The context passed to BTRFS_ScrubResume
+///
+/// @return     0 to continue, any other value stops the scrub.
+///
+typedef int (*BTRFS_ScrubProgress)(const BTRFS_ScrubCheckpoint *checkpoint,
+                                   void *context);
+
+///
+/// @brief      Start a scrub pass of the data written since a generation.
+///
+/// @param[out] checkpoint  The checkpoint to start
+/// @param[in]  since       The generation, 0 for all data
+///
+void BTRFS_StartScrubCheckpoint(BTRFS_ScrubCheckpoint *checkpoint,
+                                uint64_t since);
+
+///
+/// @brief      Verify the data whose checksums were written since the
+///             checkpoint's generation, from where it left off.
+///
+/// Subtrees of the checksum tree whose pointers are older than the
+/// generation are not read. Every item of the leaves that are read is
+/// verified, so items next to new ones are checked again.
+///
+/// @param      checkpoint  The checkpoint, updated as the scrub goes on
+/// @param[in]  progress    Called after each leaf, may be NULL
+/// @param      context     Passed through to progress
+///
+/// @return     -1 if the checksum tree could not be read, the progress
+///             callback's return value if it stopped the scrub, 0 once the
+///             pass is complete.
+///
+int BTRFS_ScrubResume(BTRFS_ScrubCheckpoint *checkpoint,
+                      BTRFS_ScrubProgress progress, void *context);
+
+///
+/// @brief      Verify the data whose checksums were written since a
+///             generation, see BTRFS_ScrubResume.
+///
+/// @param[in]  generation  The generation
+///
+/// @return     The number of checksum mismatches detected.
+///
+uint64_t BTRFS_ScrubSince(uint64_t generation);
+
+///
+/// @brief      Read a checkpoint saved by BTRFS_SaveScrubCheckpoint.
+///
+/// @param[in]  path        The file
+/// @param[out] checkpoint  Receives the checkpoint
+///
+/// @return     -1 if the file is missing, invalid or of another filesystem,
+///             0 on success.
+///
+int BTRFS_LoadScrubCheckpoint(const char *path,
+                              BTRFS_ScrubCheckpoint *checkpoint);
+
+///
+/// @brief      Save a checkpoint, replacing the file atomically.
+///
+/// @param[in]  path        The file
+/// @param[in]  checkpoint  The checkpoint
+///
+/// @return     -1 on failure, 0 on success.
+///
+int BTRFS_SaveScrubCheckpoint(const char *path,
+                              const BTRFS_ScrubCheckpoint *checkpoint);
+
 ///
 /// @brief      Parse the root tree.
 ///
@@ -195,12 +944,127 @@ uint64_t BTRFS_Scrub(void);
 int BTRFS_ParseRootTree(void);
 
 ///
-/// @brief      Parse the chunk tree.
+/// @brief      Find the root of a tree or subvolume in the root tree.
+///
+/// @param[in]  tree_id     The tree's object id (5 for the default FS tree)
+/// @param      root_addr   The logical address of the tree's root node
+/// @param      generation  The generation of the tree's root, may be NULL
+///
+/// @return     -1 on read failure, -2 if not found, 0 on success.
+///
+int BTRFS_GetTreeRoot(uint64_t tree_id, uint64_t *root_addr,
+                      uint64_t *generation);
+
+///
+/// @brief      Report the items that differ between two versions of a tree.
+///
+/// Subtrees reached through the same block from both sides are skipped, so
+/// the cost follows the size of the change rather than of the trees.
+/// Without an old tree, every item in subtrees at least as new as
+/// min_generation is reported as added.
+///
+/// @param[in]  old_root        The old tree's root node, 0 if there is none
+/// @param[in]  new_root        The new tree's root node
+/// @param[in]  min_generation  The baseline generation without an old tree,
+///                             ignored with one
+/// @param[in]  callback        Called for every change, in key order
+/// @param      context         Passed through to the callback
+///
+/// @return     -1 on read failure, the callback's return value if it stopped
+///             the diff, 0 on success.
+///
+int BTRFS_DiffTrees(uint64_t old_root, uint64_t new_root,
+                    uint64_t min_generation, BTRFS_DiffCallback callback,
+                    void *context);
+
+///
+/// @brief      Check the chunk tree is readable. Chunks are loaded from it
+///             on first use rather than here.
 ///
 /// @return     Error code on failure, 0 on success.
 ///
 int BTRFS_ParseChunkTree(void);
 
+///
+/// @brief      Find the chunk covering a logical address in the chunk tree
+///             and add it to the translation cache.
+///
+/// @param[in]  logicalAddress  The logical address
+///
+/// @return     -1 if no chunk covers the address, 0 on success.
+///
+int BTRFS_LoadChunk(uint64_t logicalAddress);
+
+///
+/// @brief      Find the last item whose key is at most the given key.
+///
+/// @param[in]  root  The logical address of the tree's root
+/// @param      key   The key to search for
+/// @param      leaf  A node sized buffer, receives the leaf holding the item
+/// @param      slot  Receives the item's index in the leaf
+///
+/// @return     -1 on read failure, -2 if every key in the tree is larger,
+///             0 on success.
+///
+int BTRFS_SearchTree(uint64_t root, const BTRFS_Key *key, BTRFS_Header *leaf,
+                     int *slot);
+
+///
+/// @brief      Position a path at the first item whose key is at least the
+///             given key.
+///
+/// Nodes the path already holds are not read again, so a series of
+/// searches in key order mostly costs the leaves it moves through.
+///
+/// @param[in]  root  The logical address of the tree's root
+/// @param      key   The key to search for
+/// @param      path  The path
+///
+/// @return     -1 on read failure, 1 if every key in the tree is smaller,
+///             0 on success.
+///
+int BTRFS_SearchPath(uint64_t root, const BTRFS_Key *key, BTRFS_Path *path);
+
+///
+/// @brief      Move a path to the next item, crossing into the next leaf
+///             if needed.
+///
+/// @param      path  The path
+///
+/// @return     -1 on read failure, 1 past the last item, 0 on success.
+///
+int BTRFS_NextItem(BTRFS_Path *path);
+
+///
+/// @brief      Move a path to the previous item, crossing into the previous
+///             leaf if needed. Also steps back from one past the last item.
+///
+/// @param      path  The path
+///
+/// @return     -1 on read failure, 1 before the first item, 0 on success.
+///
+int BTRFS_PrevItem(BTRFS_Path *path);
+
+///
+/// @brief      Get the key of the item a path is at.
+///
+BTRFS_Key *BTRFS_PathKey(BTRFS_Path *path);
+
+///
+/// @brief      Get the data of the item a path is at.
+///
+/// @param      path  The path
+/// @param      size  Receives the size of the item, may be NULL
+///
+/// @return     The item's data, valid until the path moves.
+///
+void *BTRFS_PathItem(BTRFS_Path *path, uint32_t *size);
+
+///
+/// @brief      Free the node buffers held by a path.
+///
+void BTRFS_PathRelease(BTRFS_Path *path);
+
 ///
 /// @brief      Get the inode for the specified file or directory.
 ///
@@ -211,16 +1075,279 @@ int BTRFS_ParseChunkTree(void);
 ///
 int BTRFS_ParseFullFSTree(char *path, uint64_t *resolved_inode);
 
+///
+/// @brief      Get the inodes of many files or directories at once.
+///
+/// The paths are sorted so that shared prefixes are resolved once, and the
+/// names looked up in each directory are searched for in the order of its
+/// DIR_ITEM keys, so the cost follows the distinct directories and names
+/// rather than the number of paths times their depth.
+///
+/// @param      paths       The paths
+/// @param[in]  count       The number of paths
+/// @param      out_inodes  Receives each path's inode, 0 if it was not found
+///
+/// @return     -1 on read failure, otherwise the number of paths not found.
+///
+int BTRFS_ResolvePaths(const char **paths, size_t count, uint64_t *out_inodes);
+
+///
+/// @brief      Find every path of a file, one for each of its hard links.
+///
+/// The names are followed up to the root directory through the INODE_REF
+/// and INODE_EXTREF items. Directory paths are memoized across calls, so
+/// resolving many files costs about one lookup per file and per distinct
+/// directory.
+///
+/// @param[in]  inode     The inode
+/// @param[in]  callback  Called for every path
+/// @param      context   Passed through to the callback
+///
+/// @return     -1 on read failure, the callback's return value if it stopped
+///             the resolution, 0 on success, also when the inode has no
+///             reachable path.
+///
+int BTRFS_InodeToPaths(uint64_t inode, BTRFS_PathCallback callback,
+                       void *context);
+
+///
+/// @brief      Find the paths of many files, see BTRFS_InodeToPaths. The
+///             inodes are visited in ascending order, each once.
+///
+/// @param[in]  inodes    The inodes
+/// @param[in]  count     The number of inodes
+/// @param[in]  callback  Called for every path
+/// @param      context   Passed through to the callback
+///
+/// @return     -1 on read failure, the callback's return value if it stopped
+///             the resolution, 0 on success.
+///
+int BTRFS_InodesToPaths(const uint64_t *inodes, size_t count,
+                        BTRFS_PathCallback callback, void *context);
+
+///
+/// @brief      Drop the memoized directory paths. Done by
+///             BTRFS_CloseDevices and BTRFS_InitializeStructures.
+///
+void BTRFS_ReleasePathCache(void);
+
 int BTRFS_GetFSTreeExtent(BTRFS_Header *parent, uint64_t inode, uint64_t offset,
                           BTRFS_ExtentDataInline *node, uint64_t *node_off);
 
+///
+/// @brief      Find the first extent of a file that ends after an offset,
+///             from the sidecar if there is one, else from the FS tree.
+///
+/// @param      path        Used for the search, reused across calls
+/// @param[in]  inode       The file's inode
+/// @param[in]  offset      The offset in the file
+/// @param      extent       Receives the extent item, a node size buffer
+/// @param      extent_off   Receives the file offset the extent starts at
+/// @param      extent_size  Receives the size of the item, which bounds its
+///                          inline data, may be NULL
+///
+/// @return     -1 on read failure, 0 if there is none, 1 if found.
+///
+int BTRFS_FindFileExtent(BTRFS_Path *path, uint64_t inode, uint64_t offset,
+                         BTRFS_ExtentDataInline *extent, uint64_t *extent_off,
+                         uint32_t *extent_size);
+
+///
+/// @brief      Read part of a file. Holes and preallocated extents read as
+///             zeros and the read stops at the end of the file. Compressed
+///             extents are not supported and cut the read short.
+///
+/// With read verification on, every sector read is checked against the
+/// checksum tree, unless the file was created without data checksums.
+///
+/// @param[in]  inode     The file's inode
+/// @param[in]  offset    The offset in the file
+/// @param[in]  len       The number of bytes to read
+/// @param      dest_buf  Receives the data
+///
+/// @return     (uint64_t)-1 on read failure, (uint64_t)-2 on a checksum
+///             mismatch, otherwise the number of bytes read.
+///
 uint64_t BTRFS_ReadFile(uint64_t inode, uint64_t offset, uint64_t len,
                         void *dest_buf);
 
+///
+/// @brief      Read part of a file as BTRFS_ReadFile does, searching with a
+///             path kept by the caller. Reading many files through one path
+///             re-reads none of the nodes it still holds.
+///
+/// @param      path      Used for the searches, reused across calls
+/// @param[in]  inode     The file's inode
+/// @param[in]  offset    The offset in the file
+/// @param[in]  len       The number of bytes to read
+/// @param      dest_buf  Receives the data
+///
+/// @return     As for BTRFS_ReadFile.
+///
+uint64_t BTRFS_ReadFilePath(BTRFS_Path *path, uint64_t inode, uint64_t offset,
+                            uint64_t len, void *dest_buf);
+
+///
+/// @brief      Turn checksum verification of file reads on or off.
+///
+/// @param[in]  enable  Non-zero to verify
+///
+void BTRFS_SetReadVerification(int enable);
+
+///
+/// @brief      Check whether file reads are verified.
+///
+/// @return     Non-zero if they are.
+///
+int BTRFS_GetReadVerification(void);
+
+///
+/// @brief      One range of a file for BTRFS_ReadFiles, with its destination.
+///
+typedef struct {
+  uint64_t inode;
+  uint64_t offset;
+  uint64_t len;
+  BTRFS_ReadCallback callback;
+  void *context;
+} BTRFS_ReadRequest;
+
+///
+/// @brief      Read ranges of many files at once, in disk order.
+///
+/// The extents of every request are gathered first, then read sorted by
+/// device and physical address, with neighbouring ranges merged into one
+/// read. Each piece of data goes to its request's callback as soon as it
+/// is read, so a file's pieces arrive out of order. As with BTRFS_ReadFile,
+/// holes read as zeros and the ranges stop at the end of each file.
+///
+/// With several threads, the reads are shared out in disk order and the
+/// callbacks of different pieces run concurrently.
+///
+/// @param[in]  requests  The requests
+/// @param[in]  count     The number of requests
+/// @param[in]  threads   The number of reader threads
+///
+/// @return     -1 on read failure, the callback's return value if it stopped
+///             the reads, 0 on success.
+///
+int BTRFS_ReadFiles(const BTRFS_ReadRequest *requests, size_t count,
+                    int threads);
+
+///
+/// @brief      Check sectors of data against the checksum tree.
+///
+/// The checksum items found are cached as ranges, so verifying through a
+/// file or neighbouring files mostly does not search the tree again.
+///
+/// @param[in]  logical  The logical address of the first sector
+/// @param[in]  buf      The data
+/// @param[in]  count    The number of sectors
+///
+/// @return     -1 on read failure, -2 on a mismatch or a missing checksum, 0
+///             on success.
+///
+int BTRFS_VerifyData(uint64_t logical, const void *buf, uint64_t count);
+
+///
+/// @brief      Get the checksums of a run of data sectors, from the same
+///             cache as BTRFS_VerifyData.
+///
+/// @param[in]  logical  The logical address of the first sector
+/// @param[in]  count    The number of sectors
+/// @param[out] sums     Receives up to count checksums
+/// @param[out] found    Receives how many sectors from the first have one
+///
+/// @return     -1 on read failure, 0 on success.
+///
+int BTRFS_GetChecksums(uint64_t logical, uint64_t count, uint32_t *sums,
+                       uint64_t *found);
+
+///
+/// @brief      Drop the cached checksum ranges. Done by BTRFS_CloseDevices
+///             and BTRFS_InitializeStructures.
+///
+void BTRFS_ReleaseChecksumCache(void);
+
+#define BTRFS_FINGERPRINT_SIZE 32
+
+///
+/// @brief      Fingerprint a file's contents, a SHA-256 over its size and
+///             the checksums of its data.
+///
+/// Data with checksums is fingerprinted from the checksum tree alone, only
+/// NODATASUM files and sectors without a checksum are read. For files laid
+/// out alike, different fingerprints mean different contents; equal ones
+/// are a strong hint only, as checksums such as crc32c stand in for the
+/// data and can collide. Contents rewritten with different extents, or
+/// compressed differently, may fingerprint differently.
+///
+/// @param[in]  inode   The file's inode
+/// @param[out] digest  Receives BTRFS_FINGERPRINT_SIZE bytes
+///
+/// @return     -1 on read failure, -2 if there is no such inode, 0 on success.
+///
+int BTRFS_FileFingerprint(uint64_t inode, uint8_t *digest);
+
+///
+/// @brief      Visit every INODE_ITEM, INODE_REF and INODE_EXTREF of the FS
+///             tree in leaf order.
+///
+/// Items of one inode arrive together, the INODE_ITEM first, followed by
+/// its references.
+///
+/// @param[in]  visitor  Called for every item
+/// @param      context  Passed through to the visitor
+///
+/// @return     -1 on read failure, the visitor's return value if it stopped
+///             the enumeration, 0 on success.
+///
+int BTRFS_EnumerateInodes(BTRFS_InodeVisitor visitor, void *context);
+
 void BTRFS_AddInodeToCache(uint64_t inode, uint64_t addr);
 
 void BTRFS_GetInodeFromCache(uint64_t *inode, uint64_t *addr);
 
 int BTRFS_TraverseLogTree(BTRFS_Header *parent);
 
+///
+/// @brief      Visit every leaf of a tree using a pool of worker threads.
+///
+/// The root's subtrees are dealt out to per-worker work-stealing deques and
+/// children are prefetched as soon as their parent is read, keeping many
+/// reads in flight. The disk read handler must be safe to call from several
+/// threads at once.
+///
+/// @param[in]  root     The logical address of the tree's root
+/// @param[in]  threads  The number of workers, including the calling thread
+/// @param[in]  visitor  Called for every leaf, see BTRFS_LeafVisitor
+/// @param      context  Passed through to the visitor
+///
+/// @return     -1 on read failure, the visitor's return value if it stopped
+///             the walk, 0 on success.
+///
+int BTRFS_ParallelWalk(uint64_t root, int threads, BTRFS_LeafVisitor visitor,
+                       void *context);
+
+///
+/// @brief      Visit every leaf below a node, one level at a time.
+///
+/// The child pointers of a level are collected and read in batches with
+/// BTRFS_GetNodes, so the device sees runs of reads in physical order
+/// instead of one read per node in key order. Each level queues a bounded
+/// number of pointers and walks the level below when that fills, so memory
+/// use does not grow with the tree. Batches are taken in key order, so
+/// leaves are visited in the order a depth first walk would visit them. The
+/// visitor is always called with worker 0.
+///
+/// @param      top      The node to start from, a leaf is visited alone
+/// @param[in]  visitor  Called for every leaf, see BTRFS_LeafVisitor
+/// @param      context  Passed through to the visitor
+///
+/// @return     -1 on read failure, the visitor's return value if it stopped
+///             the walk, 0 on success.
+///
+int BTRFS_LevelWalk(BTRFS_Header *top, BTRFS_LeafVisitor visitor,
+                    void *context);
+
 #endif
\ No newline at end of file
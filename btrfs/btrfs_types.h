@@ -24,6 +24,15 @@ static uint64_t BTRFS_superblock_offsets[] = {
 #define UUID_LEN 0x10
 #define CHECKSUM_LEN 0x20
 
+/*Maximum height of a tree, leaves are level 0*/
+#define BTRFS_MAX_LEVEL 8
+
+/*Object id of every item in the checksum tree*/
+#define BTRFS_ExtentChecksumObjectID 0xfffffffffffffff6ull
+
+/*Inode flag set on files whose data has no checksums*/
+#define BTRFS_InodeFlag_NoDataSum 0x1
+
 typedef enum {
   KeyType_InodeItem = 0x01,
   KeyType_InodeRef = 0x0c,
@@ -40,6 +49,7 @@ typedef enum {
   KeyType_RootBackRef = 0x90,
   KeyType_RoofRef = 0x9c,
   KeyType_ExtentItem = 0xa8,
+  KeyType_MetadataItem = 0xa9,
   KeyType_TreeBlockRef = 0xb0,
   KeyType_ExtentDataRef = 0xb2,
   KeyType_ExtentRefV0 = 0xb4,
@@ -53,10 +63,13 @@ typedef enum {
 } BTRFS_KeyType;
 
 typedef enum {
+  ReservedObjectID_RootTree = 0x01,
   ReservedObjectID_ExtentTree = 0x02,
+  ReservedObjectID_ChunkTree = 0x03,
   ReservedObjectID_DevTree = 0x04,
   ReservedObjectID_FSTree = 0x05,
   ReservedObjectID_ChecksumTree = 0x07,
+  ReservedObjectID_FirstChunkTree = 0x100,
 } BTRFS_ReservedObjectID;
 
 typedef enum {
@@ -65,6 +78,35 @@ typedef enum {
   DirectoryItemType_Directory = 2,
 } BTRFS_DirectoryItemType;
 
+typedef enum {
+  BlockGroupFlag_Data = 0x1,
+  BlockGroupFlag_System = 0x2,
+  BlockGroupFlag_Metadata = 0x4,
+  BlockGroupFlag_RAID0 = 0x8,
+  BlockGroupFlag_RAID1 = 0x10,
+  BlockGroupFlag_DUP = 0x20,
+  BlockGroupFlag_RAID10 = 0x40,
+  BlockGroupFlag_RAID5 = 0x80,
+  BlockGroupFlag_RAID6 = 0x100,
+} BTRFS_BlockGroupFlag;
+
+typedef enum {
+  ExtentFlag_Data = 0x1,
+  ExtentFlag_TreeBlock = 0x2,
+} BTRFS_ExtentFlag;
+
+/*The file type of a directory entry*/
+typedef enum {
+  FileType_Unknown = 0,
+  FileType_Regular = 1,
+  FileType_Directory = 2,
+  FileType_CharDevice = 3,
+  FileType_BlockDevice = 4,
+  FileType_Fifo = 5,
+  FileType_Socket = 6,
+  FileType_Symlink = 7,
+} BTRFS_FileType;
+
 typedef enum {
   ExtentDataType_Inline = 0,
   ExtentDataType_Regular = 1,
@@ -305,6 +347,49 @@ typedef struct {
   uint64_t logical_byte_count;
 } __attribute__((packed)) BTRFS_ExtentDataFull;
 
+/*Followed by inline references, in the extent tree*/
+typedef struct {
+  uint64_t refs;
+  uint64_t generation;
+  uint64_t flags;
+} __attribute__((packed)) BTRFS_ExtentItem;
+
+/*Between a non-skinny tree block's extent item and its inline references*/
+typedef struct {
+  BTRFS_Key key;
+  uint8_t level;
+} __attribute__((packed)) BTRFS_TreeBlockInfo;
+
+/*The offset is the root or parent, except for EXTENT_DATA_REF whose
+  BTRFS_ExtentDataRef starts in its place*/
+typedef struct {
+  uint8_t type;
+  uint64_t offset;
+} __attribute__((packed)) BTRFS_ExtentInlineRef;
+
+/*The offset is the file offset the extent would start at*/
+typedef struct {
+  uint64_t root;
+  uint64_t object_id;
+  uint64_t offset;
+  uint32_t count;
+} __attribute__((packed)) BTRFS_ExtentDataRef;
+
+typedef struct {
+  uint64_t used;
+  uint64_t chunk_object_id;
+  uint64_t flags;
+} __attribute__((packed)) BTRFS_BlockGroupItem;
+
+/*Keyed by device id and physical offset, in the dev tree*/
+typedef struct {
+  uint64_t chunk_tree;
+  uint64_t chunk_object_id;
+  uint64_t chunk_offset;
+  uint64_t length;
+  uint8_t chunk_tree_uuid[UUID_LEN];
+} __attribute__((packed)) BTRFS_DevExtent;
+
 typedef struct {
   BTRFS_InodeItem inode;
   uint64_t expected_generation;
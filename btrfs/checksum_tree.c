@@ -1,83 +1,76 @@
 #include "btrfs.h"
 #include "crc32c.h"
 
-#include <stdlib.h>
-
-uint64_t
-BTRFS_VerifyChecksums(BTRFS_Header *parent)
+static int
+BTRFS_VerifyChecksumLeaf(BTRFS_Header *parent, int worker, void *context)
 {
 	uint32_t node_size = BTRFS_GetNodeSize();
 	uint32_t sector_size = BTRFS_GetSectorSize();
+	uint64_t *retVal = context;
 
-	if(parent->level == 0)
-	{
-		uint64_t retVal = 0;
-
-		//Fill the chunk cache
-		BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer*)(parent + 1);
-
-		void *data_block = malloc(node_size);
+	BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer*)(parent + 1);
 
-		for(int i = 0; i < parent->item_count; i++) {
+	void *data_block = BTRFS_Alloc(node_size);
+	if(data_block == NULL)
+		return -1;
 
-			if(chunk_entry->key.type == KeyType_ExtentChecksum){
+	for(int i = 0; i < parent->item_count; i++) {
 
-				uint32_t *chunk_item = (uint32_t*)((uint8_t*)parent + sizeof(BTRFS_Header) + chunk_entry->data_offset);
-				
-				uint64_t sz = 0;
-				uint64_t logicalAddr = chunk_entry->key.offset;
-				while(sz < chunk_entry->data_size){
+		if(chunk_entry->key.type == KeyType_ExtentChecksum){
 
-					BTRFS_Read(data_block, logicalAddr, sector_size);
-					uint32_t crc = crc32c(-1, data_block, sector_size);
+			uint32_t *chunk_item = (uint32_t*)((uint8_t*)parent + sizeof(BTRFS_Header) + chunk_entry->data_offset);
+			
+			uint64_t sz = 0;
+			uint64_t logicalAddr = chunk_entry->key.offset;
+			while(sz < chunk_entry->data_size){
 
-					if(crc != *chunk_item){
-						retVal++;
-					}
+				BTRFS_Read(data_block, logicalAddr, sector_size);
+				uint32_t crc = crc32c(-1, data_block, sector_size);
 
-					logicalAddr += sector_size;
-					chunk_item ++;
-					sz += sizeof(uint32_t);
+				if(crc != *chunk_item){
+					(*retVal)++;
 				}
 
+				logicalAddr += sector_size;
+				chunk_item ++;
+				sz += sizeof(uint32_t);
 			}
 
-			chunk_entry++;
 		}
 
-		free(data_block);
-		return retVal;
-	}else
-	{
-		uint64_t retVal = 0;
-
-		//Visit all of this node's children
-		BTRFS_Header *children = malloc(node_size);
-		BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer*)(parent + 1);
-
-		for(uint64_t i = 0; i < parent->item_count; i++){
+		chunk_entry++;
+	}
 
-			if(BTRFS_GetNode(children, key_ptr->block_number) != 0) {
-				return 1;
-			}
+	BTRFS_Free(data_block, node_size);
+	return 0;
+}
 
-			retVal += BTRFS_VerifyChecksums(children);
+uint64_t
+BTRFS_VerifyChecksums(BTRFS_Header *parent)
+{
+	uint64_t retVal = 0;
 
-			key_ptr++;
-		}
-		free(children);
+	//The checksum leaves are read a level at a time in disk order, a node
+	//that cannot be read counts as one more error.
+	if(BTRFS_LevelWalk(parent, BTRFS_VerifyChecksumLeaf, &retVal) != 0)
+		retVal++;
 
-		return retVal;
-	}
+	return retVal;
 }
 
 uint64_t
 BTRFS_Scrub(void)
 {
-	BTRFS_Header *children = malloc(BTRFS_GetNodeSize());
+	BTRFS_Header *children = BTRFS_Alloc(BTRFS_GetNodeSize());
+	if(children == NULL)
+		return 1;
+
 	if(BTRFS_GetNode(children, BTRFS_GetChecksumTreeLocation()) != 0) {
+		BTRFS_Free(children, BTRFS_GetNodeSize());
 		return 1;
-	}	
+	}
 
-	return BTRFS_VerifyChecksums(children);
+	uint64_t retVal = BTRFS_VerifyChecksums(children);
+	BTRFS_Free(children, BTRFS_GetNodeSize());
+	return retVal;
 }
\ No newline at end of file
@@ -1,55 +1,59 @@
 #include "btrfs.h"
 
-#include <stdlib.h>
+#include <pthread.h>
+#include <stdbool.h>
 
-void
-BTRFS_FillChunkTreeCache(BTRFS_Header *parent)
-{
-	uint32_t node_size = BTRFS_GetNodeSize();
-
-	if(parent->level == 0)
-	{
-		//Fill the chunk cache
-		BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer*)(parent + 1);
-
-		for(int i = 0; i < parent->item_count; i++) {
-
-			if(chunk_entry->key.type == KeyType_DeviceItem){
-
-			}else if(chunk_entry->key.type == KeyType_ChunkItem) {
-
-				BTRFS_ChunkItem *chunk_item = (BTRFS_ChunkItem*)((uint8_t*)parent + sizeof(BTRFS_Header) + chunk_entry->data_offset);
-
-				uint64_t logical_addr = chunk_entry->key.offset;
-				for(int j = 0; j < chunk_item->stripe_count; j++){
-					BTRFS_AddMappingToCache(logical_addr, chunk_item->stripes[j].device_id, chunk_item->stripes[j].offset, chunk_item->chunk_size_bytes);
-					logical_addr += chunk_item->chunk_size_bytes;
-				}
-			}
-
-			chunk_entry++;
-		}
+static pthread_mutex_t chunk_load_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local bool chunk_load_active = false;
 
-	}else
-	{
-		//Visit all of this node's children
-		
-		BTRFS_Header *children = malloc(node_size);
+int
+BTRFS_LoadChunk(uint64_t logicalAddress)
+{
+	//Reading the chunk tree must never need another chunk, give up rather
+	//than recurse if the system chunks do not cover it.
+	if(chunk_load_active)
+		return -1;
 
-		BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer*)(parent + 1);
+	BTRFS_PhysicalAddress p_addr;
+	int retVal = -1;
 
-		for(uint64_t i = 0; i < parent->item_count; i++){
+	pthread_mutex_lock(&chunk_load_lock);
+	chunk_load_active = true;
 
-			if(BTRFS_GetNode(children, key_ptr->block_number) != 0) {
-				return;
-			}
+	//Another thread may have loaded it while we waited.
+	if(BTRFS_LookupMapping(logicalAddress, &p_addr) == 0) {
+		retVal = 0;
+		goto done;
+	}
 
-			BTRFS_FillChunkTreeCache(children);
-			key_ptr++;
+	BTRFS_Header *leaf = BTRFS_Alloc(BTRFS_GetNodeSize());
+	if(leaf == NULL)
+		goto done;
+
+	BTRFS_Key key = {ReservedObjectID_FirstChunkTree, KeyType_ChunkItem, logicalAddress};
+	int slot = 0;
+
+	if(BTRFS_SearchTree(BTRFS_GetChunkTreeRootAddress(), &key, leaf, &slot) == 0) {
+		BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer*)(leaf + 1) + slot;
+		BTRFS_ChunkItem *chunk_item = (BTRFS_ChunkItem*)((uint8_t*)leaf + sizeof(BTRFS_Header) + chunk_entry->data_offset);
+
+		//Every stripe of a mirrored chunk holds the same data, the first one is enough to read it.
+		//Striped chunks are refused, their data is not all on the first stripe.
+		if(chunk_entry->key.type == KeyType_ChunkItem &&
+			chunk_entry->key.object_id == ReservedObjectID_FirstChunkTree &&
+			chunk_item->stripe_count > 0 &&
+			!BTRFS_ChunkIsStriped(chunk_item) &&
+			logicalAddress - chunk_entry->key.offset < chunk_item->chunk_size_bytes) {
+			BTRFS_AddMappingToCache(chunk_entry->key.offset, chunk_item->stripes[0].device_id, chunk_item->stripes[0].offset, chunk_item->chunk_size_bytes);
+			retVal = 0;
 		}
-
-		free(children);
 	}
+
+	BTRFS_Free(leaf, BTRFS_GetNodeSize());
+done:
+	chunk_load_active = false;
+	pthread_mutex_unlock(&chunk_load_lock);
+	return retVal;
 }
 
 int
@@ -57,13 +61,21 @@ BTRFS_ParseChunkTree(void){
 
 	uint32_t node_size = BTRFS_GetNodeSize();
 
-	BTRFS_Header *chunk_tree = malloc(node_size);
+	if(BTRFS_SidecarLoadChunks() == 0)
+		return 0;
+
+	//Only check that the chunk tree is readable, its chunks are loaded by
+	//BTRFS_LoadChunk the first time an address in them is translated.
+	BTRFS_Header *chunk_tree = BTRFS_Alloc(node_size);
+	if(chunk_tree == NULL)
+		return -1;
+
 	int err = 0;
-	if((err = BTRFS_GetNode(chunk_tree, BTRFS_GetChunkTreeRootAddress())) != 0)
+	if((err = BTRFS_GetNode(chunk_tree, BTRFS_GetChunkTreeRootAddress())) != 0) {
+		BTRFS_Free(chunk_tree, node_size);
 		return err;
+	}
 
-	BTRFS_FillChunkTreeCache(chunk_tree);
-	free(chunk_tree);
-
+	BTRFS_Free(chunk_tree, node_size);
 	return 0;
-}
\ No newline at end of file
+}
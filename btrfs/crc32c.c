@@ -63,6 +63,15 @@ static uint32_t crc32c_sw(uint32_t crci, const void *buf, size_t len) {
   return (uint32_t)crc ^ 0xffffffff;
 }
 
+/* Byte at a time software version, slow but simple enough to serve as the
+   reference the others are checked against. */
+static uint32_t crc32c_byte(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *next = buf;
+
+  while (len--) crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffff;
+}
+
 /* Multiply a matrix times a vector over the Galois field of two elements,
    GF(2).  Each element is a bit in an unsigned integer.  mat must have at
    least as many entries as the power of two for most significant one bit in
@@ -264,6 +273,69 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
   return (uint32_t)crc0 ^ 0xffffffff;
 }
 
+/* Compute CRC-32C using the hardware instruction on a single stream, with no
+   shift tables.  Latency bound, but with nothing to combine at the end. */
+static uint32_t crc32c_hw_serial(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *next = buf;
+  uint64_t crc0 = crc;
+
+  while (len && ((uintptr_t)next & 7) != 0) {
+    __asm__("crc32b\t(%1), %0" : "=r"(crc0) : "r"(next), "0"(crc0));
+    next++;
+    len--;
+  }
+  while (len >= 8) {
+    __asm__("crc32q\t(%1), %0" : "=r"(crc0) : "r"(next), "0"(crc0));
+    next += 8;
+    len -= 8;
+  }
+  while (len) {
+    __asm__("crc32b\t(%1), %0" : "=r"(crc0) : "r"(next), "0"(crc0));
+    next++;
+    len--;
+  }
+  return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+/* Compute the crcs of a run of equally sized sectors, three sectors at a
+   time.  Each sector is its own independent stream, so the three crc
+   instructions in flight never need combining through the shift tables. */
+static void crc32c_sectors_hw(const void *buf, size_t sector_size,
+                              size_t count, uint32_t *out) {
+  const unsigned char *next = buf;
+  const unsigned char *end;
+  uint64_t crc0, crc1, crc2;
+
+  if ((sector_size & 7) == 0) {
+    while (count >= 3) {
+      crc0 = crc1 = crc2 = 0xffffffff;
+      end = next + sector_size;
+      do {
+        __asm__(
+            "crc32q\t"
+            "(%3), %0\n\t"
+            "crc32q\t"
+            "(%3,%4), %1\n\t"
+            "crc32q\t"
+            "(%3,%4,2), %2"
+            : "=r"(crc0), "=r"(crc1), "=r"(crc2)
+            : "r"(next), "r"(sector_size), "0"(crc0), "1"(crc1), "2"(crc2));
+        next += 8;
+      } while (next < end);
+      *out++ = (uint32_t)crc0 ^ 0xffffffff;
+      *out++ = (uint32_t)crc1 ^ 0xffffffff;
+      *out++ = (uint32_t)crc2 ^ 0xffffffff;
+      next += sector_size * 2;
+      count -= 3;
+    }
+  }
+
+  while (count--) {
+    *out++ = crc32c_hw(0xffffffff, next, sector_size);
+    next += sector_size;
+  }
+}
+
 /* Check for SSE 4.2.  SSE 4.2 was first supported in Nehalem processors
    introduced in November, 2008.  This does not check for the existence of the
    cpuid instruction itself, which was introduced on the 486SL in 1992, so this
@@ -277,19 +349,80 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
     (have) = (ecx >> 20) & 1;                                 \
   } while (0)
 
+/* Whether the crc32 instruction is there, -1 until crc32c_init has run. */
+static int crc32c_sse42 = -1;
+
 uint32_t crc32c_init(void) {
   int sse42 = 0;
 
+  if (crc32c_sse42 >= 0) return crc32c_sse42;
+
+  /* Both sets of tables are built so every implementation can be run. */
   SSE42(sse42);
-  sse42 ? crc32c_init_hw() : crc32c_init_sw();
+  crc32c_init_sw();
+  crc32c_init_hw();
+  crc32c_sse42 = sse42;
   return sse42;
 }
 
 /* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
    version.  Otherwise, use the software version. */
 uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
-  int sse42 = 0;
+  if (crc32c_sse42 < 0) crc32c_init();
+  return crc32c_sse42 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+}
 
-  SSE42(sse42);
-  return sse42 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
-}
\ No newline at end of file
+static void crc32c_sectors_with(uint32_t (*crc)(uint32_t, const void *,
+                                                size_t),
+                                const void *buf, size_t sector_size,
+                                size_t count, uint32_t *out) {
+  const unsigned char *next = buf;
+
+  while (count--) {
+    *out++ = crc(0xffffffff, next, sector_size);
+    next += sector_size;
+  }
+}
+
+static void crc32c_sectors_sw(const void *buf, size_t sector_size,
+                              size_t count, uint32_t *out) {
+  crc32c_sectors_with(crc32c_sw, buf, sector_size, count, out);
+}
+
+static void crc32c_sectors_byte(const void *buf, size_t sector_size,
+                                size_t count, uint32_t *out) {
+  crc32c_sectors_with(crc32c_byte, buf, sector_size, count, out);
+}
+
+static void crc32c_sectors_serial(const void *buf, size_t sector_size,
+                                  size_t count, uint32_t *out) {
+  crc32c_sectors_with(crc32c_hw_serial, buf, sector_size, count, out);
+}
+
+/* Compute the CRC-32C of each of count sectors, as stored in the checksum
+   tree. */
+void crc32c_sectors(const void *buf, size_t sector_size, size_t count,
+                    uint32_t *out) {
+  if (crc32c_sse42 < 0) crc32c_init();
+  if (crc32c_sse42)
+    crc32c_sectors_hw(buf, sector_size, count, out);
+  else
+    crc32c_sectors_sw(buf, sector_size, count, out);
+}
+
+static const crc32c_impl crc32c_impl_table[] = {
+    {"byte", 0, crc32c_byte, crc32c_sectors_byte},
+    {"slice8", 0, crc32c_sw, crc32c_sectors_sw},
+    {"sse42-serial", 1, crc32c_hw_serial, crc32c_sectors_serial},
+    {"sse42-3way", 1, crc32c_hw, crc32c_sectors_hw},
+};
+
+const crc32c_impl *crc32c_impls(size_t *count) {
+  crc32c_init();
+  *count = sizeof(crc32c_impl_table) / sizeof(crc32c_impl_table[0]);
+  return crc32c_impl_table;
+}
+
+int crc32c_impl_available(const crc32c_impl *impl) {
+  return !impl->sse42 || crc32c_init();
+}
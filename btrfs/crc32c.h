@@ -11,4 +11,25 @@ crc32c_init(void);
 uint32_t 
 crc32c(uint32_t crc, const void *buf, size_t len);
 
+void
+crc32c_sectors(const void *buf, size_t sector_size, size_t count,
+               uint32_t *out);
+
+/* One way of computing CRC-32C, for testing and benchmarking them against
+   each other.  crc32c and crc32c_sectors pick among these at run time. */
+typedef struct {
+  const char *name;
+  int sse42; /* needs the crc32 instruction */
+  uint32_t (*crc)(uint32_t crc, const void *buf, size_t len);
+  void (*sectors)(const void *buf, size_t sector_size, size_t count,
+                  uint32_t *out);
+} crc32c_impl;
+
+/* All implementations, the first being the byte at a time reference. */
+const crc32c_impl *
+crc32c_impls(size_t *count);
+
+int
+crc32c_impl_available(const crc32c_impl *impl);
+
 #endif
\ No newline at end of file
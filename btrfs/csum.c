@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Checksum items are cached as the sorted, non-overlapping ranges of
+// sectors they cover. A miss descends the checksum tree once and caches
+// every item of the leaf it lands in, so reading through a file moves
+// through the tree a leaf at a time instead of a search per extent.
+
+// Bound on the cached sums, 4 MiB of them cover 4 GiB of 4 KiB sectors.
+#define CSUM_CACHE_LIMIT (1024 * 1024)
+
+// Sectors hashed and compared per batch.
+#define CSUM_BATCH 256
+
+typedef struct {
+  uint64_t start;
+  uint64_t count;
+  uint32_t *sums;
+} CsumRange;
+
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+static CsumRange *csum_ranges = NULL;
+static size_t csum_range_count = 0;
+static size_t csum_range_capacity = 0;
+static size_t csum_cached = 0;
+
+// Index of the last range starting at or before the address, -1 if none.
+static long Csum_FindRange(uint64_t logical) {
+  size_t lo = 0, hi = csum_range_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (csum_ranges[mid].start <= logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (long)lo - 1;
+}
+
+static void Csum_Clear(void) {
+  for (size_t i = 0; i < csum_range_count; i++)
+    BTRFS_Free(csum_ranges[i].sums, csum_ranges[i].count * sizeof(uint32_t));
+  BTRFS_Free(csum_ranges, csum_range_capacity * sizeof(CsumRange));
+  csum_ranges = NULL;
+  csum_range_count = 0;
+  csum_range_capacity = 0;
+  csum_cached = 0;
+}
+
+// Add one checksum item's range, called with the lock held.
+static int Csum_Insert(uint64_t start, const uint32_t *sums, uint64_t count) {
+  if (count == 0) return 0;
+
+  long index = Csum_FindRange(start);
+  if (index >= 0 && csum_ranges[index].start == start) return 0;
+
+  // Rather than tracking use, the whole cache is dropped once full.
+  if (csum_cached + count > CSUM_CACHE_LIMIT) {
+    Csum_Clear();
+    index = -1;
+  }
+
+  if (csum_range_count == csum_range_capacity) {
+    size_t capacity = csum_range_capacity ? csum_range_capacity * 2 : 64;
+    CsumRange *ranges = BTRFS_Alloc(capacity * sizeof(CsumRange));
+    if (ranges == NULL) return -1;
+    if (csum_range_count > 0)
+      memcpy(ranges, csum_ranges, csum_range_count * sizeof(CsumRange));
+    BTRFS_Free(csum_ranges, csum_range_capacity * sizeof(CsumRange));
+    csum_ranges = ranges;
+    csum_range_capacity = capacity;
+  }
+
+  uint32_t *copy = BTRFS_Alloc(count * sizeof(uint32_t));
+  if (copy == NULL) return -1;
+  memcpy(copy, sums, count * sizeof(uint32_t));
+
+  CsumRange *range = &csum_ranges[index + 1];
+  memmove(range + 1, range,
+          (csum_range_count - (index + 1)) * sizeof(CsumRange));
+  range->start = start;
+  range->count = count;
+  range->sums = copy;
+  csum_range_count++;
+  csum_cached += count;
+  return 0;
+}
+
+// Copy up to count sums starting at the address from the cache, returns
+// how many were there.
+static uint64_t Csum_Lookup(uint64_t logical, uint64_t count, uint32_t *out) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  uint64_t found = 0;
+
+  pthread_mutex_lock(&csum_lock);
+  long index = Csum_FindRange(logical);
+
+  // Adjacent items continue the run.
+  while (index >= 0 && (size_t)index < csum_range_count && found < count) {
+    CsumRange *range = &csum_ranges[index];
+    if (logical < range->start) break;
+
+    uint64_t first = (logical - range->start) / sector_size;
+    if (first >= range->count) break;
+
+    uint64_t n = range->count - first;
+    if (n > count - found) n = count - found;
+    memcpy(out + found, range->sums + first, n * sizeof(uint32_t));
+    found += n;
+    logical += n * sector_size;
+    index++;
+  }
+
+  pthread_mutex_unlock(&csum_lock);
+  return found;
+}
+
+// Read the checksum tree leaf that holds the item covering the address, and
+// cache all of its items.
+static int Csum_Fill(uint64_t logical) {
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+
+  BTRFS_Key key = {BTRFS_ExtentChecksumObjectID, KeyType_ExtentChecksum,
+                   logical};
+  int err = BTRFS_SearchPath(BTRFS_GetChecksumTreeLocation(), &key, &path);
+
+  // The covering item starts before the address unless it starts right at
+  // it, which puts it one item back.
+  if (err > 0 ||
+      (err == 0 && BTRFS_CompareKeys(BTRFS_PathKey(&path), &key) != 0))
+    err = BTRFS_PrevItem(&path);
+  if (err != 0) {
+    BTRFS_PathRelease(&path);
+    return err < 0 ? -1 : 0;
+  }
+
+  BTRFS_Header *leaf = path.nodes[0];
+  BTRFS_ItemPointer *items = (BTRFS_ItemPointer *)(leaf + 1);
+
+  pthread_mutex_lock(&csum_lock);
+  for (uint32_t i = 0; i < leaf->item_count && err == 0; i++) {
+    if (items[i].key.object_id != BTRFS_ExtentChecksumObjectID ||
+        items[i].key.type != KeyType_ExtentChecksum)
+      continue;
+    err = Csum_Insert(items[i].key.offset,
+                      (uint32_t *)((uint8_t *)leaf + sizeof(BTRFS_Header) +
+                                   items[i].data_offset),
+                      items[i].data_size / sizeof(uint32_t));
+  }
+  pthread_mutex_unlock(&csum_lock);
+
+  BTRFS_PathRelease(&path);
+  return err;
+}
+
+void BTRFS_ReleaseChecksumCache(void) {
+  pthread_mutex_lock(&csum_lock);
+  Csum_Clear();
+  pthread_mutex_unlock(&csum_lock);
+}
+
+int BTRFS_VerifyData(uint64_t logical, const void *buf, uint64_t count) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  const uint8_t *data = buf;
+  uint32_t expected[CSUM_BATCH];
+  uint32_t actual[CSUM_BATCH];
+
+  while (count > 0) {
+    uint64_t n = count < CSUM_BATCH ? count : CSUM_BATCH;
+
+    uint64_t found = Csum_Lookup(logical, n, expected);
+    if (found == 0) {
+      if (Csum_Fill(logical) != 0) return -1;
+      found = Csum_Lookup(logical, n, expected);
+      // Sectors without a checksum cannot be trusted either.
+      if (found == 0) return -2;
+      BTRFS_STAT(csum_misses, found);
+    } else {
+      BTRFS_STAT(csum_hits, found);
+    }
+
+    uint64_t start = BTRFS_StatsClock();
+    crc32c_sectors(data, sector_size, found, actual);
+    BTRFS_STAT(checksum_bytes, found * sector_size);
+    BTRFS_STAT(checksum_ns, BTRFS_StatsClock() - start);
+    if (memcmp(actual, expected, found * sizeof(uint32_t)) != 0) return -2;
+
+    data += found * sector_size;
+    logical += found * sector_size;
+    count -= found;
+  }
+  return 0;
+}
+
+int BTRFS_GetChecksums(uint64_t logical, uint64_t count, uint32_t *sums,
+                       uint64_t *found) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  *found = 0;
+
+  while (*found < count) {
+    uint64_t n = Csum_Lookup(logical, count - *found, sums + *found);
+    if (n == 0) {
+      if (Csum_Fill(logical) != 0) return -1;
+      n = Csum_Lookup(logical, count - *found, sums + *found);
+      if (n == 0) break;
+      BTRFS_STAT(csum_misses, n);
+    } else {
+      BTRFS_STAT(csum_hits, n);
+    }
+
+    *found += n;
+    logical += n * sector_size;
+  }
+  return 0;
+}
@@ -0,0 +1,239 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "btrfs.h"
+
+#define DIFF_ADVANCE 1
+#define DIFF_ADVANCE_ONLY_NEXT 2
+
+// Position in a tree during a diff. Holds one node buffer per level so that
+// moving back up after a subtree does not need to re-read anything.
+typedef struct {
+  BTRFS_Header *nodes[BTRFS_MAX_LEVEL];
+  int slots[BTRFS_MAX_LEVEL];
+  int level;
+  int root_level;
+  bool done;
+} BTRFS_DiffCursor;
+
+static void BTRFS_DiffCursorFree(BTRFS_DiffCursor *cursor) {
+  for (int i = 0; i < BTRFS_MAX_LEVEL; i++)
+    BTRFS_Free(cursor->nodes[i], BTRFS_GetNodeSize());
+}
+
+static int BTRFS_DiffCursorInit(BTRFS_DiffCursor *cursor, uint64_t root) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  memset(cursor, 0, sizeof(BTRFS_DiffCursor));
+  if (root == 0) {
+    cursor->done = true;
+    return 0;
+  }
+
+  for (int i = 0; i < BTRFS_MAX_LEVEL; i++) {
+    cursor->nodes[i] = BTRFS_Alloc(node_size);
+    if (cursor->nodes[i] == NULL) return -1;
+  }
+
+  BTRFS_Header *scratch = cursor->nodes[0];
+  if (BTRFS_GetNode(scratch, root) != 0) return -1;
+  if (scratch->level >= BTRFS_MAX_LEVEL) return -1;
+
+  cursor->root_level = cursor->level = scratch->level;
+  if (cursor->level != 0) {
+    memcpy(cursor->nodes[cursor->level], scratch, node_size);
+  }
+  cursor->done = (scratch->item_count == 0);
+  return 0;
+}
+
+static BTRFS_Key *BTRFS_DiffCursorKey(BTRFS_DiffCursor *cursor) {
+  BTRFS_Header *node = cursor->nodes[cursor->level];
+  int slot = cursor->slots[cursor->level];
+
+  if (cursor->level == 0) return &((BTRFS_ItemPointer *)(node + 1))[slot].key;
+  return &((BTRFS_KeyPointer *)(node + 1))[slot].key;
+}
+
+static BTRFS_KeyPointer *BTRFS_DiffCursorPointer(BTRFS_DiffCursor *cursor) {
+  BTRFS_Header *node = cursor->nodes[cursor->level];
+  return &((BTRFS_KeyPointer *)(node + 1))[cursor->slots[cursor->level]];
+}
+
+static BTRFS_ItemPointer *BTRFS_DiffCursorItem(BTRFS_DiffCursor *cursor) {
+  BTRFS_Header *node = cursor->nodes[0];
+  return &((BTRFS_ItemPointer *)(node + 1))[cursor->slots[0]];
+}
+
+static void *BTRFS_DiffCursorData(BTRFS_DiffCursor *cursor) {
+  return (uint8_t *)cursor->nodes[0] + sizeof(BTRFS_Header) +
+         BTRFS_DiffCursorItem(cursor)->data_offset;
+}
+
+// Move to the next slot, climbing up as levels are exhausted.
+static void BTRFS_DiffCursorNext(BTRFS_DiffCursor *cursor) {
+  cursor->slots[cursor->level]++;
+  while (cursor->slots[cursor->level] >=
+         (int)cursor->nodes[cursor->level]->item_count) {
+    if (cursor->level == cursor->root_level) {
+      cursor->done = true;
+      return;
+    }
+    cursor->level++;
+    cursor->slots[cursor->level]++;
+  }
+}
+
+static int BTRFS_DiffCursorAdvance(BTRFS_DiffCursor *cursor, int mode) {
+  if (mode == DIFF_ADVANCE_ONLY_NEXT || cursor->level == 0) {
+    BTRFS_DiffCursorNext(cursor);
+    return 0;
+  }
+
+  uint64_t child = BTRFS_DiffCursorPointer(cursor)->block_number;
+  int level = cursor->level - 1;
+
+  if (BTRFS_GetNode(cursor->nodes[level], child) != 0) return -1;
+  if (cursor->nodes[level]->level != level) return -1;
+
+  cursor->level = level;
+  cursor->slots[level] = 0;
+  if (cursor->nodes[level]->item_count == 0) BTRFS_DiffCursorNext(cursor);
+  return 0;
+}
+
+// Both pointers lead to subtrees which are known to hold the same items.
+// Only the same block is proof of that: two old blocks at different
+// addresses can hold anything, whatever their generations.
+static bool BTRFS_DiffIsShared(BTRFS_KeyPointer *old_ptr,
+                               BTRFS_KeyPointer *new_ptr) {
+  return old_ptr->block_number == new_ptr->block_number &&
+         old_ptr->generation == new_ptr->generation;
+}
+
+int BTRFS_DiffTrees(uint64_t old_root, uint64_t new_root,
+                    uint64_t min_generation, BTRFS_DiffCallback callback,
+                    void *context) {
+  BTRFS_DiffCursor old_cursor, new_cursor;
+  int retVal = 0;
+
+  memset(&old_cursor, 0, sizeof(BTRFS_DiffCursor));
+  memset(&new_cursor, 0, sizeof(BTRFS_DiffCursor));
+
+  if (BTRFS_DiffCursorInit(&old_cursor, old_root) != 0 ||
+      BTRFS_DiffCursorInit(&new_cursor, new_root) != 0) {
+    retVal = -1;
+    goto done;
+  }
+
+  // Without an old tree only generation pruning applies, and everything in
+  // the newer subtrees is reported as added.
+  if (old_root == 0 && !new_cursor.done &&
+      new_cursor.nodes[new_cursor.level]->generation < min_generation)
+    new_cursor.done = true;
+
+  int advance_old = 0;
+  int advance_new = 0;
+
+  while (retVal == 0) {
+    if (advance_old && !old_cursor.done &&
+        BTRFS_DiffCursorAdvance(&old_cursor, advance_old) != 0) {
+      retVal = -1;
+      break;
+    }
+    if (advance_new && !new_cursor.done &&
+        BTRFS_DiffCursorAdvance(&new_cursor, advance_new) != 0) {
+      retVal = -1;
+      break;
+    }
+    advance_old = 0;
+    advance_new = 0;
+
+    if (old_cursor.done && new_cursor.done) break;
+
+    if (old_cursor.done) {
+      if (new_cursor.level == 0) {
+        BTRFS_ItemPointer *item = BTRFS_DiffCursorItem(&new_cursor);
+        retVal = callback(DiffChange_Added, &item->key, NULL, 0,
+                          BTRFS_DiffCursorData(&new_cursor), item->data_size,
+                          context);
+        advance_new = DIFF_ADVANCE;
+      } else if (old_root == 0 &&
+                 BTRFS_DiffCursorPointer(&new_cursor)->generation <
+                     min_generation) {
+        advance_new = DIFF_ADVANCE_ONLY_NEXT;
+      } else {
+        advance_new = DIFF_ADVANCE;
+      }
+      continue;
+    }
+
+    if (new_cursor.done) {
+      if (old_cursor.level == 0) {
+        BTRFS_ItemPointer *item = BTRFS_DiffCursorItem(&old_cursor);
+        retVal = callback(DiffChange_Removed, &item->key,
+                          BTRFS_DiffCursorData(&old_cursor), item->data_size,
+                          NULL, 0, context);
+      }
+      advance_old = DIFF_ADVANCE;
+      continue;
+    }
+
+    if (old_cursor.level == 0 && new_cursor.level == 0) {
+      BTRFS_ItemPointer *old_item = BTRFS_DiffCursorItem(&old_cursor);
+      BTRFS_ItemPointer *new_item = BTRFS_DiffCursorItem(&new_cursor);
+      void *old_data = BTRFS_DiffCursorData(&old_cursor);
+      void *new_data = BTRFS_DiffCursorData(&new_cursor);
+
+      int cmp = BTRFS_CompareKeys(&old_item->key, &new_item->key);
+      if (cmp < 0) {
+        retVal = callback(DiffChange_Removed, &old_item->key, old_data,
+                          old_item->data_size, NULL, 0, context);
+        advance_old = DIFF_ADVANCE;
+      } else if (cmp > 0) {
+        retVal = callback(DiffChange_Added, &new_item->key, NULL, 0, new_data,
+                          new_item->data_size, context);
+        advance_new = DIFF_ADVANCE;
+      } else {
+        if (old_item->data_size != new_item->data_size ||
+            memcmp(old_data, new_data, new_item->data_size) != 0)
+          retVal = callback(DiffChange_Modified, &new_item->key, old_data,
+                            old_item->data_size, new_data,
+                            new_item->data_size, context);
+        advance_old = DIFF_ADVANCE;
+        advance_new = DIFF_ADVANCE;
+      }
+    } else if (old_cursor.level == new_cursor.level) {
+      int cmp = BTRFS_CompareKeys(BTRFS_DiffCursorKey(&old_cursor),
+                                  BTRFS_DiffCursorKey(&new_cursor));
+      if (cmp < 0) {
+        advance_old = DIFF_ADVANCE;
+      } else if (cmp > 0) {
+        advance_new = DIFF_ADVANCE;
+      } else if (BTRFS_DiffIsShared(BTRFS_DiffCursorPointer(&old_cursor),
+                                    BTRFS_DiffCursorPointer(&new_cursor))) {
+        advance_old = DIFF_ADVANCE_ONLY_NEXT;
+        advance_new = DIFF_ADVANCE_ONLY_NEXT;
+      } else {
+        advance_old = DIFF_ADVANCE;
+        advance_new = DIFF_ADVANCE;
+      }
+    } else if (old_cursor.level < new_cursor.level) {
+      advance_new = DIFF_ADVANCE;
+    } else {
+      advance_old = DIFF_ADVANCE;
+    }
+  }
+
+done:
+  BTRFS_DiffCursorFree(&old_cursor);
+  BTRFS_DiffCursorFree(&new_cursor);
+  return retVal;
+}
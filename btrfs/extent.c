@@ -4,3 +4,294 @@
  * This software is released under the MIT License.
  * https://opensource.org/licenses/MIT
  */
+
+#include "extent.h"
+#include "btrfs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Each worker collects the ranges of the leaves it visits on its own,
+// merging runs within a leaf as it goes; the lists are joined, sorted and
+// merged once the walk is done.
+typedef struct {
+  BTRFS_Range *ranges;
+  size_t count;
+  size_t capacity;
+  size_t block_group_count;
+  uint64_t block_group_bytes;
+  uint64_t block_group_used;
+} AllocWorker;
+
+static int Alloc_AddRange(AllocWorker *worker, uint64_t start,
+                          uint64_t length) {
+  if (worker->count > 0) {
+    BTRFS_Range *last = &worker->ranges[worker->count - 1];
+    if (start >= last->start && start <= last->start + last->length) {
+      if (start + length > last->start + last->length)
+        last->length = start + length - last->start;
+      return 0;
+    }
+  }
+
+  if (worker->count == worker->capacity) {
+    size_t capacity = worker->capacity ? worker->capacity * 2 : 1024;
+    BTRFS_Range *grown = realloc(worker->ranges, capacity * sizeof(BTRFS_Range));
+    if (grown == NULL) return -1;
+    worker->ranges = grown;
+    worker->capacity = capacity;
+  }
+  worker->ranges[worker->count++] = (BTRFS_Range){start, length};
+  return 0;
+}
+
+static int Alloc_VisitLeaf(BTRFS_Header *leaf, int worker, void *context) {
+  AllocWorker *state = (AllocWorker *)context + worker;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    BTRFS_Key *key = &chunk_entry->key;
+
+    switch (key->type) {
+      case KeyType_ExtentItem:
+        // Tree blocks without skinny metadata use these too, with the node
+        // size as the length.
+        if (Alloc_AddRange(state, key->object_id, key->offset) != 0) return -1;
+        break;
+      case KeyType_MetadataItem:
+        // Skinny metadata keys hold the level, every tree block is a node.
+        if (Alloc_AddRange(state, key->object_id, BTRFS_GetNodeSize()) != 0)
+          return -1;
+        break;
+      case KeyType_BlockGroupItem: {
+        BTRFS_BlockGroupItem *block_group =
+            (BTRFS_BlockGroupItem *)((uint8_t *)leaf + sizeof(BTRFS_Header) +
+                                     chunk_entry->data_offset);
+        state->block_group_count++;
+        state->block_group_bytes += key->offset;
+        state->block_group_used += block_group->used;
+      } break;
+    }
+  }
+  return 0;
+}
+
+static int Alloc_CompareRanges(const void *a, const void *b) {
+  const BTRFS_Range *x = a, *y = b;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return 0;
+}
+
+static int Alloc_ComparePhysical(const void *a, const void *b) {
+  const BTRFS_PhysicalRange *x = a, *y = b;
+  if (x->device_id != y->device_id) return x->device_id < y->device_id ? -1 : 1;
+  if (x->physical_addr != y->physical_addr)
+    return x->physical_addr < y->physical_addr ? -1 : 1;
+  return 0;
+}
+
+int BTRFS_BuildAllocMap(int threads, BTRFS_AllocMap *map) {
+  memset(map, 0, sizeof(BTRFS_AllocMap));
+  if (threads < 1) threads = 1;
+
+  AllocWorker *workers = calloc(threads, sizeof(AllocWorker));
+  if (workers == NULL) return -1;
+
+  int retVal = BTRFS_ParallelWalk(BTRFS_GetExtentTreeLocation(), threads,
+                                  Alloc_VisitLeaf, workers);
+
+  size_t total = 0;
+  for (int i = 0; i < threads; i++) total += workers[i].count;
+
+  if (retVal == 0) {
+    map->ranges = malloc(total * sizeof(BTRFS_Range) + 1);
+    if (map->ranges == NULL) retVal = -1;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    if (retVal == 0) {
+      memcpy(map->ranges + map->range_count, workers[i].ranges,
+             workers[i].count * sizeof(BTRFS_Range));
+      map->range_count += workers[i].count;
+      map->block_group_count += workers[i].block_group_count;
+      map->block_group_bytes += workers[i].block_group_bytes;
+      map->block_group_used += workers[i].block_group_used;
+    }
+    free(workers[i].ranges);
+  }
+  free(workers);
+
+  if (retVal != 0) {
+    BTRFS_FreeAllocMap(map);
+    return -1;
+  }
+
+  qsort(map->ranges, map->range_count, sizeof(BTRFS_Range),
+        Alloc_CompareRanges);
+
+  size_t count = 0;
+  for (size_t i = 0; i < map->range_count; i++) {
+    BTRFS_Range *range = &map->ranges[i];
+    BTRFS_Range *last = count > 0 ? &map->ranges[count - 1] : NULL;
+
+    if (last != NULL && range->start <= last->start + last->length) {
+      if (range->start + range->length > last->start + last->length)
+        last->length = range->start + range->length - last->start;
+    } else {
+      map->ranges[count++] = *range;
+    }
+  }
+  map->range_count = count;
+
+  for (size_t i = 0; i < count; i++)
+    map->allocated_bytes += map->ranges[i].length;
+  return 0;
+}
+
+void BTRFS_FreeAllocMap(BTRFS_AllocMap *map) {
+  free(map->ranges);
+  memset(map, 0, sizeof(BTRFS_AllocMap));
+}
+
+// Index of the first range ending after the address.
+static size_t Alloc_FindRange(const BTRFS_AllocMap *map, uint64_t logical) {
+  size_t lo = 0, hi = map->range_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (map->ranges[mid].start + map->ranges[mid].length <= logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int BTRFS_AllocMapContains(const BTRFS_AllocMap *map, uint64_t logical) {
+  size_t index = Alloc_FindRange(map, logical);
+  return index < map->range_count && map->ranges[index].start <= logical;
+}
+
+// The number of stripes a chunk's data is spread over, each of the others
+// holding a copy or parity.
+static uint64_t Alloc_DataStripes(BTRFS_ChunkItem *chunk_item) {
+  uint64_t stripes = chunk_item->stripe_count;
+
+  if (chunk_item->type & BlockGroupFlag_RAID0) return stripes;
+  if (chunk_item->type & BlockGroupFlag_RAID10)
+    return chunk_item->sub_stripes ? stripes / chunk_item->sub_stripes : 1;
+  if ((chunk_item->type & BlockGroupFlag_RAID5) && stripes > 1)
+    return stripes - 1;
+  if ((chunk_item->type & BlockGroupFlag_RAID6) && stripes > 2)
+    return stripes - 2;
+  return 1;
+}
+
+typedef struct {
+  BTRFS_PhysicalRange *ranges;
+  size_t count;
+  size_t capacity;
+} AllocPhysical;
+
+static int Alloc_AddPhysical(AllocPhysical *physical, uint64_t device_id,
+                             uint64_t addr, uint64_t length) {
+  if (physical->count == physical->capacity) {
+    size_t capacity = physical->capacity ? physical->capacity * 2 : 1024;
+    BTRFS_PhysicalRange *grown =
+        realloc(physical->ranges, capacity * sizeof(BTRFS_PhysicalRange));
+    if (grown == NULL) return -1;
+    physical->ranges = grown;
+    physical->capacity = capacity;
+  }
+  physical->ranges[physical->count++] =
+      (BTRFS_PhysicalRange){device_id, addr, length};
+  return 0;
+}
+
+// Add the device ranges of the allocated space inside one chunk.
+static int Alloc_MapChunk(const BTRFS_AllocMap *map, uint64_t chunk_start,
+                          BTRFS_ChunkItem *chunk_item,
+                          AllocPhysical *physical) {
+  uint64_t chunk_end = chunk_start + chunk_item->chunk_size_bytes;
+  size_t index = Alloc_FindRange(map, chunk_start);
+  if (index == map->range_count || map->ranges[index].start >= chunk_end)
+    return 0;
+
+  uint64_t data_stripes = Alloc_DataStripes(chunk_item);
+  if (data_stripes > 1) {
+    uint64_t length = chunk_item->chunk_size_bytes / data_stripes;
+    for (uint16_t s = 0; s < chunk_item->stripe_count; s++)
+      if (Alloc_AddPhysical(physical, chunk_item->stripes[s].device_id,
+                            chunk_item->stripes[s].offset, length) != 0)
+        return -1;
+    return 0;
+  }
+
+  for (; index < map->range_count && map->ranges[index].start < chunk_end;
+       index++) {
+    const BTRFS_Range *range = &map->ranges[index];
+    uint64_t start = range->start > chunk_start ? range->start : chunk_start;
+    uint64_t end = range->start + range->length;
+    if (end > chunk_end) end = chunk_end;
+
+    for (uint16_t s = 0; s < chunk_item->stripe_count; s++)
+      if (Alloc_AddPhysical(physical, chunk_item->stripes[s].device_id,
+                            chunk_item->stripes[s].offset + start - chunk_start,
+                            end - start) != 0)
+        return -1;
+  }
+  return 0;
+}
+
+int BTRFS_AllocMapToPhysical(const BTRFS_AllocMap *map,
+                             BTRFS_PhysicalRange **out, size_t *count) {
+  AllocPhysical physical;
+  memset(&physical, 0, sizeof(AllocPhysical));
+
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+
+  BTRFS_Key key = {ReservedObjectID_FirstChunkTree, KeyType_ChunkItem, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetChunkTreeRootAddress(), &key, &path);
+
+  while (err == 0) {
+    BTRFS_Key *chunk_key = BTRFS_PathKey(&path);
+    if (chunk_key->object_id != ReservedObjectID_FirstChunkTree ||
+        chunk_key->type != KeyType_ChunkItem)
+      break;
+
+    BTRFS_ChunkItem *chunk_item = BTRFS_PathItem(&path, NULL);
+    if (Alloc_MapChunk(map, chunk_key->offset, chunk_item, &physical) != 0) {
+      err = -1;
+      break;
+    }
+    err = BTRFS_NextItem(&path);
+  }
+  BTRFS_PathRelease(&path);
+
+  if (err < 0) {
+    free(physical.ranges);
+    return -1;
+  }
+
+  qsort(physical.ranges, physical.count, sizeof(BTRFS_PhysicalRange),
+        Alloc_ComparePhysical);
+
+  size_t merged = 0;
+  for (size_t i = 0; i < physical.count; i++) {
+    BTRFS_PhysicalRange *range = &physical.ranges[i];
+    BTRFS_PhysicalRange *last = merged > 0 ? &physical.ranges[merged - 1] : NULL;
+
+    if (last != NULL && range->device_id == last->device_id &&
+        range->physical_addr <= last->physical_addr + last->length) {
+      uint64_t end = range->physical_addr + range->length;
+      if (end > last->physical_addr + last->length)
+        last->length = end - last->physical_addr;
+    } else {
+      physical.ranges[merged++] = *range;
+    }
+  }
+
+  *out = physical.ranges;
+  *count = merged;
+  return 0;
+}
@@ -6,4 +6,180 @@
 #ifndef BTRFS_EXTENT_TREE_H_
 #define BTRFS_EXTENT_TREE_H_
 
-#endif
\ No newline at end of file
+#include <stddef.h>
+#include <stdint.h>
+
+#include "btrfs_types.h"
+
+///
+/// @brief      A range of logical addresses.
+///
+typedef struct {
+  uint64_t start;
+  uint64_t length;
+} BTRFS_Range;
+
+///
+/// @brief      A range of a device.
+///
+typedef struct {
+  uint64_t device_id;
+  uint64_t physical_addr;
+  uint64_t length;
+} BTRFS_PhysicalRange;
+
+///
+/// @brief      The allocated space of the filesystem, from the extent tree.
+///
+typedef struct {
+  /// Allocated logical ranges, sorted and with touching ranges merged.
+  BTRFS_Range *ranges;
+  size_t range_count;
+  uint64_t allocated_bytes;
+
+  /// Totals of the block group items.
+  size_t block_group_count;
+  uint64_t block_group_bytes;
+  uint64_t block_group_used;
+} BTRFS_AllocMap;
+
+///
+/// @brief      Build the allocated range map from the extent and metadata
+///             items of the extent tree, scanning its leaves in parallel.
+///
+/// @param[in]  threads  The number of workers, see BTRFS_ParallelWalk
+/// @param      map      Receives the map, release it with
+///                      BTRFS_FreeAllocMap
+///
+/// @return     -1 on failure, 0 on success.
+///
+int BTRFS_BuildAllocMap(int threads, BTRFS_AllocMap *map);
+
+///
+/// @brief      Release the memory of an allocated range map.
+///
+/// @param      map   The map
+///
+void BTRFS_FreeAllocMap(BTRFS_AllocMap *map);
+
+///
+/// @brief      Check whether a logical address is allocated.
+///
+/// @param[in]  map      The map
+/// @param[in]  logical  The logical address
+///
+/// @return     1 if it is, 0 if not.
+///
+int BTRFS_AllocMapContains(const BTRFS_AllocMap *map, uint64_t logical);
+
+///
+/// @brief      Find the device ranges holding the allocated space, every
+///             copy of mirrored chunks included.
+///
+/// Striped chunks are not split per stripe, all of each stripe's device
+/// extent is taken instead.
+///
+/// @param[in]  map    The map
+/// @param      out    Receives the ranges sorted by device and address,
+///                    with touching ranges merged; release with free
+/// @param      count  Receives the number of ranges
+///
+/// @return     -1 on failure, 0 on success.
+///
+int BTRFS_AllocMapToPhysical(const BTRFS_AllocMap *map,
+                             BTRFS_PhysicalRange **out, size_t *count);
+
+///
+/// @brief      An owner of an extent: a file's data at an offset, or a tree
+///             block of a root, which has inode 0.
+///
+typedef struct {
+  uint64_t root;
+  uint64_t inode;
+  uint64_t offset;
+} BTRFS_BackRef;
+
+///
+/// @brief      Receives each owner of an address.
+///
+/// @param      ref      The owner, only valid for the duration of the call
+/// @param      context  The context passed along with the callback
+///
+/// @return     0 to continue, any other value stops the resolution.
+///
+typedef int (*BTRFS_BackRefCallback)(const BTRFS_BackRef *ref, void *context);
+
+///
+/// @brief      One owner of an extent in a BTRFS_BackRefIndex. The offset is
+///             where the extent's start would be in the file, and the owner
+///             only holds the bytes from start to end into the extent.
+///
+typedef struct {
+  uint64_t bytenr;
+  uint64_t length;
+  uint64_t start;
+  uint64_t end;
+  BTRFS_BackRef ref;
+} BTRFS_BackRefEntry;
+
+///
+/// @brief      Every owner of every extent, sorted by address.
+///
+typedef struct {
+  BTRFS_BackRefEntry *entries;
+  size_t count;
+} BTRFS_BackRefIndex;
+
+///
+/// @brief      Find the owners of a logical address through the extent
+///             tree's back references. Shared references are resolved by
+///             reading the tree block holding them.
+///
+/// @param[in]  logical   The logical address
+/// @param[in]  callback  Called for every owner, with the offset of the
+///                       address in the file. Files are only owners of the
+///                       part of an extent their file extent items reference.
+/// @param      context   Passed through to the callback
+///
+/// @return     -1 on read failure, the callback's return value if it stopped
+///             the resolution, 0 on success, also when nothing owns the
+///             address.
+///
+int BTRFS_ResolveLogical(uint64_t logical, BTRFS_BackRefCallback callback,
+                         void *context);
+
+///
+/// @brief      Build the owners of every extent in one parallel scan of the
+///             extent tree, for resolving many addresses.
+///
+/// @param[in]  threads  The number of workers, see BTRFS_ParallelWalk
+/// @param      index    Receives the index, release it with
+///                      BTRFS_FreeBackRefIndex
+///
+/// @return     -1 on failure, 0 on success.
+///
+int BTRFS_BuildBackRefIndex(int threads, BTRFS_BackRefIndex *index);
+
+///
+/// @brief      Release the memory of a back reference index.
+///
+/// @param      index  The index
+///
+void BTRFS_FreeBackRefIndex(BTRFS_BackRefIndex *index);
+
+///
+/// @brief      Find the owners of a logical address in an index, as
+///             BTRFS_ResolveLogical would.
+///
+/// @param[in]  index     The index
+/// @param[in]  logical   The logical address
+/// @param[in]  callback  Called for every owner
+/// @param      context   Passed through to the callback
+///
+/// @return     The callback's return value if it stopped the lookup, 0
+///             otherwise.
+///
+int BTRFS_BackRefIndexLookup(const BTRFS_BackRefIndex *index, uint64_t logical,
+                             BTRFS_BackRefCallback callback, void *context);
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+#include "sha256.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// A fingerprint is the SHA-256 of records describing the file in order: its
+// size, then each piece of it with a tag and its length, followed by the
+// data checksums covering it, or the data itself where there are none.
+// For files laid out alike, different fingerprints mean different contents;
+// equal ones are a strong hint only, as checksums such as crc32c stand in
+// for the data and can collide. The pieces follow the extents, so contents
+// rewritten in different extents may fingerprint differently.
+
+// Sectors covered by one record.
+#define FP_BATCH 256
+
+// Data without checksums is read and hashed this many bytes at a time.
+#define FP_DATA_SIZE (64 * 1024)
+
+typedef enum {
+  FpTag_Size = 'S',
+  FpTag_Hole = 'Z',
+  FpTag_Inline = 'I',
+  FpTag_Compressed = 'X',
+  FpTag_Checksums = 'C',
+  FpTag_Data = 'D',
+} FpTag;
+
+typedef struct {
+  sha256_ctx sha;
+  bool nodatasum;
+  uint32_t sums[FP_BATCH];
+  uint8_t *data;
+} Fingerprint;
+
+static void Fp_Record(Fingerprint *fp, FpTag tag, uint64_t value) {
+  uint8_t record[1 + sizeof(uint64_t)];
+  record[0] = tag;
+  memcpy(record + 1, &value, sizeof(uint64_t));
+  sha256_update(&fp->sha, record, sizeof(record));
+}
+
+// Hash a range of data, reading whole sectors a buffer at a time.
+static int Fp_AddData(Fingerprint *fp, uint64_t logical, uint64_t len) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+
+  while (len > 0) {
+    uint64_t skip = logical % sector_size;
+    uint64_t n = FP_DATA_SIZE - skip;
+    if (n > len) n = len;
+    uint64_t bytes = (skip + n + sector_size - 1) / sector_size * sector_size;
+
+    if (BTRFS_Read(fp->data, logical - skip, bytes) != bytes) return -1;
+    sha256_update(&fp->sha, fp->data + skip, n);
+    logical += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Add a range of data on disk, by its checksums where every sector of a
+// batch has one, else by its data.
+static int Fp_AddRange(Fingerprint *fp, uint64_t logical, uint64_t len) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+
+  while (len > 0) {
+    uint64_t skip = logical % sector_size;
+    uint64_t n = FP_BATCH * sector_size - skip;
+    if (n > len) n = len;
+    uint64_t sectors = (skip + n + sector_size - 1) / sector_size;
+
+    uint64_t found = 0;
+    if (!fp->nodatasum &&
+        BTRFS_GetChecksums(logical - skip, sectors, fp->sums, &found) != 0)
+      return -1;
+
+    if (found == sectors) {
+      Fp_Record(fp, FpTag_Checksums, n);
+      sha256_update(&fp->sha, fp->sums, sectors * sizeof(uint32_t));
+    } else {
+      Fp_Record(fp, FpTag_Data, n);
+      if (Fp_AddData(fp, logical, n) != 0) return -1;
+    }
+
+    logical += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Add the part of an extent from off_in_ext on.
+static int Fp_AddExtent(Fingerprint *fp, BTRFS_ExtentDataInline *extent,
+                        uint32_t extent_size, uint64_t off_in_ext,
+                        uint64_t len) {
+  uint64_t avail = extent_size - sizeof(BTRFS_ExtentDataInline);
+  uint8_t *inline_data = (uint8_t *)(extent + 1);
+
+  if (extent->type == ExtentDataType_Inline) {
+    if (extent->compression_type != 0) {
+      Fp_Record(fp, FpTag_Compressed, len);
+      Fp_Record(fp, extent->compression_type, off_in_ext);
+      Fp_Record(fp, FpTag_Inline, avail);
+      sha256_update(&fp->sha, inline_data, avail);
+      return 0;
+    }
+
+    // Inline data shorter than the extent claims reads as zeros.
+    uint64_t copy = off_in_ext < avail ? avail - off_in_ext : 0;
+    if (copy > len) copy = len;
+    Fp_Record(fp, FpTag_Inline, copy);
+    sha256_update(&fp->sha, inline_data + off_in_ext, copy);
+    if (copy < len) Fp_Record(fp, FpTag_Hole, len - copy);
+    return 0;
+  }
+
+  BTRFS_ExtentDataFull *extent_full = (BTRFS_ExtentDataFull *)extent;
+  if (extent->type == ExtentDataType_Prealloc ||
+      extent_full->extent_logical_addr == 0) {
+    Fp_Record(fp, FpTag_Hole, len);
+    return 0;
+  }
+
+  // The whole compressed extent is needed to decode any of it, so all of
+  // it is added along with where the piece is in the decoded data.
+  if (extent->compression_type != 0) {
+    Fp_Record(fp, FpTag_Compressed, len);
+    Fp_Record(fp, extent->compression_type,
+              extent_full->extent_offset + off_in_ext);
+    return Fp_AddRange(fp, extent_full->extent_logical_addr,
+                       extent_full->extent_size);
+  }
+
+  return Fp_AddRange(fp,
+                     extent_full->extent_logical_addr +
+                         extent_full->extent_offset + off_in_ext,
+                     len);
+}
+
+static int Fp_AddFile(Fingerprint *fp, BTRFS_Path *path,
+                      BTRFS_ExtentDataInline *extent, uint64_t inode) {
+  BTRFS_Key key = {inode, KeyType_InodeItem, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+  if (err < 0) return -1;
+  if (err > 0 || BTRFS_CompareKeys(BTRFS_PathKey(path), &key) != 0) return -2;
+
+  BTRFS_InodeItem *inode_item = BTRFS_PathItem(path, NULL);
+  uint64_t file_size = inode_item->st_size;
+  fp->nodatasum = inode_item->flags & BTRFS_InodeFlag_NoDataSum;
+  Fp_Record(fp, FpTag_Size, file_size);
+
+  for (uint64_t offset = 0; offset < file_size;) {
+    uint64_t size_rem = file_size - offset;
+    uint64_t extent_off = 0;
+    uint32_t extent_size = 0;
+
+    int found = BTRFS_FindFileExtent(path, inode, offset, extent, &extent_off,
+                                     &extent_size);
+    if (found < 0) return -1;
+
+    if (found == 0 || extent_off > offset) {
+      uint64_t hole = found == 0 ? size_rem : extent_off - offset;
+      if (hole > size_rem) hole = size_rem;
+      Fp_Record(fp, FpTag_Hole, hole);
+      offset += hole;
+      continue;
+    }
+
+    uint64_t off_in_ext = offset - extent_off;
+    uint64_t extent_len = extent->decoded_size;
+    if (extent->type != ExtentDataType_Inline)
+      extent_len = ((BTRFS_ExtentDataFull *)extent)->logical_byte_count;
+    if (off_in_ext >= extent_len) return -1;
+
+    uint64_t len = extent_len - off_in_ext;
+    if (len > size_rem) len = size_rem;
+    if (Fp_AddExtent(fp, extent, extent_size, off_in_ext, len) != 0)
+      return -1;
+    offset += len;
+  }
+  return 0;
+}
+
+int BTRFS_FileFingerprint(uint64_t inode, uint8_t *digest) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+  BTRFS_ExtentDataInline *extent = BTRFS_Alloc(node_size);
+
+  Fingerprint fp;
+  sha256_init(&fp.sha);
+  fp.data = BTRFS_Alloc(FP_DATA_SIZE);
+
+  int retVal = -1;
+  if (extent != NULL && fp.data != NULL)
+    retVal = Fp_AddFile(&fp, &path, extent, inode);
+  if (retVal == 0) sha256_final(&fp.sha, digest);
+
+  BTRFS_PathRelease(&path);
+  BTRFS_Free(extent, node_size);
+  BTRFS_Free(fp.data, FP_DATA_SIZE);
+  return retVal;
+}
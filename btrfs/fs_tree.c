@@ -6,10 +6,10 @@
  */
 
 #include <stdbool.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "btrfs.h"
+#include "crc32c.h"
 
 static uint64_t current_inode = 0;
 
@@ -44,12 +44,13 @@ int BTRFS_GetFSTreeExtent(BTRFS_Header *parent, uint64_t inode, uint64_t offset,
   } else {
     // Visit all of this node's children
 
-    BTRFS_Header *children = malloc(node_size);
+    BTRFS_Header *children = BTRFS_Alloc(node_size);
+    if (children == NULL) return -1;
     BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(parent + 1);
 
     for (uint64_t i = 0; i < parent->item_count; i++) {
       if (BTRFS_GetNode(children, key_ptr->block_number) != 0) {
-        free(children);
+        BTRFS_Free(children, node_size);
         return -1;
       }
 
@@ -57,14 +58,14 @@ int BTRFS_GetFSTreeExtent(BTRFS_Header *parent, uint64_t inode, uint64_t offset,
           BTRFS_GetFSTreeExtent(children, inode, offset, node, node_off);
 
       if (retVal != 0) {
-        free(children);
+        BTRFS_Free(children, node_size);
         return retVal;
       }
 
       key_ptr++;
     }
 
-    free(children);
+    BTRFS_Free(children, node_size);
   }
   return 0;
 }
@@ -112,12 +113,13 @@ int BTRFS_TraverseFullFSTree(BTRFS_Header *parent, uint64_t inode_index,
   } else {
     // Visit all of this node's children
 
-    BTRFS_Header *children = malloc(node_size);
+    BTRFS_Header *children = BTRFS_Alloc(node_size);
+    if (children == NULL) return -1;
     BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(parent + 1);
 
     for (uint64_t i = 0; i < parent->item_count; i++) {
       if (BTRFS_GetNode(children, key_ptr->block_number) != 0) {
-        free(children);
+        BTRFS_Free(children, node_size);
         return -1;
       }
 
@@ -125,104 +127,318 @@ int BTRFS_TraverseFullFSTree(BTRFS_Header *parent, uint64_t inode_index,
                                             desired_inode);
 
       if (retVal != 0) {
-        free(children);
+        BTRFS_Free(children, node_size);
         return retVal;
       }
 
       key_ptr++;
     }
 
-    free(children);
+    BTRFS_Free(children, node_size);
   }
 
   return 0;
 }
 
-uint64_t BTRFS_ReadFile(uint64_t inode, uint64_t offset, uint64_t len,
-                        void *dest_buf) {
-  uint32_t node_size = BTRFS_GetNodeSize();
+// Largest read made at once when verifying.
+#define VERIFY_READ_SIZE (128 * 1024)
 
-  BTRFS_Header *children = malloc(node_size);
-  if (BTRFS_GetNode(children, BTRFS_GetFSTreeLocation()) != 0) {
-    free(children);
-    return -1;
+static int verify_reads = 0;
+
+void BTRFS_SetReadVerification(int enable) { verify_reads = enable; }
+
+int BTRFS_GetReadVerification(void) { return verify_reads; }
+
+static uint64_t BTRFS_ExtentFileLength(BTRFS_ExtentDataInline *extent) {
+  if (extent->type == ExtentDataType_Inline) return extent->decoded_size;
+  return ((BTRFS_ExtentDataFull *)extent)->logical_byte_count;
+}
+
+int BTRFS_FindFileExtent(BTRFS_Path *path, uint64_t inode, uint64_t offset,
+                         BTRFS_ExtentDataInline *extent, uint64_t *extent_off,
+                         uint32_t *extent_size) {
+  int found =
+      BTRFS_SidecarGetExtent(inode, offset, extent, extent_off, extent_size);
+  if (found != -1) return found;
+
+  BTRFS_Key key = {inode, KeyType_ExtentData, offset};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+  if (err < 0) return -1;
+
+  // Unless an extent starts right at the offset, the one before it may
+  // still cover it. That holds past the end of the tree too, where the
+  // last extent of the last file is the one before.
+  if (err > 0 || BTRFS_CompareKeys(BTRFS_PathKey(path), &key) != 0) {
+    int prev = BTRFS_PrevItem(path);
+    if (prev < 0) return -1;
+
+    if (prev == 0) {
+      BTRFS_Key *prev_key = BTRFS_PathKey(path);
+      uint32_t size = 0;
+      BTRFS_ExtentDataInline *data = BTRFS_PathItem(path, &size);
+      bool covers = prev_key->object_id == inode &&
+                    prev_key->type == KeyType_ExtentData &&
+                    size >= sizeof(BTRFS_ExtentDataInline) &&
+                    offset - prev_key->offset < BTRFS_ExtentFileLength(data);
+      err = covers ? 0 : BTRFS_NextItem(path);
+      if (err < 0) return -1;
+    }
+    if (err > 0) return 0;
   }
 
-  BTRFS_ExtentDataInline *extent = malloc(node_size);
-  uint64_t extent_off = 0;
-  uint64_t size_rem = len;
+  BTRFS_Key *found_key = BTRFS_PathKey(path);
+  if (found_key->object_id != inode || found_key->type != KeyType_ExtentData)
+    return 0;
+
+  uint32_t size = 0;
+  void *data = BTRFS_PathItem(path, &size);
+  if (size < sizeof(BTRFS_ExtentDataInline)) return -1;
+  memcpy(extent, data, size);
+  *extent_off = found_key->offset;
+  if (extent_size != NULL) *extent_size = size;
+  return 1;
+}
+
+// Read part of an extent from disk. When verifying, whole sectors are read
+// so their checksums can be checked, through the bounce buffer unless they
+// line up with the destination. Returns -1 on read failure, -2 on a
+// checksum mismatch.
+static int BTRFS_ReadExtentData(uint8_t *dst, uint64_t logical, uint64_t len,
+                                uint8_t *bounce) {
+  if (bounce == NULL) return BTRFS_Read(dst, logical, len) == len ? 0 : -1;
+
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  while (len > 0) {
+    uint64_t in_sector = logical % sector_size;
+    uint64_t span = (in_sector + len + sector_size - 1) / sector_size *
+                    sector_size;
+    // Hashing right behind the read finds the data still in cache.
+    if (span > VERIFY_READ_SIZE) span = VERIFY_READ_SIZE;
+    uint64_t n = span - in_sector;
+    if (n > len) n = len;
+
+    uint8_t *buf = in_sector == 0 && n == span ? dst : bounce;
+    if (BTRFS_Read(buf, logical - in_sector, span) != span) return -1;
+
+    int err = BTRFS_VerifyData(logical - in_sector, buf, span / sector_size);
+    if (err != 0) return err;
+    if (buf != dst) memcpy(dst, bounce + in_sector, n);
+
+    dst += n;
+    logical += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint64_t BTRFS_ReadFileExtents(BTRFS_Path *path, uint64_t inode,
+                                      uint64_t offset, uint64_t len,
+                                      uint8_t *dst,
+                                      BTRFS_ExtentDataInline *extent,
+                                      uint8_t *bounce) {
   uint64_t size_read = 0;
-  uint64_t buf_off = 0;
-  uint8_t *dst = (uint8_t *)dest_buf;
-  bool exit_read = false;
-
-  while (!exit_read) {
-    if (BTRFS_GetFSTreeExtent(children, inode, offset, extent, &extent_off) !=
-        1) {
-      free(extent);
-      free(children);
-      return size_read;
+
+  while (size_read < len) {
+    uint64_t size_rem = len - size_read;
+    uint64_t extent_off = 0;
+    uint32_t extent_size = 0;
+
+    int found = BTRFS_FindFileExtent(path, inode, offset, extent, &extent_off,
+                                     &extent_size);
+    if (found < 0) return -1;
+
+    // Holes read as zeros, up to the next extent or the end of the read.
+    if (found == 0 || extent_off > offset) {
+      uint64_t hole = found == 0 ? size_rem : extent_off - offset;
+      if (hole > size_rem) hole = size_rem;
+      memset(dst + size_read, 0, hole);
+      offset += hole;
+      size_read += hole;
+      continue;
     }
 
-    // Parse the extent to get the next part of the requested file.
-    if (extent->decoded_size >= size_rem) exit_read = true;
+    // Compressed extents are not supported, the read stops short.
+    if (extent->compression_type != 0) return size_read;
 
-    uint64_t off_in_ext = (offset - extent_off);
-    uint64_t rd_size =
-        (extent->decoded_size > size_rem ? extent->decoded_size : size_rem);
+    uint64_t off_in_ext = offset - extent_off;
+    uint64_t rd_size = BTRFS_ExtentFileLength(extent) - off_in_ext;
+    if (rd_size > size_rem) rd_size = size_rem;
 
-    if (extent->type & ExtentDataType_Inline) {
-      memcpy(dst + buf_off, (uint8_t *)(extent + 1) + off_in_ext, rd_size);
-    } else if (extent->type & ExtentDataType_Regular) {
+    if (extent->type == ExtentDataType_Inline) {
+      // Inline data shorter than the extent claims reads as zeros.
+      uint64_t avail = extent_size - sizeof(BTRFS_ExtentDataInline);
+      uint64_t copy = off_in_ext < avail ? avail - off_in_ext : 0;
+      if (copy > rd_size) copy = rd_size;
+      memcpy(dst + size_read, (uint8_t *)(extent + 1) + off_in_ext, copy);
+      memset(dst + size_read + copy, 0, rd_size - copy);
+    } else {
       BTRFS_ExtentDataFull *extent_full = (BTRFS_ExtentDataFull *)extent;
-      BTRFS_Read(dst + buf_off, extent_full->extent_logical_addr + off_in_ext,
-                 rd_size);
+
+      if (extent->type == ExtentDataType_Prealloc ||
+          extent_full->extent_logical_addr == 0) {
+        memset(dst + size_read, 0, rd_size);
+      } else {
+        int err = BTRFS_ReadExtentData(
+            dst + size_read,
+            extent_full->extent_logical_addr + extent_full->extent_offset +
+                off_in_ext,
+            rd_size, bounce);
+        if (err != 0) return err;
+      }
     }
 
     offset += rd_size;
-    size_rem -= rd_size;
     size_read += rd_size;
-    buf_off += rd_size;
   }
 
   return size_read;
 }
 
-int BTRFS_ParseFullFSTree(char *path, uint64_t *resolved_inode) {
-  // Parse the tree from the root
+static uint64_t BTRFS_ReadFileAt(BTRFS_Path *path, uint64_t inode,
+                                 uint64_t offset, uint64_t len,
+                                 void *dest_buf) {
   uint32_t node_size = BTRFS_GetNodeSize();
 
-  uint64_t path_len = strlen(path);
-  uint64_t inode = 256;
+  // Reads stop at the end of the file rather than of its last extent,
+  // which is rounded up to a sector.
+  BTRFS_Key key = {inode, KeyType_InodeItem, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+  if (err != 0 || BTRFS_CompareKeys(BTRFS_PathKey(path), &key) != 0)
+    return err < 0 ? (uint64_t)-1 : 0;
+
+  BTRFS_InodeItem *inode_item = BTRFS_PathItem(path, NULL);
+  uint64_t file_size = inode_item->st_size;
+  bool verify =
+      verify_reads && !(inode_item->flags & BTRFS_InodeFlag_NoDataSum);
+
+  if (offset >= file_size) return 0;
+  if (len > file_size - offset) len = file_size - offset;
 
-  if (path[0] == '/') {
-    path++;
-    path_len--;
+  BTRFS_ExtentDataInline *extent = BTRFS_Alloc(node_size);
+  uint8_t *bounce = verify ? BTRFS_Alloc(VERIFY_READ_SIZE) : NULL;
+  uint64_t retVal = -1;
+
+  if (extent != NULL && (bounce != NULL || !verify))
+    retVal = BTRFS_ReadFileExtents(path, inode, offset, len, dest_buf, extent,
+                                   bounce);
+
+  BTRFS_Free(bounce, VERIFY_READ_SIZE);
+  BTRFS_Free(extent, node_size);
+  return retVal;
+}
+
+uint64_t BTRFS_ReadFilePath(BTRFS_Path *path, uint64_t inode, uint64_t offset,
+                            uint64_t len, void *dest_buf) {
+  BTRFS_TraceEvent event = {.op = TraceOp_ReadFile,
+                            .tree = ReservedObjectID_FSTree,
+                            .inode = inode,
+                            .bytes = len};
+  uint64_t start = BTRFS_TraceBegin(&event);
+
+  uint64_t retVal = BTRFS_ReadFileAt(path, inode, offset, len, dest_buf);
+  if (start != 0) {
+    event.result = (int64_t)retVal;
+    event.bytes = retVal <= len ? retVal : 0;
+    BTRFS_TraceEnd(&event, start);
   }
+  return retVal;
+}
 
-  BTRFS_Header *children = malloc(node_size);
-  for (uint64_t i = 0; i < path_len; i++) {
-    uint64_t read_inode = inode;
-    uint64_t read_inode_addr = 0;
-    BTRFS_GetInodeFromCache(&read_inode, &read_inode_addr);
+uint64_t BTRFS_ReadFile(uint64_t inode, uint64_t offset, uint64_t len,
+                        void *dest_buf) {
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
 
-    if (read_inode == inode) {
-      if (BTRFS_GetNode(children, read_inode_addr) != 0) {
-        return -1;
+  uint64_t retVal = BTRFS_ReadFilePath(&path, inode, offset, len, dest_buf);
+  BTRFS_PathRelease(&path);
+  return retVal;
+}
+
+static int BTRFS_VisitInodeItems(BTRFS_Header *parent,
+                                 BTRFS_InodeVisitor visitor, void *context) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  if (parent->level == 0) {
+    BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(parent + 1);
+
+    for (int i = 0; i < parent->item_count; i++) {
+      switch (chunk_entry->key.type) {
+        case KeyType_InodeItem:
+        case KeyType_InodeRef:
+        case KeyType_InodeExtRef: {
+          int retVal = visitor(&chunk_entry->key,
+                               (uint8_t *)parent + sizeof(BTRFS_Header) +
+                                   chunk_entry->data_offset,
+                               chunk_entry->data_size, context);
+          if (retVal != 0) return retVal;
+        } break;
       }
-    } else {
-      if (BTRFS_GetNode(children, BTRFS_GetFSTreeLocation()) != 0) {
+
+      chunk_entry++;
+    }
+  } else {
+    // Visit all of this node's children, letting the reads of the later ones
+    // start while the earlier ones are processed.
+    BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(parent + 1);
+    for (uint64_t i = 0; i < parent->item_count; i++)
+      BTRFS_Prefetch(key_ptr[i].block_number, node_size);
+
+    BTRFS_Header *children = BTRFS_Alloc(node_size);
+    if (children == NULL) return -1;
+
+    for (uint64_t i = 0; i < parent->item_count; i++) {
+      if (BTRFS_GetNode(children, key_ptr->block_number) != 0) {
+        BTRFS_Free(children, node_size);
         return -1;
       }
-    }
 
-    if (BTRFS_TraverseFullFSTree(children, inode, &path[i], &inode) != 1) {
-      return -2;
+      int retVal = BTRFS_VisitInodeItems(children, visitor, context);
+
+      if (retVal != 0) {
+        BTRFS_Free(children, node_size);
+        return retVal;
+      }
+
+      key_ptr++;
     }
 
-    i = strchr(&path[i], '/') - path;
+    BTRFS_Free(children, node_size);
+  }
+
+  return 0;
+}
+
+int BTRFS_EnumerateInodes(BTRFS_InodeVisitor visitor, void *context) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BTRFS_Header *children = BTRFS_Alloc(node_size);
+  if (children == NULL) return -1;
+
+  if (BTRFS_GetNode(children, BTRFS_GetFSTreeLocation()) != 0) {
+    BTRFS_Free(children, node_size);
+    return -1;
   }
-  free(children);
+
+  int retVal = BTRFS_VisitInodeItems(children, visitor, context);
+  BTRFS_Free(children, node_size);
+  return retVal;
+}
+
+int BTRFS_ParseFullFSTree(char *path, uint64_t *resolved_inode) {
+  BTRFS_TraceEvent event = {.op = TraceOp_ParseFullFSTree,
+                            .tree = ReservedObjectID_FSTree};
+  uint64_t start = BTRFS_TraceBegin(&event);
+
+  // A single lookup is just a batch of one.
+  const char *paths[1] = {path};
+  uint64_t inode = 0;
+
+  int retVal = BTRFS_ResolvePaths(paths, 1, &inode);
+  if (retVal != 0) retVal = retVal < 0 ? -1 : -2;
+
+  event.inode = inode;
+  event.result = retVal;
+  BTRFS_TraceEnd(&event, start);
+  if (retVal != 0) return retVal;
 
   // Now we have found the inode of the target, this can be used to retrieve any
   // desired information
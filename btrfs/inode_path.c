@@ -0,0 +1,278 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The subvolume's root directory, where every path starts.
+#define PATH_ROOT_DIR 256
+
+// Directory paths are memoized in an open addressing table, sized to fit
+// the largest arena allocation. Rather than tracking use, the whole table
+// is dropped once it is three quarters full.
+#define PATH_CACHE_SIZE 8192
+
+#define PATH_MAX_LEN 4096
+#define PATH_NAME_MAX 255
+
+typedef struct {
+  uint64_t dir;
+  char *path;
+  uint32_t len;
+} PathCacheEntry;
+
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static PathCacheEntry *path_cache = NULL;
+static size_t path_cache_used = 0;
+
+typedef struct {
+  BTRFS_Path files;
+  BTRFS_Path dirs;
+  BTRFS_PathCallback callback;
+  void *context;
+} InodePaths;
+
+static size_t Path_Bucket(uint64_t dir) {
+  return (dir * 0x9e3779b97f4a7c15ull) >> 48 & (PATH_CACHE_SIZE - 1);
+}
+
+static void Path_CacheClear(void) {
+  if (path_cache == NULL) return;
+  for (size_t i = 0; i < PATH_CACHE_SIZE; i++)
+    if (path_cache[i].dir != 0)
+      BTRFS_Free(path_cache[i].path, path_cache[i].len + 1);
+  memset(path_cache, 0, PATH_CACHE_SIZE * sizeof(PathCacheEntry));
+  path_cache_used = 0;
+}
+
+static bool Path_CacheGet(uint64_t dir, char *buf, size_t *len) {
+  bool found = false;
+
+  pthread_mutex_lock(&path_cache_lock);
+  for (size_t i = Path_Bucket(dir); path_cache != NULL;
+       i = (i + 1) & (PATH_CACHE_SIZE - 1)) {
+    PathCacheEntry *entry = &path_cache[i];
+    if (entry->dir == 0) break;
+    if (entry->dir == dir) {
+      memcpy(buf, entry->path, entry->len);
+      *len = entry->len;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&path_cache_lock);
+  return found;
+}
+
+static void Path_CachePut(uint64_t dir, const char *buf, size_t len) {
+  pthread_mutex_lock(&path_cache_lock);
+
+  if (path_cache == NULL) {
+    path_cache = BTRFS_Alloc(PATH_CACHE_SIZE * sizeof(PathCacheEntry));
+    if (path_cache != NULL)
+      memset(path_cache, 0, PATH_CACHE_SIZE * sizeof(PathCacheEntry));
+  }
+  if (path_cache_used >= PATH_CACHE_SIZE / 4 * 3) Path_CacheClear();
+
+  char *copy = path_cache != NULL ? BTRFS_Alloc(len + 1) : NULL;
+  if (copy != NULL) {
+    memcpy(copy, buf, len);
+    copy[len] = '\0';
+
+    size_t i = Path_Bucket(dir);
+    while (path_cache[i].dir != 0 && path_cache[i].dir != dir)
+      i = (i + 1) & (PATH_CACHE_SIZE - 1);
+
+    if (path_cache[i].dir == dir) {
+      BTRFS_Free(copy, len + 1);
+    } else {
+      path_cache[i] = (PathCacheEntry){dir, copy, (uint32_t)len};
+      path_cache_used++;
+    }
+  }
+
+  pthread_mutex_unlock(&path_cache_lock);
+}
+
+void BTRFS_ReleasePathCache(void) {
+  pthread_mutex_lock(&path_cache_lock);
+  Path_CacheClear();
+  BTRFS_Free(path_cache, PATH_CACHE_SIZE * sizeof(PathCacheEntry));
+  path_cache = NULL;
+  pthread_mutex_unlock(&path_cache_lock);
+}
+
+// Position the path at the first reference item of an inode. Returns -1 on
+// read failure, 1 if the inode has none, 0 on success.
+static int Path_FirstRef(BTRFS_Path *path, uint64_t inode) {
+  BTRFS_Key key = {inode, KeyType_InodeRef, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+  if (err != 0) return err;
+
+  BTRFS_Key *found = BTRFS_PathKey(path);
+  if (found->object_id != inode ||
+      (found->type != KeyType_InodeRef && found->type != KeyType_InodeExtRef))
+    return 1;
+  return 0;
+}
+
+// Write the path of a directory, without a trailing '/', into buf. A
+// directory has a single name, so its first reference is the only one.
+// Returns -1 on read failure, 1 if the directory is not reachable, 0 on
+// success.
+static int Path_Dir(InodePaths *paths, uint64_t dir, char *buf, size_t *len,
+                    int depth) {
+  if (dir == PATH_ROOT_DIR) {
+    *len = 0;
+    return 0;
+  }
+  if (Path_CacheGet(dir, buf, len)) return 0;
+  if (depth > PATH_MAX_LEN / 2) return 1;
+
+  int err = Path_FirstRef(&paths->dirs, dir);
+  if (err != 0) return err;
+
+  // The item is gone once the path moves on, keep the name.
+  BTRFS_Key *key = BTRFS_PathKey(&paths->dirs);
+  uint32_t size = 0;
+  uint8_t *data = BTRFS_PathItem(&paths->dirs, &size);
+  uint64_t parent = 0;
+  char name[PATH_NAME_MAX + 1];
+  size_t name_len = 0;
+  const char *ref_name = NULL;
+
+  if (key->type == KeyType_InodeRef &&
+      size >= offsetof(BTRFS_InodeReference, name)) {
+    BTRFS_InodeReference *ref = (BTRFS_InodeReference *)data;
+    parent = key->offset;
+    name_len = ref->name_len;
+    ref_name = ref->name;
+    if (offsetof(BTRFS_InodeReference, name) + name_len > size) return 1;
+  } else if (key->type == KeyType_InodeExtRef &&
+             size >= offsetof(BTRFS_InodeExtReference, name)) {
+    BTRFS_InodeExtReference *ref = (BTRFS_InodeExtReference *)data;
+    parent = ref->dir_objectid;
+    name_len = ref->name_len;
+    ref_name = ref->name;
+    if (offsetof(BTRFS_InodeExtReference, name) + name_len > size) return 1;
+  }
+  if (ref_name == NULL || parent == dir || name_len > PATH_NAME_MAX) return 1;
+  memcpy(name, ref_name, name_len);
+
+  err = Path_Dir(paths, parent, buf, len, depth + 1);
+  if (err != 0) return err;
+  if (*len + 1 + name_len >= PATH_MAX_LEN) return 1;
+
+  buf[(*len)++] = '/';
+  memcpy(buf + *len, name, name_len);
+  *len += name_len;
+
+  Path_CachePut(dir, buf, *len);
+  return 0;
+}
+
+// Report the path through one name of an inode.
+static int Path_Report(InodePaths *paths, uint64_t inode, uint64_t parent,
+                       const char *name, size_t name_len) {
+  char buf[PATH_MAX_LEN + 1];
+  size_t len = 0;
+
+  int err = Path_Dir(paths, parent, buf, &len, 0);
+  if (err < 0) return -1;
+  if (err > 0 || len + 1 + name_len > PATH_MAX_LEN) return 0;
+
+  buf[len++] = '/';
+  memcpy(buf + len, name, name_len);
+  buf[len + name_len] = '\0';
+  return paths->callback(inode, buf, paths->context);
+}
+
+// Report every name of an inode, hard links each have their own.
+static int Path_Inode(InodePaths *paths, uint64_t inode) {
+  if (inode == PATH_ROOT_DIR)
+    return paths->callback(inode, "/", paths->context);
+
+  int err = Path_FirstRef(&paths->files, inode);
+  if (err != 0) return err < 0 ? -1 : 0;
+
+  for (;;) {
+    BTRFS_Key key = *BTRFS_PathKey(&paths->files);
+    if (key.object_id != inode ||
+        (key.type != KeyType_InodeRef && key.type != KeyType_InodeExtRef))
+      return 0;
+
+    // Parents are resolved through the other path, this one stays put.
+    uint32_t size = 0;
+    uint8_t *data = BTRFS_PathItem(&paths->files, &size);
+
+    uint32_t off = 0;
+    int retVal = 0;
+    if (key.type == KeyType_InodeRef) {
+      // Several names in the same parent share one item.
+      while (retVal == 0 &&
+             off + offsetof(BTRFS_InodeReference, name) <= size) {
+        BTRFS_InodeReference *ref = (BTRFS_InodeReference *)(data + off);
+        off += offsetof(BTRFS_InodeReference, name) + ref->name_len;
+        if (off > size) break;
+        retVal = Path_Report(paths, inode, key.offset, ref->name, ref->name_len);
+      }
+    } else {
+      while (retVal == 0 &&
+             off + offsetof(BTRFS_InodeExtReference, name) <= size) {
+        BTRFS_InodeExtReference *ref = (BTRFS_InodeExtReference *)(data + off);
+        off += offsetof(BTRFS_InodeExtReference, name) + ref->name_len;
+        if (off > size) break;
+        retVal = Path_Report(paths, inode, ref->dir_objectid, ref->name,
+                             ref->name_len);
+      }
+    }
+    if (retVal != 0) return retVal;
+
+    err = BTRFS_NextItem(&paths->files);
+    if (err != 0) return err < 0 ? -1 : 0;
+  }
+}
+
+static int Path_CompareInodes(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int BTRFS_InodesToPaths(const uint64_t *inodes, size_t count,
+                        BTRFS_PathCallback callback, void *context) {
+  InodePaths paths;
+  memset(&paths, 0, sizeof(InodePaths));
+  paths.callback = callback;
+  paths.context = context;
+
+  // In inode order the searches move forward through the tree, and the
+  // path holding the files re-reads nothing it already has.
+  uint64_t *sorted = malloc(count * sizeof(uint64_t) + 1);
+  if (sorted == NULL) return -1;
+  memcpy(sorted, inodes, count * sizeof(uint64_t));
+  qsort(sorted, count, sizeof(uint64_t), Path_CompareInodes);
+
+  int retVal = 0;
+  for (size_t i = 0; retVal == 0 && i < count; i++)
+    if (i == 0 || sorted[i] != sorted[i - 1])
+      retVal = Path_Inode(&paths, sorted[i]);
+
+  BTRFS_PathRelease(&paths.files);
+  BTRFS_PathRelease(&paths.dirs);
+  free(sorted);
+  return retVal;
+}
+
+int BTRFS_InodeToPaths(uint64_t inode, BTRFS_PathCallback callback,
+                       void *context) {
+  return BTRFS_InodesToPaths(&inode, 1, callback, context);
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Records from all threads go through one buffer under a lock. Recording is
+// a diagnostic mode, and the lock is cheap next to the read being recorded.
+
+#define RECORD_BUFFER_COUNT 4096
+
+static atomic_int record_active = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *record_file = NULL;
+static uint64_t record_start = 0;
+static int record_failed = 0;
+static BTRFS_IORecord record_buffer[RECORD_BUFFER_COUNT];
+static size_t record_count = 0;
+
+static atomic_uint record_threads = 0;
+static _Thread_local uint32_t record_thread = 0;
+
+// Called with the lock held.
+static void Record_Flush(void) {
+  if (record_count != 0 &&
+      fwrite(record_buffer, sizeof(BTRFS_IORecord), record_count,
+             record_file) != record_count)
+    record_failed = 1;
+  record_count = 0;
+}
+
+int BTRFS_StartIORecord(const char *path) {
+  pthread_mutex_lock(&record_lock);
+  if (record_file != NULL) {
+    pthread_mutex_unlock(&record_lock);
+    return -1;
+  }
+
+  record_file = fopen(path, "wb");
+  if (record_file == NULL) {
+    pthread_mutex_unlock(&record_lock);
+    return -1;
+  }
+
+  BTRFS_IORecordHeader header = {BTRFS_IO_RECORD_MAGIC,
+                                 BTRFS_IO_RECORD_VERSION,
+                                 sizeof(BTRFS_IORecord)};
+  record_failed = fwrite(&header, sizeof(header), 1, record_file) != 1;
+  record_count = 0;
+  record_start = BTRFS_StatsClock();
+
+  BTRFS_SetTraceContext(1);
+  atomic_store(&record_active, 1);
+  pthread_mutex_unlock(&record_lock);
+  return 0;
+}
+
+int BTRFS_StopIORecord(void) {
+  pthread_mutex_lock(&record_lock);
+  if (record_file == NULL) {
+    pthread_mutex_unlock(&record_lock);
+    return -1;
+  }
+
+  atomic_store(&record_active, 0);
+  BTRFS_SetTraceContext(0);
+
+  Record_Flush();
+  if (fclose(record_file) != 0) record_failed = 1;
+  record_file = NULL;
+
+  int retVal = record_failed ? -1 : 0;
+  pthread_mutex_unlock(&record_lock);
+  return retVal;
+}
+
+void BTRFS_RecordIO(uint64_t device, uint64_t offset, uint64_t len,
+                    uint64_t done, uint64_t start, uint64_t duration_ns) {
+  if (!atomic_load_explicit(&record_active, memory_order_relaxed)) return;
+
+  if (record_thread == 0)
+    record_thread = atomic_fetch_add(&record_threads, 1) + 1;
+
+  int node = 0;
+  int api = BTRFS_TraceContext(&node);
+
+  pthread_mutex_lock(&record_lock);
+  // The recording may have stopped since the flag was checked.
+  if (record_file != NULL) {
+    BTRFS_IORecord *record = &record_buffer[record_count++];
+    record->time_ns = start > record_start ? start - record_start : 0;
+    record->offset = offset;
+    record->len = len > UINT32_MAX ? UINT32_MAX : len;
+    record->duration_ns =
+        duration_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ns;
+    record->device = device;
+    record->api = api < 0 ? 0xff : api;
+    record->flags = (node ? BTRFS_IORecordFlag_Node : 0) |
+                    (done != len ? BTRFS_IORecordFlag_Short : 0);
+    record->thread = record_thread - 1;
+
+    if (record_count == RECORD_BUFFER_COUNT) Record_Flush();
+  }
+  pthread_mutex_unlock(&record_lock);
+}
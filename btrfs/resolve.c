@@ -0,0 +1,184 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+#include "crc32c.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *path;
+  size_t index;
+} ResolveEntry;
+
+// The paths of a batch sharing the next component below a directory.
+typedef struct {
+  const char *name;
+  size_t name_len;
+  uint32_t name_hash;
+  size_t lo;
+  size_t hi;
+  uint64_t child;
+} ResolveGroup;
+
+typedef struct {
+  ResolveEntry *entries;
+  uint64_t *out_inodes;
+  BTRFS_Path path;
+  int missing;
+} Resolve;
+
+// Orders paths component by component, so every path below a directory
+// sorts next to the directory itself: '/' sorts before any other character
+// and only the end of the string sorts before it.
+static int Resolve_ComparePaths(const void *a, const void *b) {
+  const unsigned char *x = (const unsigned char *)((ResolveEntry *)a)->path;
+  const unsigned char *y = (const unsigned char *)((ResolveEntry *)b)->path;
+
+  while (*x != '\0' && *x == *y) {
+    x++;
+    y++;
+  }
+
+  int cx = *x == '/' ? 1 : (*x == '\0' ? 0 : *x + 1);
+  int cy = *y == '/' ? 1 : (*y == '\0' ? 0 : *y + 1);
+  return cx - cy;
+}
+
+static int Resolve_CompareGroups(const void *a, const void *b) {
+  const ResolveGroup *x = a, *y = b;
+  if (x->name_hash != y->name_hash) return x->name_hash < y->name_hash ? -1 : 1;
+  return 0;
+}
+
+// Find a name among the entries of one DIR_ITEM, which holds every name of
+// the directory with the same hash.
+static int Resolve_MatchDirItem(uint8_t *data, uint32_t size,
+                                ResolveGroup *group) {
+  uint32_t off = 0;
+
+  while (off + sizeof(BTRFS_DirectoryItem) <= size) {
+    BTRFS_DirectoryItem *dir_item = (BTRFS_DirectoryItem *)(data + off);
+    if (dir_item->name_len == group->name_len &&
+        memcmp(dir_item->name_data, group->name, group->name_len) == 0) {
+      group->child = dir_item->key.object_id;
+      return 1;
+    }
+    off += sizeof(BTRFS_DirectoryItem) + dir_item->name_len +
+           dir_item->data_size;
+  }
+  return 0;
+}
+
+// Look every group's name up in the directory. Groups are visited in hash
+// order, the order of the directory's DIR_ITEM keys, so the searches move
+// forward through the directory and the path re-reads nothing it holds.
+static int Resolve_LookupGroups(Resolve *resolve, uint64_t dir,
+                                ResolveGroup *groups, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    ResolveGroup *group = &groups[i];
+    group->child = 0;
+
+    int found = BTRFS_SidecarLookup(dir, group->name, group->name_len,
+                                    &group->child);
+    if (found != -1) continue;
+
+    BTRFS_Key key = {dir, KeyType_DirItem, group->name_hash};
+    int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, &resolve->path);
+    if (err < 0) return -1;
+    if (err > 0 || BTRFS_CompareKeys(BTRFS_PathKey(&resolve->path), &key) != 0)
+      continue;
+
+    uint32_t size = 0;
+    uint8_t *data = BTRFS_PathItem(&resolve->path, &size);
+    Resolve_MatchDirItem(data, size, group);
+  }
+  return 0;
+}
+
+// Resolve the paths in [lo, hi), which all name dir up to offset.
+static int Resolve_Directory(Resolve *resolve, uint64_t dir, size_t lo,
+                             size_t hi, size_t offset) {
+  ResolveEntry *entries = resolve->entries;
+
+  // Paths ending here name the directory itself, they sort first.
+  while (lo < hi && entries[lo].path[offset] == '\0')
+    resolve->out_inodes[entries[lo++].index] = dir;
+  if (lo == hi) return 0;
+
+  ResolveGroup *groups = malloc((hi - lo) * sizeof(ResolveGroup));
+  if (groups == NULL) return -1;
+
+  size_t count = 0;
+  for (size_t i = lo; i < hi;) {
+    ResolveGroup *group = &groups[count++];
+    group->name = entries[i].path + offset;
+    group->name_len = strcspn(group->name, "/");
+    group->name_hash = ~crc32c(~1, group->name, group->name_len);
+    group->lo = i;
+
+    for (i++; i < hi; i++) {
+      const char *name = entries[i].path + offset;
+      if (strncmp(name, group->name, group->name_len) != 0 ||
+          (name[group->name_len] != '/' && name[group->name_len] != '\0'))
+        break;
+    }
+    group->hi = i;
+  }
+
+  qsort(groups, count, sizeof(ResolveGroup), Resolve_CompareGroups);
+
+  int retVal = Resolve_LookupGroups(resolve, dir, groups, count);
+
+  for (size_t i = 0; retVal == 0 && i < count; i++) {
+    ResolveGroup *group = &groups[i];
+
+    if (group->child == 0) {
+      for (size_t j = group->lo; j < group->hi; j++)
+        resolve->out_inodes[entries[j].index] = 0;
+      resolve->missing += group->hi - group->lo;
+      continue;
+    }
+
+    // Paths continuing below the name skip its '/'; those ending at the name
+    // are handled by the next level as naming the directory itself.
+    size_t next = offset + group->name_len;
+    size_t j = group->lo;
+    while (j < group->hi && entries[j].path[next] == '\0')
+      resolve->out_inodes[entries[j++].index] = group->child;
+    if (j < group->hi)
+      retVal = Resolve_Directory(resolve, group->child, j, group->hi, next + 1);
+  }
+
+  free(groups);
+  return retVal;
+}
+
+int BTRFS_ResolvePaths(const char **paths, size_t count,
+                       uint64_t *out_inodes) {
+  Resolve resolve;
+  memset(&resolve, 0, sizeof(Resolve));
+  resolve.out_inodes = out_inodes;
+
+  resolve.entries = malloc(count * sizeof(ResolveEntry) + 1);
+  if (resolve.entries == NULL) return -1;
+
+  for (size_t i = 0; i < count; i++) {
+    const char *path = paths[i];
+    if (path[0] == '/') path++;
+    resolve.entries[i].path = path;
+    resolve.entries[i].index = i;
+  }
+  qsort(resolve.entries, count, sizeof(ResolveEntry), Resolve_ComparePaths);
+
+  int retVal = Resolve_Directory(&resolve, 256, 0, count, 0);
+
+  BTRFS_PathRelease(&resolve.path);
+  free(resolve.entries);
+  return retVal < 0 ? -1 : resolve.missing;
+}
@@ -6,7 +6,7 @@
  */
 
 #include "btrfs.h"
-#include <stdlib.h>
+#include <string.h>
 
 static uint64_t extent_tree_loc;
 static uint64_t dev_tree_loc;
@@ -22,8 +22,19 @@ uint64_t BTRFS_GetFSTreeLocation(void) { return fs_tree_loc; }
 uint64_t BTRFS_GetChecksumTreeLocation(void) { return checksum_tree_loc; }
 
 int BTRFS_ParseRootTree(void) {
-  BTRFS_Header *children = malloc(BTRFS_GetNodeSize());
+  // With a sidecar the root tree does not need to be read at all.
+  if (BTRFS_SidecarGetRoot(ReservedObjectID_FSTree, &fs_tree_loc, NULL) != -1) {
+    BTRFS_SidecarGetRoot(ReservedObjectID_ExtentTree, &extent_tree_loc, NULL);
+    BTRFS_SidecarGetRoot(ReservedObjectID_DevTree, &dev_tree_loc, NULL);
+    BTRFS_SidecarGetRoot(ReservedObjectID_ChecksumTree, &checksum_tree_loc,
+                         NULL);
+    return 0;
+  }
+
+  BTRFS_Header *children = BTRFS_Alloc(BTRFS_GetNodeSize());
+  if (children == NULL) return -1;
   if (BTRFS_GetNode(children, BTRFS_GetRootTreeBlockAddress()) != 0) {
+    BTRFS_Free(children, BTRFS_GetNodeSize());
     return -1;
   }
 
@@ -55,6 +66,81 @@ int BTRFS_ParseRootTree(void) {
     chunk_entry++;
   }
 
-  free(children);
+  BTRFS_Free(children, BTRFS_GetNodeSize());
+  return 0;
+}
+
+static int BTRFS_FindRootItem(BTRFS_Header *parent, uint64_t tree_id,
+                              BTRFS_RootItem *item) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  if (parent->level == 0) {
+    BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(parent + 1);
+
+    for (int i = 0; i < parent->item_count; i++) {
+      if (chunk_entry->key.object_id == tree_id &&
+          chunk_entry->key.type == KeyType_RootItem) {
+        memcpy(item,
+               (uint8_t *)parent + sizeof(BTRFS_Header) +
+                   chunk_entry->data_offset,
+               sizeof(BTRFS_RootItem));
+        return 1;
+      }
+      chunk_entry++;
+    }
+    return 0;
+  }
+
+  BTRFS_Header *children = BTRFS_Alloc(node_size);
+  if (children == NULL) return -1;
+  BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(parent + 1);
+
+  for (uint64_t i = 0; i < parent->item_count; i++) {
+    // Only the subtree that can hold the key needs to be visited.
+    if (i + 1 < parent->item_count && key_ptr[1].key.object_id < tree_id) {
+      key_ptr++;
+      continue;
+    }
+    if (key_ptr->key.object_id > tree_id) break;
+
+    if (BTRFS_GetNode(children, key_ptr->block_number) != 0) {
+      BTRFS_Free(children, node_size);
+      return -1;
+    }
+
+    int retVal = BTRFS_FindRootItem(children, tree_id, item);
+    if (retVal != 0) {
+      BTRFS_Free(children, node_size);
+      return retVal;
+    }
+
+    key_ptr++;
+  }
+
+  BTRFS_Free(children, node_size);
+  return 0;
+}
+
+int BTRFS_GetTreeRoot(uint64_t tree_id, uint64_t *root_addr,
+                      uint64_t *generation) {
+  int err = BTRFS_SidecarGetRoot(tree_id, root_addr, generation);
+  if (err != -1) return err;
+
+  BTRFS_Header *children = BTRFS_Alloc(BTRFS_GetNodeSize());
+  if (children == NULL) return -1;
+  if (BTRFS_GetNode(children, BTRFS_GetRootTreeBlockAddress()) != 0) {
+    BTRFS_Free(children, BTRFS_GetNodeSize());
+    return -1;
+  }
+
+  BTRFS_RootItem item;
+  int retVal = BTRFS_FindRootItem(children, tree_id, &item);
+  BTRFS_Free(children, BTRFS_GetNodeSize());
+
+  if (retVal < 0) return -1;
+  if (retVal == 0) return -2;
+
+  *root_addr = item.root_block_num;
+  if (generation != NULL) *generation = item.expected_generation;
   return 0;
-}
\ No newline at end of file
+}
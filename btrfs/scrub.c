@@ -0,0 +1,521 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tree blocks are found from the extent tree rather than by walking every
+// tree, so blocks of trees that are no longer reachable from the roots are
+// checked too, and nothing is read twice. The list is sorted by physical
+// address and split into reads the way batch_read.c splits file extents.
+
+// Blocks are read together across gaps up to this size.
+#define SCRUB_MERGE_GAP (128 * 1024)
+
+// Largest single read.
+#define SCRUB_READ_SIZE (4 * 1024 * 1024)
+
+#define SCRUB_MAX_THREADS 64
+
+typedef struct {
+  uint64_t logical;
+  uint64_t generation;
+  uint64_t device_id;
+  uint64_t physical_addr;
+  uint8_t level;
+} ScrubBlock;
+
+// Each worker of the extent tree walk lists the blocks of the leaves it
+// visits on its own, the lists are joined once the walk is done.
+typedef struct {
+  ScrubBlock *blocks;
+  size_t count;
+  size_t capacity;
+} ScrubList;
+
+typedef struct {
+  ScrubBlock *blocks;
+  size_t *spans;
+  size_t span_count;
+  uint8_t fsid[UUID_LEN];
+  atomic_size_t next;
+} ScrubReaders;
+
+typedef struct {
+  ScrubReaders *readers;
+  BTRFS_MetadataScrub result;
+} ScrubReader;
+
+static int Scrub_AddBlock(ScrubList *list, const ScrubBlock *block) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    ScrubBlock *grown = realloc(list->blocks, capacity * sizeof(ScrubBlock));
+    if (grown == NULL) return -1;
+    list->blocks = grown;
+    list->capacity = capacity;
+  }
+  list->blocks[list->count++] = *block;
+  return 0;
+}
+
+static int Scrub_VisitLeaf(BTRFS_Header *leaf, int worker, void *context) {
+  ScrubList *list = (ScrubList *)context + worker;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    BTRFS_Key *key = &chunk_entry->key;
+    if (key->type != KeyType_ExtentItem && key->type != KeyType_MetadataItem)
+      continue;
+
+    BTRFS_ExtentItem *extent_item =
+        (BTRFS_ExtentItem *)((uint8_t *)leaf + sizeof(BTRFS_Header) +
+                             chunk_entry->data_offset);
+    ScrubBlock block = {key->object_id, extent_item->generation, 0, 0, 0};
+
+    // Skinny metadata keys hold the level, tree blocks without skinny
+    // metadata keep it after the extent item.
+    if (key->type == KeyType_MetadataItem) {
+      block.level = key->offset;
+    } else if (extent_item->flags & ExtentFlag_TreeBlock) {
+      BTRFS_TreeBlockInfo *info = (BTRFS_TreeBlockInfo *)(extent_item + 1);
+      block.level = info->level;
+    } else {
+      continue;
+    }
+
+    if (Scrub_AddBlock(list, &block) != 0) return -1;
+  }
+  return 0;
+}
+
+static int Scrub_ComparePhysical(const void *a, const void *b) {
+  const ScrubBlock *x = a, *y = b;
+  if (x->device_id != y->device_id) return x->device_id < y->device_id ? -1 : 1;
+  if (x->physical_addr != y->physical_addr)
+    return x->physical_addr < y->physical_addr ? -1 : 1;
+  return 0;
+}
+
+static void Scrub_CheckBlock(ScrubReaders *readers, const ScrubBlock *block,
+                             BTRFS_Header *node,
+                             BTRFS_MetadataScrub *result) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  uint64_t start = BTRFS_StatsClock();
+  uint32_t crc = crc32c(-1, node->uuid, node_size - 0x20);
+  BTRFS_STAT(checksum_bytes, node_size - 0x20);
+  BTRFS_STAT(checksum_ns, BTRFS_StatsClock() - start);
+
+  if (crc != *(uint32_t *)node->csum) result->csum_errors++;
+  if (node->logical_address != block->logical) result->address_errors++;
+  if (memcmp(node->uuid, readers->fsid, UUID_LEN) != 0) result->fsid_errors++;
+  if (node->level != block->level) result->level_errors++;
+  if (node->generation != block->generation) result->generation_errors++;
+}
+
+// Read the blocks from first up to, not including, last with one read, and
+// check them. A failed read is retried a block at a time, so one bad sector
+// does not fail the blocks around it.
+static void Scrub_ReadSpan(ScrubReaders *readers, size_t first, size_t last,
+                           uint8_t *buf, BTRFS_MetadataScrub *result) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  ScrubBlock *blocks = readers->blocks;
+  uint64_t start = blocks[first].physical_addr;
+  uint64_t end = blocks[last - 1].physical_addr + node_size;
+
+  bool whole = BTRFS_ReadRaw(buf, blocks[first].device_id, start,
+                             end - start) == end - start;
+
+  for (size_t i = first; i < last; i++) {
+    uint8_t *node = buf + (blocks[i].physical_addr - start);
+    result->blocks++;
+    result->bytes += node_size;
+
+    if (!whole && BTRFS_ReadRaw(node, blocks[i].device_id,
+                                blocks[i].physical_addr,
+                                node_size) != node_size)
+      result->read_errors++;
+    else
+      Scrub_CheckBlock(readers, &blocks[i], (BTRFS_Header *)node, result);
+  }
+}
+
+static void *Scrub_ReadThread(void *arg) {
+  ScrubReader *reader = arg;
+  ScrubReaders *readers = reader->readers;
+  uint8_t *buf = malloc(SCRUB_READ_SIZE + SCRUB_MERGE_GAP);
+
+  while (1) {
+    size_t span = atomic_fetch_add(&readers->next, 1);
+    if (span >= readers->span_count) break;
+
+    size_t first = readers->spans[span], last = readers->spans[span + 1];
+    if (buf == NULL) {
+      reader->result.blocks += last - first;
+      reader->result.read_errors += last - first;
+      continue;
+    }
+    Scrub_ReadSpan(readers, first, last, buf, &reader->result);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Split the sorted blocks into reads. Blocks join a read while they start
+// within the merge gap of its end and the read stays within the buffer.
+static size_t Scrub_SplitSpans(ScrubBlock *blocks, size_t count,
+                               size_t *spans) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  size_t span_count = 0;
+  size_t first = 0;
+
+  while (first < count) {
+    ScrubBlock *head = &blocks[first];
+    uint64_t end = head->physical_addr + node_size;
+    size_t last = first + 1;
+
+    for (; last < count; last++) {
+      ScrubBlock *block = &blocks[last];
+      if (block->device_id != head->device_id ||
+          block->physical_addr > end + SCRUB_MERGE_GAP ||
+          block->physical_addr + node_size - head->physical_addr >
+              SCRUB_READ_SIZE + SCRUB_MERGE_GAP)
+        break;
+      end = block->physical_addr + node_size;
+    }
+
+    spans[span_count++] = first;
+    first = last;
+  }
+  spans[span_count] = count;
+  return span_count;
+}
+
+// Translate the blocks, counting those that cannot be as read errors and
+// dropping them, then sort the rest by where they are.
+static size_t Scrub_Translate(ScrubBlock *blocks, size_t count,
+                              BTRFS_MetadataScrub *result) {
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    BTRFS_PhysicalAddress p_addr = {0, 0};
+    if (BTRFS_TranslateLogicalAddress(blocks[i].logical, &p_addr) != 0) {
+      result->blocks++;
+      result->read_errors++;
+      continue;
+    }
+    blocks[i].device_id = p_addr.device_id;
+    blocks[i].physical_addr = p_addr.physical_addr;
+    blocks[kept++] = blocks[i];
+  }
+
+  qsort(blocks, kept, sizeof(ScrubBlock), Scrub_ComparePhysical);
+  return kept;
+}
+
+static void Scrub_AddResult(BTRFS_MetadataScrub *total,
+                            const BTRFS_MetadataScrub *result) {
+  total->blocks += result->blocks;
+  total->bytes += result->bytes;
+  total->read_errors += result->read_errors;
+  total->csum_errors += result->csum_errors;
+  total->address_errors += result->address_errors;
+  total->fsid_errors += result->fsid_errors;
+  total->level_errors += result->level_errors;
+  total->generation_errors += result->generation_errors;
+}
+
+int BTRFS_ScrubMetadata(int threads, BTRFS_MetadataScrub *result) {
+  memset(result, 0, sizeof(BTRFS_MetadataScrub));
+  if (threads < 1) threads = 1;
+  if (threads > SCRUB_MAX_THREADS) threads = SCRUB_MAX_THREADS;
+
+  ScrubList *lists = calloc(threads, sizeof(ScrubList));
+  if (lists == NULL) return -1;
+
+  int retVal = BTRFS_ParallelWalk(BTRFS_GetExtentTreeLocation(), threads,
+                                  Scrub_VisitLeaf, lists);
+
+  size_t total = 0;
+  for (int i = 0; i < threads; i++) total += lists[i].count;
+
+  ScrubReaders readers;
+  readers.blocks = retVal == 0 ? malloc(total * sizeof(ScrubBlock) + 1) : NULL;
+  readers.spans = retVal == 0 ? malloc((total + 1) * sizeof(size_t)) : NULL;
+  if (readers.blocks == NULL || readers.spans == NULL) retVal = -1;
+
+  size_t count = 0;
+  for (int i = 0; i < threads; i++) {
+    if (retVal == 0) {
+      memcpy(readers.blocks + count, lists[i].blocks,
+             lists[i].count * sizeof(ScrubBlock));
+      count += lists[i].count;
+    }
+    free(lists[i].blocks);
+  }
+  free(lists);
+
+  if (retVal != 0) {
+    free(readers.blocks);
+    free(readers.spans);
+    return -1;
+  }
+
+  count = Scrub_Translate(readers.blocks, count, result);
+  readers.span_count = Scrub_SplitSpans(readers.blocks, count, readers.spans);
+  BTRFS_GetFSID(readers.fsid);
+  atomic_init(&readers.next, 0);
+
+  pthread_t handles[SCRUB_MAX_THREADS];
+  ScrubReader workers[SCRUB_MAX_THREADS];
+  memset(workers, 0, sizeof(ScrubReader) * threads);
+  int started = 0;
+
+  for (int i = 1; i < threads && (size_t)i < readers.span_count; i++) {
+    workers[i].readers = &readers;
+    if (pthread_create(&handles[i], NULL, Scrub_ReadThread, &workers[i]) != 0)
+      break;
+    started = i;
+  }
+
+  // The calling thread is reader 0.
+  workers[0].readers = &readers;
+  Scrub_ReadThread(&workers[0]);
+
+  for (int i = 1; i <= started; i++) pthread_join(handles[i], NULL);
+  for (int i = 0; i <= started; i++)
+    Scrub_AddResult(result, &workers[i].result);
+
+  free(readers.blocks);
+  free(readers.spans);
+  return 0;
+}
+
+// An incremental scrub walks the checksum tree in key order, so its
+// position is the logical address its items have been verified up to.
+// Subtrees whose pointer generation is older than the pass's are skipped
+// without being read: copy on write gives every changed block, and every
+// block above it, the generation of the transaction that changed it.
+
+#define SCRUB_CHECKPOINT_MAGIC "BTRFSSCP"
+#define SCRUB_CHECKPOINT_VERSION 1
+
+// Data is read and checked this many bytes at a time.
+#define SCRUB_DATA_SIZE (1024 * 1024)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t complete;
+  uint8_t fsid[UUID_LEN];
+  uint64_t since;
+  uint64_t generation;
+  uint64_t position;
+  uint64_t sectors;
+  uint64_t errors;
+} ScrubCheckpointFile;
+
+typedef struct {
+  BTRFS_ScrubCheckpoint *checkpoint;
+  BTRFS_ScrubProgress progress;
+  void *context;
+  uint8_t *data;
+  uint32_t *sums;
+} ScrubPass;
+
+static void Scrub_VerifyItem(ScrubPass *pass, uint64_t logical,
+                             const uint32_t *csums, uint64_t count) {
+  uint32_t sector_size = BTRFS_GetSectorSize();
+  uint64_t per_read = SCRUB_DATA_SIZE / sector_size;
+  BTRFS_ScrubCheckpoint *checkpoint = pass->checkpoint;
+
+  for (uint64_t done = 0; done < count;) {
+    uint64_t n = count - done < per_read ? count - done : per_read;
+    uint64_t len = n * sector_size;
+
+    if (BTRFS_Read(pass->data, logical + done * sector_size, len) != len) {
+      checkpoint->errors += n;
+    } else {
+      uint64_t start = BTRFS_StatsClock();
+      crc32c_sectors(pass->data, sector_size, n, pass->sums);
+      BTRFS_STAT(checksum_bytes, len);
+      BTRFS_STAT(checksum_ns, BTRFS_StatsClock() - start);
+
+      for (uint64_t i = 0; i < n; i++)
+        if (memcmp(&pass->sums[i], &csums[done + i], sizeof(uint32_t)) != 0)
+          checkpoint->errors++;
+    }
+    checkpoint->sectors += n;
+    done += n;
+  }
+}
+
+static int Scrub_VerifyLeaf(ScrubPass *pass, BTRFS_Header *leaf) {
+  BTRFS_ScrubCheckpoint *checkpoint = pass->checkpoint;
+  BTRFS_ItemPointer *items = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++) {
+    if (items[i].key.object_id != BTRFS_ExtentChecksumObjectID ||
+        items[i].key.type != KeyType_ExtentChecksum ||
+        items[i].key.offset < checkpoint->position)
+      continue;
+
+    uint64_t count = items[i].data_size / sizeof(uint32_t);
+    Scrub_VerifyItem(pass, items[i].key.offset,
+                     (uint32_t *)((uint8_t *)leaf + sizeof(BTRFS_Header) +
+                                  items[i].data_offset),
+                     count);
+    checkpoint->position =
+        items[i].key.offset + count * BTRFS_GetSectorSize();
+  }
+
+  return pass->progress != NULL ? pass->progress(checkpoint, pass->context)
+                                : 0;
+}
+
+static int Scrub_VisitNode(ScrubPass *pass, BTRFS_Header *node) {
+  if (node->level == 0) return Scrub_VerifyLeaf(pass, node);
+
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(node + 1);
+  BTRFS_Key position = {BTRFS_ExtentChecksumObjectID, KeyType_ExtentChecksum,
+                        pass->checkpoint->position};
+
+  // A child is skipped if it is older than the pass, or if the next child
+  // starts at or before the position, so that it has all been verified.
+  uint32_t first = 0;
+  while (first + 1 < node->item_count &&
+         BTRFS_CompareKeys(&key_ptr[first + 1].key, &position) <= 0)
+    first++;
+
+  for (uint32_t i = first; i < node->item_count; i++)
+    if (key_ptr[i].generation >= pass->checkpoint->since)
+      BTRFS_Prefetch(key_ptr[i].block_number, node_size);
+
+  BTRFS_Header *child = BTRFS_Alloc(node_size);
+  if (child == NULL) return -1;
+
+  int retVal = 0;
+  for (uint32_t i = first; retVal == 0 && i < node->item_count; i++) {
+    if (key_ptr[i].generation < pass->checkpoint->since) continue;
+
+    if (BTRFS_GetNode(child, key_ptr[i].block_number) != 0 ||
+        child->level != node->level - 1 ||
+        child->generation != key_ptr[i].generation)
+      retVal = -1;
+    else
+      retVal = Scrub_VisitNode(pass, child);
+  }
+
+  BTRFS_Free(child, node_size);
+  return retVal;
+}
+
+void BTRFS_StartScrubCheckpoint(BTRFS_ScrubCheckpoint *checkpoint,
+                                uint64_t since) {
+  memset(checkpoint, 0, sizeof(BTRFS_ScrubCheckpoint));
+  checkpoint->since = since;
+  checkpoint->generation = BTRFS_GetGeneration();
+}
+
+int BTRFS_ScrubResume(BTRFS_ScrubCheckpoint *checkpoint,
+                      BTRFS_ScrubProgress progress, void *context) {
+  if (checkpoint->complete) return 0;
+
+  uint32_t node_size = BTRFS_GetNodeSize();
+  ScrubPass pass = {checkpoint, progress, context, NULL, NULL};
+  pass.data = malloc(SCRUB_DATA_SIZE);
+  pass.sums = malloc(SCRUB_DATA_SIZE / BTRFS_GetSectorSize() *
+                     sizeof(uint32_t));
+  BTRFS_Header *root = BTRFS_Alloc(node_size);
+
+  int retVal = -1;
+  if (pass.data != NULL && pass.sums != NULL && root != NULL &&
+      BTRFS_GetNode(root, BTRFS_GetChecksumTreeLocation()) == 0)
+    retVal = root->generation < checkpoint->since
+                 ? 0
+                 : Scrub_VisitNode(&pass, root);
+  if (retVal == 0) checkpoint->complete = 1;
+
+  BTRFS_Free(root, node_size);
+  free(pass.sums);
+  free(pass.data);
+  return retVal;
+}
+
+uint64_t BTRFS_ScrubSince(uint64_t generation) {
+  BTRFS_ScrubCheckpoint checkpoint;
+  BTRFS_StartScrubCheckpoint(&checkpoint, generation);
+  if (BTRFS_ScrubResume(&checkpoint, NULL, NULL) != 0) checkpoint.errors++;
+  return checkpoint.errors;
+}
+
+int BTRFS_LoadScrubCheckpoint(const char *path,
+                              BTRFS_ScrubCheckpoint *checkpoint) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return -1;
+
+  ScrubCheckpointFile file;
+  uint8_t fsid[UUID_LEN];
+  BTRFS_GetFSID(fsid);
+
+  int retVal = -1;
+  if (fread(&file, sizeof(file), 1, f) == 1 &&
+      memcmp(file.magic, SCRUB_CHECKPOINT_MAGIC, sizeof(file.magic)) == 0 &&
+      file.version == SCRUB_CHECKPOINT_VERSION &&
+      memcmp(file.fsid, fsid, UUID_LEN) == 0) {
+    checkpoint->since = file.since;
+    checkpoint->generation = file.generation;
+    checkpoint->position = file.position;
+    checkpoint->sectors = file.sectors;
+    checkpoint->errors = file.errors;
+    checkpoint->complete = file.complete;
+    retVal = 0;
+  }
+  fclose(f);
+  return retVal;
+}
+
+int BTRFS_SaveScrubCheckpoint(const char *path,
+                              const BTRFS_ScrubCheckpoint *checkpoint) {
+  ScrubCheckpointFile file;
+  memset(&file, 0, sizeof(file));
+  memcpy(file.magic, SCRUB_CHECKPOINT_MAGIC, sizeof(file.magic));
+  file.version = SCRUB_CHECKPOINT_VERSION;
+  file.complete = checkpoint->complete;
+  BTRFS_GetFSID(file.fsid);
+  file.since = checkpoint->since;
+  file.generation = checkpoint->generation;
+  file.position = checkpoint->position;
+  file.sectors = checkpoint->sectors;
+  file.errors = checkpoint->errors;
+
+  // Written under a temporary name and renamed into place, so a scrub
+  // stopped while saving still has the previous checkpoint.
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp_path = malloc(tmp_len);
+  if (tmp_path == NULL) return -1;
+  snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+  int retVal = -1;
+  FILE *f = fopen(tmp_path, "wb");
+  if (f != NULL) {
+    bool ok = fwrite(&file, sizeof(file), 1, f) == 1;
+    if (fclose(f) == 0 && ok && rename(tmp_path, path) == 0) retVal = 0;
+    if (retVal != 0) remove(tmp_path);
+  }
+
+  free(tmp_path);
+  return retVal;
+}
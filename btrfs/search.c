@@ -0,0 +1,189 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+// Index of the last entry whose key is at most the given key, -1 if the
+// first entry is already larger. Works on both node kinds through the
+// entry stride.
+static int BTRFS_SearchNode(BTRFS_Header *node, const BTRFS_Key *key) {
+  size_t stride =
+      node->level == 0 ? sizeof(BTRFS_ItemPointer) : sizeof(BTRFS_KeyPointer);
+  uint8_t *entries = (uint8_t *)(node + 1);
+  int lo = 0, hi = node->item_count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (BTRFS_CompareKeys((BTRFS_Key *)(entries + mid * stride), key) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+int BTRFS_SearchTree(uint64_t root, const BTRFS_Key *key, BTRFS_Header *leaf,
+                     int *slot) {
+  uint64_t block = root;
+
+  for (int depth = 0; depth < BTRFS_MAX_LEVEL; depth++) {
+    if (BTRFS_GetNode(leaf, block) != 0) return -1;
+
+    int index = BTRFS_SearchNode(leaf, key);
+    if (leaf->level == 0) {
+      if (index < 0) return -2;
+      *slot = index;
+      return 0;
+    }
+
+    // Keys before the first pointer can only be in its subtree.
+    if (index < 0) index = 0;
+    if (index >= (int)leaf->item_count) return -1;
+    block = ((BTRFS_KeyPointer *)(leaf + 1))[index].block_number;
+  }
+
+  return -1;
+}
+
+void BTRFS_PathRelease(BTRFS_Path *path) {
+  for (int i = 0; i < BTRFS_MAX_LEVEL; i++) {
+    BTRFS_Free(path->nodes[i], BTRFS_GetNodeSize());
+    path->nodes[i] = NULL;
+  }
+  path->root = 0;
+}
+
+// Make the path's node at a level hold the given block. Reading is skipped
+// when it already does, which is common as successive searches of a batch
+// share most of their way down.
+static int BTRFS_PathLoad(BTRFS_Path *path, int level, uint64_t block) {
+  BTRFS_Header *node = path->nodes[level];
+
+  if (node == NULL) {
+    node = path->nodes[level] = BTRFS_Alloc(BTRFS_GetNodeSize());
+    if (node == NULL) return -1;
+  } else if (node->logical_address == block && node->level == level) {
+    BTRFS_STAT(path_hits, 1);
+    return 0;
+  }
+  BTRFS_STAT(path_misses, 1);
+
+  if (BTRFS_GetNode(node, block) != 0 || node->level != level) {
+    node->logical_address = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Move to the first item of the next leaf once the current one is used up.
+static int BTRFS_PathNextLeaf(BTRFS_Path *path) {
+  int level = 0;
+
+  while (path->slots[level] >= (int)path->nodes[level]->item_count) {
+    if (level == path->root_level) {
+      // Leave the path on the last leaf, one past its end, so stepping
+      // back still works.
+      while (level > 0) path->slots[level--]--;
+      return 1;
+    }
+    level++;
+    path->slots[level]++;
+  }
+
+  while (level > 0) {
+    BTRFS_KeyPointer *key_ptr =
+        (BTRFS_KeyPointer *)(path->nodes[level] + 1) + path->slots[level];
+    level--;
+    if (BTRFS_PathLoad(path, level, key_ptr->block_number) != 0) return -1;
+    path->slots[level] = 0;
+
+    // Empty nodes only occur in an empty tree's root, but do not loop on
+    // them if they show up anywhere else.
+    if (path->nodes[level]->item_count == 0) return BTRFS_PathNextLeaf(path);
+  }
+  return 0;
+}
+
+int BTRFS_SearchPath(uint64_t root, const BTRFS_Key *key, BTRFS_Path *path) {
+  // The root's level decides where its buffer goes, so a new root is read
+  // aside first and then moved into place.
+  if (path->root != root) {
+    BTRFS_Header *node = BTRFS_Alloc(BTRFS_GetNodeSize());
+    if (node == NULL) return -1;
+    if (BTRFS_GetNode(node, root) != 0 || node->level >= BTRFS_MAX_LEVEL) {
+      BTRFS_Free(node, BTRFS_GetNodeSize());
+      return -1;
+    }
+
+    BTRFS_Free(path->nodes[node->level], BTRFS_GetNodeSize());
+    path->nodes[node->level] = node;
+    path->root = root;
+    path->root_level = node->level;
+  }
+
+  int level = path->root_level;
+
+  for (;;) {
+    BTRFS_Header *node = path->nodes[level];
+    int index = BTRFS_SearchNode(node, key);
+
+    if (level == 0) {
+      // Step past the last smaller key to the first one at least as large.
+      if (index < 0 ||
+          BTRFS_CompareKeys(&((BTRFS_ItemPointer *)(node + 1))[index].key,
+                            key) != 0)
+        index++;
+      path->slots[0] = index;
+      return BTRFS_PathNextLeaf(path);
+    }
+
+    // Keys before the first pointer can only be in its subtree.
+    if (index < 0) index = 0;
+    if (index >= (int)node->item_count) return -1;
+    path->slots[level] = index;
+
+    uint64_t block = ((BTRFS_KeyPointer *)(node + 1))[index].block_number;
+    level--;
+    if (BTRFS_PathLoad(path, level, block) != 0) return -1;
+  }
+}
+
+int BTRFS_NextItem(BTRFS_Path *path) {
+  path->slots[0]++;
+  return BTRFS_PathNextLeaf(path);
+}
+
+int BTRFS_PrevItem(BTRFS_Path *path) {
+  int level = 0;
+
+  while (path->slots[level] == 0) {
+    if (level == path->root_level) return 1;
+    level++;
+  }
+  path->slots[level]--;
+
+  while (level > 0) {
+    BTRFS_KeyPointer *key_ptr =
+        (BTRFS_KeyPointer *)(path->nodes[level] + 1) + path->slots[level];
+    level--;
+    if (BTRFS_PathLoad(path, level, key_ptr->block_number) != 0) return -1;
+    if (path->nodes[level]->item_count == 0) return -1;
+    path->slots[level] = path->nodes[level]->item_count - 1;
+  }
+  return 0;
+}
+
+BTRFS_Key *BTRFS_PathKey(BTRFS_Path *path) {
+  return &((BTRFS_ItemPointer *)(path->nodes[0] + 1))[path->slots[0]].key;
+}
+
+void *BTRFS_PathItem(BTRFS_Path *path, uint32_t *size) {
+  BTRFS_ItemPointer *item =
+      (BTRFS_ItemPointer *)(path->nodes[0] + 1) + path->slots[0];
+  if (size != NULL) *size = item->data_size;
+  return (uint8_t *)path->nodes[0] + sizeof(BTRFS_Header) + item->data_offset;
+}
@@ -0,0 +1,25 @@
+#ifndef _BTRFS_SHA256_H_
+#define _BTRFS_SHA256_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  size_t used;
+} sha256_ctx;
+
+void
+sha256_init(sha256_ctx *ctx);
+
+void
+sha256_update(sha256_ctx *ctx, const void *buf, size_t len);
+
+void
+sha256_final(sha256_ctx *ctx, uint8_t *digest);
+
+#endif
@@ -0,0 +1,545 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "btrfs.h"
+#include "crc32c.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A sidecar caches everything needed to open a volume and resolve paths and
+// file extents without touching the trees: the chunk map, the root items,
+// one hash table of directory entries for the FS tree and the FS tree's file
+// extent items sorted by (inode, offset). Records are fixed size and
+// reference a shared heap for names and raw extent items, so the file is
+// used in place after mmap.
+
+#define SIDECAR_MAGIC "BTRFSSDC"
+// Version 2 widened directory entries' name offsets, which wrapped once
+// the heap passed 4GiB.
+#define SIDECAR_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint8_t fsid[UUID_LEN];
+  uint64_t generation;
+  uint64_t chunk_offset;
+  uint64_t chunk_count;
+  uint64_t root_offset;
+  uint64_t root_count;
+  uint64_t dir_offset;
+  uint64_t dir_buckets;
+  uint64_t extent_offset;
+  uint64_t extent_count;
+  uint64_t heap_offset;
+  uint64_t heap_bytes;
+} SidecarHeader;
+
+typedef struct {
+  uint64_t logical_addr;
+  uint64_t length;
+  uint64_t device_id;
+  uint64_t physical_addr;
+} SidecarChunk;
+
+typedef struct {
+  uint64_t tree_id;
+  uint64_t root_addr;
+  uint64_t generation;
+  uint64_t level;
+} SidecarRoot;
+
+// An empty bucket has dir == 0, which no directory inode uses.
+typedef struct {
+  uint64_t dir;
+  uint64_t child;
+  uint64_t name_off;
+  uint32_t name_hash;
+  uint16_t name_len;
+  uint16_t rsv;
+} SidecarDirEntry;
+
+typedef struct {
+  uint64_t inode;
+  uint64_t file_offset;
+  uint64_t file_length;
+  uint64_t item_off;
+  uint32_t item_size;
+  uint32_t rsv;
+} SidecarExtent;
+
+static uint8_t *sidecar_map = NULL;
+static size_t sidecar_size = 0;
+
+static SidecarHeader *Sidecar_Header(void) {
+  return (SidecarHeader *)sidecar_map;
+}
+
+static void *Sidecar_Section(uint64_t offset) { return sidecar_map + offset; }
+
+static uint64_t Sidecar_Bucket(uint64_t dir, uint32_t name_hash,
+                               uint64_t buckets) {
+  uint64_t h = (dir ^ ((uint64_t)name_hash << 32 | name_hash)) *
+               0x9E3779B97F4A7C15ull;
+  return (h >> 17) & (buckets - 1);
+}
+
+static bool Sidecar_SectionFits(uint64_t offset, uint64_t count,
+                                uint64_t size) {
+  if (count > sidecar_size / size) return false;
+  return offset <= sidecar_size && count * size <= sidecar_size - offset;
+}
+
+void BTRFS_CloseSidecar(void) {
+  if (sidecar_map != NULL) munmap(sidecar_map, sidecar_size);
+  sidecar_map = NULL;
+  sidecar_size = 0;
+}
+
+int BTRFS_OpenSidecar(const char *path) {
+  BTRFS_CloseSidecar();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SidecarHeader)) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  sidecar_map = map;
+  sidecar_size = st.st_size;
+
+  SidecarHeader *hdr = Sidecar_Header();
+  uint8_t fsid[UUID_LEN];
+  BTRFS_GetFSID(fsid);
+
+  if (memcmp(hdr->magic, SIDECAR_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != SIDECAR_VERSION ||
+      !Sidecar_SectionFits(hdr->chunk_offset, hdr->chunk_count,
+                           sizeof(SidecarChunk)) ||
+      !Sidecar_SectionFits(hdr->root_offset, hdr->root_count,
+                           sizeof(SidecarRoot)) ||
+      !Sidecar_SectionFits(hdr->dir_offset, hdr->dir_buckets,
+                           sizeof(SidecarDirEntry)) ||
+      hdr->dir_buckets == 0 || (hdr->dir_buckets & (hdr->dir_buckets - 1)) ||
+      !Sidecar_SectionFits(hdr->extent_offset, hdr->extent_count,
+                           sizeof(SidecarExtent)) ||
+      !Sidecar_SectionFits(hdr->heap_offset, hdr->heap_bytes, 1)) {
+    BTRFS_CloseSidecar();
+    return -1;
+  }
+
+  // Anything committed since the sidecar was written may have moved.
+  if (memcmp(hdr->fsid, fsid, UUID_LEN) != 0 ||
+      hdr->generation != BTRFS_GetGeneration() ||
+      hdr->node_size != BTRFS_GetNodeSize()) {
+    BTRFS_CloseSidecar();
+    return -2;
+  }
+
+  return 0;
+}
+
+int BTRFS_SidecarLoadChunks(void) {
+  if (sidecar_map == NULL) return -1;
+
+  SidecarChunk *chunks = Sidecar_Section(Sidecar_Header()->chunk_offset);
+  for (uint64_t i = 0; i < Sidecar_Header()->chunk_count; i++)
+    BTRFS_AddMappingToCache(chunks[i].logical_addr, chunks[i].device_id,
+                            chunks[i].physical_addr, chunks[i].length);
+  return 0;
+}
+
+int BTRFS_SidecarGetRoot(uint64_t tree_id, uint64_t *root_addr,
+                         uint64_t *generation) {
+  if (sidecar_map == NULL) return -1;
+
+  SidecarRoot *roots = Sidecar_Section(Sidecar_Header()->root_offset);
+  uint64_t lo = 0, hi = Sidecar_Header()->root_count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (roots[mid].tree_id < tree_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == Sidecar_Header()->root_count || roots[lo].tree_id != tree_id)
+    return -2;
+
+  *root_addr = roots[lo].root_addr;
+  if (generation != NULL) *generation = roots[lo].generation;
+  return 0;
+}
+
+int BTRFS_SidecarLookup(uint64_t dir, const char *name, size_t name_len,
+                        uint64_t *child) {
+  if (sidecar_map == NULL) return -1;
+
+  SidecarHeader *hdr = Sidecar_Header();
+  SidecarDirEntry *table = Sidecar_Section(hdr->dir_offset);
+  const char *heap = Sidecar_Section(hdr->heap_offset);
+  uint32_t name_hash = ~crc32c(~1, name, name_len);
+
+  uint64_t bucket = Sidecar_Bucket(dir, name_hash, hdr->dir_buckets);
+  for (uint64_t i = 0; i < hdr->dir_buckets; i++) {
+    SidecarDirEntry *entry = &table[(bucket + i) & (hdr->dir_buckets - 1)];
+    if (entry->dir == 0) break;
+
+    if (entry->dir == dir && entry->name_hash == name_hash &&
+        entry->name_len == name_len &&
+        entry->name_off + name_len <= hdr->heap_bytes &&
+        memcmp(heap + entry->name_off, name, name_len) == 0) {
+      *child = entry->child;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int BTRFS_SidecarGetExtent(uint64_t inode, uint64_t offset,
+                           BTRFS_ExtentDataInline *node, uint64_t *node_off,
+                           uint32_t *node_size) {
+  if (sidecar_map == NULL) return -1;
+
+  SidecarHeader *hdr = Sidecar_Header();
+  SidecarExtent *extents = Sidecar_Section(hdr->extent_offset);
+  const uint8_t *heap = Sidecar_Section(hdr->heap_offset);
+
+  // Find the last extent starting at or before the offset.
+  uint64_t lo = 0, hi = hdr->extent_count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (extents[mid].inode < inode ||
+        (extents[mid].inode == inode && extents[mid].file_offset <= offset))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // When it ends before the offset, the offset is in a hole and the next
+  // extent is the one wanted.
+  if (lo > 0 && extents[lo - 1].inode == inode &&
+      offset - extents[lo - 1].file_offset < extents[lo - 1].file_length)
+    lo--;
+  if (lo == hdr->extent_count) return 0;
+
+  SidecarExtent *extent = &extents[lo];
+  if (extent->inode != inode ||
+      extent->item_off + extent->item_size > hdr->heap_bytes)
+    return 0;
+
+  memcpy(node, heap + extent->item_off, extent->item_size);
+  *node_off = extent->file_offset;
+  if (node_size != NULL) *node_size = extent->item_size;
+  return 1;
+}
+
+typedef struct {
+  SidecarChunk *chunks;
+  size_t chunks_count, chunks_capacity;
+  SidecarRoot *roots;
+  size_t roots_count, roots_capacity;
+  SidecarDirEntry *dirs;
+  size_t dirs_count, dirs_capacity;
+  SidecarExtent *extents;
+  size_t extents_count, extents_capacity;
+  uint8_t *heap;
+  size_t heap_bytes, heap_capacity;
+} SidecarBuilder;
+
+// Returns a new slot at the end of the array, growing it as needed.
+static void *Sidecar_Append(void *array_ptr, size_t *count, size_t *capacity,
+                            size_t size) {
+  uint8_t **array = array_ptr;
+
+  if (*count == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    uint8_t *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL) return NULL;
+    *array = grown;
+    *capacity = new_capacity;
+  }
+  return *array + (*count)++ * size;
+}
+
+#define SIDECAR_APPEND(builder, name)                             \
+  Sidecar_Append(&(builder)->name, &(builder)->name##_count,      \
+                 &(builder)->name##_capacity, sizeof(*(builder)->name))
+
+static int64_t Sidecar_HeapAdd(SidecarBuilder *builder, const void *data,
+                               size_t len) {
+  size_t needed = builder->heap_bytes + len;
+  if (needed > builder->heap_capacity) {
+    size_t capacity = builder->heap_capacity ? builder->heap_capacity : 4096;
+    while (capacity < needed) capacity *= 2;
+    uint8_t *heap = realloc(builder->heap, capacity);
+    if (heap == NULL) return -1;
+    builder->heap = heap;
+    builder->heap_capacity = capacity;
+  }
+
+  int64_t off = builder->heap_bytes;
+  memcpy(builder->heap + off, data, len);
+  builder->heap_bytes += len;
+  return off;
+}
+
+static void *Sidecar_ItemData(BTRFS_Header *leaf, BTRFS_ItemPointer *item) {
+  return (uint8_t *)leaf + sizeof(BTRFS_Header) + item->data_offset;
+}
+
+static int Sidecar_VisitChunkLeaf(BTRFS_Header *leaf, int worker,
+                                  void *context) {
+  SidecarBuilder *builder = context;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    if (chunk_entry->key.type != KeyType_ChunkItem) continue;
+
+    // Every stripe of a mirrored chunk holds the same data, the first one is
+    // enough to read it. Striped chunks are left out, so translations in
+    // them go to BTRFS_LoadChunk, which refuses them.
+    BTRFS_ChunkItem *chunk_item = Sidecar_ItemData(leaf, chunk_entry);
+    if (chunk_item->stripe_count == 0 || BTRFS_ChunkIsStriped(chunk_item))
+      continue;
+
+    SidecarChunk *chunk = SIDECAR_APPEND(builder, chunks);
+    if (chunk == NULL) return -1;
+    chunk->logical_addr = chunk_entry->key.offset;
+    chunk->length = chunk_item->chunk_size_bytes;
+    chunk->device_id = chunk_item->stripes[0].device_id;
+    chunk->physical_addr = chunk_item->stripes[0].offset;
+  }
+  return 0;
+}
+
+static int Sidecar_VisitRootLeaf(BTRFS_Header *leaf, int worker,
+                                 void *context) {
+  SidecarBuilder *builder = context;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    if (chunk_entry->key.type != KeyType_RootItem) continue;
+
+    BTRFS_RootItem *root_item = Sidecar_ItemData(leaf, chunk_entry);
+    SidecarRoot *root = SIDECAR_APPEND(builder, roots);
+    if (root == NULL) return -1;
+    root->tree_id = chunk_entry->key.object_id;
+    root->root_addr = root_item->root_block_num;
+    root->generation = root_item->expected_generation;
+    root->level = root_item->level;
+  }
+  return 0;
+}
+
+static int Sidecar_VisitFSLeaf(BTRFS_Header *leaf, int worker,
+                               void *context) {
+  SidecarBuilder *builder = context;
+  BTRFS_ItemPointer *chunk_entry = (BTRFS_ItemPointer *)(leaf + 1);
+
+  for (uint32_t i = 0; i < leaf->item_count; i++, chunk_entry++) {
+    uint8_t *data = Sidecar_ItemData(leaf, chunk_entry);
+
+    if (chunk_entry->key.type == KeyType_DirItem) {
+      // Names whose hashes collide share one item.
+      uint32_t off = 0;
+      while (off + sizeof(BTRFS_DirectoryItem) <= chunk_entry->data_size) {
+        BTRFS_DirectoryItem *dir_item = (BTRFS_DirectoryItem *)(data + off);
+        // A name running past the item is not indexed, nor is what follows.
+        if (off + sizeof(BTRFS_DirectoryItem) + dir_item->name_len >
+            chunk_entry->data_size)
+          break;
+        int64_t name_off =
+            Sidecar_HeapAdd(builder, dir_item->name_data, dir_item->name_len);
+        SidecarDirEntry *entry = SIDECAR_APPEND(builder, dirs);
+        if (name_off < 0 || entry == NULL) return -1;
+
+        memset(entry, 0, sizeof(SidecarDirEntry));
+        entry->dir = chunk_entry->key.object_id;
+        entry->child = dir_item->key.object_id;
+        entry->name_hash = chunk_entry->key.offset;
+        entry->name_off = name_off;
+        entry->name_len = dir_item->name_len;
+
+        off += sizeof(BTRFS_DirectoryItem) + dir_item->name_len +
+               dir_item->data_size;
+      }
+    } else if (chunk_entry->key.type == KeyType_ExtentData &&
+               chunk_entry->data_size >= sizeof(BTRFS_ExtentDataInline)) {
+      BTRFS_ExtentDataInline *extent_data = (BTRFS_ExtentDataInline *)data;
+      uint64_t file_length = extent_data->decoded_size;
+
+      if (extent_data->type != ExtentDataType_Inline) {
+        if (chunk_entry->data_size < sizeof(BTRFS_ExtentDataFull)) continue;
+        file_length = ((BTRFS_ExtentDataFull *)data)->logical_byte_count;
+      }
+
+      int64_t item_off = Sidecar_HeapAdd(builder, data, chunk_entry->data_size);
+      SidecarExtent *extent = SIDECAR_APPEND(builder, extents);
+      if (item_off < 0 || extent == NULL) return -1;
+
+      memset(extent, 0, sizeof(SidecarExtent));
+      extent->inode = chunk_entry->key.object_id;
+      extent->file_offset = chunk_entry->key.offset;
+      extent->file_length = file_length;
+      extent->item_off = item_off;
+      extent->item_size = chunk_entry->data_size;
+    }
+  }
+  return 0;
+}
+
+static int Sidecar_CompareChunks(const void *a, const void *b) {
+  const SidecarChunk *x = a, *y = b;
+  if (x->logical_addr != y->logical_addr)
+    return x->logical_addr < y->logical_addr ? -1 : 1;
+  return 0;
+}
+
+static int Sidecar_CompareRoots(const void *a, const void *b) {
+  const SidecarRoot *x = a, *y = b;
+  if (x->tree_id != y->tree_id) return x->tree_id < y->tree_id ? -1 : 1;
+  return 0;
+}
+
+static int Sidecar_CompareExtents(const void *a, const void *b) {
+  const SidecarExtent *x = a, *y = b;
+  if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+  if (x->file_offset != y->file_offset)
+    return x->file_offset < y->file_offset ? -1 : 1;
+  return 0;
+}
+
+static bool Sidecar_Write(FILE *f, const void *data, size_t len,
+                          uint64_t *offset) {
+  static const uint8_t padding[8];
+
+  if (len != 0 && fwrite(data, 1, len, f) != len) return false;
+  *offset += len;
+
+  // Keep every section 8 byte aligned so records can be used in place.
+  size_t pad = (8 - *offset % 8) % 8;
+  if (pad != 0 && fwrite(padding, 1, pad, f) != pad) return false;
+  *offset += pad;
+  return true;
+}
+
+static int Sidecar_Save(SidecarBuilder *builder, const char *path) {
+  SidecarHeader hdr;
+  memset(&hdr, 0, sizeof(SidecarHeader));
+  memcpy(hdr.magic, SIDECAR_MAGIC, sizeof(hdr.magic));
+  hdr.version = SIDECAR_VERSION;
+  hdr.node_size = BTRFS_GetNodeSize();
+  BTRFS_GetFSID(hdr.fsid);
+  hdr.generation = BTRFS_GetGeneration();
+
+  // Keep the directory table at most half full so probes stay short.
+  hdr.dir_buckets = 16;
+  while (hdr.dir_buckets < builder->dirs_count * 2) hdr.dir_buckets *= 2;
+  SidecarDirEntry *table = calloc(hdr.dir_buckets, sizeof(SidecarDirEntry));
+  if (table == NULL) return -1;
+
+  for (size_t i = 0; i < builder->dirs_count; i++) {
+    SidecarDirEntry *entry = &builder->dirs[i];
+    uint64_t bucket =
+        Sidecar_Bucket(entry->dir, entry->name_hash, hdr.dir_buckets);
+    while (table[bucket].dir != 0) bucket = (bucket + 1) & (hdr.dir_buckets - 1);
+    table[bucket] = *entry;
+  }
+
+  qsort(builder->chunks, builder->chunks_count, sizeof(SidecarChunk),
+        Sidecar_CompareChunks);
+  qsort(builder->roots, builder->roots_count, sizeof(SidecarRoot),
+        Sidecar_CompareRoots);
+  qsort(builder->extents, builder->extents_count, sizeof(SidecarExtent),
+        Sidecar_CompareExtents);
+
+  hdr.chunk_count = builder->chunks_count;
+  hdr.root_count = builder->roots_count;
+  hdr.extent_count = builder->extents_count;
+  hdr.heap_bytes = builder->heap_bytes;
+
+  hdr.chunk_offset = (sizeof(SidecarHeader) + 7) & ~7ull;
+  hdr.root_offset = hdr.chunk_offset + hdr.chunk_count * sizeof(SidecarChunk);
+  hdr.dir_offset = hdr.root_offset + hdr.root_count * sizeof(SidecarRoot);
+  hdr.extent_offset =
+      hdr.dir_offset + hdr.dir_buckets * sizeof(SidecarDirEntry);
+  hdr.heap_offset =
+      hdr.extent_offset + hdr.extent_count * sizeof(SidecarExtent);
+
+  // Written under a temporary name and renamed into place so a concurrent
+  // open never maps a partial file.
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp_path = malloc(tmp_len);
+  if (tmp_path == NULL) {
+    free(table);
+    return -1;
+  }
+  snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+  int retVal = -1;
+  FILE *f = fopen(tmp_path, "wb");
+  if (f != NULL) {
+    uint64_t offset = 0;
+    bool ok =
+        Sidecar_Write(f, &hdr, sizeof(SidecarHeader), &offset) &&
+        Sidecar_Write(f, builder->chunks,
+                      hdr.chunk_count * sizeof(SidecarChunk), &offset) &&
+        Sidecar_Write(f, builder->roots, hdr.root_count * sizeof(SidecarRoot),
+                      &offset) &&
+        Sidecar_Write(f, table, hdr.dir_buckets * sizeof(SidecarDirEntry),
+                      &offset) &&
+        Sidecar_Write(f, builder->extents,
+                      hdr.extent_count * sizeof(SidecarExtent), &offset) &&
+        Sidecar_Write(f, builder->heap, hdr.heap_bytes, &offset);
+
+    if (fclose(f) == 0 && ok && rename(tmp_path, path) == 0) retVal = 0;
+    if (retVal != 0) remove(tmp_path);
+  }
+
+  free(tmp_path);
+  free(table);
+  return retVal;
+}
+
+int BTRFS_WriteSidecar(const char *path) {
+  SidecarBuilder builder;
+  memset(&builder, 0, sizeof(SidecarBuilder));
+
+  int retVal = -1;
+  if (BTRFS_ParallelWalk(BTRFS_GetChunkTreeRootAddress(), 1,
+                         Sidecar_VisitChunkLeaf, &builder) == 0 &&
+      BTRFS_ParallelWalk(BTRFS_GetRootTreeBlockAddress(), 1,
+                         Sidecar_VisitRootLeaf, &builder) == 0 &&
+      BTRFS_ParallelWalk(BTRFS_GetFSTreeLocation(), 1, Sidecar_VisitFSLeaf,
+                         &builder) == 0)
+    retVal = Sidecar_Save(&builder, path);
+
+  free(builder.chunks);
+  free(builder.roots);
+  free(builder.dirs);
+  free(builder.extents);
+  free(builder.heap);
+  return retVal;
+}
@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "btrfs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every thread counts into its own block, so an update is a plain load and
+// store that never bounces a cache line between cores. Readers sum the
+// blocks of the live threads with those folded in by threads as they exit.
+
+#define STATS_COUNTERS (sizeof(BTRFS_Stats) / sizeof(uint64_t))
+
+typedef struct Stats_Block {
+  _Atomic uint64_t counters[STATS_COUNTERS];
+  struct Stats_Block *prev;
+  struct Stats_Block *next;
+} Stats_Block;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static Stats_Block *stats_blocks = NULL;
+static uint64_t stats_retired[STATS_COUNTERS];
+static _Thread_local Stats_Block *stats_local = NULL;
+
+// Runs as a thread exits, with the block it registered.
+static void Stats_Retire(void *ptr) {
+  Stats_Block *block = ptr;
+
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < STATS_COUNTERS; i++)
+    stats_retired[i] +=
+        atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    stats_blocks = block->next;
+  if (block->next != NULL) block->next->prev = block->prev;
+  pthread_mutex_unlock(&stats_lock);
+
+  free(block);
+}
+
+static void Stats_CreateKey(void) {
+  pthread_key_create(&stats_key, Stats_Retire);
+}
+
+static Stats_Block *Stats_Register(void) {
+  pthread_once(&stats_once, Stats_CreateKey);
+
+  Stats_Block *block = calloc(1, sizeof(Stats_Block));
+  if (block == NULL) return NULL;
+
+  pthread_mutex_lock(&stats_lock);
+  block->next = stats_blocks;
+  if (stats_blocks != NULL) stats_blocks->prev = block;
+  stats_blocks = block;
+  pthread_mutex_unlock(&stats_lock);
+
+  pthread_setspecific(stats_key, block);
+  stats_local = block;
+  return block;
+}
+
+void BTRFS_StatsAdd(size_t counter, uint64_t n) {
+  Stats_Block *block = stats_local;
+  if (block == NULL && (block = Stats_Register()) == NULL) return;
+
+  // Only this thread writes the counter, the atomics just keep readers from
+  // seeing a torn value.
+  uint64_t value =
+      atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+  atomic_store_explicit(&block->counters[counter], value + n,
+                        memory_order_relaxed);
+}
+
+uint64_t BTRFS_StatsClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void BTRFS_GetStats(BTRFS_Stats *stats) {
+  uint64_t *totals = (uint64_t *)stats;
+
+  pthread_mutex_lock(&stats_lock);
+  memcpy(totals, stats_retired, sizeof(stats_retired));
+  for (Stats_Block *block = stats_blocks; block != NULL; block = block->next)
+    for (size_t i = 0; i < STATS_COUNTERS; i++)
+      totals[i] +=
+          atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void BTRFS_ResetStats(void) {
+  pthread_mutex_lock(&stats_lock);
+  memset(stats_retired, 0, sizeof(stats_retired));
+  for (Stats_Block *block = stats_blocks; block != NULL; block = block->next)
+    for (size_t i = 0; i < STATS_COUNTERS; i++)
+      atomic_store_explicit(&block->counters[i], 0, memory_order_relaxed);
+  pthread_mutex_unlock(&stats_lock);
+}
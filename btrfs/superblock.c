@@ -29,6 +29,10 @@ uint64_t BTRFS_GetChunkTreeRootAddress(void) {
 
 void BTRFS_GetLabel(char *buffer) { strcpy(buffer, superblock.label); }
 
+void BTRFS_GetFSID(uint8_t *uuid) { memcpy(uuid, superblock.uuid, UUID_LEN); }
+
+uint64_t BTRFS_GetGeneration(void) { return superblock.generation; }
+
 int BTRFS_ParseSuperblock(BTRFS_Superblock *block) {
   crc32c_init();
 
@@ -72,10 +76,6 @@ int BTRFS_ParseSuperblock(BTRFS_Superblock *block) {
   // Read in the highest generation block
   BTRFS_ReadRaw(sblock, 0, BTRFS_superblock_offsets[highest_gen_idx], 0x1000);
 
-  printf("Label: %s\n", sblock->label);
-  printf("Highest gen Superblock: %d\n", highest_gen_idx);
-  printf("Chunk tree root: %llx\n", sblock->chunk_tree_root_addr);
-
   // Copy the superblock into a backup table
   memcpy(&superblock, sblock, sizeof(BTRFS_Superblock));
 
@@ -86,14 +86,15 @@ int BTRFS_ParseSuperblock(BTRFS_Superblock *block) {
 
   while (table_bytes > 0) {
     int stripe_cnt = mapping->value.stripe_count;
-    uint64_t logical_addr = mapping->key.offset;
 
-    for (int i = 0; i < stripe_cnt; i++) {
-      BTRFS_AddMappingToCache(logical_addr, mapping->value.stripes[i].device_id,
-                              mapping->value.stripes[i].offset,
+    // Every stripe of a mirrored chunk holds the same data, the first one is
+    // enough to read it. Striped system chunks cannot be read this way.
+    if (BTRFS_ChunkIsStriped(&mapping->value)) return -1;
+    if (stripe_cnt > 0)
+      BTRFS_AddMappingToCache(mapping->key.offset,
+                              mapping->value.stripes[0].device_id,
+                              mapping->value.stripes[0].offset,
                               mapping->value.chunk_size_bytes);
-      logical_addr += mapping->value.chunk_size_bytes;
-    }
 
     int sz =
         sizeof(BTRFS_Key_ChunkItem_Pair) + stripe_cnt * sizeof(BTRFS_Stripe);
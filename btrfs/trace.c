@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "btrfs.h"
+
+#include <stdatomic.h>
+
+// With neither histograms nor a callback, a traced call costs one relaxed
+// load in BTRFS_TraceBegin and skips the clock entirely. Histogram buckets
+// are shared by all threads and only ever atomically incremented.
+
+static atomic_int trace_histograms = 0;
+static _Atomic(BTRFS_TraceCallback) trace_callback = NULL;
+static _Atomic(void *) trace_context = NULL;
+static atomic_int trace_tracking = 0;
+static atomic_int trace_enabled = 0;
+static _Thread_local int trace_depth = 0;
+static _Thread_local int trace_outer = -1;
+static _Thread_local int trace_nodes = 0;
+
+static _Atomic uint64_t trace_counts[BTRFS_TRACE_OPS];
+static _Atomic uint64_t trace_buckets[BTRFS_TRACE_OPS][BTRFS_LATENCY_BUCKETS];
+
+#define SUB_COUNT (1 << BTRFS_LATENCY_SUB_BITS)
+
+static void Trace_Update(void) {
+  atomic_store(&trace_enabled,
+               atomic_load(&trace_histograms) ||
+                   atomic_load(&trace_callback) != NULL ||
+                   atomic_load(&trace_tracking) > 0);
+}
+
+// Counted, so each user can turn tracking on and off on its own.
+void BTRFS_SetTraceContext(int enabled) {
+  atomic_fetch_add(&trace_tracking, enabled ? 1 : -1);
+  Trace_Update();
+}
+
+int BTRFS_TraceContext(int *node) {
+  *node = trace_nodes > 0;
+  return trace_depth > 0 ? trace_outer : -1;
+}
+
+void BTRFS_SetTraceCallback(BTRFS_TraceCallback callback, void *context) {
+  atomic_store(&trace_context, context);
+  atomic_store(&trace_callback, callback);
+  Trace_Update();
+}
+
+void BTRFS_SetLatencyHistograms(int enabled) {
+  atomic_store(&trace_histograms, enabled != 0);
+  Trace_Update();
+}
+
+// Values below SUB_COUNT get a bucket each, the rest go by their top bit and
+// the BTRFS_LATENCY_SUB_BITS bits below it.
+static int Trace_Bucket(uint64_t value) {
+  if (value < SUB_COUNT) return (int)value;
+
+  int top = 63 - __builtin_clzll(value);
+  int sub = (value >> (top - BTRFS_LATENCY_SUB_BITS)) & (SUB_COUNT - 1);
+  return (top - BTRFS_LATENCY_SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+static uint64_t Trace_BucketLimit(int bucket) {
+  if (bucket < SUB_COUNT) return bucket;
+
+  int top = bucket / SUB_COUNT + BTRFS_LATENCY_SUB_BITS - 1;
+  int shift = top - BTRFS_LATENCY_SUB_BITS;
+  uint64_t low = (uint64_t)(SUB_COUNT + bucket % SUB_COUNT) << shift;
+  return low + (((uint64_t)1 << shift) - 1);
+}
+
+uint64_t BTRFS_TraceBegin(BTRFS_TraceEvent *event) {
+  if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return 0;
+
+  event->end = 0;
+  event->depth = trace_depth++;
+  if (event->depth == 0) trace_outer = event->op;
+  if (event->op == TraceOp_GetNode || event->op == TraceOp_GetNodes)
+    trace_nodes++;
+
+  BTRFS_TraceCallback callback = atomic_load(&trace_callback);
+  if (callback != NULL) callback(event, atomic_load(&trace_context));
+
+  // Started after the callback so it is not counted in the call's latency.
+  uint64_t start = BTRFS_StatsClock();
+  return start != 0 ? start : 1;
+}
+
+void BTRFS_TraceEnd(BTRFS_TraceEvent *event, uint64_t start) {
+  if (start == 0) return;
+
+  event->end = 1;
+  event->duration_ns = BTRFS_StatsClock() - start;
+  event->depth = --trace_depth;
+  if (event->op == TraceOp_GetNode || event->op == TraceOp_GetNodes)
+    trace_nodes--;
+
+  if (atomic_load_explicit(&trace_histograms, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&trace_counts[event->op], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &trace_buckets[event->op][Trace_Bucket(event->duration_ns)], 1,
+        memory_order_relaxed);
+  }
+
+  BTRFS_TraceCallback callback = atomic_load(&trace_callback);
+  if (callback != NULL) callback(event, atomic_load(&trace_context));
+}
+
+void BTRFS_GetLatencyHistogram(BTRFS_TraceOp op,
+                               BTRFS_LatencyHistogram *histogram) {
+  histogram->count =
+      atomic_load_explicit(&trace_counts[op], memory_order_relaxed);
+  for (int i = 0; i < BTRFS_LATENCY_BUCKETS; i++)
+    histogram->buckets[i] =
+        atomic_load_explicit(&trace_buckets[op][i], memory_order_relaxed);
+}
+
+void BTRFS_ResetLatencyHistograms(void) {
+  for (int op = 0; op < BTRFS_TRACE_OPS; op++) {
+    atomic_store_explicit(&trace_counts[op], 0, memory_order_relaxed);
+    for (int i = 0; i < BTRFS_LATENCY_BUCKETS; i++)
+      atomic_store_explicit(&trace_buckets[op][i], 0, memory_order_relaxed);
+  }
+}
+
+uint64_t BTRFS_LatencyPercentile(const BTRFS_LatencyHistogram *histogram,
+                                 double percentile) {
+  // The count is read apart from the buckets, so go by their sum instead.
+  uint64_t total = 0;
+  for (int i = 0; i < BTRFS_LATENCY_BUCKETS; i++)
+    total += histogram->buckets[i];
+  if (total == 0) return 0;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.999999);
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < BTRFS_LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) return Trace_BucketLimit(i);
+  }
+  return Trace_BucketLimit(BTRFS_LATENCY_BUCKETS - 1);
+}
@@ -0,0 +1,419 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrfs.h"
+
+#define WALK_MAX_THREADS 64
+#define WALK_INITIAL_DEQUE_SIZE 256
+
+// BTRFS_LevelWalk reads as many nodes per batch as fit in this, and queues
+// as many tasks per level, so each of its buffers is one arena allocation.
+#define WALK_LEVEL_BYTES (256 * 1024)
+#define WALK_LEVEL_TASKS (WALK_LEVEL_BYTES / sizeof(BTRFS_WalkTask))
+#define WALK_MAX_BATCH (WALK_LEVEL_BYTES / 4096)
+
+// Nodes of a level asked for ahead of the batch being read.
+#define WALK_PREFETCH_NODES 256
+
+typedef struct {
+  uint64_t block_number;
+  uint64_t generation;
+  uint8_t level;
+} BTRFS_WalkTask;
+
+// Owner pushes and pops at the bottom, thieves take from the top, so each
+// worker descends depth first while idle workers take the largest subtrees.
+typedef struct {
+  pthread_mutex_t lock;
+  BTRFS_WalkTask *tasks;
+  size_t top;
+  size_t bottom;
+  size_t capacity;
+} BTRFS_WalkDeque;
+
+typedef struct {
+  BTRFS_WalkDeque deques[WALK_MAX_THREADS];
+  int thread_count;
+  BTRFS_LeafVisitor visitor;
+  void *context;
+  atomic_size_t pending;
+  atomic_int result;
+  // Workers that find nothing to take sleep here until more is pushed or
+  // the walk is done. Pushes are counted so a worker can tell whether any
+  // happened while it was looking.
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  atomic_int idle;
+  atomic_uint pushes;
+} BTRFS_Walk;
+
+typedef struct {
+  BTRFS_Walk *walk;
+  int index;
+} BTRFS_WalkWorker;
+
+static bool BTRFS_WalkPush(BTRFS_WalkDeque *deque, BTRFS_WalkTask *task) {
+  bool pushed = true;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom == deque->capacity) {
+    if (deque->top > 0) {
+      memmove(deque->tasks, deque->tasks + deque->top,
+              (deque->bottom - deque->top) * sizeof(BTRFS_WalkTask));
+      deque->bottom -= deque->top;
+      deque->top = 0;
+    } else {
+      size_t capacity =
+          deque->capacity ? deque->capacity * 2 : WALK_INITIAL_DEQUE_SIZE;
+      BTRFS_WalkTask *tasks = BTRFS_Alloc(capacity * sizeof(BTRFS_WalkTask));
+      if (tasks == NULL) {
+        pushed = false;
+      } else {
+        if (deque->tasks != NULL)
+          memcpy(tasks, deque->tasks, deque->bottom * sizeof(BTRFS_WalkTask));
+        BTRFS_Free(deque->tasks, deque->capacity * sizeof(BTRFS_WalkTask));
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+      }
+    }
+  }
+  if (pushed) deque->tasks[deque->bottom++] = *task;
+  pthread_mutex_unlock(&deque->lock);
+
+  return pushed;
+}
+
+static bool BTRFS_WalkPop(BTRFS_WalkDeque *deque, BTRFS_WalkTask *task) {
+  bool found = false;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top) {
+    *task = deque->tasks[--deque->bottom];
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+// Thieves first pass over deques that are busy. Before going idle they
+// wait for every lock, so that a busy deque is not taken for an empty one.
+static bool BTRFS_WalkSteal(BTRFS_WalkDeque *deque, BTRFS_WalkTask *task,
+                            bool wait) {
+  bool found = false;
+
+  if (wait)
+    pthread_mutex_lock(&deque->lock);
+  else if (pthread_mutex_trylock(&deque->lock) != 0)
+    return false;
+  if (deque->bottom > deque->top) {
+    *task = deque->tasks[deque->top++];
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+static void BTRFS_WalkWake(BTRFS_Walk *walk) {
+  pthread_mutex_lock(&walk->idle_lock);
+  pthread_cond_broadcast(&walk->idle_cond);
+  pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// Sleep until a push newer than the given count or the end of the walk.
+// The sleeper is counted before checking, and pushers count their push
+// before checking for sleepers, so one of the two always sees the other.
+static void BTRFS_WalkIdle(BTRFS_Walk *walk, unsigned pushes) {
+  pthread_mutex_lock(&walk->idle_lock);
+  atomic_fetch_add(&walk->idle, 1);
+  if (atomic_load(&walk->pending) > 0 &&
+      atomic_load(&walk->pushes) == pushes)
+    pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+  atomic_fetch_sub(&walk->idle, 1);
+  pthread_mutex_unlock(&walk->idle_lock);
+}
+
+static void BTRFS_WalkFail(BTRFS_Walk *walk, int err) {
+  int expected = 0;
+  atomic_compare_exchange_strong(&walk->result, &expected, err);
+}
+
+// Queue the children of an internal node on the worker's own deque. They are
+// pushed last to first so that the owner continues with the leftmost child,
+// and read-ahead is requested for all of them so the reads overlap.
+static void BTRFS_WalkExpand(BTRFS_Walk *walk, BTRFS_WalkDeque *deque,
+                             BTRFS_Header *node) {
+  BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(node + 1);
+  uint32_t node_size = BTRFS_GetNodeSize();
+
+  for (uint32_t i = 0; i < node->item_count; i++)
+    BTRFS_Prefetch(key_ptr[i].block_number, node_size);
+
+  for (uint32_t i = node->item_count; i > 0; i--) {
+    BTRFS_WalkTask task = {key_ptr[i - 1].block_number,
+                           key_ptr[i - 1].generation, node->level - 1};
+    atomic_fetch_add(&walk->pending, 1);
+    if (!BTRFS_WalkPush(deque, &task)) {
+      atomic_fetch_sub(&walk->pending, 1);
+      BTRFS_WalkFail(walk, -1);
+      break;
+    }
+  }
+
+  atomic_fetch_add(&walk->pushes, 1);
+  if (atomic_load(&walk->idle) > 0) BTRFS_WalkWake(walk);
+}
+
+static void *BTRFS_WalkThread(void *arg) {
+  BTRFS_WalkWorker *worker = arg;
+  BTRFS_Walk *walk = worker->walk;
+  BTRFS_WalkDeque *own = &walk->deques[worker->index];
+  BTRFS_Header *node = BTRFS_Alloc(BTRFS_GetNodeSize());
+
+  if (node == NULL) BTRFS_WalkFail(walk, -1);
+
+  while (atomic_load(&walk->pending) > 0) {
+    unsigned pushes = atomic_load(&walk->pushes);
+    BTRFS_WalkTask task;
+    bool found = BTRFS_WalkPop(own, &task);
+
+    for (int pass = 0; !found && pass < 2; pass++)
+      for (int i = 1; !found && i < walk->thread_count; i++)
+        found = BTRFS_WalkSteal(
+            &walk->deques[(worker->index + i) % walk->thread_count], &task,
+            pass == 1);
+
+    if (!found) {
+      BTRFS_WalkIdle(walk, pushes);
+      continue;
+    }
+
+    // After a failure the remaining tasks are only drained.
+    if (node != NULL && atomic_load(&walk->result) == 0) {
+      if (BTRFS_GetNode(node, task.block_number) != 0 ||
+          node->level != task.level || node->generation != task.generation) {
+        BTRFS_WalkFail(walk, -1);
+      } else if (node->level == 0) {
+        int err = walk->visitor(node, worker->index, walk->context);
+        if (err != 0) BTRFS_WalkFail(walk, err);
+      } else {
+        BTRFS_WalkExpand(walk, own, node);
+      }
+    }
+
+    if (atomic_fetch_sub(&walk->pending, 1) == 1) BTRFS_WalkWake(walk);
+  }
+
+  BTRFS_Free(node, BTRFS_GetNodeSize());
+  return NULL;
+}
+
+int BTRFS_ParallelWalk(uint64_t root, int threads, BTRFS_LeafVisitor visitor,
+                       void *context) {
+  if (threads < 1) threads = 1;
+  if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BTRFS_Header *node = BTRFS_Alloc(node_size);
+  if (node == NULL) return -1;
+
+  if (BTRFS_GetNode(node, root) != 0) {
+    BTRFS_Free(node, node_size);
+    return -1;
+  }
+
+  if (node->level == 0) {
+    int retVal = visitor(node, 0, context);
+    BTRFS_Free(node, node_size);
+    return retVal;
+  }
+
+  BTRFS_Walk *walk = BTRFS_Alloc(sizeof(BTRFS_Walk));
+  if (walk == NULL) {
+    BTRFS_Free(node, node_size);
+    return -1;
+  }
+  memset(walk, 0, sizeof(BTRFS_Walk));
+  walk->thread_count = threads;
+  walk->visitor = visitor;
+  walk->context = context;
+  atomic_init(&walk->pending, 0);
+  atomic_init(&walk->result, 0);
+  atomic_init(&walk->idle, 0);
+  atomic_init(&walk->pushes, 0);
+  pthread_mutex_init(&walk->idle_lock, NULL);
+  pthread_cond_init(&walk->idle_cond, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_init(&walk->deques[i].lock, NULL);
+
+  // Deal the root's children out round robin so every worker starts with
+  // its own subtrees instead of stealing them one at a time.
+  BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(node + 1);
+  for (uint32_t i = 0; i < node->item_count; i++)
+    BTRFS_Prefetch(key_ptr[i].block_number, node_size);
+  for (uint32_t i = node->item_count; i > 0; i--) {
+    BTRFS_WalkTask task = {key_ptr[i - 1].block_number,
+                           key_ptr[i - 1].generation, node->level - 1};
+    atomic_fetch_add(&walk->pending, 1);
+    if (!BTRFS_WalkPush(&walk->deques[(i - 1) % threads], &task)) {
+      atomic_fetch_sub(&walk->pending, 1);
+      BTRFS_WalkFail(walk, -1);
+      break;
+    }
+  }
+  BTRFS_Free(node, node_size);
+
+  pthread_t handles[WALK_MAX_THREADS];
+  BTRFS_WalkWorker workers[WALK_MAX_THREADS];
+  int started = 0;
+
+  for (int i = 1; i < threads; i++) {
+    workers[i].walk = walk;
+    workers[i].index = i;
+    if (pthread_create(&handles[i], NULL, BTRFS_WalkThread, &workers[i]) != 0)
+      break;
+    started = i;
+  }
+
+  // The calling thread is worker 0.
+  workers[0].walk = walk;
+  workers[0].index = 0;
+  BTRFS_WalkThread(&workers[0]);
+
+  for (int i = 1; i <= started; i++) pthread_join(handles[i], NULL);
+
+  int retVal = atomic_load(&walk->result);
+  pthread_cond_destroy(&walk->idle_cond);
+  pthread_mutex_destroy(&walk->idle_lock);
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_destroy(&walk->deques[i].lock);
+    BTRFS_Free(walk->deques[i].tasks,
+               walk->deques[i].capacity * sizeof(BTRFS_WalkTask));
+  }
+  BTRFS_Free(walk, sizeof(BTRFS_Walk));
+  return retVal;
+}
+
+// The queued nodes of one level of a level walk, in key order, and the
+// buffer its batches are read into.
+typedef struct {
+  BTRFS_WalkTask *tasks;
+  size_t count;
+  uint8_t *nodes;
+} BTRFS_WalkLevel;
+
+typedef struct {
+  BTRFS_WalkLevel levels[BTRFS_MAX_LEVEL];
+  size_t batch;
+  BTRFS_LeafVisitor visitor;
+  void *context;
+} BTRFS_LevelWalkState;
+
+static void BTRFS_WalkLevelAdd(BTRFS_WalkLevel *level, BTRFS_Header *node) {
+  BTRFS_KeyPointer *key_ptr = (BTRFS_KeyPointer *)(node + 1);
+
+  for (uint32_t i = 0; i < node->item_count; i++)
+    level->tasks[level->count++] = (BTRFS_WalkTask){
+        key_ptr[i].block_number, key_ptr[i].generation, node->level - 1};
+}
+
+// Read the queued nodes of a level in batches, visiting leaves and queueing
+// the children of internal nodes on the level below. When that queue is
+// full it is walked first, so leaves are still visited in key order and no
+// queue outgrows its buffer.
+static int BTRFS_WalkLevelRun(BTRFS_LevelWalkState *walk, int depth) {
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BTRFS_WalkLevel *level = &walk->levels[depth];
+  BTRFS_WalkLevel *next = depth > 0 ? &walk->levels[depth - 1] : NULL;
+  uint64_t addrs[WALK_MAX_BATCH];
+  size_t ahead = 0;
+
+  for (size_t first = 0; first < level->count; first += walk->batch) {
+    size_t count = level->count - first;
+    if (count > walk->batch) count = walk->batch;
+
+    // Keep reads for the nodes after this batch in flight while it is
+    // processed.
+    if (ahead < first + count) ahead = first + count;
+    for (; ahead < level->count &&
+           ahead < first + count + WALK_PREFETCH_NODES;
+         ahead++)
+      BTRFS_Prefetch(level->tasks[ahead].block_number, node_size);
+
+    for (size_t i = 0; i < count; i++)
+      addrs[i] = level->tasks[first + i].block_number;
+    if (BTRFS_GetNodes(level->nodes, addrs, count) != 0) return -1;
+
+    for (size_t i = 0; i < count; i++) {
+      BTRFS_Header *node = (BTRFS_Header *)(level->nodes + i * node_size);
+      BTRFS_WalkTask *task = &level->tasks[first + i];
+      if (node->level != task->level ||
+          node->generation != task->generation ||
+          node->item_count > WALK_LEVEL_TASKS)
+        return -1;
+
+      if (node->level == 0) {
+        int err = walk->visitor(node, 0, walk->context);
+        if (err != 0) return err;
+        continue;
+      }
+
+      if (next->count + node->item_count > WALK_LEVEL_TASKS) {
+        int err = BTRFS_WalkLevelRun(walk, depth - 1);
+        if (err != 0) return err;
+        next->count = 0;
+      }
+      BTRFS_WalkLevelAdd(next, node);
+    }
+  }
+  return 0;
+}
+
+int BTRFS_LevelWalk(BTRFS_Header *top, BTRFS_LeafVisitor visitor,
+                    void *context) {
+  if (top->level == 0) return visitor(top, 0, context);
+  if (top->level >= BTRFS_MAX_LEVEL) return -1;
+
+  uint32_t node_size = BTRFS_GetNodeSize();
+  BTRFS_LevelWalkState walk;
+  memset(&walk, 0, sizeof(BTRFS_LevelWalkState));
+  walk.batch = WALK_LEVEL_BYTES / node_size;
+  if (walk.batch > WALK_MAX_BATCH) walk.batch = WALK_MAX_BATCH;
+  walk.visitor = visitor;
+  walk.context = context;
+
+  int retVal = 0;
+  for (int depth = 0; depth < top->level; depth++) {
+    walk.levels[depth].tasks =
+        BTRFS_Alloc(WALK_LEVEL_TASKS * sizeof(BTRFS_WalkTask));
+    walk.levels[depth].nodes = BTRFS_Alloc(walk.batch * node_size);
+    if (walk.levels[depth].tasks == NULL || walk.levels[depth].nodes == NULL)
+      retVal = -1;
+  }
+
+  // Each level's run leaves the children of its last nodes queued on the
+  // level below, which is walked next.
+  if (retVal == 0) BTRFS_WalkLevelAdd(&walk.levels[top->level - 1], top);
+  for (int depth = top->level - 1; retVal == 0 && depth >= 0; depth--)
+    retVal = BTRFS_WalkLevelRun(&walk, depth);
+
+  for (int depth = 0; depth < top->level; depth++) {
+    BTRFS_Free(walk.levels[depth].tasks,
+               WALK_LEVEL_TASKS * sizeof(BTRFS_WalkTask));
+    BTRFS_Free(walk.levels[depth].nodes, walk.batch * node_size);
+  }
+  return retVal;
+}
@@ -0,0 +1,430 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "btrfs/btrfs.h"
+#include "inventory.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// <sys/stat.h> maps these to struct timespec members, which would clash with
+// the BTRFS_InodeItem fields of the same name.
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define INVENTORY_MAX_COLUMNS 16
+
+static const uint8_t inode_columns[] = {
+    8,  // ino
+    4,  // mode
+    4,  // nlink
+    4,  // uid
+    4,  // gid
+    8,  // size
+    8,  // bytes allocated
+    8,  // atime
+    4,  // atime nanoseconds
+    8,  // mtime
+    4,  // mtime nanoseconds
+    8,  // ctime
+    4,  // ctime nanoseconds
+    8,  // flags
+};
+
+static const uint8_t link_columns[] = {
+    8,  // ino
+    8,  // parent directory
+    4,  // name offset in the heap
+    2,  // name length
+};
+
+typedef struct {
+  InventoryTable table;
+  const uint8_t *widths;
+  int column_count;
+  uint8_t *columns[INVENTORY_MAX_COLUMNS];
+  uint32_t rows;
+  char *heap;
+  uint64_t heap_bytes;
+  uint64_t heap_capacity;
+} InventoryGroup;
+
+typedef struct {
+  int fd;
+  InventoryGroup inodes;
+  InventoryGroup links;
+  InventoryHeader header;
+  int error;
+} InventoryWriter;
+
+static int Inventory_GroupInit(InventoryGroup *group, InventoryTable table,
+                               const uint8_t *widths, int column_count) {
+  memset(group, 0, sizeof(InventoryGroup));
+  group->table = table;
+  group->widths = widths;
+  group->column_count = column_count;
+
+  for (int i = 0; i < column_count; i++) {
+    group->columns[i] = malloc((size_t)widths[i] * INVENTORY_GROUP_ROWS);
+    if (group->columns[i] == NULL) return -1;
+  }
+  return 0;
+}
+
+static void Inventory_GroupFree(InventoryGroup *group) {
+  for (int i = 0; i < group->column_count; i++) free(group->columns[i]);
+  free(group->heap);
+}
+
+static void Inventory_Set(InventoryGroup *group, int column, uint64_t value) {
+  // Columns are little endian, like everything else on disk.
+  memcpy(group->columns[column] + (size_t)group->rows * group->widths[column],
+         &value, group->widths[column]);
+}
+
+// Writes a full group with a single gathered write.
+static int Inventory_GroupFlush(InventoryWriter *writer,
+                                InventoryGroup *group) {
+  if (group->rows == 0) return 0;
+
+  InventoryGroupHeader hdr = {group->table, group->rows, group->heap_bytes};
+  struct iovec iov[INVENTORY_MAX_COLUMNS + 2];
+  int cnt = 0;
+  size_t total = sizeof(hdr) + group->heap_bytes;
+
+  iov[cnt].iov_base = &hdr;
+  iov[cnt++].iov_len = sizeof(hdr);
+  for (int i = 0; i < group->column_count; i++) {
+    iov[cnt].iov_base = group->columns[i];
+    iov[cnt++].iov_len = (size_t)group->widths[i] * group->rows;
+    total += (size_t)group->widths[i] * group->rows;
+  }
+  iov[cnt].iov_base = group->heap;
+  iov[cnt++].iov_len = group->heap_bytes;
+
+  // Writes to regular files complete in full unless something is wrong.
+  if (writev(writer->fd, iov, cnt) != (ssize_t)total) return -1;
+
+  group->rows = 0;
+  group->heap_bytes = 0;
+  return 0;
+}
+
+static int Inventory_AddLink(InventoryWriter *writer, uint64_t ino,
+                             uint64_t parent, const char *name,
+                             uint16_t name_len) {
+  InventoryGroup *group = &writer->links;
+
+  if (group->heap_bytes + name_len > group->heap_capacity) {
+    uint64_t capacity = group->heap_capacity ? group->heap_capacity * 2
+                                             : 16 * INVENTORY_GROUP_ROWS;
+    char *heap = realloc(group->heap, capacity);
+    if (heap == NULL) return -1;
+    group->heap = heap;
+    group->heap_capacity = capacity;
+  }
+
+  Inventory_Set(group, 0, ino);
+  Inventory_Set(group, 1, parent);
+  Inventory_Set(group, 2, group->heap_bytes);
+  Inventory_Set(group, 3, name_len);
+  memcpy(group->heap + group->heap_bytes, name, name_len);
+  group->heap_bytes += name_len;
+  writer->header.link_count++;
+
+  if (++group->rows == INVENTORY_GROUP_ROWS)
+    return Inventory_GroupFlush(writer, group);
+  return 0;
+}
+
+static int Inventory_Visit(BTRFS_Key *key, void *item, uint32_t size,
+                           void *context) {
+  InventoryWriter *writer = context;
+  uint8_t *data = item;
+
+  switch (key->type) {
+    case KeyType_InodeItem: {
+      InventoryGroup *group = &writer->inodes;
+      BTRFS_InodeItem *inode = item;
+
+      Inventory_Set(group, 0, key->object_id);
+      Inventory_Set(group, 1, inode->st_mode);
+      Inventory_Set(group, 2, inode->st_nlink);
+      Inventory_Set(group, 3, inode->st_uid);
+      Inventory_Set(group, 4, inode->st_gid);
+      Inventory_Set(group, 5, inode->st_size);
+      Inventory_Set(group, 6, inode->st_blocks);
+      Inventory_Set(group, 7, inode->st_atime.seconds);
+      Inventory_Set(group, 8, inode->st_atime.nanoseconds);
+      Inventory_Set(group, 9, inode->st_mtime.seconds);
+      Inventory_Set(group, 10, inode->st_mtime.nanoseconds);
+      Inventory_Set(group, 11, inode->st_ctime.seconds);
+      Inventory_Set(group, 12, inode->st_ctime.nanoseconds);
+      Inventory_Set(group, 13, inode->flags);
+      writer->header.inode_count++;
+
+      if (++group->rows == INVENTORY_GROUP_ROWS)
+        return Inventory_GroupFlush(writer, group);
+    } break;
+    case KeyType_InodeRef: {
+      // Several names in the same parent share one item. A name running
+      // past the item ends it.
+      uint32_t off = 0;
+      while (off + offsetof(BTRFS_InodeReference, name) <= size) {
+        BTRFS_InodeReference *ref = (BTRFS_InodeReference *)(data + off);
+        if (off + offsetof(BTRFS_InodeReference, name) + ref->name_len > size) break;
+        if (Inventory_AddLink(writer, key->object_id, key->offset, ref->name,
+                              ref->name_len) != 0)
+          return -1;
+        off += offsetof(BTRFS_InodeReference, name) + ref->name_len;
+      }
+    } break;
+    case KeyType_InodeExtRef: {
+      uint32_t off = 0;
+      while (off + offsetof(BTRFS_InodeExtReference, name) <= size) {
+        BTRFS_InodeExtReference *ref = (BTRFS_InodeExtReference *)(data + off);
+        if (off + offsetof(BTRFS_InodeExtReference, name) + ref->name_len > size) break;
+        if (Inventory_AddLink(writer, key->object_id, ref->dir_objectid,
+                              ref->name, ref->name_len) != 0)
+          return -1;
+        off += offsetof(BTRFS_InodeExtReference, name) + ref->name_len;
+      }
+    } break;
+  }
+
+  return 0;
+}
+
+int Inventory_Export(const char *path) {
+  InventoryWriter writer;
+  int retVal = -1;
+
+  memset(&writer, 0, sizeof(InventoryWriter));
+  memcpy(writer.header.magic, INVENTORY_MAGIC, sizeof(writer.header.magic));
+  writer.header.version = INVENTORY_VERSION;
+  writer.header.group_rows = INVENTORY_GROUP_ROWS;
+  BTRFS_GetFSID(writer.header.fsid);
+  writer.header.generation = BTRFS_GetGeneration();
+
+  writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer.fd < 0) return -1;
+
+  if (Inventory_GroupInit(&writer.inodes, InventoryTable_Inodes, inode_columns,
+                          sizeof(inode_columns)) != 0 ||
+      Inventory_GroupInit(&writer.links, InventoryTable_Links, link_columns,
+                          sizeof(link_columns)) != 0)
+    goto done;
+
+  // The header is rewritten with the final counts once everything is out.
+  if (write(writer.fd, &writer.header, sizeof(InventoryHeader)) !=
+      sizeof(InventoryHeader))
+    goto done;
+
+  if (BTRFS_EnumerateInodes(Inventory_Visit, &writer) != 0) goto done;
+  if (Inventory_GroupFlush(&writer, &writer.inodes) != 0) goto done;
+  if (Inventory_GroupFlush(&writer, &writer.links) != 0) goto done;
+
+  if (pwrite(writer.fd, &writer.header, sizeof(InventoryHeader), 0) !=
+      sizeof(InventoryHeader))
+    goto done;
+
+  retVal = 0;
+
+done:
+  Inventory_GroupFree(&writer.inodes);
+  Inventory_GroupFree(&writer.links);
+  if (close(writer.fd) != 0) retVal = -1;
+  return retVal;
+}
+
+typedef struct {
+  uint64_t ino;
+  uint64_t parent;
+  char *name;
+} InventoryLink;
+
+static int Inventory_LinkCompare(const void *a, const void *b) {
+  const InventoryLink *x = a;
+  const InventoryLink *y = b;
+  if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
+
+static InventoryLink *Inventory_FindLink(InventoryLink *links, uint64_t count,
+                                         uint64_t ino) {
+  InventoryLink key = {ino, 0, NULL};
+  InventoryLink *link =
+      bsearch(&key, links, count, sizeof(InventoryLink), Inventory_LinkCompare);
+
+  // Hard links: always resolve through the first name of an inode.
+  while (link != NULL && link > links && link[-1].ino == ino) link--;
+  return link;
+}
+
+static void Inventory_BuildPath(InventoryLink *links, uint64_t count,
+                                uint64_t ino, char *path, size_t path_len) {
+  char *end = path + path_len - 1;
+  char *pos = end;
+  *pos = '\0';
+
+  for (int depth = 0; depth < 4096; depth++) {
+    InventoryLink *link = Inventory_FindLink(links, count, ino);
+    if (link == NULL || link->parent == ino) break;
+
+    size_t len = strlen(link->name);
+    if ((size_t)(pos - path) < len + 1) break;
+    pos -= len;
+    memcpy(pos, link->name, len);
+    *--pos = '/';
+    ino = link->parent;
+  }
+
+  if (pos == end) *--pos = '/';
+  memmove(path, pos, end - pos + 1);
+}
+
+static uint64_t Inventory_Get(uint8_t *column, uint8_t width, uint32_t row) {
+  uint64_t value = 0;
+  memcpy(&value, column + (size_t)row * width, width);
+  return value;
+}
+
+static int Inventory_ReadGroup(FILE *f, InventoryGroupHeader *hdr,
+                               const uint8_t *widths, int column_count,
+                               uint8_t **columns, char **heap) {
+  for (int i = 0; i < column_count; i++) {
+    size_t len = (size_t)widths[i] * hdr->rows;
+    columns[i] = malloc(len ? len : 1);
+    if (columns[i] == NULL || fread(columns[i], 1, len, f) != len) return -1;
+  }
+  *heap = malloc(hdr->heap_bytes + 1);
+  if (*heap == NULL || fread(*heap, 1, hdr->heap_bytes, f) != hdr->heap_bytes)
+    return -1;
+  return 0;
+}
+
+static uint64_t Inventory_GroupBytes(InventoryGroupHeader *hdr,
+                                     const uint8_t *widths, int column_count) {
+  uint64_t bytes = hdr->heap_bytes;
+  for (int i = 0; i < column_count; i++)
+    bytes += (uint64_t)widths[i] * hdr->rows;
+  return bytes;
+}
+
+int Inventory_Print(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return -1;
+
+  InventoryHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, INVENTORY_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != INVENTORY_VERSION) {
+    fclose(f);
+    return -1;
+  }
+
+  InventoryLink *links = malloc(sizeof(InventoryLink) * (header.link_count + 1));
+  uint64_t link_count = 0;
+  int retVal = -1;
+  if (links == NULL) goto done;
+
+  // First pass: load the link table so paths can be rebuilt.
+  InventoryGroupHeader hdr;
+  while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+    if (hdr.table != InventoryTable_Links) {
+      if (fseek(f,
+                Inventory_GroupBytes(&hdr, inode_columns,
+                                     sizeof(inode_columns)),
+                SEEK_CUR) != 0)
+        goto done;
+      continue;
+    }
+
+    uint8_t *columns[INVENTORY_MAX_COLUMNS] = {NULL};
+    char *heap = NULL;
+    int err = Inventory_ReadGroup(f, &hdr, link_columns, sizeof(link_columns),
+                                  columns, &heap);
+    for (uint32_t r = 0; err == 0 && r < hdr.rows; r++) {
+      uint64_t off = Inventory_Get(columns[2], link_columns[2], r);
+      uint64_t len = Inventory_Get(columns[3], link_columns[3], r);
+      if (link_count == header.link_count || off + len > hdr.heap_bytes) {
+        err = -1;
+        break;
+      }
+      InventoryLink *link = &links[link_count++];
+      link->ino = Inventory_Get(columns[0], link_columns[0], r);
+      link->parent = Inventory_Get(columns[1], link_columns[1], r);
+      link->name = malloc(len + 1);
+      if (link->name == NULL) {
+        link_count--;
+        err = -1;
+        break;
+      }
+      memcpy(link->name, heap + off, len);
+      link->name[len] = '\0';
+    }
+    for (size_t i = 0; i < sizeof(link_columns); i++) free(columns[i]);
+    free(heap);
+    if (err != 0) goto done;
+  }
+
+  // Links are written in key order, so this is usually a no-op.
+  qsort(links, link_count, sizeof(InventoryLink), Inventory_LinkCompare);
+
+  // Second pass: one line per inode.
+  if (fseek(f, sizeof(InventoryHeader), SEEK_SET) != 0) goto done;
+  printf("ino\tmode\tnlink\tuid\tgid\tsize\tmtime\tpath\n");
+  while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+    if (hdr.table != InventoryTable_Inodes) {
+      if (fseek(f,
+                Inventory_GroupBytes(&hdr, link_columns,
+                                     sizeof(link_columns)),
+                SEEK_CUR) != 0)
+        goto done;
+      continue;
+    }
+
+    uint8_t *columns[INVENTORY_MAX_COLUMNS] = {NULL};
+    char *heap = NULL;
+    int err = Inventory_ReadGroup(f, &hdr, inode_columns,
+                                  sizeof(inode_columns), columns, &heap);
+    for (uint32_t r = 0; err == 0 && r < hdr.rows; r++) {
+      char file_path[4096];
+      uint64_t ino = Inventory_Get(columns[0], inode_columns[0], r);
+      Inventory_BuildPath(links, link_count, ino, file_path,
+                          sizeof(file_path));
+      printf("%llu\t%06llo\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n",
+             (unsigned long long)ino,
+             (unsigned long long)Inventory_Get(columns[1], inode_columns[1], r),
+             (unsigned long long)Inventory_Get(columns[2], inode_columns[2], r),
+             (unsigned long long)Inventory_Get(columns[3], inode_columns[3], r),
+             (unsigned long long)Inventory_Get(columns[4], inode_columns[4], r),
+             (unsigned long long)Inventory_Get(columns[5], inode_columns[5], r),
+             (unsigned long long)Inventory_Get(columns[9], inode_columns[9], r),
+             file_path);
+    }
+    for (size_t i = 0; i < sizeof(inode_columns); i++) free(columns[i]);
+    free(heap);
+    if (err != 0) goto done;
+  }
+
+  retVal = 0;
+
+done:
+  for (uint64_t i = 0; i < link_count; i++) free(links[i].name);
+  free(links);
+  fclose(f);
+  return retVal;
+}
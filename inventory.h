@@ -0,0 +1,63 @@
+// Copyright (c) 2017 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef BTRFS_INVENTORY_H_
+#define BTRFS_INVENTORY_H_
+
+#include <stdint.h>
+
+// An inventory file is a header followed by row groups. Every group holds up
+// to INVENTORY_GROUP_ROWS rows of one table, stored column by column with
+// fixed width values, and ends with a heap for the variable length strings.
+//
+// The inode table has one row per INODE_ITEM. The link table has one row per
+// name in an INODE_REF or INODE_EXTREF, giving the parent directory and the
+// name, from which paths are rebuilt on load.
+
+#define INVENTORY_MAGIC "BTRFSINV"
+#define INVENTORY_VERSION 1
+#define INVENTORY_GROUP_ROWS 65536
+
+typedef enum {
+  InventoryTable_Inodes = 0,
+  InventoryTable_Links = 1,
+} InventoryTable;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t group_rows;
+  uint8_t fsid[16];
+  uint64_t generation;
+  uint64_t inode_count;
+  uint64_t link_count;
+} __attribute__((packed)) InventoryHeader;
+
+typedef struct {
+  uint32_t table;
+  uint32_t rows;
+  uint64_t heap_bytes;
+} __attribute__((packed)) InventoryGroupHeader;
+
+///
+/// @brief      Write the inventory of the parsed volume's FS tree.
+///
+/// @param      path  The output file
+///
+/// @return     -1 on error, 0 on success.
+///
+int Inventory_Export(const char *path);
+
+///
+/// @brief      Print an inventory file as tab separated text, one line per
+///             inode, without touching the image it was taken from.
+///
+/// @param      path  The inventory file
+///
+/// @return     -1 on error, 0 on success.
+///
+int Inventory_Print(const char *path);
+
+#endif
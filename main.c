@@ -5,45 +5,571 @@
  * https://opensource.org/licenses/MIT
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include "btrfs/btrfs.h"
+#include "btrfs/extent.h"
+#include "archive.h"
+#include "inventory.h"
+#include "restore.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include "btrfs/btrfs.h"
+// Large enough for the device to stream, small enough to stay in cache.
+#define CLONE_IO_SIZE (8 * 1024 * 1024)
+#define SUPERBLOCK_SIZE 0x1000
+#define OWNERS_INDEX_THRESHOLD 64
+
+static BTRFS_BackendType backend = Backend_Pread;
+static const char *sidecar_path = NULL;
+static bool show_stats = false;
+static const char *record_path = NULL;
+
+// Devices of a filesystem spread over several files or block devices are
+// given separated by commas.
+#define MAX_DEVICES 16
+
+static const char *device_paths[MAX_DEVICES];
+static int device_count = 0;
+
+static int open_image(const char *path) {
+  static char paths[4096];
+  snprintf(paths, sizeof(paths), "%s", path);
+
+  device_count = 0;
+  for (char *save = NULL, *p = strtok_r(paths, ",", &save);
+       p != NULL && device_count < MAX_DEVICES; p = strtok_r(NULL, ",", &save))
+    device_paths[device_count++] = p;
 
-static FILE *fd = NULL;
+  BTRFS_InitializeStructures(32 * 1024);
+  int err = BTRFS_OpenDevices(device_paths, device_count, backend);
+  if (err != 0) {
+    printf(err == -2 ? "The devices are not of one filesystem.\n"
+                     : "Failed to load image.\n");
+    return -1;
+  }
 
-uint64_t disk_read(void *buf, uint64_t devID, uint64_t off, uint64_t len) {
-  fseek(fd, off, SEEK_SET);
-  return fread(buf, 1, len, fd);
+  if (BTRFS_StartParserWithSidecar(sidecar_path) != 0) {
+    printf("Failed to parse image.\n");
+    BTRFS_CloseDevices();
+    return -1;
+  }
+  return 0;
 }
 
-uint64_t disk_write(void *buf, uint64_t devID, uint64_t off, uint64_t len) {
-  return -1;
+static int cmd_inventory(int argc, char *argv[]) {
+  if (argc != 4) {
+    printf("Usage: %s inventory <image> <output>\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  int retVal = Inventory_Export(argv[3]);
+  if (retVal != 0) printf("Failed to write inventory.\n");
+
+  BTRFS_CloseDevices();
+  return retVal != 0;
 }
 
-int main(int argc, char *argv[]) {
-  fd = fopen(argv[1], "rb");
-  if (fd == NULL) {
-    printf("Failed to load image.");
-    return 0;
+static int cmd_inventory_dump(int argc, char *argv[]) {
+  if (argc != 3) {
+    printf("Usage: %s inventory-dump <inventory>\n", argv[0]);
+    return 1;
   }
 
+  if (Inventory_Print(argv[2]) != 0) {
+    fprintf(stderr, "Failed to read inventory.\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int cmd_lookup(int argc, char *argv[]) {
+  if (argc != 4) {
+    printf("Usage: %s lookup <image> <path>\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  uint64_t inode = 0;
+  int retVal = BTRFS_ParseFullFSTree(argv[3], &inode);
+  if (retVal == 0)
+    printf("%llu\n", (unsigned long long)inode);
+  else
+    printf("Failed to resolve %s: %d\n", argv[3], retVal);
+
+  BTRFS_CloseDevices();
+  return retVal != 0;
+}
+
+static int copy_range(int out, uint8_t *buf, uint64_t off, uint64_t len) {
+  while (len > 0) {
+    uint64_t n = len < CLONE_IO_SIZE ? len : CLONE_IO_SIZE;
+    if (BTRFS_ReadRaw(buf, 0, off, n) != n) return -1;
+    for (uint64_t done = 0; done < n;) {
+      ssize_t w = pwrite(out, buf + done, n - done, off + done);
+      if (w <= 0) return -1;
+      done += w;
+    }
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Copy only the allocated space and the superblocks into a sparse image of
+// the same size, in device order.
+static int cmd_clone(int argc, char *argv[]) {
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s clone <image> <output> [threads]\n", argv[0]);
+    return 1;
+  }
+  int threads = argc == 5 ? atoi(argv[4]) : 4;
+  if (open_image(argv[2]) != 0) return 1;
+
+  // The output is one image, so only single device filesystems clone.
+  if (device_count != 1) {
+    printf("Only a single device can be cloned.\n");
+    BTRFS_CloseDevices();
+    return 1;
+  }
+
+  uint64_t size = BTRFS_GetDeviceSize(0);
+  BTRFS_AllocMap map;
+  BTRFS_PhysicalRange *ranges = NULL;
+  size_t count = 0;
+
+  if (BTRFS_BuildAllocMap(threads, &map) != 0) {
+    printf("Failed to read the extent tree.\n");
+    BTRFS_CloseDevices();
+    return 1;
+  }
+  if (BTRFS_AllocMapToPhysical(&map, &ranges, &count) != 0) {
+    printf("Failed to read the chunk tree.\n");
+    BTRFS_FreeAllocMap(&map);
+    BTRFS_CloseDevices();
+    return 1;
+  }
+
+  int out = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  uint8_t *buf = malloc(CLONE_IO_SIZE);
+  int retVal = out < 0 || buf == NULL || ftruncate(out, size) != 0;
+
+  // Device 0 is the one device, whatever id its ranges carry.
+  uint64_t copied = 0;
+  for (size_t i = 0; retVal == 0 && i < count; i++) {
+    uint64_t len = ranges[i].length;
+    if (ranges[i].physical_addr >= size) continue;
+    if (len > size - ranges[i].physical_addr)
+      len = size - ranges[i].physical_addr;
+    retVal = copy_range(out, buf, ranges[i].physical_addr, len) != 0;
+    copied += len;
+  }
+  for (int i = 0; retVal == 0 && BTRFS_superblock_offsets[i] != 0; i++) {
+    uint64_t off = BTRFS_superblock_offsets[i];
+    if (off + SUPERBLOCK_SIZE <= size)
+      retVal = copy_range(out, buf, off, SUPERBLOCK_SIZE) != 0;
+  }
+
+  if (retVal != 0)
+    printf("Failed to write %s.\n", argv[3]);
+  else
+    printf("Copied %llu of %llu bytes in %zu ranges, %llu bytes allocated "
+           "in %zu block groups\n",
+           (unsigned long long)copied, (unsigned long long)size, count,
+           (unsigned long long)map.allocated_bytes, map.block_group_count);
+
+  free(buf);
+  if (out >= 0 && close(out) != 0) retVal = 1;
+  free(ranges);
+  BTRFS_FreeAllocMap(&map);
+  BTRFS_CloseDevices();
+  return retVal;
+}
+
+static int print_owner(const BTRFS_BackRef *ref, void *context) {
+  printf("%llx\t%llu\t%llu\t%llu\n",
+         (unsigned long long)*(uint64_t *)context, (unsigned long long)ref->root,
+         (unsigned long long)ref->inode, (unsigned long long)ref->offset);
+  return 0;
+}
+
+// Print the owners of logical addresses. Past a few addresses one scan of
+// the extent tree is cheaper than a search for each.
+static int cmd_owners(int argc, char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s owners <image> <logical>...\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  BTRFS_BackRefIndex index;
+  bool use_index = argc - 3 > OWNERS_INDEX_THRESHOLD;
+  int retVal = use_index ? BTRFS_BuildBackRefIndex(4, &index) : 0;
+
+  for (int i = 3; retVal == 0 && i < argc; i++) {
+    uint64_t logical = strtoull(argv[i], NULL, 0);
+    if (use_index)
+      retVal = BTRFS_BackRefIndexLookup(&index, logical, print_owner, &logical);
+    else
+      retVal = BTRFS_ResolveLogical(logical, print_owner, &logical);
+  }
+  if (retVal != 0) printf("Failed to read the extent tree.\n");
+
+  if (use_index) BTRFS_FreeBackRefIndex(&index);
+  BTRFS_CloseDevices();
+  return retVal != 0;
+}
+
+static int print_path(uint64_t inode, const char *path, void *context) {
+  printf("%llu\t%s\n", (unsigned long long)inode, path);
+  return 0;
+}
+
+// Print every path of inodes, hard links included.
+static int cmd_paths(int argc, char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s paths <image> <inode>...\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  uint64_t *inodes = malloc((argc - 3) * sizeof(uint64_t));
+  int retVal = inodes == NULL;
+  for (int i = 3; retVal == 0 && i < argc; i++)
+    inodes[i - 3] = strtoull(argv[i], NULL, 0);
+
+  if (retVal == 0)
+    retVal = BTRFS_InodesToPaths(inodes, argc - 3, print_path, NULL);
+  if (retVal != 0) printf("Failed to read the filesystem tree.\n");
+
+  free(inodes);
+  BTRFS_CloseDevices();
+  return retVal != 0;
+}
+
+static int print_change(BTRFS_DiffChange change, BTRFS_Key *key,
+                        void *old_item, uint32_t old_size, void *new_item,
+                        uint32_t new_size, void *context) {
+  static const char *changes[] = {"added", "removed", "changed"};
+  printf("%s\t%llu %u %llu\n", changes[change],
+         (unsigned long long)key->object_id, key->type,
+         (unsigned long long)key->offset);
+  return 0;
+}
+
+// Print the items that differ between two trees, a snapshot and the
+// subvolume it was taken of for instance.
+static int cmd_diff(int argc, char *argv[]) {
+  if (argc != 5) {
+    printf("Usage: %s diff <image> <old tree> <new tree>\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  uint64_t roots[2];
   int retVal = 0;
+  for (int i = 0; retVal == 0 && i < 2; i++) {
+    retVal = BTRFS_GetTreeRoot(strtoull(argv[3 + i], NULL, 0), &roots[i],
+                               NULL);
+    if (retVal == -2) printf("No tree %s.\n", argv[3 + i]);
+  }
 
+  if (retVal == 0)
+    retVal = BTRFS_DiffTrees(roots[0], roots[1], 0, print_change, NULL);
+  if (retVal == -1) printf("Failed to read the trees.\n");
+
+  BTRFS_CloseDevices();
+  return retVal != 0;
+}
+
+// Print a fingerprint of the contents of each inode.
+static int cmd_fingerprint(int argc, char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s fingerprint <image> <inode>...\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  int failed = 0;
+  for (int i = 3; i < argc; i++) {
+    uint64_t inode = strtoull(argv[i], NULL, 0);
+    uint8_t digest[BTRFS_FINGERPRINT_SIZE];
+
+    int err = BTRFS_FileFingerprint(inode, digest);
+    if (err != 0) {
+      printf("%llu\t%s\n", (unsigned long long)inode,
+             err == -2 ? "no such inode" : "read failure");
+      failed++;
+      continue;
+    }
+
+    printf("%llu\t", (unsigned long long)inode);
+    for (int j = 0; j < BTRFS_FINGERPRINT_SIZE; j++) printf("%02x", digest[j]);
+    printf("\n");
+  }
+
+  BTRFS_CloseDevices();
+  return failed != 0;
+}
+
+// Recreate a subtree of the image under a host directory.
+static int cmd_restore(int argc, char *argv[]) {
+  if (argc != 5 && argc != 6) {
+    printf("Usage: %s restore <image> <path> <output> [threads]\n", argv[0]);
+    return 1;
+  }
+  int threads = argc == 6 ? atoi(argv[5]) : 4;
+  if (open_image(argv[2]) != 0) return 1;
+
+  long failed = Restore_Subtree(argv[3], argv[4], threads);
+  if (failed < 0)
+    printf("Failed to read %s.\n", argv[3]);
+  else if (failed > 0)
+    printf("%ld entries could not be restored.\n", failed);
+
+  BTRFS_CloseDevices();
+  return failed != 0;
+}
+
+// Write a subtree of the image as a tar archive, to stdout by default.
+static int cmd_tar(int argc, char *argv[]) {
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s tar <image> <path> [output]\n", argv[0]);
+    return 1;
+  }
+
+  // Messages go to stderr so they cannot end up in the archive.
+  int out = dup(STDOUT_FILENO);
+  if (out < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) return 1;
+  if (argc == 5 && strcmp(argv[4], "-") != 0) {
+    close(out);
+    out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+      printf("Failed to open %s.\n", argv[4]);
+      return 1;
+    }
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  long failed = Archive_WriteTar(argv[3], out);
+  if (failed < 0)
+    printf("Failed to write the archive of %s.\n", argv[3]);
+  else if (failed > 0)
+    printf("%ld files could not be read.\n", failed);
+
+  if (close(out) != 0) failed = -1;
+  BTRFS_CloseDevices();
+  return failed != 0;
+}
+
+// Check every tree block against its checksum and the extent tree.
+static int cmd_scrub_metadata(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s scrub-metadata <image> [threads]\n", argv[0]);
+    return 1;
+  }
+  int threads = argc == 4 ? atoi(argv[3]) : 4;
+  if (open_image(argv[2]) != 0) return 1;
+
+  BTRFS_MetadataScrub result;
+  if (BTRFS_ScrubMetadata(threads, &result) != 0) {
+    printf("Failed to read the extent tree.\n");
+    BTRFS_CloseDevices();
+    return 1;
+  }
+
+  uint64_t errors = result.read_errors + result.csum_errors +
+                    result.address_errors + result.fsid_errors +
+                    result.level_errors + result.generation_errors;
+  printf("%llu tree blocks, %llu bytes checked\n"
+         "read errors %llu\nchecksum errors %llu\naddress errors %llu\n"
+         "fsid errors %llu\nlevel errors %llu\ngeneration errors %llu\n",
+         (unsigned long long)result.blocks, (unsigned long long)result.bytes,
+         (unsigned long long)result.read_errors,
+         (unsigned long long)result.csum_errors,
+         (unsigned long long)result.address_errors,
+         (unsigned long long)result.fsid_errors,
+         (unsigned long long)result.level_errors,
+         (unsigned long long)result.generation_errors);
+
+  BTRFS_CloseDevices();
+  return errors != 0;
+}
+
+// Checkpoints are saved at most this often while a scrub runs.
+#define CHECKPOINT_INTERVAL_NS 1000000000ull
+
+typedef struct {
+  const char *path;
+  uint64_t saved;
+} ScrubState;
+
+static int save_checkpoint(const BTRFS_ScrubCheckpoint *checkpoint,
+                           void *context) {
+  ScrubState *state = context;
+  uint64_t now = BTRFS_StatsClock();
+  if (now - state->saved < CHECKPOINT_INTERVAL_NS) return 0;
+
+  state->saved = now;
+  if (BTRFS_SaveScrubCheckpoint(state->path, checkpoint) != 0) {
+    printf("Failed to write %s.\n", state->path);
+    return 1;
+  }
+  return 0;
+}
+
+// Verify data, incrementally with a checkpoint. A stopped pass resumes where
+// it left off, and a completed one is followed by a pass over only what was
+// written after it.
+static int cmd_scrub(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s scrub <image> [checkpoint]\n", argv[0]);
+    return 1;
+  }
+  if (open_image(argv[2]) != 0) return 1;
+
+  BTRFS_ScrubCheckpoint checkpoint;
+  ScrubState state = {argc == 4 ? argv[3] : NULL, BTRFS_StatsClock()};
+  if (state.path == NULL ||
+      BTRFS_LoadScrubCheckpoint(state.path, &checkpoint) != 0)
+    BTRFS_StartScrubCheckpoint(&checkpoint, 0);
+  else if (checkpoint.complete)
+    BTRFS_StartScrubCheckpoint(&checkpoint, checkpoint.generation + 1);
+
+  int retVal = BTRFS_ScrubResume(&checkpoint,
+                                 state.path != NULL ? save_checkpoint : NULL,
+                                 &state);
+  if (retVal < 0) printf("Failed to read the checksum tree.\n");
+  if (state.path != NULL &&
+      BTRFS_SaveScrubCheckpoint(state.path, &checkpoint) != 0) {
+    printf("Failed to write %s.\n", state.path);
+    retVal = 1;
+  }
+
+  printf("Generations %llu to %llu: %llu sectors checked, %llu errors\n",
+         (unsigned long long)checkpoint.since,
+         (unsigned long long)checkpoint.generation,
+         (unsigned long long)checkpoint.sectors,
+         (unsigned long long)checkpoint.errors);
+
+  BTRFS_CloseDevices();
+  return retVal != 0 || checkpoint.errors != 0;
+}
+
+static const struct {
+  const char *name;
+  int (*handler)(int argc, char *argv[]);
+} commands[] = {
+    {"inventory", cmd_inventory},
+    {"inventory-dump", cmd_inventory_dump},
+    {"lookup", cmd_lookup},
+    {"clone", cmd_clone},
+    {"fingerprint", cmd_fingerprint},
+    {"owners", cmd_owners},
+    {"paths", cmd_paths},
+    {"diff", cmd_diff},
+    {"restore", cmd_restore},
+    {"scrub", cmd_scrub},
+    {"scrub-metadata", cmd_scrub_metadata},
+    {"tar", cmd_tar},
+};
+
+// Stats go to stderr, so they can follow a command writing to stdout.
+static void print_stats(void) {
+  static const char *trees[BTRFS_STATS_TREES] = {"root", "chunk", "extent",
+                                                 "fs", "checksum", "other"};
+  BTRFS_Stats stats;
+  BTRFS_GetStats(&stats);
+
+  for (int i = 0; i < BTRFS_STATS_TREES; i++)
+    fprintf(stderr, "node reads %-8s %llu\n", trees[i],
+            (unsigned long long)stats.node_reads[i]);
+  fprintf(stderr, "path hits %llu misses %llu\n",
+          (unsigned long long)stats.path_hits,
+          (unsigned long long)stats.path_misses);
+  fprintf(stderr, "csum hits %llu misses %llu\n",
+          (unsigned long long)stats.csum_hits,
+          (unsigned long long)stats.csum_misses);
+  fprintf(stderr, "reads %llu bytes %llu avg %llu ns\n",
+          (unsigned long long)stats.read_calls,
+          (unsigned long long)stats.read_bytes,
+          (unsigned long long)(stats.read_calls
+                                   ? stats.read_ns / stats.read_calls
+                                   : 0));
+  for (int i = 0; i < BTRFS_STATS_DEVICES; i++)
+    if (stats.device_bytes[i] != 0)
+      fprintf(stderr, "device %d bytes %llu\n", i,
+              (unsigned long long)stats.device_bytes[i]);
+  fprintf(stderr, "checksum bytes %llu time %llu us\n",
+          (unsigned long long)stats.checksum_bytes,
+          (unsigned long long)stats.checksum_ns / 1000);
+  fprintf(stderr, "translation misses %llu\n",
+          (unsigned long long)stats.translation_misses);
+  fprintf(stderr, "allocations %llu bytes %llu failed %llu\n",
+          (unsigned long long)stats.allocations,
+          (unsigned long long)stats.allocation_bytes,
+          (unsigned long long)stats.allocation_failures);
+
+  static const char *ops[BTRFS_TRACE_OPS] = {"lookup", "read", "node",
+                                             "nodes"};
+  for (int i = 0; i < BTRFS_TRACE_OPS; i++) {
+    BTRFS_LatencyHistogram histogram;
+    BTRFS_GetLatencyHistogram(i, &histogram);
+    if (histogram.count == 0) continue;
+    fprintf(stderr, "%s calls %llu p50 %llu p99 %llu p999 %llu ns\n", ops[i],
+            (unsigned long long)histogram.count,
+            (unsigned long long)BTRFS_LatencyPercentile(&histogram, 50),
+            (unsigned long long)BTRFS_LatencyPercentile(&histogram, 99),
+            (unsigned long long)BTRFS_LatencyPercentile(&histogram, 99.9));
+  }
+}
+
+// Traced calls are printed as they end, indented by how deep they are.
+static void print_trace(const BTRFS_TraceEvent *event, void *context) {
+  static const char *ops[BTRFS_TRACE_OPS] = {"lookup", "read", "node",
+                                             "nodes"};
+  if (!event->end) return;
+
+  fprintf(stderr, "%*s%s tree %llu level %d inode %llu logical %llx bytes %llu"
+          " result %lld %llu ns\n",
+          event->depth * 2, "", ops[event->op],
+          (unsigned long long)event->tree, event->level,
+          (unsigned long long)event->inode,
+          (unsigned long long)event->logical,
+          (unsigned long long)event->bytes, (long long)event->result,
+          (unsigned long long)event->duration_ns);
+}
+
+static int legacy_demo(int argc, char *argv[]) {
   BTRFS_InitializeStructures(32 * 1024);
-  BTRFS_SetDiskReadHandler(disk_read);
-  BTRFS_SetDiskWriteHandler(disk_write);
+  if (BTRFS_OpenDevices((const char **)&argv[1], 1, backend) != 0) {
+    printf("Failed to load image.");
+    return 0;
+  }
+
+  int retVal = 0;
 
   retVal = BTRFS_StartParser();
 
   printf("RetVal = %d\n", retVal);
 
+  char label[256];
+  BTRFS_GetLabel(label);
+  printf("Label: %s\n", label);
 
   uint64_t inode = 0;
   retVal = BTRFS_ParseFullFSTree("/test/wallpaper.png", &inode);
 
   void *file_buf = malloc(10 * 1024 * 1024);
   uint64_t len = BTRFS_ReadFile(inode, 0, 10 * 1024 * 1024, file_buf);
+  if (len == (uint64_t)-2) printf("Checksum mismatch\n");
+  if (len > 10 * 1024 * 1024) len = 0;
 
    FILE *oF = fopen("test.png", "wb");
    fwrite(file_buf, 1, len, oF);
@@ -66,4 +592,70 @@ int main(int argc, char *argv[]) {
   // The fs tree is traversed for file reads
 
   // The checksum tree is used to verify the filesystem
-}
\ No newline at end of file
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // Global options come before the command and are removed from argv.
+  while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+    int shift = 2;
+    if (strcmp(argv[1], "--verify") == 0) {
+      BTRFS_SetReadVerification(1);
+      shift = 1;
+    } else if (strcmp(argv[1], "--stats") == 0) {
+      BTRFS_SetLatencyHistograms(1);
+      show_stats = true;
+      shift = 1;
+    } else if (strcmp(argv[1], "--record") == 0) {
+      record_path = argv[2];
+    } else if (strcmp(argv[1], "--trace") == 0) {
+      BTRFS_SetTraceCallback(print_trace, NULL);
+      shift = 1;
+    } else if (strcmp(argv[1], "--backend") == 0) {
+      if (strcmp(argv[2], "direct") == 0) {
+        backend = Backend_Direct;
+      } else if (strcmp(argv[2], "pread") != 0) {
+        printf("Unknown backend: %s\n", argv[2]);
+        return 1;
+      }
+    } else if (strcmp(argv[1], "--sidecar") == 0) {
+      sidecar_path = argv[2];
+    } else if (strcmp(argv[1], "--arena") == 0) {
+      size_t size = strtoull(argv[2], NULL, 0) * 1024 * 1024;
+      void *arena = malloc(size);
+      if (arena == NULL || BTRFS_SetArena(arena, size) != 0) {
+        printf("Invalid arena size: %s MiB\n", argv[2]);
+        return 1;
+      }
+    } else {
+      break;
+    }
+    argv[shift] = argv[0];
+    argv += shift;
+    argc -= shift;
+  }
+
+  if (argc < 2) {
+    printf("Usage: %s [--sidecar <file>] [--arena <MiB>] [--verify] [--stats]"
+           " [--trace] [--record <file>] [--backend pread|direct] <command>"
+           " [args...] | %s <image>\n"
+           "Images of several devices are given as <device>,<device>...\n",
+           argv[0], argv[0]);
+    return 1;
+  }
+
+  int (*handler)(int argc, char *argv[]) = legacy_demo;
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    if (strcmp(argv[1], commands[i].name) == 0) handler = commands[i].handler;
+
+  if (record_path != NULL && BTRFS_StartIORecord(record_path) != 0) {
+    printf("Failed to create %s.\n", record_path);
+    return 1;
+  }
+
+  int retVal = handler(argc, argv);
+  if (record_path != NULL && BTRFS_StopIORecord() != 0)
+    printf("Failed to write %s.\n", record_path);
+  if (show_stats) print_stats();
+  return retVal;
+}
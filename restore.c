@@ -0,0 +1,418 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "btrfs/btrfs.h"
+#include "restore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// <sys/stat.h> maps these to struct timespec members, which would clash with
+// the BTRFS_InodeItem fields of the same name.
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define RESTORE_ROOT_DIR 256
+#define RESTORE_PATH_MAX 4096
+
+// A restore runs in phases: the subtree's entries are listed breadth first
+// from the DIR_INDEX items, the inode items are read in inode order, the
+// entries are created, all file data is read in one disk ordered batch, and
+// finally modes and times are applied children first, so that writing into
+// a directory does not disturb its restored times.
+
+typedef struct {
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  uint64_t rdev;
+  BTRFS_Time atime;
+  BTRFS_Time mtime;
+} RestoreInode;
+
+typedef struct {
+  uint64_t inode;
+  size_t parent;
+  size_t name;
+  uint16_t name_len;
+  uint8_t type;
+  // The first entry of the same inode, the others are hard links to it.
+  size_t link;
+  size_t meta;
+  bool failed;
+} RestoreEntry;
+
+typedef struct {
+  RestoreEntry *entries;
+  size_t count;
+  size_t capacity;
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
+  RestoreInode *inodes;
+  size_t inode_count;
+  const char *output;
+  atomic_long failed;
+} Restore;
+
+// The destination of one file's data.
+typedef struct {
+  Restore *restore;
+  size_t entry;
+  atomic_int failed;
+} RestoreFile;
+
+static int Restore_AddEntry(Restore *restore, uint64_t inode, size_t parent,
+                            const char *name, uint16_t name_len,
+                            uint8_t type) {
+  if (restore->count == restore->capacity) {
+    size_t capacity = restore->capacity ? restore->capacity * 2 : 1024;
+    RestoreEntry *grown =
+        realloc(restore->entries, capacity * sizeof(RestoreEntry));
+    if (grown == NULL) return -1;
+    restore->entries = grown;
+    restore->capacity = capacity;
+  }
+  if (restore->names_len + name_len > restore->names_capacity) {
+    size_t capacity = restore->names_capacity ? restore->names_capacity : 65536;
+    while (capacity < restore->names_len + name_len) capacity *= 2;
+    char *grown = realloc(restore->names, capacity);
+    if (grown == NULL) return -1;
+    restore->names = grown;
+    restore->names_capacity = capacity;
+  }
+
+  memcpy(restore->names + restore->names_len, name, name_len);
+  restore->entries[restore->count++] = (RestoreEntry){
+      inode, parent, restore->names_len, name_len, type, 0, 0, false};
+  restore->names_len += name_len;
+  return 0;
+}
+
+// Build the host path of an entry. Returns -1 if it is too long.
+static int Restore_Path(Restore *restore, size_t index, char *path) {
+  char *end = path + RESTORE_PATH_MAX - 1;
+  char *pos = end;
+  *pos = '\0';
+
+  for (; index != 0; index = restore->entries[index].parent) {
+    RestoreEntry *entry = &restore->entries[index];
+    if ((size_t)(pos - path) < entry->name_len + 1) return -1;
+    pos -= entry->name_len;
+    memcpy(pos, restore->names + entry->name, entry->name_len);
+    *--pos = '/';
+  }
+
+  size_t len = strlen(restore->output);
+  if ((size_t)(pos - path) < len) return -1;
+  pos -= len;
+  memcpy(pos, restore->output, len);
+  memmove(path, pos, end - pos + 1);
+  return 0;
+}
+
+static void Restore_Fail(Restore *restore, size_t index, const char *what) {
+  char path[RESTORE_PATH_MAX];
+  if (Restore_Path(restore, index, path) != 0) strcpy(path, "(too long)");
+  fprintf(stderr, "%s: %s\n", path, what);
+  restore->entries[index].failed = true;
+  atomic_fetch_add(&restore->failed, 1);
+}
+
+// Add the entries of a directory, from its DIR_INDEX items so they come in
+// creation order.
+static int Restore_ListDirectory(Restore *restore, BTRFS_Path *path,
+                                 size_t index) {
+  uint64_t dir = restore->entries[index].inode;
+  BTRFS_Key key = {dir, KeyType_DirIndex, 0};
+  int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+
+  while (err == 0) {
+    BTRFS_Key *found = BTRFS_PathKey(path);
+    if (found->object_id != dir || found->type != KeyType_DirIndex) break;
+
+    uint32_t size = 0;
+    BTRFS_DirectoryIndex *item = BTRFS_PathItem(path, &size);
+    const char *name = item->name_data;
+    uint16_t name_len = item->name_len;
+
+    // Subvolumes live in trees of their own and are left out.
+    bool valid = size >= sizeof(BTRFS_DirectoryIndex) + name_len &&
+                 item->key.type == KeyType_InodeItem && name_len > 0 &&
+                 memchr(name, '/', name_len) == NULL &&
+                 !(name_len == 1 && name[0] == '.') &&
+                 !(name_len == 2 && name[0] == '.' && name[1] == '.');
+    if (valid && Restore_AddEntry(restore, item->key.object_id, index, name,
+                                  name_len, item->type) != 0)
+      return -1;
+
+    err = BTRFS_NextItem(path);
+  }
+  return err < 0 ? -1 : 0;
+}
+
+static int Restore_CompareEntries(const void *a, const void *b) {
+  const RestoreEntry *x = *(const RestoreEntry **)a;
+  const RestoreEntry *y = *(const RestoreEntry **)b;
+  if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+// Read every inode item once, in inode order, and link the entries of each
+// inode to the first of them.
+static int Restore_LoadInodes(Restore *restore, BTRFS_Path *path) {
+  RestoreEntry **order = malloc(restore->count * sizeof(RestoreEntry *));
+  restore->inodes = malloc(restore->count * sizeof(RestoreInode));
+  if (order == NULL || restore->inodes == NULL) {
+    free(order);
+    return -1;
+  }
+
+  for (size_t i = 0; i < restore->count; i++) order[i] = &restore->entries[i];
+  qsort(order, restore->count, sizeof(RestoreEntry *), Restore_CompareEntries);
+
+  int retVal = 0;
+  for (size_t i = 0; retVal == 0 && i < restore->count; i++) {
+    RestoreEntry *entry = order[i];
+    if (i > 0 && order[i - 1]->inode == entry->inode) {
+      entry->link = order[i - 1]->link;
+      entry->meta = order[i - 1]->meta;
+      continue;
+    }
+    entry->link = entry - restore->entries;
+    entry->meta = restore->inode_count;
+
+    BTRFS_Key key = {entry->inode, KeyType_InodeItem, 0};
+    int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, path);
+    if (err < 0) {
+      retVal = -1;
+      break;
+    }
+
+    RestoreInode *meta = &restore->inodes[restore->inode_count++];
+    memset(meta, 0, sizeof(RestoreInode));
+    if (err == 0 && BTRFS_CompareKeys(BTRFS_PathKey(path), &key) == 0) {
+      BTRFS_InodeItem *item = BTRFS_PathItem(path, NULL);
+      meta->mode = item->st_mode;
+      meta->uid = item->st_uid;
+      meta->gid = item->st_gid;
+      meta->size = item->st_size;
+      meta->rdev = item->st_rdev;
+      meta->atime = item->st_atime;
+      meta->mtime = item->st_mtime;
+    }
+  }
+
+  free(order);
+  return retVal;
+}
+
+static bool Restore_IsZero(const uint8_t *data, uint64_t len) {
+  return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+// Write one piece of a file. Pieces of zeros are skipped, the file was
+// already extended to its size so they read back as holes.
+static int Restore_Write(uint64_t inode, uint64_t offset, const void *data,
+                         uint64_t len, void *context) {
+  RestoreFile *file = context;
+  const char *error = NULL;
+
+  if (data == NULL) {
+    error = "unreadable data";
+  } else if (!Restore_IsZero(data, len)) {
+    char path[RESTORE_PATH_MAX];
+    int fd = -1;
+    if (Restore_Path(file->restore, file->entry, path) != 0 ||
+        (fd = open(path, O_WRONLY)) < 0)
+      error = strerror(errno);
+
+    for (uint64_t done = 0; error == NULL && done < len;) {
+      ssize_t n = pwrite(fd, (const uint8_t *)data + done, len - done,
+                         offset + done);
+      if (n <= 0)
+        error = strerror(errno);
+      else
+        done += n;
+    }
+    if (fd >= 0 && close(fd) != 0 && error == NULL) error = strerror(errno);
+  }
+
+  // A file is only reported once, however many of its pieces fail.
+  if (error != NULL && atomic_exchange(&file->failed, 1) == 0)
+    Restore_Fail(file->restore, file->entry, error);
+  return 0;
+}
+
+static int Restore_Symlink(Restore *restore, size_t index, const char *path) {
+  RestoreEntry *entry = &restore->entries[index];
+  RestoreInode *meta = &restore->inodes[entry->meta];
+  char target[RESTORE_PATH_MAX];
+
+  if (meta->size >= RESTORE_PATH_MAX) return -1;
+  if (BTRFS_ReadFile(entry->inode, 0, meta->size, target) != meta->size)
+    return -1;
+  target[meta->size] = '\0';
+  return symlink(target, path);
+}
+
+// Create an entry, adding a read request for the data of regular files.
+static int Restore_Create(Restore *restore, size_t index,
+                          BTRFS_ReadRequest *requests, RestoreFile *files,
+                          size_t *request_count) {
+  RestoreEntry *entry = &restore->entries[index];
+  RestoreInode *meta = &restore->inodes[entry->meta];
+  char path[RESTORE_PATH_MAX];
+  int err = 0;
+
+  if (Restore_Path(restore, index, path) != 0) {
+    Restore_Fail(restore, index, "path too long");
+    return 0;
+  }
+  if (entry->parent != index && restore->entries[entry->parent].failed) {
+    Restore_Fail(restore, index, "parent directory not restored");
+    return 0;
+  }
+
+  if (entry->link != index) {
+    if (restore->entries[entry->link].failed) {
+      Restore_Fail(restore, index, "hard link target not restored");
+      return 0;
+    }
+    char target[RESTORE_PATH_MAX];
+    if (Restore_Path(restore, entry->link, target) == 0)
+      err = link(target, path);
+    if (err != 0) Restore_Fail(restore, index, strerror(errno));
+    return 0;
+  }
+
+  switch (meta->mode & S_IFMT) {
+    case S_IFDIR:
+      // Writable until the final modes are applied.
+      err = mkdir(path, 0700);
+      if (err != 0 && errno == EEXIST) err = 0;
+      break;
+    case S_IFREG: {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0 || ftruncate(fd, meta->size) != 0) err = -1;
+      if (fd >= 0 && close(fd) != 0) err = -1;
+      if (err == 0 && meta->size > 0) {
+        files[*request_count] = (RestoreFile){restore, index, 0};
+        requests[*request_count] =
+            (BTRFS_ReadRequest){entry->inode, 0, meta->size, Restore_Write,
+                                &files[*request_count]};
+        (*request_count)++;
+      }
+    } break;
+    case S_IFLNK:
+      err = Restore_Symlink(restore, index, path);
+      break;
+    case S_IFIFO:
+      err = mkfifo(path, 0600);
+      break;
+    case S_IFCHR:
+    case S_IFBLK:
+      err = mknod(path, (meta->mode & S_IFMT) | 0600,
+                  makedev(meta->rdev >> 20, meta->rdev & 0xfffff));
+      break;
+    default:
+      // Sockets only exist while something listens on them.
+      return 0;
+  }
+
+  if (err != 0) Restore_Fail(restore, index, strerror(errno));
+  return 0;
+}
+
+static void Restore_SetAttributes(Restore *restore, size_t index) {
+  RestoreEntry *entry = &restore->entries[index];
+  RestoreInode *meta = &restore->inodes[entry->meta];
+  char path[RESTORE_PATH_MAX];
+
+  if (entry->failed || entry->link != index ||
+      (meta->mode & S_IFMT) == S_IFSOCK ||
+      Restore_Path(restore, index, path) != 0)
+    return;
+
+  bool symlink = (meta->mode & S_IFMT) == S_IFLNK;
+  int err = 0;
+  if (geteuid() == 0) err = lchown(path, meta->uid, meta->gid);
+  if (err == 0 && !symlink) err = chmod(path, meta->mode & 07777);
+
+  struct timespec times[2] = {
+      {meta->atime.seconds, meta->atime.nanoseconds},
+      {meta->mtime.seconds, meta->mtime.nanoseconds},
+  };
+  if (err == 0) err = utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+  if (err != 0) Restore_Fail(restore, index, strerror(errno));
+}
+
+long Restore_Subtree(const char *path, const char *output, int threads) {
+  Restore restore;
+  memset(&restore, 0, sizeof(Restore));
+  restore.output = output;
+  atomic_init(&restore.failed, 0);
+
+  BTRFS_Path tree_path;
+  memset(&tree_path, 0, sizeof(BTRFS_Path));
+  BTRFS_ReadRequest *requests = NULL;
+  RestoreFile *files = NULL;
+  long retVal = -1;
+
+  uint64_t root = RESTORE_ROOT_DIR;
+  if (strcmp(path, "/") != 0 && path[0] != '\0' &&
+      BTRFS_ParseFullFSTree((char *)path, &root) != 0)
+    goto done;
+
+  // Whether the root is a directory is only known once its inode is read,
+  // listing a file just finds nothing.
+  if (Restore_AddEntry(&restore, root, 0, "", 0, FileType_Directory) != 0)
+    goto done;
+  for (size_t i = 0; i < restore.count; i++)
+    if (restore.entries[i].type == FileType_Directory &&
+        Restore_ListDirectory(&restore, &tree_path, i) != 0)
+      goto done;
+
+  if (Restore_LoadInodes(&restore, &tree_path) != 0) goto done;
+  BTRFS_PathRelease(&tree_path);
+
+  requests = malloc(restore.count * sizeof(BTRFS_ReadRequest));
+  files = malloc(restore.count * sizeof(RestoreFile));
+  if (requests == NULL || files == NULL) goto done;
+
+  size_t request_count = 0;
+  for (size_t i = 0; i < restore.count; i++)
+    Restore_Create(&restore, i, requests, files, &request_count);
+
+  if (BTRFS_ReadFiles(requests, request_count, threads) != 0) goto done;
+
+  for (size_t i = restore.count; i > 0; i--)
+    Restore_SetAttributes(&restore, i - 1);
+
+  retVal = atomic_load(&restore.failed);
+
+done:
+  BTRFS_PathRelease(&tree_path);
+  free(files);
+  free(requests);
+  free(restore.inodes);
+  free(restore.names);
+  free(restore.entries);
+  return retVal;
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2017 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef BTRFS_RESTORE_H_
+#define BTRFS_RESTORE_H_
+
+///
+/// @brief      Recreate a subtree of the parsed volume's FS tree on the host.
+///
+/// Directories, regular files, symlinks, hard links, fifos and device nodes
+/// are recreated with their modes and times, and their owners when run as
+/// root. File data is read for all files at once in disk order by a pool of
+/// threads that also write it out; holes and runs of zeros are left sparse.
+///
+/// @param      path     The subtree in the volume, "/" for all of it
+/// @param      output   The directory to restore into, created if missing
+/// @param[in]  threads  The number of reader and writer threads
+///
+/// @return     -1 if the subtree could not be read, otherwise the number of
+///             entries that could not be fully restored.
+///
+long Restore_Subtree(const char *path, const char *output, int threads);
+
+#endif
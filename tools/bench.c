@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// End to end benchmark of the driver against an image and the manifest
+// tools/mkimage wrote for it. Every figure is printed as one JSON object so
+// runs can be compared across versions; data is checked against the
+// manifest's hashes along the way so a fast but wrong build stands out.
+// Compressed files are not decoded by the driver and count as mismatches.
+
+#define _DEFAULT_SOURCE
+
+#include "../btrfs/btrfs.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define READ_CHUNK (1024 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define RANDOM_READS 20000
+#define META_SCRUB_THREADS 4
+#define FNV_OFFSET 1469598103934665603ull
+#define FNV_PRIME 1099511628211ull
+
+typedef struct {
+  uint64_t inode;
+  uint32_t mode;
+  uint64_t size;
+  uint64_t hash;
+  char *path;
+} Entry;
+
+static uint64_t rng_state = 1;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double seconds_since(uint64_t start) {
+  return (BTRFS_StatsClock() - start) / 1e9;
+}
+
+static Entry *load_manifest(const char *path, size_t *count) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return NULL;
+
+  size_t capacity = 1024;
+  Entry *entries = malloc(capacity * sizeof(Entry));
+  char line[4096 + 128];
+  *count = 0;
+
+  while (entries != NULL && fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long inode, size, hash;
+    unsigned int mode;
+    int name_at = 0;
+    if (sscanf(line, "%llu %o %llu %llx %n", &inode, &mode, &size, &hash,
+               &name_at) != 4)
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+
+    if (*count == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, capacity * sizeof(Entry));
+      if (entries == NULL) break;
+    }
+    entries[*count] =
+        (Entry){inode, mode, size, hash, strdup(line + name_at)};
+    (*count)++;
+  }
+  fclose(f);
+  return entries;
+}
+
+// Reads every regular file once, whole and in order, checking its hash.
+static void bench_sequential(Entry *entries, size_t count, uint8_t *buf,
+                             double *mb_s, uint64_t *mismatches) {
+  uint64_t bytes = 0;
+  uint64_t start = BTRFS_StatsClock();
+
+  for (size_t i = 0; i < count; i++) {
+    Entry *e = &entries[i];
+    if (!S_ISREG(e->mode)) continue;
+    // Hard links share the hash of their first name.
+    if (i > 0 && entries[i - 1].inode == e->inode) continue;
+
+    uint64_t hash = FNV_OFFSET;
+    uint64_t off = 0;
+    while (off < e->size) {
+      uint64_t n = BTRFS_ReadFile(e->inode, off, READ_CHUNK, buf);
+      if (n == 0 || n > READ_CHUNK) break;
+      for (uint64_t k = 0; k < n; k++) hash = (hash ^ buf[k]) * FNV_PRIME;
+      off += n;
+    }
+    bytes += off;
+    if (off != e->size || hash != e->hash) (*mismatches)++;
+  }
+
+  *mb_s = bytes / (1024.0 * 1024) / seconds_since(start);
+}
+
+static void bench_random(Entry *entries, size_t count, uint8_t *buf,
+                         double *mb_s, double *iops) {
+  size_t *files = malloc(count * sizeof(size_t));
+  size_t file_count = 0;
+  for (size_t i = 0; i < count; i++)
+    if (S_ISREG(entries[i].mode) && entries[i].size > 0)
+      files[file_count++] = i;
+  if (file_count == 0) {
+    free(files);
+    return;
+  }
+
+  uint64_t bytes = 0;
+  uint64_t start = BTRFS_StatsClock();
+  for (int i = 0; i < RANDOM_READS; i++) {
+    Entry *e = &entries[files[rng() % file_count]];
+    uint64_t off = rng() % e->size / RANDOM_READ_SIZE * RANDOM_READ_SIZE;
+    uint64_t n = BTRFS_ReadFile(e->inode, off, RANDOM_READ_SIZE, buf);
+    if (n <= RANDOM_READ_SIZE) bytes += n;
+  }
+  double elapsed = seconds_since(start);
+
+  *mb_s = bytes / (1024.0 * 1024) / elapsed;
+  *iops = RANDOM_READS / elapsed;
+  free(files);
+}
+
+static double bench_listing(Entry *entries, size_t count) {
+  BTRFS_Path path;
+  memset(&path, 0, sizeof(BTRFS_Path));
+  uint64_t listed = 0;
+  uint64_t start = BTRFS_StatsClock();
+
+  for (size_t i = 0; i < count; i++) {
+    if (!S_ISDIR(entries[i].mode)) continue;
+
+    BTRFS_Key key = {entries[i].inode, KeyType_DirIndex, 0};
+    int err = BTRFS_SearchPath(BTRFS_GetFSTreeLocation(), &key, &path);
+    while (err == 0) {
+      BTRFS_Key *found = BTRFS_PathKey(&path);
+      if (found->object_id != key.object_id || found->type != key.type) break;
+      listed++;
+      err = BTRFS_NextItem(&path);
+    }
+  }
+
+  double rate = listed / seconds_since(start);
+  BTRFS_PathRelease(&path);
+  return rate;
+}
+
+static int main_usage(const char *prog) {
+  fprintf(stderr, "usage: %s <image> <manifest>\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) return main_usage(argv[0]);
+
+  size_t count = 0;
+  Entry *entries = load_manifest(argv[2], &count);
+  uint8_t *buf = malloc(READ_CHUNK);
+  if (entries == NULL || buf == NULL) {
+    fprintf(stderr, "Failed to open %s.\n", argv[2]);
+    return 1;
+  }
+
+  uint64_t start = BTRFS_StatsClock();
+  BTRFS_InitializeStructures(32 * 1024);
+  if (BTRFS_OpenDevices((const char **)&argv[1], 1, Backend_Pread) != 0 ||
+      BTRFS_StartParser() != 0) {
+    fprintf(stderr, "Failed to parse %s.\n", argv[1]);
+    return 1;
+  }
+  double startup_ms = seconds_since(start) * 1000;
+
+  // Lookups in a shuffled order, so consecutive paths rarely share a leaf.
+  size_t *order = malloc(count * sizeof(size_t));
+  for (size_t i = 0; i < count; i++) order[i] = i;
+  for (size_t i = count; i > 1; i--) {
+    size_t j = rng() % i;
+    size_t t = order[i - 1];
+    order[i - 1] = order[j];
+    order[j] = t;
+  }
+  uint64_t lookup_errors = 0;
+  start = BTRFS_StatsClock();
+  for (size_t i = 0; i < count; i++) {
+    uint64_t inode = 0;
+    Entry *e = &entries[order[i]];
+    if (BTRFS_ParseFullFSTree(e->path, &inode) != 0 || inode != e->inode)
+      lookup_errors++;
+  }
+  double lookups_s = count / seconds_since(start);
+  free(order);
+
+  double listing_s = bench_listing(entries, count);
+
+  double seq_mb_s = 0;
+  uint64_t mismatches = 0;
+  bench_sequential(entries, count, buf, &seq_mb_s, &mismatches);
+
+  double rand_mb_s = 0, rand_iops = 0;
+  bench_random(entries, count, buf, &rand_mb_s, &rand_iops);
+
+  // Scrub reads the data through the driver, which counts it.
+  BTRFS_Stats before, after;
+  BTRFS_GetStats(&before);
+  start = BTRFS_StatsClock();
+  uint64_t scrub_errors = BTRFS_Scrub();
+  double scrub_elapsed = seconds_since(start);
+  BTRFS_GetStats(&after);
+  double scrub_gb_s = (after.read_bytes - before.read_bytes) /
+                      (1024.0 * 1024 * 1024) / scrub_elapsed;
+
+  BTRFS_MetadataScrub meta;
+  start = BTRFS_StatsClock();
+  int meta_err = BTRFS_ScrubMetadata(META_SCRUB_THREADS, &meta);
+  double meta_gb_s = meta.bytes / (1024.0 * 1024 * 1024) / seconds_since(start);
+  uint64_t meta_errors = meta_err != 0 ? 1
+                                       : meta.read_errors + meta.csum_errors +
+                                             meta.address_errors +
+                                             meta.fsid_errors +
+                                             meta.level_errors +
+                                             meta.generation_errors;
+
+  printf("{\"image\":\"%s\",\"entries\":%zu,\"startup_ms\":%.3f,"
+         "\"lookups_per_s\":%.0f,\"lookup_errors\":%llu,"
+         "\"dir_entries_per_s\":%.0f,\"seq_read_mb_s\":%.1f,"
+         "\"hash_mismatches\":%llu,\"rand_read_mb_s\":%.1f,"
+         "\"rand_read_iops\":%.0f,\"scrub_gb_s\":%.3f,\"scrub_errors\":%llu,"
+         "\"meta_scrub_gb_s\":%.3f,\"meta_scrub_errors\":%llu,"
+         "\"node_reads\":%llu}\n",
+         argv[1], count, startup_ms, lookups_s,
+         (unsigned long long)lookup_errors, listing_s, seq_mb_s,
+         (unsigned long long)mismatches, rand_mb_s, rand_iops, scrub_gb_s,
+         (unsigned long long)scrub_errors, meta_gb_s,
+         (unsigned long long)meta_errors,
+         (unsigned long long)(after.node_reads[StatsTree_Root] +
+                              after.node_reads[StatsTree_Chunk] +
+                              after.node_reads[StatsTree_Extent] +
+                              after.node_reads[StatsTree_FS] +
+                              after.node_reads[StatsTree_Checksum] +
+                              after.node_reads[StatsTree_Other]));
+
+  for (size_t i = 0; i < count; i++) free(entries[i].path);
+  free(entries);
+  free(buf);
+  BTRFS_CloseDevices();
+  return 0;
+}
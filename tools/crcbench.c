@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// Checks every CRC-32C implementation against the byte at a time reference
+// and measures each across buffer sizes from name hashes to whole extents,
+// at several alignments. One JSON object is printed per measurement; the
+// exit status is non-zero if any implementation disagreed.
+//
+// Cycles are counted with the time stamp counter, which ticks at a fixed
+// rate rather than the core clock, so cycles/byte are only comparable
+// between runs on the same host.
+
+#define _DEFAULT_SOURCE
+
+#include "../btrfs/crc32c.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+// Name hashes, small items, sectors, nodes and extents.
+static const size_t sizes[] = {16,        64,        256,       1024,
+                               4 * 1024,  16 * 1024, 64 * 1024, 1024 * 1024};
+static const size_t alignments[] = {0, 1, 4, 8};
+
+#define SECTOR_SIZE 4096
+#define SECTOR_COUNT 64
+#define TARGET_BYTES (64 * 1024 * 1024)
+#define BUF_SIZE (2 * 1024 * 1024)
+#define CHECK_MAX_LEN 1100
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// Every length up to past the three stream thresholds at every alignment,
+// plus the sizes measured, with random seeds.
+static int check(const crc32c_impl *impls, size_t count, const uint8_t *buf) {
+  int failures = 0;
+  uint32_t expected[SECTOR_COUNT], actual[SECTOR_COUNT];
+
+  for (size_t i = 1; i < count; i++) {
+    if (!crc32c_impl_available(&impls[i])) continue;
+
+    for (size_t align = 0; align < 8; align++)
+      for (size_t len = 0; len <= CHECK_MAX_LEN; len++) {
+        uint32_t seed = len == 0 ? 0xffffffff : (uint32_t)rng();
+        if (impls[i].crc(seed, buf + align, len) !=
+            impls[0].crc(seed, buf + align, len)) {
+          fprintf(stderr, "%s differs: len %zu align %zu\n", impls[i].name,
+                  len, align);
+          failures++;
+        }
+      }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+      for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+        if (impls[i].crc(0xffffffff, buf + alignments[a], sizes[s]) !=
+            impls[0].crc(0xffffffff, buf + alignments[a], sizes[s])) {
+          fprintf(stderr, "%s differs: len %zu align %zu\n", impls[i].name,
+                  sizes[s], alignments[a]);
+          failures++;
+        }
+
+    // Counts that do and do not divide among three streams.
+    for (size_t n = 1; n <= SECTOR_COUNT; n += 7) {
+      impls[0].sectors(buf + 8, SECTOR_SIZE, n, expected);
+      impls[i].sectors(buf + 8, SECTOR_SIZE, n, actual);
+      if (memcmp(expected, actual, n * sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "%s sectors differ: count %zu\n", impls[i].name, n);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+// The reference is only there to be checked against, so it gets less time.
+static void measure(const crc32c_impl *impl, bool reference,
+                    const uint8_t *buf, size_t size, size_t align) {
+  size_t iterations = TARGET_BYTES / size / (reference ? 16 : 1);
+  if (iterations == 0) iterations = 1;
+
+  // Spread over the buffer, as reads land on different lines.
+  size_t slots = (BUF_SIZE - 64) / size;
+  volatile uint32_t sink = 0;
+
+  uint64_t start = __rdtsc();
+  for (size_t i = 0; i < iterations; i++)
+    sink ^= impl->crc(0xffffffff, buf + (i % slots) * size + align, size);
+  uint64_t cycles = __rdtsc() - start;
+  (void)sink;
+
+  printf("{\"impl\":\"%s\",\"op\":\"crc\",\"size\":%zu,\"align\":%zu,"
+         "\"cycles_per_byte\":%.3f}\n",
+         impl->name, size, align, (double)cycles / (iterations * size));
+}
+
+static void measure_sectors(const crc32c_impl *impl, bool reference,
+                            const uint8_t *buf) {
+  size_t bytes = SECTOR_SIZE * SECTOR_COUNT;
+  size_t iterations = TARGET_BYTES / bytes / (reference ? 16 : 1);
+  uint32_t out[SECTOR_COUNT];
+
+  uint64_t start = __rdtsc();
+  for (size_t i = 0; i < iterations; i++)
+    impl->sectors(buf, SECTOR_SIZE, SECTOR_COUNT, out);
+  uint64_t cycles = __rdtsc() - start;
+
+  printf("{\"impl\":\"%s\",\"op\":\"sectors\",\"size\":%d,\"count\":%d,"
+         "\"cycles_per_byte\":%.3f}\n",
+         impl->name, SECTOR_SIZE, SECTOR_COUNT,
+         (double)cycles / (iterations * bytes));
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 0;
+  const crc32c_impl *impls = crc32c_impls(&count);
+
+  uint8_t *buf = aligned_alloc(64, BUF_SIZE);
+  if (buf == NULL) return 1;
+  for (size_t i = 0; i < BUF_SIZE; i++) buf[i] = rng();
+
+  int failures = check(impls, count, buf);
+
+  // With --check only correctness is tested, quickly.
+  if (argc < 2 || strcmp(argv[1], "--check") != 0) {
+    for (size_t i = 0; i < count; i++) {
+      if (!crc32c_impl_available(&impls[i])) continue;
+      for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+          measure(&impls[i], i == 0, buf, sizes[s], alignments[a]);
+      measure_sectors(&impls[i], i == 0, buf);
+    }
+  }
+
+  fprintf(stderr, "%d mismatches\n", failures);
+  free(buf);
+  return failures != 0;
+}
@@ -0,0 +1,343 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// Replays an I/O trace recorded with --record (see BTRFS_StartIORecord)
+// against a backing file, and reports the access pattern of the trace and
+// how the replay performed, as one JSON object.
+//
+// The backing file is extended to cover every read that was not short when
+// recorded, so a sparse file stands in for an image that cannot leave the
+// machine it was recorded on. Reads are dealt out in trace order to a pool
+// of threads, either as fast as they complete or, with --timed, no earlier
+// than recorded. --drop-cache evicts the backing file from the page cache
+// first, which needs no privileges.
+
+#define _DEFAULT_SOURCE
+
+#include "../btrfs/btrfs.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define MAX_THREADS 64
+#define LOG2_BUCKETS 64
+
+typedef struct {
+  BTRFS_IORecord *records;
+  size_t count;
+  int fd;
+  bool timed;
+  uint64_t start;
+  atomic_size_t next;
+  atomic_uint_fast64_t failed;
+  // When each replayed read was issued and completed.
+  uint64_t *issued;
+  uint64_t *completed;
+} Replay;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int log2_bucket(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+static void *Replay_Worker(void *ptr) {
+  Replay *replay = ptr;
+  uint8_t *buf = NULL;
+  size_t buf_size = 0;
+
+  for (;;) {
+    size_t i = atomic_fetch_add(&replay->next, 1);
+    if (i >= replay->count) break;
+    BTRFS_IORecord *record = &replay->records[i];
+
+    if (record->len > buf_size) {
+      free(buf);
+      buf_size = record->len;
+      buf = malloc(buf_size);
+      if (buf == NULL) {
+        buf_size = 0;
+        atomic_fetch_add(&replay->failed, 1);
+        continue;
+      }
+    }
+
+    if (replay->timed) {
+      uint64_t due = replay->start + record->time_ns;
+      uint64_t now = now_ns();
+      if (due > now) {
+        struct timespec wait = {(due - now) / 1000000000ull,
+                                (due - now) % 1000000000ull};
+        nanosleep(&wait, NULL);
+      }
+    }
+
+    replay->issued[i] = now_ns();
+    uint64_t done = 0;
+    while (done < record->len) {
+      ssize_t n = pread(replay->fd, buf + done, record->len - done,
+                        record->offset + done);
+      if (n <= 0) break;
+      done += n;
+    }
+    replay->completed[i] = now_ns();
+    if (done != record->len && !(record->flags & BTRFS_IORecordFlag_Short))
+      atomic_fetch_add(&replay->failed, 1);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static BTRFS_IORecord *load_trace(const char *path, size_t *count) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+
+  BTRFS_IORecordHeader header;
+  BTRFS_IORecord *records = NULL;
+  struct stat st;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != BTRFS_IO_RECORD_MAGIC ||
+      header.version != BTRFS_IO_RECORD_VERSION ||
+      header.record_size != sizeof(BTRFS_IORecord) || fstat(fileno(f), &st))
+    goto done;
+
+  *count = (st.st_size - sizeof(header)) / sizeof(BTRFS_IORecord);
+  records = malloc(*count * sizeof(BTRFS_IORecord) + 1);
+  if (records != NULL &&
+      fread(records, sizeof(BTRFS_IORecord), *count, f) != *count) {
+    free(records);
+    records = NULL;
+  }
+
+done:
+  fclose(f);
+  return records;
+}
+
+typedef struct {
+  uint64_t time;
+  int delta;
+} Event;
+
+// By time, with ends before starts so back to back reads do not overlap.
+static int compare_events(const void *a, const void *b) {
+  const Event *x = a, *y = b;
+  if (x->time != y->time) return x->time < y->time ? -1 : 1;
+  return x->delta - y->delta;
+}
+
+// The mean and peak number of intervals in flight, the mean weighted by the
+// time spent at each depth while any were.
+static void queue_depth(const uint64_t *start, const uint64_t *end,
+                        size_t count, double *mean, uint64_t *peak) {
+  *mean = 0;
+  *peak = 0;
+  Event *events = malloc(count * 2 * sizeof(Event) + 1);
+  if (events == NULL) return;
+
+  for (size_t i = 0; i < count; i++) {
+    events[i * 2] = (Event){start[i], 1};
+    events[i * 2 + 1] = (Event){end[i] > start[i] ? end[i] : start[i], -1};
+  }
+  qsort(events, count * 2, sizeof(Event), compare_events);
+
+  uint64_t depth = 0, busy = 0, weighted = 0, last = 0;
+  for (size_t i = 0; i < count * 2; i++) {
+    if (depth > 0) {
+      weighted += depth * (events[i].time - last);
+      busy += events[i].time - last;
+    }
+    last = events[i].time;
+    depth += events[i].delta;
+    if (depth > *peak) *peak = depth;
+  }
+  *mean = busy ? (double)weighted / busy : 0;
+  free(events);
+}
+
+static void print_histogram(const char *name, const uint64_t *buckets) {
+  printf("\"%s\":{", name);
+  bool first = true;
+  for (int i = 0; i < LOG2_BUCKETS; i++) {
+    if (buckets[i] == 0) continue;
+    // Each bucket is named by its upper bound.
+    printf("%s\"%llu\":%llu", first ? "" : ",",
+           i == 0 ? 0ull : (unsigned long long)(((uint64_t)1 << i) - 1),
+           (unsigned long long)buckets[i]);
+    first = false;
+  }
+  printf("}");
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--threads N] [--timed] [--drop-cache] <trace> "
+          "<backing file>\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = 1;
+  bool timed = false, drop_cache = false;
+  const char *paths[2];
+  int path_count = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--timed") == 0) {
+      timed = true;
+    } else if (strcmp(argv[i], "--drop-cache") == 0) {
+      drop_cache = true;
+    } else if (argv[i][0] != '-' && path_count < 2) {
+      paths[path_count++] = argv[i];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (path_count != 2 || threads < 1 || threads > MAX_THREADS)
+    return usage(argv[0]);
+
+  size_t count = 0;
+  BTRFS_IORecord *records = load_trace(paths[0], &count);
+  if (records == NULL) {
+    fprintf(stderr, "Failed to read trace %s.\n", paths[0]);
+    return 1;
+  }
+
+  // The pattern as recorded: sizes, seeks from the end of the previous read
+  // of the same device, and how many reads the driver had in flight.
+  uint64_t size_hist[LOG2_BUCKETS] = {0}, seek_hist[LOG2_BUCKETS] = {0};
+  uint64_t bytes = 0, sequential = 0, seek_total = 0, node_reads = 0;
+  uint64_t end_offset[BTRFS_STATS_DEVICES] = {0};
+  uint64_t max_offset = 0;
+  uint64_t *rec_start = malloc(count * sizeof(uint64_t) + 1);
+  uint64_t *rec_end = malloc(count * sizeof(uint64_t) + 1);
+  uint64_t *issued = calloc(count + 1, sizeof(uint64_t));
+  uint64_t *completed = calloc(count + 1, sizeof(uint64_t));
+  if (rec_start == NULL || rec_end == NULL || issued == NULL ||
+      completed == NULL)
+    return 1;
+
+  size_t seeks = 0;
+  for (size_t i = 0; i < count; i++) {
+    BTRFS_IORecord *r = &records[i];
+    int dev = r->device < BTRFS_STATS_DEVICES ? r->device
+                                               : BTRFS_STATS_DEVICES - 1;
+
+    // Short reads probe past the end of the device and are left out of the
+    // seeks, and of the backing file.
+    if (!(r->flags & BTRFS_IORecordFlag_Short)) {
+      uint64_t seek = r->offset > end_offset[dev]
+                          ? r->offset - end_offset[dev]
+                          : end_offset[dev] - r->offset;
+      if (seeks++ > 0) {
+        seek_hist[log2_bucket(seek)]++;
+        seek_total += seek;
+        if (seek == 0) sequential++;
+      }
+      end_offset[dev] = r->offset + r->len;
+      if (end_offset[dev] > max_offset) max_offset = end_offset[dev];
+    }
+
+    size_hist[log2_bucket(r->len)]++;
+    bytes += r->len;
+    if (r->flags & BTRFS_IORecordFlag_Node) node_reads++;
+    rec_start[i] = r->time_ns;
+    rec_end[i] = r->time_ns + r->duration_ns;
+  }
+  double recorded_qd = 0;
+  uint64_t recorded_peak = 0;
+  queue_depth(rec_start, rec_end, count, &recorded_qd, &recorded_peak);
+
+  // Only a missing or short backing file is written to.
+  struct stat st;
+  if (stat(paths[1], &st) != 0 || (uint64_t)st.st_size < max_offset) {
+    int wfd = open(paths[1], O_WRONLY | O_CREAT, 0644);
+    if (wfd < 0 || ftruncate(wfd, max_offset) != 0) {
+      fprintf(stderr, "Failed to extend %s.\n", paths[1]);
+      return 1;
+    }
+    close(wfd);
+  }
+  int fd = open(paths[1], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s.\n", paths[1]);
+    return 1;
+  }
+  if (drop_cache) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  Replay replay = {records, count, fd, timed};
+  replay.issued = issued;
+  replay.completed = completed;
+  atomic_init(&replay.next, 0);
+  atomic_init(&replay.failed, 0);
+
+  pthread_t workers[MAX_THREADS];
+  replay.start = now_ns();
+  int started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&workers[started], NULL, Replay_Worker, &replay) != 0)
+      break;
+  for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+  double elapsed = (now_ns() - replay.start) / 1e9;
+
+  uint64_t latency_hist[LOG2_BUCKETS] = {0};
+  for (size_t i = 0; i < count; i++)
+    latency_hist[log2_bucket(completed[i] - issued[i])]++;
+  double replay_qd = 0;
+  uint64_t replay_peak = 0;
+  queue_depth(issued, completed, count, &replay_qd, &replay_peak);
+
+  printf("{\"reads\":%zu,\"bytes\":%llu,\"node_reads\":%llu,"
+         "\"sequential\":%llu,\"mean_seek\":%.0f,",
+         count, (unsigned long long)bytes, (unsigned long long)node_reads,
+         (unsigned long long)sequential,
+         seeks > 1 ? (double)seek_total / (seeks - 1) : 0.0);
+  print_histogram("size_hist", size_hist);
+  printf(",");
+  print_histogram("seek_hist", seek_hist);
+  printf(",\"recorded_qd\":%.2f,\"recorded_peak_qd\":%llu,", recorded_qd,
+         (unsigned long long)recorded_peak);
+  printf("\"threads\":%d,\"timed\":%s,\"seconds\":%.3f,\"mb_s\":%.1f,"
+         "\"iops\":%.0f,\"replay_qd\":%.2f,\"replay_peak_qd\":%llu,"
+         "\"failed\":%llu,",
+         started, timed ? "true" : "false", elapsed,
+         bytes / (1024.0 * 1024) / elapsed, count / elapsed, replay_qd,
+         (unsigned long long)replay_peak,
+         (unsigned long long)atomic_load(&replay.failed));
+  print_histogram("latency_ns_hist", latency_hist);
+  printf("}\n");
+
+  close(fd);
+  free(records);
+  free(rec_start);
+  free(rec_end);
+  free(issued);
+  free(completed);
+  return started == threads && atomic_load(&replay.failed) == 0 ? 0 : 1;
+}
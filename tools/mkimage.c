@@ -0,0 +1,1781 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// Offline generator for synthetic single-device btrfs images. Builds every
+// tree in memory from a generated file system model and writes the result
+// into a sparse image, so no mkfs, loop devices or root are needed.
+
+#define _DEFAULT_SOURCE
+
+#include "../btrfs/btrfs_types.h"
+#include "../btrfs/crc32c.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// <sys/stat.h> maps these to struct timespec members, which would clash with
+// the BTRFS_InodeItem fields of the same name.
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#define SECTOR_SIZE 4096
+#define MIB (1024ull * 1024)
+
+#define SYS_LOGICAL (16 * MIB)
+#define SYS_CHUNK_SIZE (4 * MIB)
+#define META_LOGICAL (1024 * MIB)
+// With DUP metadata the chunks are laid out as mkfs does: an 8M system
+// chunk with the metadata chunks right after it, where the system chunk's
+// second copy would land if it were mapped as the next range.
+#define SYS_CHUNK_SIZE_DUP (8 * MIB)
+#define META_LOGICAL_DUP (SYS_LOGICAL + SYS_CHUNK_SIZE_DUP)
+#define META_CHUNK_SIZE (256 * MIB)
+#define DATA_LOGICAL (1024ull * 1024 * MIB)
+
+#define CSUM_OBJECTID (-10ull)
+#define DEV_ITEMS_OBJECTID 1
+
+#define MAX_OWNERS 16
+#define COMPRESS_MAX (128 * 1024)
+
+// ----------------------------------------------------------------------------
+// Configuration
+// ----------------------------------------------------------------------------
+
+static struct {
+  uint64_t inodes;
+  uint32_t fanout;
+  uint32_t depth;
+  uint64_t min_size;
+  uint64_t max_size;
+  uint32_t frag_pct;
+  uint32_t frag_extents;
+  uint32_t compress_pct;
+  uint32_t hole_pct;
+  uint32_t symlink_pct;
+  uint32_t hardlink_pct;
+  uint32_t nodatasum_pct;
+  uint32_t node_size;
+  uint32_t inline_max;
+  uint32_t snapshots;
+  uint32_t churn_pct;
+  uint64_t data_chunk_size;
+  bool metadata_dup;
+  uint64_t seed;
+  const char *output;
+  const char *manifest;
+} cfg = {
+    .inodes = 2000,
+    .fanout = 8,
+    .depth = 3,
+    .min_size = 0,
+    .max_size = 256 * 1024,
+    .frag_pct = 10,
+    .frag_extents = 4,
+    .compress_pct = 0,
+    .hole_pct = 5,
+    .symlink_pct = 2,
+    .hardlink_pct = 2,
+    .nodatasum_pct = 0,
+    .node_size = 16384,
+    .inline_max = 2048,
+    .snapshots = 0,
+    .churn_pct = 5,
+    .data_chunk_size = 256 * MIB,
+    .seed = 1,
+};
+
+static uint64_t meta_logical = META_LOGICAL;
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return rng_state = x;
+}
+
+static uint64_t rng_range(uint64_t lo, uint64_t hi) {
+  if (hi <= lo) return lo;
+  return lo + rng() % (hi - lo + 1);
+}
+
+static bool rng_pct(uint32_t pct) { return rng() % 100 < pct; }
+
+static void *xmalloc(size_t sz) {
+  void *p = malloc(sz ? sz : 1);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void *xrealloc(void *p, size_t sz) {
+  p = realloc(p, sz);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static uint64_t round_up(uint64_t v, uint64_t a) { return (v + a - 1) / a * a; }
+
+// Deterministic file contents, so readers can verify what they get back.
+static void pattern_fill(uint64_t seed, uint64_t off, uint8_t *buf,
+                         uint64_t len) {
+  for (uint64_t i = 0; i < len; i++) {
+    uint64_t pos = off + i;
+    uint64_t x = (seed * 0x9E3779B97F4A7C15ull) ^
+                 ((pos >> 3) * 0xC2B2AE3D27D4EB4Full);
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 32;
+    buf[i] = (uint8_t)(x >> ((pos & 7) * 8));
+  }
+}
+
+static uint32_t name_hash(const char *name, size_t len) {
+  return ~crc32c(~1, name, len);
+}
+
+static uint64_t extent_data_ref_hash(uint64_t root, uint64_t owner,
+                                     uint64_t offset) {
+  uint32_t high_crc = ~crc32c(-1, &root, sizeof(root));
+  uint32_t low_crc = ~crc32c(-1, &owner, sizeof(owner));
+  low_crc = ~crc32c(~low_crc, &offset, sizeof(offset));
+  return ((uint64_t)high_crc << 31) ^ low_crc;
+}
+
+// ----------------------------------------------------------------------------
+// Image output
+// ----------------------------------------------------------------------------
+
+static int image_fd = -1;
+static uint64_t phys_next = 1 * MIB;
+static uint64_t device_size;
+
+static uint64_t phys_alloc(uint64_t len) {
+  uint64_t start = phys_next;
+  uint64_t mirror = BTRFS_SuperblockOffset1;
+  if (start < mirror + MIB && start + len > mirror) start = mirror + MIB;
+  phys_next = start + len;
+  return start;
+}
+
+static void image_write(const void *buf, uint64_t len, uint64_t phys) {
+  if (pwrite(image_fd, buf, len, phys) != (ssize_t)len) {
+    perror("pwrite");
+    exit(1);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Chunks
+// ----------------------------------------------------------------------------
+
+// A DUP chunk has a second copy on the device at mirror.
+typedef struct {
+  uint64_t logical;
+  uint64_t phys;
+  uint64_t mirror;
+  uint64_t len;
+  uint64_t used;
+  uint64_t type;
+} Chunk;
+
+static Chunk *chunks;
+static size_t chunk_count;
+
+static Chunk *chunk_add(uint64_t logical, uint64_t len, uint64_t type) {
+  chunks = xrealloc(chunks, sizeof(Chunk) * (chunk_count + 1));
+  Chunk *c = &chunks[chunk_count++];
+  c->logical = logical;
+  c->len = len;
+  c->phys = phys_alloc(len);
+  c->mirror = 0;
+  c->used = 0;
+  c->type = type;
+  if (cfg.metadata_dup && !(type & BlockGroupFlag_Data)) {
+    c->mirror = phys_alloc(len);
+    c->type |= BlockGroupFlag_DUP;
+  }
+  return c;
+}
+
+static uint16_t chunk_stripes(const Chunk *c) { return c->mirror ? 2 : 1; }
+
+
+static Chunk *chunk_find(uint64_t logical) {
+  for (size_t i = 0; i < chunk_count; i++)
+    if (logical >= chunks[i].logical &&
+        logical < chunks[i].logical + chunks[i].len)
+      return &chunks[i];
+  return NULL;
+}
+
+static uint64_t logical_to_phys(uint64_t logical) {
+  Chunk *c = chunk_find(logical);
+  if (c == NULL) {
+    fprintf(stderr, "unmapped logical address %llx\n",
+            (unsigned long long)logical);
+    exit(1);
+  }
+  return c->phys + (logical - c->logical);
+}
+
+// Write to every copy of a logical range.
+static void logical_write(const void *buf, uint64_t len, uint64_t logical) {
+  image_write(buf, len, logical_to_phys(logical));
+  Chunk *c = chunk_find(logical);
+  if (c->mirror) image_write(buf, len, c->mirror + (logical - c->logical));
+}
+
+// Data is allocated from consecutive data chunks, never crossing a chunk.
+static uint64_t data_next = DATA_LOGICAL;
+static uint64_t data_chunk_end = DATA_LOGICAL;
+
+static uint64_t data_alloc(uint64_t len) {
+  len = round_up(len, SECTOR_SIZE);
+  if (data_next + len > data_chunk_end) {
+    data_next = data_chunk_end;
+    chunk_add(data_next, cfg.data_chunk_size, BlockGroupFlag_Data);
+    data_chunk_end += cfg.data_chunk_size;
+  }
+  uint64_t r = data_next;
+  data_next += len;
+  chunk_find(r)->used += len;
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+// Items
+// ----------------------------------------------------------------------------
+
+typedef struct {
+  BTRFS_Key key;
+  uint32_t size;
+  uint8_t *data;
+} Item;
+
+typedef struct {
+  Item *items;
+  size_t count;
+  size_t cap;
+} ItemList;
+
+static int key_cmp(const BTRFS_Key *a, const BTRFS_Key *b) {
+  if (a->object_id != b->object_id) return a->object_id < b->object_id ? -1 : 1;
+  if (a->type != b->type) return a->type < b->type ? -1 : 1;
+  if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+  return 0;
+}
+
+static int item_cmp(const void *a, const void *b) {
+  return key_cmp(&((const Item *)a)->key, &((const Item *)b)->key);
+}
+
+static uint8_t *items_add(ItemList *l, uint64_t oid, uint8_t type,
+                          uint64_t off, const void *data, uint32_t size) {
+  if (l->count == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->items = xrealloc(l->items, l->cap * sizeof(Item));
+  }
+  Item *it = &l->items[l->count++];
+  it->key.object_id = oid;
+  it->key.type = type;
+  it->key.offset = off;
+  it->size = size;
+  it->data = xmalloc(size);
+  if (data) memcpy(it->data, data, size);
+  return it->data;
+}
+
+static void items_sort(ItemList *l) {
+  qsort(l->items, l->count, sizeof(Item), item_cmp);
+}
+
+static void items_free(ItemList *l) {
+  for (size_t i = 0; i < l->count; i++) free(l->items[i].data);
+  free(l->items);
+  memset(l, 0, sizeof(*l));
+}
+
+// ----------------------------------------------------------------------------
+// Tree blocks
+// ----------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t logical;
+  uint8_t *buf;
+  uint64_t owners[MAX_OWNERS];
+  int owner_count;
+} Node;
+
+static Node *nodes;
+static size_t node_count;
+static uint8_t fsid[UUID_LEN];
+static uint8_t chunk_uuid[UUID_LEN];
+static uint8_t dev_uuid[UUID_LEN];
+
+#define DEDUPE_BUCKETS (1 << 20)
+static int64_t *dedupe_table;
+
+typedef struct {
+  uint64_t next;
+  uint64_t end;
+  uint64_t type;
+} MetaAlloc;
+
+static MetaAlloc sys_meta, fs_meta;
+static const uint64_t *reserved_addrs;
+static size_t reserved_left;
+
+static uint64_t meta_alloc(MetaAlloc *a) {
+  if (reserved_addrs != NULL && reserved_left > 0) {
+    reserved_left--;
+    return *reserved_addrs++;
+  }
+  uint64_t r = a->next;
+  a->next += cfg.node_size;
+  if (a->end && a->next > a->end) {
+    fprintf(stderr, "system chunk exhausted\n");
+    exit(1);
+  }
+  return r;
+}
+
+static uint64_t payload_hash(const uint8_t *buf) {
+  const BTRFS_Header *h = (const BTRFS_Header *)buf;
+  uint64_t hash = 1469598103934665603ull;
+  hash = (hash ^ h->level) * 1099511628211ull;
+  hash = (hash ^ h->item_count) * 1099511628211ull;
+  return hash ^ crc32c(-1, buf + sizeof(BTRFS_Header),
+                       cfg.node_size - sizeof(BTRFS_Header));
+}
+
+static bool payload_equal(const uint8_t *a, const uint8_t *b) {
+  const BTRFS_Header *ha = (const BTRFS_Header *)a;
+  const BTRFS_Header *hb = (const BTRFS_Header *)b;
+  return ha->level == hb->level && ha->item_count == hb->item_count &&
+         memcmp(a + sizeof(BTRFS_Header), b + sizeof(BTRFS_Header),
+                cfg.node_size - sizeof(BTRFS_Header)) == 0;
+}
+
+// Stores a finished node, reusing an identical existing block when dedupe is
+// requested so that snapshots share unchanged subtrees.
+static uint64_t node_emit(uint8_t *buf, uint64_t owner, uint64_t gen,
+                          MetaAlloc *alloc, bool dedupe, uint64_t *out_gen) {
+  BTRFS_Header *h = (BTRFS_Header *)buf;
+  uint64_t hash = 0;
+  if (dedupe) {
+    hash = payload_hash(buf);
+    for (uint64_t b = hash % DEDUPE_BUCKETS;; b = (b + 1) % DEDUPE_BUCKETS) {
+      int64_t idx = dedupe_table[b];
+      if (idx < 0) break;
+      if (payload_equal(nodes[idx].buf, buf)) {
+        free(buf);
+        *out_gen = ((BTRFS_Header *)nodes[idx].buf)->generation;
+        return nodes[idx].logical;
+      }
+    }
+  }
+
+  h->logical_address = meta_alloc(alloc);
+  memcpy(h->uuid, fsid, UUID_LEN);
+  memcpy(h->chunk_tree_uuid, chunk_uuid, UUID_LEN);
+  h->flags[0] = 1;
+  h->backref_revision = 1;
+  h->generation = gen;
+  h->parent_tree_id = owner;
+  *out_gen = gen;
+
+  if (node_count % 1024 == 0)
+    nodes = xrealloc(nodes, sizeof(Node) * (node_count + 1024));
+  Node *n = &nodes[node_count];
+  n->logical = h->logical_address;
+  n->buf = buf;
+  n->owner_count = 0;
+
+  if (dedupe) {
+    uint64_t b = hash % DEDUPE_BUCKETS;
+    while (dedupe_table[b] >= 0) b = (b + 1) % DEDUPE_BUCKETS;
+    dedupe_table[b] = node_count;
+  }
+  node_count++;
+  return h->logical_address;
+}
+
+static size_t *node_order;
+
+static int node_order_cmp(const void *a, const void *b) {
+  uint64_t x = nodes[*(const size_t *)a].logical;
+  uint64_t y = nodes[*(const size_t *)b].logical;
+  return x < y ? -1 : x > y;
+}
+
+// Builds an address-ordered index over the emitted nodes for lookups.
+static void node_index(void) {
+  node_order = xrealloc(node_order, sizeof(size_t) * (node_count + 1));
+  for (size_t i = 0; i < node_count; i++) node_order[i] = i;
+  qsort(node_order, node_count, sizeof(size_t), node_order_cmp);
+}
+
+static Node *node_lookup(uint64_t logical) {
+  size_t lo = 0, hi = node_count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    Node *n = &nodes[node_order[mid]];
+    if (n->logical == logical) return n;
+    if (n->logical < logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+typedef struct {
+  uint64_t root;
+  uint64_t generation;
+  uint8_t level;
+} Tree;
+
+typedef struct {
+  BTRFS_Key key;
+  uint64_t block;
+  uint64_t gen;
+} Child;
+
+static uint32_t leaf_capacity(void) {
+  return cfg.node_size - sizeof(BTRFS_Header);
+}
+
+static uint32_t node_capacity(void) {
+  return leaf_capacity() / sizeof(BTRFS_KeyPointer);
+}
+
+// Counts the nodes a tree over the given item sizes needs, per level, without
+// emitting anything. Used to reserve addresses for self-referencing trees.
+static size_t tree_layout(const uint32_t *sizes, size_t count,
+                          uint8_t *levels) {
+  size_t total = 0;
+  size_t n = 0;
+  uint32_t used = 0;
+  size_t leaves = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t need = sizeof(BTRFS_ItemPointer) + sizes[i];
+    if (n > 0 && used + need > leaf_capacity()) {
+      leaves++;
+      n = 0;
+      used = 0;
+    }
+    n++;
+    used += need;
+  }
+  leaves++;
+  for (size_t i = 0; i < leaves; i++) levels[total++] = 0;
+
+  size_t width = leaves;
+  uint8_t level = 1;
+  while (width > 1) {
+    width = (width + node_capacity() - 1) / node_capacity();
+    for (size_t i = 0; i < width; i++) levels[total++] = level;
+    level++;
+  }
+  return total;
+}
+
+static Tree tree_build(ItemList *l, uint64_t owner, uint64_t gen,
+                       MetaAlloc *alloc, bool dedupe) {
+  Child *children = xmalloc(sizeof(Child) * (l->count + 1));
+  size_t child_count = 0;
+
+  size_t i = 0;
+  do {
+    uint8_t *buf = calloc(1, cfg.node_size);
+    BTRFS_Header *h = (BTRFS_Header *)buf;
+    BTRFS_ItemPointer *ptr = (BTRFS_ItemPointer *)(h + 1);
+    uint32_t data_end = leaf_capacity();
+    uint32_t used = 0;
+    size_t first = i;
+
+    while (i < l->count) {
+      Item *it = &l->items[i];
+      uint32_t need = sizeof(BTRFS_ItemPointer) + it->size;
+      if (need > leaf_capacity()) {
+        fprintf(stderr, "item too large for node\n");
+        exit(1);
+      }
+      if (used + need > leaf_capacity()) break;
+      data_end -= it->size;
+      ptr->key = it->key;
+      ptr->data_offset = data_end;
+      ptr->data_size = it->size;
+      memcpy(buf + sizeof(BTRFS_Header) + data_end, it->data, it->size);
+      ptr++;
+      used += need;
+      i++;
+    }
+    h->item_count = i - first;
+    h->level = 0;
+
+    bool is_root = (i == l->count && first == 0);
+    Child *c = &children[child_count++];
+    if (first < l->count)
+      c->key = l->items[first].key;
+    else
+      memset(&c->key, 0, sizeof(c->key));
+    c->block = node_emit(buf, owner, gen, alloc, dedupe && !is_root, &c->gen);
+  } while (i < l->count);
+
+  uint8_t level = 0;
+  while (child_count > 1) {
+    level++;
+    size_t groups = (child_count + node_capacity() - 1) / node_capacity();
+    size_t out = 0;
+    size_t pos = 0;
+    for (size_t g = 0; g < groups; g++) {
+      size_t take = (child_count - pos) / (groups - g);
+      uint8_t *buf = calloc(1, cfg.node_size);
+      BTRFS_Header *h = (BTRFS_Header *)buf;
+      BTRFS_KeyPointer *kp = (BTRFS_KeyPointer *)(h + 1);
+      for (size_t k = 0; k < take; k++) {
+        kp[k].key = children[pos + k].key;
+        kp[k].block_number = children[pos + k].block;
+        kp[k].generation = children[pos + k].gen;
+      }
+      h->item_count = take;
+      h->level = level;
+      BTRFS_Key first = children[pos].key;
+      Child *c = &children[out++];
+      c->key = first;
+      c->block =
+          node_emit(buf, owner, gen, alloc, dedupe && groups > 1, &c->gen);
+      pos += take;
+    }
+    child_count = out;
+  }
+
+  Tree t = {children[0].block, children[0].gen, level};
+  free(children);
+  return t;
+}
+
+static void node_add_owner(Node *n, uint64_t owner) {
+  for (int i = 0; i < n->owner_count; i++)
+    if (n->owners[i] == owner) return;
+  if (n->owner_count < MAX_OWNERS) n->owners[n->owner_count++] = owner;
+}
+
+static void tree_mark_owner(uint64_t block, uint64_t owner) {
+  Node *n = node_lookup(block);
+  if (n == NULL) {
+    fprintf(stderr, "dangling block %llx\n", (unsigned long long)block);
+    exit(1);
+  }
+  node_add_owner(n, owner);
+  BTRFS_Header *h = (BTRFS_Header *)n->buf;
+  if (h->level == 0) return;
+  BTRFS_KeyPointer *kp = (BTRFS_KeyPointer *)(h + 1);
+  for (uint32_t i = 0; i < h->item_count; i++)
+    tree_mark_owner(kp[i].block_number, owner);
+}
+
+// ----------------------------------------------------------------------------
+// File system model
+// ----------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t file_off;
+  uint8_t type;
+  uint8_t compression;
+  uint64_t disk_bytenr;
+  uint64_t disk_len;
+  uint64_t extent_off;
+  uint64_t num_bytes;
+  uint64_t ram_bytes;
+  uint64_t generation;
+} FileExtent;
+
+typedef struct {
+  uint64_t ino;
+  uint64_t parent;
+  uint64_t index;
+  char name[32];
+} Link;
+
+typedef struct {
+  uint64_t ino;
+  uint32_t mode;
+  uint64_t size;
+  uint64_t generation;
+  uint64_t transid;
+  uint64_t content_seed;
+  uint64_t mtime;
+  uint64_t flags;
+  uint64_t next_index;
+  char *symlink;
+  FileExtent *extents;
+  size_t extent_count;
+  Link *links;
+  size_t link_count;
+} Inode;
+
+typedef struct {
+  Inode *inodes;
+  size_t count;
+} Model;
+
+typedef struct {
+  uint64_t bytenr;
+  uint64_t len;
+  uint64_t generation;
+  bool csum;
+} DataExtent;
+
+static DataExtent *data_extents;
+static size_t data_extent_count;
+
+static void data_extent_record(uint64_t bytenr, uint64_t len, uint64_t gen,
+                               bool csum) {
+  if (data_extent_count % 1024 == 0)
+    data_extents = xrealloc(data_extents,
+                            sizeof(DataExtent) * (data_extent_count + 1024));
+  DataExtent *d = &data_extents[data_extent_count++];
+  d->bytenr = bytenr;
+  d->len = len;
+  d->generation = gen;
+  d->csum = csum;
+}
+
+static uint32_t adler32(const uint8_t *buf, size_t len) {
+  uint32_t a = 1, b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a = (a + buf[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+// Wraps the data in a zlib stream of stored deflate blocks. The result is a
+// valid zlib extent without needing a compressor.
+static size_t zlib_store(const uint8_t *in, size_t len, uint8_t *out) {
+  size_t o = 0;
+  out[o++] = 0x78;
+  out[o++] = 0x01;
+  size_t pos = 0;
+  do {
+    size_t blk = len - pos > 65535 ? 65535 : len - pos;
+    out[o++] = (pos + blk == len) ? 1 : 0;
+    out[o++] = blk & 0xff;
+    out[o++] = blk >> 8;
+    out[o++] = ~blk & 0xff;
+    out[o++] = (~blk >> 8) & 0xff;
+    memcpy(out + o, in + pos, blk);
+    o += blk;
+    pos += blk;
+  } while (pos < len);
+  uint32_t adler = adler32(in, len);
+  out[o++] = adler >> 24;
+  out[o++] = adler >> 16;
+  out[o++] = adler >> 8;
+  out[o++] = adler;
+  return o;
+}
+
+static void inode_add_extent(Inode *ino, FileExtent *e) {
+  ino->extents =
+      xrealloc(ino->extents, sizeof(FileExtent) * (ino->extent_count + 1));
+  ino->extents[ino->extent_count++] = *e;
+}
+
+// Writes file data for [off, off + len) as one or more regular extents.
+static void write_file_range(Inode *ino, uint64_t off, uint64_t len,
+                             uint64_t gen, bool compress) {
+  while (len > 0) {
+    uint64_t piece = len;
+    if (compress && piece > COMPRESS_MAX) piece = COMPRESS_MAX;
+    if (piece > cfg.data_chunk_size / 2) piece = cfg.data_chunk_size / 2;
+
+    uint64_t aligned = round_up(piece, SECTOR_SIZE);
+    uint8_t *buf = calloc(1, aligned);
+    uint64_t valid = piece;
+    if (off + valid > ino->size) valid = ino->size - off;
+    pattern_fill(ino->content_seed, off, buf, valid);
+
+    FileExtent e = {0};
+    e.file_off = off;
+    e.type = ExtentDataType_Regular;
+    e.num_bytes = aligned;
+    e.ram_bytes = aligned;
+    e.generation = gen;
+
+    uint8_t *disk = buf;
+    uint64_t disk_len = aligned;
+    if (compress) {
+      uint8_t *z = xmalloc(aligned + aligned / 65535 * 5 + 64);
+      size_t zlen = zlib_store(buf, valid, z);
+      disk = calloc(1, round_up(zlen, SECTOR_SIZE));
+      memcpy(disk, z, zlen);
+      free(z);
+      disk_len = round_up(zlen, SECTOR_SIZE);
+      e.compression = 1;
+      e.ram_bytes = valid;
+    }
+
+    e.disk_bytenr = data_alloc(disk_len);
+    e.disk_len = disk_len;
+    image_write(disk, disk_len, logical_to_phys(e.disk_bytenr));
+    data_extent_record(e.disk_bytenr, disk_len, gen,
+                       !(ino->flags & BTRFS_InodeFlag_NoDataSum));
+    if (disk != buf) free(disk);
+    free(buf);
+
+    inode_add_extent(ino, &e);
+    off += aligned;
+    len = len > aligned ? len - aligned : 0;
+  }
+}
+
+static void inode_write_data(Inode *ino, uint64_t gen) {
+  ino->extent_count = 0;
+  if (ino->size == 0) return;
+
+  if (ino->symlink != NULL || ino->size <= cfg.inline_max) {
+    FileExtent e = {0};
+    e.type = ExtentDataType_Inline;
+    e.ram_bytes = ino->size;
+    e.generation = gen;
+    inode_add_extent(ino, &e);
+    return;
+  }
+
+  bool compress = rng_pct(cfg.compress_pct);
+  uint64_t aligned = round_up(ino->size, SECTOR_SIZE);
+
+  if (rng_pct(cfg.hole_pct) && aligned >= 4 * SECTOR_SIZE) {
+    // Leave the middle half of the file unallocated.
+    uint64_t a = round_up(aligned / 4, SECTOR_SIZE);
+    uint64_t b = round_up(aligned * 3 / 4, SECTOR_SIZE);
+    write_file_range(ino, 0, a, gen, compress);
+    write_file_range(ino, b, aligned - b, gen, compress);
+    return;
+  }
+
+  if (rng_pct(cfg.frag_pct) && cfg.frag_extents > 1 &&
+      aligned >= cfg.frag_extents * SECTOR_SIZE) {
+    uint64_t piece = round_up(aligned / cfg.frag_extents, SECTOR_SIZE);
+    for (uint64_t off = 0; off < aligned; off += piece) {
+      uint64_t len = aligned - off < piece ? aligned - off : piece;
+      write_file_range(ino, off, len, gen, compress);
+      // Interleave a filler allocation so the pieces are not contiguous.
+      data_alloc(SECTOR_SIZE);
+    }
+    return;
+  }
+
+  write_file_range(ino, 0, aligned, gen, compress);
+}
+
+static uint64_t random_size(void) {
+  if (cfg.max_size <= cfg.min_size) return cfg.min_size;
+  // Log-uniform between min and max.
+  uint64_t lo = cfg.min_size ? cfg.min_size : 1;
+  int bits_lo = 63 - __builtin_clzll(lo);
+  int bits_hi = 63 - __builtin_clzll(cfg.max_size);
+  int bits = (int)rng_range(bits_lo, bits_hi);
+  uint64_t base = 1ull << bits;
+  uint64_t v = rng_range(base, base * 2 - 1);
+  if (v < cfg.min_size) v = cfg.min_size;
+  if (v > cfg.max_size) v = cfg.max_size;
+  if (cfg.min_size == 0 && rng_pct(3)) v = 0;
+  return v;
+}
+
+static Inode *model_add(Model *m, uint32_t mode, uint64_t gen) {
+  m->inodes = xrealloc(m->inodes, sizeof(Inode) * (m->count + 1));
+  Inode *ino = &m->inodes[m->count];
+  memset(ino, 0, sizeof(*ino));
+  ino->ino = 256 + m->count;
+  ino->mode = mode;
+  ino->generation = gen;
+  ino->transid = gen;
+  ino->content_seed = cfg.seed * 1000003 + ino->ino;
+  ino->mtime = 1500000000 + ino->ino;
+  ino->next_index = 2;
+  m->count++;
+  return ino;
+}
+
+static Inode *model_get(Model *m, uint64_t ino) {
+  return &m->inodes[ino - 256];
+}
+
+static void model_link(Model *m, Inode *child, uint64_t parent,
+                       const char *name) {
+  Inode *dir = model_get(m, parent);
+  child->links =
+      xrealloc(child->links, sizeof(Link) * (child->link_count + 1));
+  Link *l = &child->links[child->link_count++];
+  l->ino = child->ino;
+  l->parent = parent;
+  l->index = dir->next_index++;
+  snprintf(l->name, sizeof(l->name), "%s", name);
+  dir->size += 2 * strlen(name);
+}
+
+static void model_generate(Model *m, uint64_t gen) {
+  Inode *root = model_add(m, 040755, gen);
+  Link *l = xmalloc(sizeof(Link));
+  l->ino = root->ino;
+  l->parent = root->ino;
+  l->index = 0;
+  strcpy(l->name, "..");
+  root->links = l;
+  root->link_count = 1;
+
+  // Directories, breadth first, up to the configured depth.
+  uint64_t *dirs = xmalloc(sizeof(uint64_t));
+  size_t dir_count = 1;
+  dirs[0] = root->ino;
+  size_t level_start = 0, level_end = 1;
+  for (uint32_t d = 0; d < cfg.depth; d++) {
+    for (size_t p = level_start; p < level_end; p++) {
+      for (uint32_t f = 0; f < cfg.fanout; f++) {
+        if (m->count >= cfg.inodes / 2 && m->count > 1) break;
+        Inode *dir = model_add(m, 040755, gen);
+        char name[32];
+        snprintf(name, sizeof(name), "d%u", f);
+        model_link(m, dir, dirs[p], name);
+        dirs = xrealloc(dirs, sizeof(uint64_t) * (dir_count + 1));
+        dirs[dir_count++] = dir->ino;
+      }
+    }
+    level_start = level_end;
+    level_end = dir_count;
+  }
+
+  uint64_t file_no = 0;
+  while (m->count < cfg.inodes) {
+    uint64_t parent = dirs[file_no % dir_count];
+    char name[32];
+
+    if (rng_pct(cfg.symlink_pct)) {
+      Inode *ino = model_add(m, 0120777, gen);
+      snprintf(name, sizeof(name), "l%llu", (unsigned long long)file_no);
+      char target[64];
+      snprintf(target, sizeof(target), "../f%llu.dat",
+               (unsigned long long)(file_no / 2));
+      ino->symlink = strdup(target);
+      ino->size = strlen(target);
+      model_link(m, ino, parent, name);
+      inode_write_data(ino, gen);
+    } else {
+      Inode *ino = model_add(m, 0100644, gen);
+      snprintf(name, sizeof(name), "f%llu.dat", (unsigned long long)file_no);
+      ino->size = random_size();
+      if (rng_pct(cfg.nodatasum_pct)) ino->flags |= BTRFS_InodeFlag_NoDataSum;
+      model_link(m, ino, parent, name);
+      inode_write_data(ino, gen);
+
+      if (rng_pct(cfg.hardlink_pct)) {
+        uint64_t other = dirs[rng() % dir_count];
+        snprintf(name, sizeof(name), "h%llu.dat", (unsigned long long)file_no);
+        ino = &m->inodes[m->count - 1];
+        model_link(m, ino, other, name);
+      }
+    }
+    file_no++;
+  }
+  free(dirs);
+}
+
+static Model model_clone(const Model *src) {
+  Model m;
+  m.count = src->count;
+  m.inodes = xmalloc(sizeof(Inode) * m.count);
+  memcpy(m.inodes, src->inodes, sizeof(Inode) * m.count);
+  for (size_t i = 0; i < m.count; i++) {
+    Inode *ino = &m.inodes[i];
+    FileExtent *e = xmalloc(sizeof(FileExtent) * (ino->extent_count + 1));
+    memcpy(e, ino->extents, sizeof(FileExtent) * ino->extent_count);
+    ino->extents = e;
+    Link *l = xmalloc(sizeof(Link) * (ino->link_count + 1));
+    memcpy(l, ino->links, sizeof(Link) * ino->link_count);
+    ino->links = l;
+  }
+  return m;
+}
+
+// Modifies a share of the files: touches metadata, rewrites data or adds new
+// files, as a day of activity between two snapshots would.
+static void model_churn(Model *m, uint64_t gen) {
+  size_t original = m->count;
+  for (size_t i = 1; i < original; i++) {
+    Inode *ino = &m->inodes[i];
+    if (!rng_pct(cfg.churn_pct)) continue;
+    ino->transid = gen;
+    ino->mtime += 86400;
+    if ((ino->mode & 0170000) == 0100000 && rng_pct(50)) {
+      ino->content_seed += 7919 * gen;
+      inode_write_data(ino, gen);
+    }
+  }
+
+  uint64_t added = original * cfg.churn_pct / 100;
+  for (uint64_t i = 0; i < added; i++) {
+    Inode *ino = model_add(m, 0100644, gen);
+    char name[32];
+    snprintf(name, sizeof(name), "n%llu.dat", (unsigned long long)ino->ino);
+    ino->size = random_size();
+    model_link(m, ino, 256, name);
+    inode_write_data(ino, gen);
+  }
+}
+
+static void fill_inode_item(BTRFS_InodeItem *it, const Inode *ino) {
+  memset(it, 0, sizeof(*it));
+  it->generation = ino->generation;
+  it->last_transid = ino->transid;
+  it->st_size = ino->size;
+  for (size_t i = 0; i < ino->extent_count; i++)
+    if (ino->extents[i].type == ExtentDataType_Regular)
+      it->st_blocks += ino->extents[i].num_bytes;
+  it->st_nlink = (ino->mode & 0170000) == 040000 ? 1 : ino->link_count;
+  it->st_uid = 1000;
+  it->st_gid = 1000;
+  it->st_mode = ino->mode;
+  it->flags = ino->flags;
+  it->st_atime.seconds = ino->mtime;
+  it->st_ctime.seconds = ino->mtime;
+  it->st_mtime.seconds = ino->mtime;
+  it->otime.seconds = 1500000000;
+}
+
+static void model_emit_items(Model *m, ItemList *l) {
+  for (size_t i = 0; i < m->count; i++) {
+    Inode *ino = &m->inodes[i];
+
+    BTRFS_InodeItem ii;
+    fill_inode_item(&ii, ino);
+    items_add(l, ino->ino, KeyType_InodeItem, 0, &ii, sizeof(ii));
+
+    for (size_t k = 0; k < ino->link_count; k++) {
+      Link *lk = &ino->links[k];
+      size_t nlen = strlen(lk->name);
+
+      // Links sharing a parent are packed into a single INODE_REF item.
+      bool seen = false;
+      for (size_t j = 0; j < k; j++)
+        if (ino->links[j].parent == lk->parent) seen = true;
+      if (!seen) {
+        size_t sz = 0;
+        for (size_t j = k; j < ino->link_count; j++)
+          if (ino->links[j].parent == lk->parent)
+            sz += 10 + strlen(ino->links[j].name);
+        uint8_t *d = items_add(l, ino->ino, KeyType_InodeRef, lk->parent,
+                               NULL, sz);
+        for (size_t j = k; j < ino->link_count; j++) {
+          if (ino->links[j].parent != lk->parent) continue;
+          uint16_t n = strlen(ino->links[j].name);
+          memcpy(d, &ino->links[j].index, 8);
+          memcpy(d + 8, &n, 2);
+          memcpy(d + 10, ino->links[j].name, n);
+          d += 10 + n;
+        }
+      }
+
+      if (ino->ino == 256) continue;
+
+      uint8_t dbuf[sizeof(BTRFS_DirectoryItem) + 32];
+      BTRFS_DirectoryItem *di = (BTRFS_DirectoryItem *)dbuf;
+      di->key.object_id = ino->ino;
+      di->key.type = KeyType_InodeItem;
+      di->key.offset = 0;
+      di->transid = ino->transid;
+      di->data_size = 0;
+      di->name_len = nlen;
+      switch (ino->mode & 0170000) {
+        case 040000:
+          di->type = 2;
+          break;
+        case 0120000:
+          di->type = 7;
+          break;
+        default:
+          di->type = 1;
+      }
+      memcpy(di->name_data, lk->name, nlen);
+      uint32_t dsz = sizeof(BTRFS_DirectoryItem) + nlen;
+      items_add(l, lk->parent, KeyType_DirItem, name_hash(lk->name, nlen),
+                dbuf, dsz);
+      items_add(l, lk->parent, KeyType_DirIndex, lk->index, dbuf, dsz);
+    }
+
+    for (size_t k = 0; k < ino->extent_count; k++) {
+      FileExtent *e = &ino->extents[k];
+      if (e->type == ExtentDataType_Inline) {
+        uint32_t sz = sizeof(BTRFS_ExtentDataInline) + e->ram_bytes;
+        uint8_t *d =
+            items_add(l, ino->ino, KeyType_ExtentData, 0, NULL, sz);
+        BTRFS_ExtentDataInline *x = (BTRFS_ExtentDataInline *)d;
+        memset(x, 0, sizeof(*x));
+        x->generation = e->generation;
+        x->decoded_size = e->ram_bytes;
+        x->type = ExtentDataType_Inline;
+        if (ino->symlink)
+          memcpy(x + 1, ino->symlink, e->ram_bytes);
+        else
+          pattern_fill(ino->content_seed, 0, (uint8_t *)(x + 1),
+                       e->ram_bytes);
+      } else {
+        BTRFS_ExtentDataFull x;
+        memset(&x, 0, sizeof(x));
+        x.inlineData.generation = e->generation;
+        x.inlineData.decoded_size = e->ram_bytes;
+        x.inlineData.compression_type = e->compression;
+        x.inlineData.type = ExtentDataType_Regular;
+        x.extent_logical_addr = e->disk_bytenr;
+        x.extent_size = e->disk_len;
+        x.extent_offset = e->extent_off;
+        x.logical_byte_count = e->num_bytes;
+        items_add(l, ino->ino, KeyType_ExtentData, e->file_off, &x,
+                  sizeof(x));
+      }
+    }
+  }
+  items_sort(l);
+}
+
+// ----------------------------------------------------------------------------
+// Data extent references
+// ----------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t bytenr;
+  uint64_t root;
+  uint64_t ino;
+  uint64_t offset;
+} DataRef;
+
+static DataRef *data_refs;
+static size_t data_ref_count;
+
+static void collect_data_refs(Model *m, uint64_t root) {
+  for (size_t i = 0; i < m->count; i++) {
+    Inode *ino = &m->inodes[i];
+    for (size_t k = 0; k < ino->extent_count; k++) {
+      FileExtent *e = &ino->extents[k];
+      if (e->type != ExtentDataType_Regular || e->disk_bytenr == 0) continue;
+      if (data_ref_count % 1024 == 0)
+        data_refs =
+            xrealloc(data_refs, sizeof(DataRef) * (data_ref_count + 1024));
+      DataRef *r = &data_refs[data_ref_count++];
+      r->bytenr = e->disk_bytenr;
+      r->root = root;
+      r->ino = ino->ino;
+      r->offset = e->file_off - e->extent_off;
+    }
+  }
+}
+
+static int data_ref_cmp(const void *a, const void *b) {
+  const DataRef *x = a, *y = b;
+  if (x->bytenr != y->bytenr) return x->bytenr < y->bytenr ? -1 : 1;
+  if (x->root != y->root) return x->root < y->root ? -1 : 1;
+  if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+  return 0;
+}
+
+static int data_extent_cmp(const void *a, const void *b) {
+  const DataExtent *x = a, *y = b;
+  if (x->bytenr != y->bytenr) return x->bytenr < y->bytenr ? -1 : 1;
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Trees built from the model
+// ----------------------------------------------------------------------------
+
+static void emit_csum_items(ItemList *l) {
+  uint32_t max_sums = (leaf_capacity() - sizeof(BTRFS_ItemPointer)) / 4;
+  uint8_t *buf = xmalloc(SECTOR_SIZE);
+  for (size_t i = 0; i < data_extent_count; i++) {
+    DataExtent *d = &data_extents[i];
+    if (!d->csum) continue;
+    uint64_t sectors = d->len / SECTOR_SIZE;
+    for (uint64_t s = 0; s < sectors; s += max_sums) {
+      uint64_t n = sectors - s < max_sums ? sectors - s : max_sums;
+      uint32_t *sums = (uint32_t *)items_add(
+          l, CSUM_OBJECTID, KeyType_ExtentChecksum,
+          d->bytenr + s * SECTOR_SIZE, NULL, n * 4);
+      for (uint64_t k = 0; k < n; k++) {
+        uint64_t logical = d->bytenr + (s + k) * SECTOR_SIZE;
+        if (pread(image_fd, buf, SECTOR_SIZE, logical_to_phys(logical)) !=
+            SECTOR_SIZE)
+          memset(buf, 0, SECTOR_SIZE);
+        sums[k] = crc32c(-1, buf, SECTOR_SIZE);
+      }
+    }
+  }
+  free(buf);
+  items_sort(l);
+}
+
+static void chunk_fill_stripes(const Chunk *c, BTRFS_Stripe *stripes) {
+  uint64_t offsets[2] = {c->phys, c->mirror};
+  for (uint16_t s = 0; s < chunk_stripes(c); s++) {
+    stripes[s].device_id = 1;
+    stripes[s].offset = offsets[s];
+    memcpy(stripes[s].uuid, dev_uuid, UUID_LEN);
+  }
+}
+
+static void emit_chunk_items(ItemList *l) {
+  BTRFS_DeviceItem dev;
+  memset(&dev, 0, sizeof(dev));
+  dev.device_id = 1;
+  dev.byte_count = device_size;
+  for (size_t i = 0; i < chunk_count; i++)
+    dev.bytes_used += chunks[i].len * chunk_stripes(&chunks[i]);
+  dev.preferred_io_alignment = SECTOR_SIZE;
+  dev.preferred_io_width = SECTOR_SIZE;
+  dev.minimum_io_size = SECTOR_SIZE;
+  memcpy(dev.device_uuid, dev_uuid, UUID_LEN);
+  memcpy(dev.fs_uuid, fsid, UUID_LEN);
+  items_add(l, DEV_ITEMS_OBJECTID, KeyType_DeviceItem, 1, &dev, sizeof(dev));
+
+  for (size_t i = 0; i < chunk_count; i++) {
+    uint8_t buf[sizeof(BTRFS_ChunkItem) + 2 * sizeof(BTRFS_Stripe)];
+    BTRFS_ChunkItem *c = (BTRFS_ChunkItem *)buf;
+    uint16_t stripes = chunk_stripes(&chunks[i]);
+    memset(buf, 0, sizeof(buf));
+    c->chunk_size_bytes = chunks[i].len;
+    c->object_id = 2;
+    c->stripe_size = 64 * 1024;
+    c->type = chunks[i].type;
+    c->preferred_io_alignment = 64 * 1024;
+    c->preferred_io_width = 64 * 1024;
+    c->minimum_io_size = SECTOR_SIZE;
+    c->stripe_count = stripes;
+    c->sub_stripes = 1;
+    chunk_fill_stripes(&chunks[i], c->stripes);
+    items_add(l, ReservedObjectID_FirstChunkTree, KeyType_ChunkItem,
+              chunks[i].logical, buf,
+              sizeof(BTRFS_ChunkItem) + stripes * sizeof(BTRFS_Stripe));
+  }
+  items_sort(l);
+}
+
+static void emit_dev_items(ItemList *l) {
+  for (size_t i = 0; i < chunk_count; i++) {
+    BTRFS_DevExtent de;
+    memset(&de, 0, sizeof(de));
+    de.chunk_tree = 3;
+    de.chunk_object_id = ReservedObjectID_FirstChunkTree;
+    de.chunk_offset = chunks[i].logical;
+    de.length = chunks[i].len;
+    memcpy(de.chunk_tree_uuid, chunk_uuid, UUID_LEN);
+    items_add(l, 1, KeyType_DeviceExtent, chunks[i].phys, &de, sizeof(de));
+    if (chunks[i].mirror)
+      items_add(l, 1, KeyType_DeviceExtent, chunks[i].mirror, &de, sizeof(de));
+  }
+  items_sort(l);
+}
+
+typedef struct {
+  uint64_t id;
+  Tree tree;
+} RootEntry;
+
+static void fill_root_item(BTRFS_RootItem *r, Tree *t, bool fs_tree) {
+  memset(r, 0, sizeof(*r));
+  r->inode.generation = 1;
+  r->inode.st_size = 3;
+  r->inode.st_nlink = 1;
+  r->inode.st_blocks = cfg.node_size;
+  r->inode.st_mode = 040755;
+  r->expected_generation = t->generation;
+  r->tree_root_object_id = fs_tree ? 256 : 0;
+  r->root_block_num = t->root;
+  r->bytes_used = cfg.node_size;
+  r->reference_count = 1;
+  r->level = t->level;
+}
+
+static void emit_root_items(ItemList *l, RootEntry *roots, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    BTRFS_RootItem r;
+    fill_root_item(&r, &roots[i].tree, roots[i].id >= 5);
+    items_add(l, roots[i].id, KeyType_RootItem, 0, &r, sizeof(r));
+  }
+  items_sort(l);
+}
+
+// Extent tree items for every reachable tree block, data extent and block
+// group. Tree block addresses passed in `pending` are included even though
+// the blocks themselves are written afterwards.
+static void emit_extent_items(ItemList *l, const uint64_t *pending,
+                              const uint8_t *pending_levels,
+                              const uint64_t *pending_owner,
+                              size_t pending_count, uint64_t gen) {
+  for (size_t i = 0; i < node_count; i++) {
+    Node *n = &nodes[i];
+    if (n->owner_count == 0) continue;
+    BTRFS_Header *h = (BTRFS_Header *)n->buf;
+    uint32_t sz = sizeof(BTRFS_ExtentItem) + 9 * n->owner_count;
+    uint8_t *d =
+        items_add(l, n->logical, KeyType_MetadataItem, h->level, NULL, sz);
+    BTRFS_ExtentItem *e = (BTRFS_ExtentItem *)d;
+    e->refs = n->owner_count;
+    e->generation = h->generation;
+    e->flags = ExtentFlag_TreeBlock;
+    d += sizeof(BTRFS_ExtentItem);
+    for (int k = 0; k < n->owner_count; k++) {
+      *d = KeyType_TreeBlockRef;
+      memcpy(d + 1, &n->owners[k], 8);
+      d += 9;
+    }
+  }
+  for (size_t i = 0; i < pending_count; i++) {
+    uint8_t *d = items_add(l, pending[i], KeyType_MetadataItem,
+                           pending_levels[i], NULL,
+                           sizeof(BTRFS_ExtentItem) + 9);
+    BTRFS_ExtentItem *e = (BTRFS_ExtentItem *)d;
+    e->refs = 1;
+    e->generation = gen;
+    e->flags = ExtentFlag_TreeBlock;
+    d[sizeof(BTRFS_ExtentItem)] = KeyType_TreeBlockRef;
+    memcpy(d + sizeof(BTRFS_ExtentItem) + 1, &pending_owner[i], 8);
+  }
+
+  // Data extents: the first reference is inline, further roots get keyed
+  // EXTENT_DATA_REF items, as after a snapshot.
+  size_t r = 0;
+  for (size_t i = 0; i < data_extent_count; i++) {
+    DataExtent *d = &data_extents[i];
+    while (r < data_ref_count && data_refs[r].bytenr < d->bytenr) r++;
+    size_t first = r;
+    while (r < data_ref_count && data_refs[r].bytenr == d->bytenr) r++;
+    if (first == r) continue;
+
+    // Collapse identical refs into counts.
+    size_t uniq = 0;
+    BTRFS_ExtentDataRef *refs =
+        xmalloc(sizeof(BTRFS_ExtentDataRef) * (r - first));
+    for (size_t k = first; k < r; k++) {
+      if (uniq > 0 && refs[uniq - 1].root == data_refs[k].root &&
+          refs[uniq - 1].object_id == data_refs[k].ino &&
+          refs[uniq - 1].offset == data_refs[k].offset) {
+        refs[uniq - 1].count++;
+        continue;
+      }
+      refs[uniq].root = data_refs[k].root;
+      refs[uniq].object_id = data_refs[k].ino;
+      refs[uniq].offset = data_refs[k].offset;
+      refs[uniq].count = 1;
+      uniq++;
+    }
+
+    uint64_t total = 0;
+    for (size_t k = 0; k < uniq; k++) total += refs[k].count;
+
+    uint8_t *p = items_add(
+        l, d->bytenr, KeyType_ExtentItem, d->len, NULL,
+        sizeof(BTRFS_ExtentItem) + 1 + sizeof(BTRFS_ExtentDataRef));
+    BTRFS_ExtentItem *e = (BTRFS_ExtentItem *)p;
+    e->refs = total;
+    e->generation = d->generation;
+    e->flags = ExtentFlag_Data;
+    p[sizeof(BTRFS_ExtentItem)] = KeyType_ExtentDataRef;
+    memcpy(p + sizeof(BTRFS_ExtentItem) + 1, &refs[0],
+           sizeof(BTRFS_ExtentDataRef));
+
+    for (size_t k = 1; k < uniq; k++)
+      items_add(l, d->bytenr, KeyType_ExtentDataRef,
+                extent_data_ref_hash(refs[k].root, refs[k].object_id,
+                                     refs[k].offset),
+                &refs[k], sizeof(BTRFS_ExtentDataRef));
+    free(refs);
+  }
+
+  for (size_t i = 0; i < chunk_count; i++) {
+    BTRFS_BlockGroupItem bg;
+    bg.used = chunks[i].used;
+    bg.chunk_object_id = ReservedObjectID_FirstChunkTree;
+    bg.flags = chunks[i].type;
+    items_add(l, chunks[i].logical, KeyType_BlockGroupItem, chunks[i].len,
+              &bg, sizeof(bg));
+  }
+  items_sort(l);
+}
+
+static void item_sizes(ItemList *l, uint32_t **sizes) {
+  *sizes = xmalloc(sizeof(uint32_t) * (l->count + 1));
+  for (size_t i = 0; i < l->count; i++) (*sizes)[i] = l->items[i].size;
+}
+
+// ----------------------------------------------------------------------------
+// Superblock
+// ----------------------------------------------------------------------------
+
+static void write_superblock(Tree *root_tree, Tree *chunk_tree, uint64_t gen,
+                             uint64_t bytes_used) {
+  uint8_t *buf = calloc(1, 0x1000);
+  BTRFS_Superblock *sb = (BTRFS_Superblock *)buf;
+  memcpy(sb->uuid, fsid, UUID_LEN);
+  memcpy(sb->magic, BTRFS_MagicString, BTRFS_MagicStringLen);
+  sb->generation = gen;
+  sb->root_tree_root_addr = root_tree->root;
+  sb->chunk_tree_root_addr = chunk_tree->root;
+  sb->total_bytes = device_size;
+  sb->bytes_used = bytes_used;
+  sb->root_dir_objectid = 6;
+  sb->num_devices = 1;
+  sb->sector_size = SECTOR_SIZE;
+  sb->node_size = cfg.node_size;
+  sb->leaf_size = cfg.node_size;
+  sb->stripe_size = SECTOR_SIZE;
+  sb->chunk_root_generation = chunk_tree->generation;
+  // MIXED_BACKREF | BIG_METADATA | EXTENDED_IREF | SKINNY_METADATA | NO_HOLES
+  sb->inompat_flags = 0x1 | 0x20 | 0x40 | 0x100 | 0x200;
+  sb->checksum_type = 0;
+  sb->root_level = root_tree->level;
+  sb->chunk_root_level = chunk_tree->level;
+  sb->dev_item.device_id = 1;
+  sb->dev_item.byte_count = device_size;
+  sb->dev_item.preferred_io_alignment = SECTOR_SIZE;
+  sb->dev_item.preferred_io_width = SECTOR_SIZE;
+  sb->dev_item.minimum_io_size = SECTOR_SIZE;
+  memcpy(sb->dev_item.device_uuid, dev_uuid, UUID_LEN);
+  memcpy(sb->dev_item.fs_uuid, fsid, UUID_LEN);
+  snprintf(sb->label, sizeof(sb->label), "synthetic");
+
+  BTRFS_Key_ChunkItem_Pair *pair =
+      (BTRFS_Key_ChunkItem_Pair *)sb->key_chunkItem_table;
+  Chunk *sys = &chunks[0];
+  pair->key.object_id = ReservedObjectID_FirstChunkTree;
+  pair->key.type = KeyType_ChunkItem;
+  pair->key.offset = sys->logical;
+  pair->value.chunk_size_bytes = sys->len;
+  pair->value.object_id = 2;
+  pair->value.stripe_size = 64 * 1024;
+  pair->value.type = sys->type;
+  pair->value.preferred_io_alignment = 64 * 1024;
+  pair->value.preferred_io_width = 64 * 1024;
+  pair->value.minimum_io_size = SECTOR_SIZE;
+  pair->value.stripe_count = chunk_stripes(sys);
+  pair->value.sub_stripes = 1;
+  chunk_fill_stripes(sys, pair->value.stripes);
+  sb->key_chunkItem_table_len = sizeof(BTRFS_Key_ChunkItem_Pair) +
+                                chunk_stripes(sys) * sizeof(BTRFS_Stripe);
+
+  for (int i = 0; BTRFS_superblock_offsets[i] != 0; i++) {
+    uint64_t off = BTRFS_superblock_offsets[i];
+    if (off + 0x1000 > device_size) break;
+    sb->cur_block_phys_addr = off;
+    uint32_t crc = crc32c(-1, buf + CHECKSUM_LEN, 0x1000 - CHECKSUM_LEN);
+    memset(sb->csum, 0, CHECKSUM_LEN);
+    memcpy(sb->csum, &crc, sizeof(crc));
+    image_write(buf, 0x1000, off);
+  }
+  free(buf);
+}
+
+static void write_nodes(void) {
+  for (size_t i = 0; i < node_count; i++) {
+    uint8_t *buf = nodes[i].buf;
+    uint32_t crc = crc32c(-1, buf + CHECKSUM_LEN, cfg.node_size - CHECKSUM_LEN);
+    memset(buf, 0, CHECKSUM_LEN);
+    memcpy(buf, &crc, sizeof(crc));
+    logical_write(buf, cfg.node_size, nodes[i].logical);
+  }
+}
+
+static uint64_t fnv_file(Inode *ino) {
+  uint64_t h = 1469598103934665603ull;
+  uint8_t buf[4096];
+  for (uint64_t off = 0; off < ino->size; off += sizeof(buf)) {
+    uint64_t n = ino->size - off < sizeof(buf) ? ino->size - off : sizeof(buf);
+    // Unallocated ranges read back as zeros.
+    memset(buf, 0, n);
+    for (size_t e = 0; e < ino->extent_count; e++) {
+      FileExtent *x = &ino->extents[e];
+      uint64_t len =
+          x->type == ExtentDataType_Inline ? x->ram_bytes : x->num_bytes;
+      uint64_t a = x->file_off > off ? x->file_off : off;
+      uint64_t b = x->file_off + len < off + n ? x->file_off + len : off + n;
+      if (a < b) pattern_fill(ino->content_seed, a, buf + (a - off), b - a);
+    }
+    for (uint64_t k = 0; k < n; k++) h = (h ^ buf[k]) * 1099511628211ull;
+  }
+  return h;
+}
+
+static void path_of(Model *m, Link *l, char *out, size_t out_len) {
+  if (l->parent == 256 || l->ino == 256) {
+    snprintf(out, out_len, "/%s", l->ino == 256 ? "" : l->name);
+    return;
+  }
+  char parent[4096];
+  path_of(m, &model_get(m, l->parent)->links[0], parent, sizeof(parent));
+  // Generated trees are far too shallow to overflow a path.
+  if (snprintf(out, out_len, "%s/%s", parent, l->name) >= (int)out_len)
+    abort();
+}
+
+static void write_manifest(Model *m, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  for (size_t i = 0; i < m->count; i++) {
+    Inode *ino = &m->inodes[i];
+    for (size_t k = 0; k < ino->link_count; k++) {
+      char p[4096];
+      path_of(m, &ino->links[k], p, sizeof(p));
+      fprintf(f, "%llu %06o %llu %016llx %s\n", (unsigned long long)ino->ino,
+              ino->mode, (unsigned long long)ino->size,
+              (unsigned long long)((ino->mode & 0170000) == 0100000
+                                       ? fnv_file(ino)
+                                       : 0),
+              p);
+    }
+  }
+  fclose(f);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] <image>\n"
+          "  --inodes N          number of inodes (default 2000)\n"
+          "  --fanout N          subdirectories per directory (default 8)\n"
+          "  --depth N           directory depth (default 3)\n"
+          "  --min-size B        smallest file size (default 0)\n"
+          "  --max-size B        largest file size, log-uniform (default "
+          "256K)\n"
+          "  --frag PCT          files split into several extents (default "
+          "10)\n"
+          "  --frag-extents N    extents per fragmented file (default 4)\n"
+          "  --compress PCT      files stored as zlib extents (default 0)\n"
+          "  --holes PCT         sparse files (default 5)\n"
+          "  --symlinks PCT      symlinks among files (default 2)\n"
+          "  --hardlinks PCT     files with a second link (default 2)\n"
+          "  --nodatasum PCT     files without data checksums (default 0)\n"
+          "  --nodesize B        tree block size (default 16384)\n"
+          "  --snapshots N       snapshots of the fs tree (default 0)\n"
+          "  --churn PCT         files changed between snapshots (default "
+          "5)\n"
+          "  --chunk-size B      data chunk size (default 256M)\n"
+          "  --metadata P        metadata profile, single or dup (default "
+          "single)\n"
+          "  --seed N            random seed (default 1)\n"
+          "  --manifest FILE     write path/size/hash of every file\n",
+          prog);
+  exit(1);
+}
+
+static uint64_t parse_size(const char *s) {
+  char *end;
+  uint64_t v = strtoull(s, &end, 0);
+  switch (*end) {
+    case 'k':
+    case 'K':
+      v *= 1024;
+      break;
+    case 'm':
+    case 'M':
+      v *= MIB;
+      break;
+    case 'g':
+    case 'G':
+      v *= 1024 * MIB;
+      break;
+  }
+  return v;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    if (a[0] != '-') {
+      cfg.output = a;
+      continue;
+    }
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *v = argv[++i];
+    if (!strcmp(a, "--inodes"))
+      cfg.inodes = parse_size(v);
+    else if (!strcmp(a, "--fanout"))
+      cfg.fanout = parse_size(v);
+    else if (!strcmp(a, "--depth"))
+      cfg.depth = parse_size(v);
+    else if (!strcmp(a, "--min-size"))
+      cfg.min_size = parse_size(v);
+    else if (!strcmp(a, "--max-size"))
+      cfg.max_size = parse_size(v);
+    else if (!strcmp(a, "--frag"))
+      cfg.frag_pct = parse_size(v);
+    else if (!strcmp(a, "--frag-extents"))
+      cfg.frag_extents = parse_size(v);
+    else if (!strcmp(a, "--compress"))
+      cfg.compress_pct = parse_size(v);
+    else if (!strcmp(a, "--holes"))
+      cfg.hole_pct = parse_size(v);
+    else if (!strcmp(a, "--symlinks"))
+      cfg.symlink_pct = parse_size(v);
+    else if (!strcmp(a, "--hardlinks"))
+      cfg.hardlink_pct = parse_size(v);
+    else if (!strcmp(a, "--nodatasum"))
+      cfg.nodatasum_pct = parse_size(v);
+    else if (!strcmp(a, "--nodesize"))
+      cfg.node_size = parse_size(v);
+    else if (!strcmp(a, "--snapshots"))
+      cfg.snapshots = parse_size(v);
+    else if (!strcmp(a, "--churn"))
+      cfg.churn_pct = parse_size(v);
+    else if (!strcmp(a, "--chunk-size"))
+      cfg.data_chunk_size = parse_size(v);
+    else if (!strcmp(a, "--metadata") && !strcmp(v, "dup"))
+      cfg.metadata_dup = true;
+    else if (!strcmp(a, "--metadata") && !strcmp(v, "single"))
+      cfg.metadata_dup = false;
+    else if (!strcmp(a, "--seed"))
+      cfg.seed = parse_size(v);
+    else if (!strcmp(a, "--manifest"))
+      cfg.manifest = v;
+    else
+      usage(argv[0]);
+  }
+  if (cfg.output == NULL || cfg.inodes < 1 || cfg.node_size < 4096 ||
+      (cfg.node_size & (cfg.node_size - 1)) || cfg.node_size > 65536 ||
+      cfg.data_chunk_size % (2 * MIB) || cfg.data_chunk_size == 0)
+    usage(argv[0]);
+
+  crc32c_init();
+  rng_state = cfg.seed * 0x9E3779B97F4A7C15ull + 1;
+  for (int i = 0; i < UUID_LEN; i++) {
+    fsid[i] = rng();
+    chunk_uuid[i] = rng();
+    dev_uuid[i] = rng();
+  }
+
+  image_fd = open(cfg.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (image_fd < 0) {
+    perror(cfg.output);
+    return 1;
+  }
+
+  dedupe_table = xmalloc(sizeof(int64_t) * DEDUPE_BUCKETS);
+  memset(dedupe_table, 0xff, sizeof(int64_t) * DEDUPE_BUCKETS);
+
+  uint64_t sys_chunk_size = SYS_CHUNK_SIZE;
+  if (cfg.metadata_dup) {
+    sys_chunk_size = SYS_CHUNK_SIZE_DUP;
+    meta_logical = META_LOGICAL_DUP;
+  }
+  Chunk *sys = chunk_add(SYS_LOGICAL, sys_chunk_size, BlockGroupFlag_System);
+  sys_meta.next = chunks[0].logical;
+  sys_meta.end = sys->logical + sys->len;
+  fs_meta.next = meta_logical;
+
+  // The base generation holds the initial content; every snapshot is taken
+  // one generation later and followed by a round of churn in the live tree.
+  uint64_t gen = 5;
+  Model live = {0};
+  model_generate(&live, gen);
+
+  RootEntry roots[64];
+  size_t root_count = 0;
+  Model *snaps = xmalloc(sizeof(Model) * (cfg.snapshots + 1));
+
+  for (uint32_t s = 0; s < cfg.snapshots; s++) {
+    snaps[s] = model_clone(&live);
+    gen++;
+    ItemList l = {0};
+    model_emit_items(&snaps[s], &l);
+    // Build the live tree at the generation it was last modified so the
+    // snapshot can share its blocks.
+    tree_build(&l, 5, gen - 1, &fs_meta, true);
+    roots[root_count].id = 257 + s;
+    roots[root_count].tree = tree_build(&l, 257 + s, gen, &fs_meta, true);
+    root_count++;
+    items_free(&l);
+    gen++;
+    model_churn(&live, gen);
+  }
+
+  ItemList fs_items = {0};
+  model_emit_items(&live, &fs_items);
+  Tree fs_tree = tree_build(&fs_items, 5, gen, &fs_meta, true);
+  items_free(&fs_items);
+
+  collect_data_refs(&live, 5);
+  for (uint32_t s = 0; s < cfg.snapshots; s++)
+    collect_data_refs(&snaps[s], 257 + s);
+  qsort(data_refs, data_ref_count, sizeof(DataRef), data_ref_cmp);
+  qsort(data_extents, data_extent_count, sizeof(DataExtent), data_extent_cmp);
+
+  ItemList csum_items = {0};
+  emit_csum_items(&csum_items);
+  Tree csum_tree = tree_build(&csum_items, 7, gen, &fs_meta, false);
+  items_free(&csum_items);
+
+  // Metadata chunks are sized once everything but the self-describing trees
+  // is known; retry with another chunk if the estimate falls short.
+  size_t node_mark = node_count;
+  uint64_t meta_mark = fs_meta.next;
+  size_t chunk_mark = chunk_count;
+  uint64_t phys_mark = phys_next;
+  uint32_t meta_chunks =
+      (meta_mark - meta_logical) / META_CHUNK_SIZE + 1;
+
+  Tree chunk_tree, dev_tree, extent_tree, root_tree;
+  for (;;) {
+    node_count = node_mark;
+    fs_meta.next = meta_mark;
+    sys_meta.next = chunks[0].logical;
+    chunk_count = chunk_mark;
+    phys_next = phys_mark;
+    for (uint32_t i = 0; i < meta_chunks; i++)
+      chunk_add(meta_logical + i * META_CHUNK_SIZE, META_CHUNK_SIZE,
+                BlockGroupFlag_Metadata);
+    device_size = phys_next;
+
+    ItemList chunk_items = {0};
+    emit_chunk_items(&chunk_items);
+    chunk_tree = tree_build(&chunk_items, 3, gen, &sys_meta, false);
+    items_free(&chunk_items);
+
+    ItemList dev_items = {0};
+    emit_dev_items(&dev_items);
+    dev_tree = tree_build(&dev_items, 4, gen, &fs_meta, false);
+    items_free(&dev_items);
+
+    for (size_t i = 0; i < node_count; i++) nodes[i].owner_count = 0;
+    node_index();
+    tree_mark_owner(fs_tree.root, 5);
+    for (size_t i = 0; i < root_count; i++)
+      tree_mark_owner(roots[i].tree.root, roots[i].id);
+    tree_mark_owner(csum_tree.root, 7);
+    tree_mark_owner(chunk_tree.root, 3);
+    tree_mark_owner(dev_tree.root, 4);
+
+    // Reserve addresses for the root tree and the extent tree, which must
+    // describe their own blocks.
+    size_t root_items = root_count + 4;
+    uint32_t *root_sizes = xmalloc(sizeof(uint32_t) * root_items);
+    for (size_t i = 0; i < root_items; i++)
+      root_sizes[i] = sizeof(BTRFS_RootItem);
+    uint8_t root_levels[64];
+    size_t root_nodes = tree_layout(root_sizes, root_items, root_levels);
+    free(root_sizes);
+
+    size_t extent_nodes = 1;
+    uint8_t *extent_levels = calloc(1, 64);
+    uint64_t *pending = NULL;
+    uint8_t *pending_levels = NULL;
+    uint64_t *pending_owner = NULL;
+    ItemList ext_items = {0};
+    for (;;) {
+      size_t total = extent_nodes + root_nodes;
+      pending = xrealloc(pending, sizeof(uint64_t) * total);
+      pending_levels = xrealloc(pending_levels, total);
+      pending_owner = xrealloc(pending_owner, sizeof(uint64_t) * total);
+      for (size_t i = 0; i < total; i++) {
+        pending[i] = fs_meta.next + i * cfg.node_size;
+        pending_owner[i] = i < extent_nodes ? 2 : 1;
+      }
+      memcpy(pending_levels, extent_levels, extent_nodes);
+      memcpy(pending_levels + extent_nodes, root_levels, root_nodes);
+
+      items_free(&ext_items);
+      emit_extent_items(&ext_items, pending, pending_levels, pending_owner,
+                        total, gen);
+      // The levels of the extent tree's own blocks depend on its layout.
+      uint32_t *sizes;
+      item_sizes(&ext_items, &sizes);
+      uint8_t *levels = xmalloc(ext_items.count + 64);
+      size_t need = tree_layout(sizes, ext_items.count, levels);
+      free(sizes);
+      bool same = need == extent_nodes &&
+                  memcmp(levels, extent_levels, extent_nodes) == 0;
+      free(extent_levels);
+      extent_levels = levels;
+      extent_nodes = need;
+      if (same) break;
+    }
+    free(extent_levels);
+
+    reserved_addrs = pending;
+    reserved_left = extent_nodes;
+    extent_tree = tree_build(&ext_items, 2, gen, &fs_meta, false);
+    items_free(&ext_items);
+
+    RootEntry all[64];
+    size_t all_count = 0;
+    all[all_count++] = (RootEntry){2, extent_tree};
+    all[all_count++] = (RootEntry){4, dev_tree};
+    all[all_count++] = (RootEntry){5, fs_tree};
+    all[all_count++] = (RootEntry){7, csum_tree};
+    for (size_t i = 0; i < root_count; i++) all[all_count++] = roots[i];
+
+    ItemList root_list = {0};
+    emit_root_items(&root_list, all, all_count);
+    reserved_addrs = pending + extent_nodes;
+    reserved_left = root_nodes;
+    root_tree = tree_build(&root_list, 1, gen, &fs_meta, false);
+    items_free(&root_list);
+    reserved_addrs = NULL;
+    reserved_left = 0;
+
+    free(pending);
+    free(pending_levels);
+    free(pending_owner);
+
+    fs_meta.next += (extent_nodes + root_nodes) * cfg.node_size;
+    if (fs_meta.next <= meta_logical + meta_chunks * META_CHUNK_SIZE) break;
+    meta_chunks++;
+  }
+
+  uint64_t used = 0;
+  for (size_t i = 0; i < chunk_count; i++) {
+    if (chunks[i].type & BlockGroupFlag_Metadata) chunks[i].used = 0;
+    used += chunks[i].used;
+  }
+  used += (fs_meta.next - meta_logical) + (sys_meta.next - chunks[0].logical);
+
+  if (ftruncate(image_fd, device_size) != 0) {
+    perror("ftruncate");
+    return 1;
+  }
+  write_nodes();
+  write_superblock(&root_tree, &chunk_tree, gen, used);
+  close(image_fd);
+
+  if (cfg.manifest) write_manifest(&live, cfg.manifest);
+
+  printf(
+      "{\"image\":\"%s\",\"inodes\":%llu,\"tree_blocks\":%zu,"
+      "\"data_extents\":%zu,\"device_size\":%llu,\"generation\":%llu,"
+      "\"fs_tree_level\":%u}\n",
+      cfg.output, (unsigned long long)live.count, node_count,
+      data_extent_count, (unsigned long long)device_size,
+      (unsigned long long)gen, fs_tree.level);
+  return 0;
+}
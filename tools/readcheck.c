@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2017 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// Reads every regular file of an image tools/mkimage wrote, whole, then in
+// small pieces at unaligned offsets, one at a time and batched, and checks
+// each against the manifest's hashes. Reads starting inside an extent take
+// a different path from reads starting at one, past the end of the tree
+// most of all, which is where the last file of the FS tree is read from.
+// Compressed files are not decoded by the driver and are skipped. With a
+// snapshot in the image, the pruned diff from it to the live tree is then
+// checked against one worked out from every item of both.
+
+#define _DEFAULT_SOURCE
+
+#include "../btrfs/btrfs.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+// Not a divisor of the sector size, so pieces start all over the sectors.
+#define PIECE_SIZE 1000
+#define FNV_OFFSET 1469598103934665603ull
+#define FNV_PRIME 1099511628211ull
+
+typedef struct {
+  uint64_t inode;
+  uint32_t mode;
+  uint64_t size;
+  uint64_t hash;
+} Entry;
+
+static Entry *load_manifest(const char *path, size_t *count) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return NULL;
+
+  size_t capacity = 1024;
+  Entry *entries = malloc(capacity * sizeof(Entry));
+  char line[4096 + 128];
+  *count = 0;
+
+  while (entries != NULL && fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long inode, size, hash;
+    unsigned int mode;
+    if (sscanf(line, "%llu %o %llu %llx", &inode, &mode, &size, &hash) != 4)
+      continue;
+
+    if (*count == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, capacity * sizeof(Entry));
+      if (entries == NULL) break;
+    }
+    entries[*count] = (Entry){inode, mode, size, hash};
+    (*count)++;
+  }
+  fclose(f);
+  return entries;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *buf, uint64_t len) {
+  for (uint64_t k = 0; k < len; k++) hash = (hash ^ buf[k]) * FNV_PRIME;
+  return hash;
+}
+
+// Read the file whole. Returns false if it reads short, as compressed files
+// do.
+static bool read_whole(Entry *e, uint8_t *buf, uint64_t *hash) {
+  if (BTRFS_ReadFile(e->inode, 0, e->size, buf) != e->size) return false;
+  *hash = hash_bytes(FNV_OFFSET, buf, e->size);
+  return true;
+}
+
+static uint64_t read_pieces(Entry *e, uint8_t *buf) {
+  uint64_t hash = FNV_OFFSET;
+  for (uint64_t off = 0; off < e->size;) {
+    uint64_t n = BTRFS_ReadFile(e->inode, off, PIECE_SIZE, buf);
+    if (n == 0 || n > PIECE_SIZE) break;
+    hash = hash_bytes(hash, buf, n);
+    off += n;
+  }
+  return hash;
+}
+
+typedef struct {
+  uint8_t *buf;
+  bool failed;
+} BatchTarget;
+
+static int batch_piece(uint64_t inode, uint64_t offset, const void *data,
+                       uint64_t len, void *context) {
+  BatchTarget *target = context;
+  if (data == NULL)
+    target->failed = true;
+  else
+    memcpy(target->buf + offset, data, len);
+  return 0;
+}
+
+// The same pieces as one BTRFS_ReadFiles batch, gathered back in order.
+static bool read_batched(Entry *e, uint8_t *buf, uint64_t *hash) {
+  size_t count = (e->size + PIECE_SIZE - 1) / PIECE_SIZE;
+  BTRFS_ReadRequest *requests = malloc((count + 1) * sizeof(*requests));
+  if (requests == NULL) return false;
+
+  BatchTarget target = {buf, false};
+  memset(buf, 0, e->size);
+  for (size_t i = 0; i < count; i++)
+    requests[i] = (BTRFS_ReadRequest){e->inode, i * PIECE_SIZE, PIECE_SIZE,
+                                      batch_piece, &target};
+
+  int err = BTRFS_ReadFiles(requests, count, 1);
+  free(requests);
+  if (err != 0 || target.failed) return false;
+  *hash = hash_bytes(FNV_OFFSET, buf, e->size);
+  return true;
+}
+
+// The snapshot tools/mkimage --snapshots 1 takes of the FS tree.
+#define SNAPSHOT_TREE 257
+
+typedef struct {
+  BTRFS_Key key;
+  uint64_t hash;
+} DiffItem;
+
+typedef struct {
+  BTRFS_DiffChange change;
+  BTRFS_Key key;
+} DiffEntry;
+
+typedef struct {
+  void *entries;
+  size_t count;
+  size_t capacity;
+  size_t size;
+} DiffList;
+
+static void *diff_push(DiffList *list) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 1024;
+    void *entries = realloc(list->entries, list->capacity * list->size);
+    if (entries == NULL) return NULL;
+    list->entries = entries;
+  }
+  return (uint8_t *)list->entries + list->count++ * list->size;
+}
+
+// Without an old tree every item is reported as added.
+static int collect_item(BTRFS_DiffChange change, BTRFS_Key *key,
+                        void *old_item, uint32_t old_size, void *new_item,
+                        uint32_t new_size, void *context) {
+  DiffItem *item = diff_push(context);
+  if (item == NULL) return 1;
+  item->key = *key;
+  item->hash = hash_bytes(hash_bytes(FNV_OFFSET, (uint8_t *)&new_size, 4),
+                          new_item, new_size);
+  return 0;
+}
+
+static int collect_change(BTRFS_DiffChange change, BTRFS_Key *key,
+                          void *old_item, uint32_t old_size, void *new_item,
+                          uint32_t new_size, void *context) {
+  DiffEntry *entry = diff_push(context);
+  if (entry == NULL) return 1;
+  *entry = (DiffEntry){change, *key};
+  return 0;
+}
+
+static bool diff_matches(DiffEntry *entry, BTRFS_DiffChange change,
+                         BTRFS_Key *key) {
+  return entry->change == change && BTRFS_CompareKeys(&entry->key, key) == 0;
+}
+
+// Diff the snapshot against the live tree and check every change against a
+// merge of both trees' full item lists. Returns the number of mismatches.
+static uint64_t check_diff(uint64_t counts[3]) {
+  uint64_t old_root, new_root;
+  if (BTRFS_GetTreeRoot(SNAPSHOT_TREE, &old_root, NULL) != 0 ||
+      BTRFS_GetTreeRoot(5, &new_root, NULL) != 0)
+    return 0;
+
+  DiffList old_items = {NULL, 0, 0, sizeof(DiffItem)};
+  DiffList new_items = {NULL, 0, 0, sizeof(DiffItem)};
+  DiffList changes = {NULL, 0, 0, sizeof(DiffEntry)};
+  uint64_t failures = 0;
+
+  if (BTRFS_DiffTrees(0, old_root, 0, collect_item, &old_items) != 0 ||
+      BTRFS_DiffTrees(0, new_root, 0, collect_item, &new_items) != 0 ||
+      BTRFS_DiffTrees(old_root, new_root, 0, collect_change, &changes) != 0) {
+    printf("diff: failed to read the trees\n");
+    failures = 1;
+    goto done;
+  }
+
+  DiffItem *a = old_items.entries, *b = new_items.entries;
+  DiffEntry *entries = changes.entries;
+  size_t i = 0, j = 0, k = 0;
+  while (i < old_items.count || j < new_items.count) {
+    int cmp = i == old_items.count   ? 1
+              : j == new_items.count ? -1
+                                     : BTRFS_CompareKeys(&a[i].key, &b[j].key);
+    BTRFS_DiffChange change;
+    BTRFS_Key *key;
+    if (cmp < 0) {
+      change = DiffChange_Removed;
+      key = &a[i++].key;
+    } else if (cmp > 0) {
+      change = DiffChange_Added;
+      key = &b[j++].key;
+    } else {
+      bool same = a[i].hash == b[j].hash;
+      key = &b[j].key;
+      i++;
+      j++;
+      if (same) continue;
+      change = DiffChange_Modified;
+    }
+
+    counts[change]++;
+    if (k == changes.count || !diff_matches(&entries[k], change, key)) {
+      printf("diff: %llu %u %llu missing or out of order\n",
+             (unsigned long long)key->object_id, key->type,
+             (unsigned long long)key->offset);
+      failures++;
+      continue;
+    }
+    k++;
+  }
+  if (k != changes.count) {
+    printf("diff: %llu changes reported that are not\n",
+           (unsigned long long)(changes.count - k));
+    failures++;
+  }
+
+done:
+  free(old_items.entries);
+  free(new_items.entries);
+  free(changes.entries);
+  return failures;
+}
+
+static int main_usage(const char *prog) {
+  fprintf(stderr, "usage: %s <image> <manifest>\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) return main_usage(argv[0]);
+
+  size_t count = 0;
+  Entry *entries = load_manifest(argv[2], &count);
+  if (entries == NULL) {
+    fprintf(stderr, "Failed to open %s.\n", argv[2]);
+    return 1;
+  }
+
+  BTRFS_InitializeStructures(32 * 1024);
+  if (BTRFS_OpenDevices((const char **)&argv[1], 1, Backend_Pread) != 0 ||
+      BTRFS_StartParser() != 0) {
+    fprintf(stderr, "Failed to parse %s.\n", argv[1]);
+    return 1;
+  }
+
+  uint64_t max_size = PIECE_SIZE;
+  Entry *last = NULL;
+  for (size_t i = 0; i < count; i++) {
+    if (!S_ISREG(entries[i].mode)) continue;
+    if (entries[i].size > max_size) max_size = entries[i].size;
+    if (last == NULL || entries[i].inode > last->inode) last = &entries[i];
+  }
+  uint8_t *buf = malloc(max_size);
+  if (buf == NULL) return 1;
+
+  uint64_t files = 0, skipped = 0, failures = 0;
+  for (size_t i = 0; i < count; i++) {
+    Entry *e = &entries[i];
+    if (!S_ISREG(e->mode)) continue;
+    // Hard links share the hash of their first name.
+    if (i > 0 && entries[i - 1].inode == e->inode) continue;
+
+    uint64_t hash = 0;
+    if (!read_whole(e, buf, &hash)) {
+      skipped++;
+      continue;
+    }
+    files++;
+
+    const char *failed = NULL;
+    if (hash != e->hash)
+      failed = "whole";
+    else if (read_pieces(e, buf) != e->hash)
+      failed = "pieces";
+    else if (!read_batched(e, buf, &hash) || hash != e->hash)
+      failed = "batched";
+
+    if (failed != NULL) {
+      printf("%llu: %s read does not match the manifest%s\n",
+             (unsigned long long)e->inode, failed,
+             e == last ? " (last file)" : "");
+      failures++;
+    }
+  }
+
+  printf("%llu files checked, %llu compressed skipped, %llu failed\n",
+         (unsigned long long)files, (unsigned long long)skipped,
+         (unsigned long long)failures);
+
+  uint64_t counts[3] = {0, 0, 0};
+  uint64_t diff_failures = check_diff(counts);
+  printf("diff %d to 5: %llu added, %llu removed, %llu changed, %llu failed\n",
+         SNAPSHOT_TREE, (unsigned long long)counts[DiffChange_Added],
+         (unsigned long long)counts[DiffChange_Removed],
+         (unsigned long long)counts[DiffChange_Modified],
+         (unsigned long long)diff_failures);
+  failures += diff_failures;
+
+  free(buf);
+  free(entries);
+  BTRFS_CloseDevices();
+  return failures != 0;
+}